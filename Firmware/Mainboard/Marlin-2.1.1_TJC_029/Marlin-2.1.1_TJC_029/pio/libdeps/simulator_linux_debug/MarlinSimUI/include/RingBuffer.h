@@ -1,79 +1,133 @@
 #pragma once
 
 #include <cstdint>
-#include <mutex>
+#include <cstring>
 #include <atomic>
+#include <algorithm>
 
+/**
+ * Wait-free single producer, single consumer ring buffer.
+ *
+ * One thread writes (write, write_span/commit) and one thread reads (read, peek,
+ * peek_span/consume, clear). The indices run freely and are published with release
+ * stores, a span stays owned by the caller until it is committed or consumed.
+ * Each side keeps a cached copy of the other side's index so the shared cache line
+ * is only read when the cached view runs out.
+ */
 template <typename T, std::size_t S> class RingBuffer {
+  static_assert(S && !(S & (S - 1)), "RingBuffer size must be a power of two");
+
 public:
-  RingBuffer() {index_read = index_write = 0;}
+  // contiguous region of the buffer, may be shorter than available()/free() where the buffer wraps
+  struct Span {
+    T* data;
+    std::size_t length;
+  };
 
-  std::size_t available() const {return mask(index_write - index_read);}
+  // index_read is loaded first, so a concurrent consumer can never make this negative
+  std::size_t available() const {
+    std::size_t read = index_read.load(std::memory_order_acquire);
+    return std::min(index_write.load(std::memory_order_acquire) - read, S);
+  }
   std::size_t free() const {return size() - available();}
-  bool empty() const {return index_read == index_write;}
-  bool full() const {return next(index_write) == index_read;}
-  void clear() {index_read = index_write = 0;}
+  bool empty() const {return available() == 0;}
+  bool full() const {return available() == size();}
 
-  bool peek(T *const value) const {
-    if (value == nullptr || empty()) return false;
-    *value = buffer[index_read];
-    return true;
+  // consumer side, drops everything written so far
+  void clear() {
+    cached_write = index_write.load(std::memory_order_acquire);
+    index_read.store(cached_write, std::memory_order_release);
+  }
+
+  // Consumer
+  Span peek_span() {
+    std::size_t read = index_read.load(std::memory_order_relaxed);
+    if (cached_write == read) cached_write = index_write.load(std::memory_order_acquire);
+    std::size_t offset = mask(read);
+    return {buffer + offset, std::min(cached_write - read, S - offset)};
   }
 
-  inline std::size_t read(T* dst, std::size_t length) {
-    std::scoped_lock lock(m);
-    length = std::min(length, available());
-    const std::size_t length1 = std::min(length, buffer_size - index_read);
-    memcpy(dst, (char*)buffer + index_read, length1);
-    memcpy(dst + length1, (char*)buffer, length - length1);
-    index_read = mask(index_read + length);
-    return length;
+  void consume(std::size_t count) {
+    index_read.store(index_read.load(std::memory_order_relaxed) + count, std::memory_order_release);
   }
 
-  inline std::size_t write(T* src, std::size_t length) {
-    std::scoped_lock lock(m);
-    length = std::min(length, free());
-    const std::size_t length1 = std::min(length, buffer_size - index_write);
-    memcpy((char*)buffer + index_write, src, length1);
-    memcpy((char*)buffer, src + length1, length - length1);
-    index_write = mask(index_write + length);
-    return length;
+  bool peek(T *const value) {
+    if (value == nullptr) return false;
+    auto span = peek_span();
+    if (!span.length) return false;
+    *value = *span.data;
+    return true;
   }
 
   std::size_t read(T *const value) {
-    std::scoped_lock lock(m);
-    if (value == nullptr || empty()) return 0;
-    *value = buffer[index_read];
-    index_read = next(index_read);
+    if (!peek(value)) return 0;
+    consume(1);
     return 1;
   }
 
+  std::size_t read(T* dst, std::size_t length) {
+    std::size_t count = 0;
+    while (count < length) {
+      auto span = peek_span();
+      if (!span.length) break;
+      std::size_t chunk = std::min(span.length, length - count);
+      memcpy(dst + count, span.data, chunk * sizeof(T));
+      consume(chunk);
+      count += chunk;
+    }
+    return count;
+  }
+
+  // Producer
+  Span write_span() {
+    std::size_t write = index_write.load(std::memory_order_relaxed);
+    if (write - cached_read == S) cached_read = index_read.load(std::memory_order_acquire);
+    std::size_t offset = mask(write);
+    return {buffer + offset, std::min(S - (write - cached_read), S - offset)};
+  }
+
+  void commit(std::size_t count) {
+    index_write.store(index_write.load(std::memory_order_relaxed) + count, std::memory_order_release);
+  }
+
   std::size_t write(const T value) {
-    std::scoped_lock lock(m);
-    std::size_t next_head = next(index_write);
-    if (next_head == index_read) return 0;     // buffer full
-    buffer[index_write] = value;
-    index_write = next_head;
+    auto span = write_span();
+    if (!span.length) return 0; // buffer full
+    *span.data = value;
+    commit(1);
     return 1;
   }
 
+  std::size_t write(const T* src, std::size_t length) {
+    std::size_t count = 0;
+    while (count < length) {
+      auto span = write_span();
+      if (!span.length) break;
+      std::size_t chunk = std::min(span.length, length - count);
+      memcpy(span.data, src + count, chunk * sizeof(T));
+      commit(chunk);
+      count += chunk;
+    }
+    return count;
+  }
+
   constexpr std::size_t size() const {
-    return buffer_size - 1;
+    return S;
   }
 
 private:
-  inline std::size_t mask(std::size_t val) const {
-    return val & buffer_mask;
+  static constexpr std::size_t mask(std::size_t val) {
+    return val & (S - 1);
   }
 
-  inline std::size_t next(std::size_t val) const {
-    return mask(val + 1);
-  }
+  static constexpr std::size_t cache_line = 64;
+
+  // producer owned
+  alignas(cache_line) std::atomic_size_t index_write{0};
+  std::size_t cached_read = 0;
+  // consumer owned
+  alignas(cache_line) std::atomic_size_t index_read{0};
+  std::size_t cached_write = 0;
 
-  std::mutex m;
-  static const std::size_t buffer_size = S;
-  static const std::size_t buffer_mask = buffer_size - 1;
-  volatile T buffer[buffer_size];
-  std::atomic_size_t index_write;
-  std::atomic_size_t index_read;
+  alignas(cache_line) T buffer[S];
 };
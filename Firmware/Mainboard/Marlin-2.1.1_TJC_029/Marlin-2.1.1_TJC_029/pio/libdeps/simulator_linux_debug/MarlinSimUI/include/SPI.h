@@ -164,7 +164,7 @@ public:
   void setModule(uint8_t device);
 
   void setClock(uint32_t clock);
-  void setClockDivider(uint32_t clock) {}
+  void setClockDivider(uint32_t clock);
   void setBitOrder(uint8_t bitOrder);
   void setDataMode(uint8_t dataMode);
   void setDataSize(uint32_t ds);
@@ -51,13 +51,16 @@ struct HalSerial {
   int16_t read() {
     uint8_t value = 0;
     uint32_t ret = receive_buffer.read(&value);
+    if (ret) notify_host();
     return (ret ? value : -1);
   }
 
   size_t write(char c) {
     if (!host_connected) return 0;
     while (!transmit_buffer.free());
-    return transmit_buffer.write(c);
+    auto written = transmit_buffer.write(c);
+    notify_host();
+    return written;
   }
 
   bool connected() { return host_connected; }
@@ -81,6 +84,12 @@ struct HalSerial {
     }
   }
 
+  // set by the host side transport, wakes it when output was written or input space freed
+  static inline std::atomic<void(*)()> on_activity{nullptr};
+  void notify_host() {
+    if (auto notify = on_activity.load(std::memory_order_relaxed)) notify();
+  }
+
   static constexpr std::size_t receive_buffer_size = 32768;
   static constexpr std::size_t transmit_buffer_size = 32768;
   RingBuffer<uint8_t, receive_buffer_size> receive_buffer;
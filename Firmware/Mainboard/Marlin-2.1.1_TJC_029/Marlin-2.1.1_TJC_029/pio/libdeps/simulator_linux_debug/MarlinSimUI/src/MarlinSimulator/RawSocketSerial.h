@@ -5,6 +5,8 @@
 
 #include <RingBuffer.h>
 
+#include "serial_transport.h"
+
 struct ServerInfo {
   TCPsocket socket;
   SDLNet_SocketSet socket_set;
@@ -116,17 +118,20 @@ public:
           return 0;
       } else {
           rx_buffer.write(receive_buffer, length);
+          SerialTransport::notify();
           return length;
       }
   }
 
   int32_t send(int index) {
-    std::size_t length = tx_buffer.read(transmit_buffer, ServerInfo::max_packet_size);
-    int num_sent = SDLNet_TCP_Send(server.sockets[index], transmit_buffer, length);
-    if(num_sent < length) {
+    auto span = tx_buffer.peek_span();
+    if (!span.length) return 0;
+    int num_sent = SDLNet_TCP_Send(server.sockets[index], span.data, span.length);
+    if(num_sent < span.length) {
         fprintf(stderr, "RawSocketSerial::send: SDLNet_TCP_Send: %s\n", SDLNet_GetError());
         close_socket(index);
     }
+    tx_buffer.consume(span.length);
     return num_sent;
   }
 
@@ -182,8 +187,18 @@ public:
   bool thread_active = false;
   ServerInfo server{};
   uint8_t receive_buffer[ServerInfo::max_packet_size];
-  uint8_t transmit_buffer[ServerInfo::max_packet_size];
   RingBuffer<uint8_t, ServerInfo::max_packet_size> rx_buffer;
   RingBuffer<uint8_t, ServerInfo::max_packet_size> tx_buffer;
   std::thread server_thread;
 };
+
+// Mirrors a port to the TCP client and forwards what the client sends to Marlin
+class SocketSink : public SerialSink {
+public:
+  SocketSink(RawSocketSerial& socket) : socket(socket) {}
+  void transmit(const uint8_t* data, std::size_t length) override { socket.write(data, length); }
+  std::size_t receive(uint8_t* data, std::size_t length) override { return socket.readBytes((char*)data, length); }
+
+private:
+  RawSocketSerial& socket;
+};
@@ -1,24 +1,56 @@
+#include <cinttypes>
+
 #include <SDL2/SDL.h>
 #include <imgui.h>
 #include <imgui_impl_sdl.h>
 
 #include "user_interface.h"
 #include "application.h"
+#include "hardware/MotionAnalytics.h"
+#include "motion_trace.h"
+#include "signal_decoders.h"
+#include "snapshot.h"
+#include "vcd_export.h"
 
 #include "../HAL.h"
 #include <src/MarlinCore.h>
 #include <src/pins/pinsDebug.h>
 #include <fstream>
-#include <vcd_writer.h>
 #include <regex>
 
+// a numeric track over [view_start, view_end] as steps, at most about one value per pixel
+static void plot_track(const DecoderTrack& track, const double view_start, const double view_end, const float width) {
+  std::size_t first = track.lower_bound(view_start), last = track.lower_bound(view_end);
+  // the value before the window sets the level it starts at
+  static ImVector<ImPlotPoint> values;
+  values.resize(0);
+  std::size_t stride = std::max<std::size_t>(1, (last - first) / width);
+  double low = 0.0, high = 0.0;
+  for (std::size_t i = first ? first - 1 : 0; i < last; i += (i < first ? 1 : stride)) {
+    double value = track.number(i);
+    if (values.size()) values.push_back(ImPlotPoint(std::max(view_start, double(track.timestamp(i))), values.back().y));
+    else low = high = value;
+    values.push_back(ImPlotPoint(std::max(view_start, double(track.timestamp(i))), value));
+    low = std::min(low, value);
+    high = std::max(high, value);
+  }
+  if (values.size()) values.push_back(ImPlotPoint(view_end, values.back().y));
+  ImPlot::SetNextPlotLimitsX(view_start, view_end, ImGuiCond_Always);
+  ImPlot::SetNextPlotLimitsY(low - 1.0, high + 1.0, ImGuiCond_Always);
+  if (ImPlot::BeginPlot(track.name.c_str(), "Time (ns)", NULL, ImVec2(-1,150), 0, ImPlotAxisFlags_NoTickLabels)) {
+    if (values.size()) ImPlot::PlotLine(track.name.c_str(), &values[0].x, &values[0].y, values.size(), 0, sizeof(ImPlotPoint));
+    ImPlot::EndPlot();
+  }
+}
+
 Application::Application() {
   sim.vis.create();
 
-  auto serial1 = user_interface.addElement<SerialMonitor>("Serial Monitor(0)", serial_stream_0);
-  user_interface.addElement<SerialMonitor>("Serial Monitor(1)", serial_stream_1);
-  user_interface.addElement<SerialMonitor>("Serial Monitor(2)", serial_stream_2);
-  user_interface.addElement<SerialMonitor>("Serial Monitor(3)", serial_stream_3);
+  auto serial1 = user_interface.addElement<SerialMonitor>("Serial Monitor(0)");
+  SerialTransport::attach(0, serial1);
+  SerialTransport::attach(1, user_interface.addElement<SerialMonitor>("Serial Monitor(1)"));
+  SerialTransport::attach(2, user_interface.addElement<SerialMonitor>("Serial Monitor(2)"));
+  SerialTransport::attach(3, user_interface.addElement<SerialMonitor>("Serial Monitor(3)"));
 
   //user_interface.addElement<TextureWindow>("Controller Display", sim.display.texture_id, (float)sim.display.width / (float)sim.display.height, [this](UiWindow* window){ this->sim.display.ui_callback(window); });
   user_interface.addElement<StatusWindow>("Status", &clear_color, [this](UiWindow* window){ this->sim.ui_info_callback(window); });
@@ -35,9 +67,9 @@ Application::Application() {
     remainder = (remainder % (Kernel::TimeControl::ONE_BILLION * 60));
     uint64_t seconds = remainder / (Kernel::TimeControl::ONE_BILLION);
     remainder = remainder % (Kernel::TimeControl::ONE_BILLION);
-    ImGui::Text("%02ld:%02ld:%02ld.%09ld", hours, mins, seconds, remainder); //TODO: work around cross platform format string differences
+    ImGui::Text("%02" PRIu64 ":%02" PRIu64 ":%02" PRIu64 ".%09" PRIu64, hours, mins, seconds, remainder);
     // Simulation Control
-    auto ui_realtime_scale = Kernel::TimeControl::realtime_scale.load();
+    auto ui_realtime_scale = Kernel::state().realtime_scale.load();
     ImGui::PushItemWidth(-1);
     ImGui::SliderFloat("##SimSpeed", &ui_realtime_scale, 0.0f, 100.0f, "%.3f", ImGuiSliderFlags_Logarithmic);
     ImGui::PopItemWidth();
@@ -59,8 +91,106 @@ Application::Application() {
     ImGui::SameLine();
     if (ImGui::Button("Max")) { ui_realtime_scale = 100.0f; paused = false; }
     ImGui::SameLine();
-    if (ImGui::Button("Break")) Kernel::execution_break();
-    Kernel::TimeControl::realtime_scale.store(ui_realtime_scale);
+    if (ImGui::Button("Break")) { Kernel::execution_break(); Kernel::TimeControl::wake(); }
+    if (ui_realtime_scale != Kernel::state().realtime_scale.load()) {
+      Kernel::state().realtime_scale.store(ui_realtime_scale);
+      Kernel::TimeControl::wake(); // a sleeping pacer has to recompute its deadline
+    }
+    ImGui::Text("Pacing error: %.1fus avg (%" PRIu64 " sleeps)", Kernel::state().pacing_error / 1000.0, Kernel::state().pacing_sleeps.load());
+
+    // Snapshots are taken and applied by the simulation thread between interrupts
+    static char snapshot_file[256] = "snapshot.msim";
+    static std::string base_snapshot;
+    static bool delta_snapshot = true;
+    ImGui::PushItemWidth(-1);
+    ImGui::InputText("##SnapshotFile", snapshot_file, sizeof(snapshot_file));
+    ImGui::PopItemWidth();
+    static std::string snapshot_status;
+    if (ImGui::Button("Save Snapshot")) {
+      std::string filename = snapshot_file, base = delta_snapshot ? base_snapshot : "";
+      if (filename == base_snapshot) {
+        // the deltas saved since would no longer load
+        snapshot_status = filename + " is the base of earlier deltas, choose another name";
+      } else {
+        if (base.empty()) base_snapshot = filename;
+        snapshot_status.clear();
+        Kernel::run_at_safe_point([filename, base](){ Snapshot::capture().save(filename, base); });
+      }
+    }
+    // the firmware's own state is not saved, so a snapshot is only restored as the firmware starts
+    if (ImGui::IsItemHovered()) ImGui::SetTooltip("Restore at startup with --restore FILE");
+    ImGui::SameLine();
+    ImGui::Checkbox("Delta", &delta_snapshot);
+    if (ImGui::IsItemHovered() && base_snapshot.size()) ImGui::SetTooltip("Saved relative to %s", base_snapshot.c_str());
+    if (snapshot_status.size()) ImGui::TextWrapped("%s", snapshot_status.c_str());
+  });
+
+  user_interface.addElement<UiWindow>("ISR Statistics", [this](UiWindow* window){
+    auto& kernel = Kernel::state();
+    // recent speed is sampled once a second, the overall ratio covers the whole run
+    static auto sample_time = Kernel::TimeControl::clock.now();
+    static double sample_seconds = Kernel::SimulationRuntime::seconds();
+    static double recent_ratio = 0.0;
+    auto now = Kernel::TimeControl::clock.now();
+    double elapsed = std::chrono::duration<double>(now - sample_time).count();
+    if (elapsed >= 1.0) {
+      double sim_seconds = Kernel::SimulationRuntime::seconds();
+      recent_ratio = (sim_seconds - sample_seconds) / elapsed;
+      sample_time = now;
+      sample_seconds = sim_seconds;
+    }
+    ImGui::Text("Speed: %.3fx realtime (%.3fx overall)", recent_ratio, Kernel::speed_ratio());
+    ImGui::Text("Pacing: %.3fs asleep in %" PRIu64 " sleeps", kernel.pacing_nanos / double(Kernel::TimeControl::ONE_BILLION), kernel.pacing_sleeps.load());
+    ImGui::SameLine();
+    if (ImGui::Button("Reset")) Kernel::run_at_safe_point(Kernel::reset_statistics);
+    ImGui::SameLine();
+    bool collect = Kernel::statistics_enabled();
+    if (ImGui::Checkbox("Collect", &collect)) Kernel::enable_statistics(collect);
+    if (ImGui::IsItemHovered()) ImGui::SetTooltip("Times every interrupt, off by default as it slows the simulation");
+
+    static std::size_t selected = 0;
+    uint64_t total_host_nanos = 0;
+    for (auto& timer : kernel.timers) total_host_nanos += timer.stats.host_nanos;
+    if (ImGui::BeginTable("##IsrStatistics", 5, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+      ImGui::TableSetupColumn("Timer");
+      ImGui::TableSetupColumn("Calls");
+      ImGui::TableSetupColumn("Late");
+      ImGui::TableSetupColumn("Avg host");
+      ImGui::TableSetupColumn("Host share");
+      ImGui::TableHeadersRow();
+      for (auto& timer : kernel.timers) {
+        uint64_t invocations = timer.stats.invocations, late = timer.stats.late, host_nanos = timer.stats.host_nanos;
+        ImGui::PushID(timer.id);
+        ImGui::TableNextRow();
+        ImGui::TableNextColumn();
+        if (ImGui::Selectable(timer.name.c_str(), selected == timer.id, ImGuiSelectableFlags_SpanAllColumns)) selected = timer.id;
+        ImGui::TableNextColumn();
+        ImGui::Text("%" PRIu64, invocations);
+        ImGui::TableNextColumn();
+        ImGui::Text("%" PRIu64 " (%.1f%%)", late, invocations ? 100.0 * late / invocations : 0.0);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.2fus", invocations ? host_nanos / 1000.0 / invocations : 0.0);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.1f%%", total_host_nanos ? 100.0 * host_nanos / total_host_nanos : 0.0);
+        ImGui::PopID();
+      }
+      ImGui::EndTable();
+    }
+
+    if (selected < kernel.timers.size()) {
+      auto& stats = kernel.timers[selected].stats;
+      float lateness[KernelTimerStats::buckets], host_cost[KernelTimerStats::buckets];
+      for (std::size_t i = 0; i < KernelTimerStats::buckets; i++) {
+        lateness[i] = stats.lateness[i];
+        host_cost[i] = stats.host_cost[i];
+      }
+      ImGui::Text("%s, buckets are powers of two in ns", kernel.timers[selected].name.c_str());
+      ImGui::PushItemWidth(-100);
+      // bucket 0 is every interrupt that was on time, it would dwarf the rest
+      ImGui::PlotHistogram("Lateness", lateness + 1, KernelTimerStats::buckets - 1, 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 80));
+      ImGui::PlotHistogram("Host cost", host_cost, KernelTimerStats::buckets, 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 80));
+      ImGui::PopItemWidth();
+    }
   });
 
   user_interface.addElement<UiWindow>("Pin List", [this](UiWindow* window){
@@ -89,31 +219,6 @@ Application::Application() {
         Gpio::resetLogs();
       }
 
-      struct ScrollingData {
-        int MaxSize;
-        int Offset;
-        ImVector<ImPlotPoint> Data;
-        ScrollingData() {
-            MaxSize = 100000;
-            Offset  = 0;
-            Data.reserve(MaxSize);
-        }
-        void AddPoint(double x, double y) {
-            if (Data.size() < MaxSize)
-                Data.push_back(ImPlotPoint(x,y));
-            else {
-                Data[Offset] = ImPlotPoint(x,y);
-                Offset =  (Offset + 1) % MaxSize;
-            }
-        }
-        void Erase() {
-            if (Data.size() > 0) {
-                Data.shrink(0);
-                Offset  = 0;
-            }
-        }
-      };
-
       static pin_type monitor_pin = X_STEP_PIN;
       static const char* label = "Select Pin";
       static char* active_label = (char *)label;
@@ -128,42 +233,145 @@ Application::Application() {
         ImGui::EndCombo();
       }
 
-      if (Gpio::pin_map[monitor_pin].event_log.size()) {
-        ScrollingData sdata;
-
-        pin_log_data last{};
-        for (auto v : Gpio::pin_map[monitor_pin].event_log) {
-          if (last.timestamp) sdata.AddPoint(v.timestamp, last.value);
-          sdata.AddPoint(v.timestamp, v.value);
-          last = v;
-        }
-        sdata.AddPoint(Kernel::SimulationRuntime::nanos(),  last.value);
-
+      auto& capture = Gpio::state().capture;
+      ImGui::Text("Spilled: %.1f MiB, dropped: %" PRIu64 " events", capture.spilled_bytes / 1048576.0, capture.dropped_events.load());
+      {
         static float window = 10000000000.0f;
         ImGui::SliderFloat("Window", &window, 10.f, 100000000000.f,"%.0f ns", ImGuiSliderFlags_Logarithmic);
         static float offset = 0.0f;
         ImGui::SliderFloat("X offset", &offset, 0.f, 10000000000.f,"%.0f ns");
         ImGui::SliderFloat("X offset", &offset, 0.f, 100000000000.f,"%.0f ns");
+
+        // only the visible window is read from the capture, at about one bucket per pixel
+        double now = Kernel::SimulationRuntime::nanos();
+        double view_end = std::max(0.0, now - offset), view_start = std::max(0.0, view_end - window);
+        float width = std::max(1.0f, ImGui::GetContentRegionAvail().x);
+        static std::vector<GpioCapture::Sample> trace;
+        static ImVector<ImPlotPoint> points;
+        capture.trace(monitor_pin, view_start, view_end, std::max(1.0, (view_end - view_start) / width), trace);
+        points.resize(0);
+        for (auto& sample : trace) points.push_back(ImPlotPoint(sample.timestamp, sample.value));
+
         if (!ImPlot::GetCurrentContext()) ImPlot::CreateContext();
-        ImPlot::SetNextPlotLimitsX(Kernel::SimulationRuntime::nanos() - window - offset, Kernel::SimulationRuntime::nanos() - offset, ImGuiCond_Always);
+        ImPlot::SetNextPlotLimitsX(view_start, view_end, ImGuiCond_Always);
         ImPlot::SetNextPlotLimitsY(0.0f, 1.2f, ImGuiCond_Always);
         static int rt_axis = ImPlotAxisFlags_NoTickLabels | ImPlotAxisFlags_LockMin;
         if (ImPlot::BeginPlot("##Scrolling", "Time (ns)", NULL, ImVec2(-1,150), ImPlotAxisFlags_NoTickLabels | ImPlotFlags_Query, rt_axis, rt_axis)) {
-          ImPlot::PlotLine("pin", &sdata.Data[0].x, &sdata.Data[0].y, sdata.Data.size(), sdata.Offset, sizeof(ImPlotPoint));
+          if (points.size()) ImPlot::PlotLine("pin", &points[0].x, &points[0].y, points.size(), 0, sizeof(ImPlotPoint));
           ImPlot::EndPlot();
         }
+
+        // decoders follow the capture while the window is open, the steppers are decoded by default
+        static DecoderPipeline decoders = [](){
+          DecoderPipeline pipeline;
+          pipeline.add(std::make_unique<StepDirDecoder>("X", X_STEP_PIN, X_DIR_PIN, X_ENABLE_PIN));
+          pipeline.add(std::make_unique<StepDirDecoder>("Y", Y_STEP_PIN, Y_DIR_PIN, Y_ENABLE_PIN));
+          pipeline.add(std::make_unique<StepDirDecoder>("Z", Z_STEP_PIN, Z_DIR_PIN, Z_ENABLE_PIN));
+          pipeline.add(std::make_unique<StepDirDecoder>("E0", E0_STEP_PIN, E0_DIR_PIN, E0_ENABLE_PIN));
+          return pipeline;
+        }();
+        decoders.poll(capture, 1000000);
+
+        static SignalDecoder* csv_decoder = nullptr;
+        if (ImGui::CollapsingHeader("Decoders")) {
+          auto& types = SignalDecoder::types();
+          static std::size_t type_index = 0;
+          static pin_type input_pins[8] = {};
+          static int parameter = types[type_index].default_parameter;
+          static char decoder_name[32] = "";
+          if (ImGui::BeginCombo("Decoder", types[type_index].name)) {
+            for (std::size_t i = 0; i < types.size(); i++) {
+              if (ImGui::Selectable(types[i].name, i == type_index)) {
+                type_index = i;
+                parameter = types[i].default_parameter;
+              }
+            }
+            ImGui::EndCombo();
+          }
+          auto& type = types[type_index];
+          if (type.limitation) ImGui::TextWrapped("%s", type.limitation);
+          for (std::size_t i = 0; i < type.inputs.size() && i < std::size(input_pins); i++) {
+            if (ImGui::BeginCombo(type.inputs[i], pin_array[input_pins[i]].name)) {
+              for (auto p : pin_array) {
+                if (p.is_digital && ImGui::Selectable(p.name, p.pin == input_pins[i])) input_pins[i] = p.pin;
+              }
+              ImGui::EndCombo();
+            }
+          }
+          if (type.parameter) ImGui::InputInt(type.parameter, &parameter);
+          ImGui::InputText("Name", decoder_name, sizeof(decoder_name));
+          if (ImGui::Button("Add decoder")) {
+            std::vector<pin_type> pins(input_pins, input_pins + type.inputs.size());
+            decoders.add(type.create(strlen(decoder_name) ? decoder_name : type.name, pins, std::max(parameter, 1)));
+          }
+
+          SignalDecoder* removed = nullptr;
+          for (auto& stage : decoders.stages) {
+            auto& decoder = *stage.decoder;
+            ImGui::PushID(&decoder);
+            if (ImGui::TreeNode(decoder.name.c_str())) {
+              if (ImGui::Button("Remove")) removed = &decoder;
+              ImGui::SameLine();
+              if (ImGui::Button("Export CSV")) {
+                csv_decoder = &decoder;
+                ImGuiFileDialog::Instance()->OpenDialog("DecoderExportDlgKey", "Choose File", "CSV (*.csv){.csv},.*", ".");
+              }
+              for (auto track : decoder.tracks) {
+                ImGui::PushID(track);
+                if (track->numeric()) plot_track(*track, view_start, view_end, width);
+                else {
+                  std::size_t first = track->lower_bound(view_start), last = track->lower_bound(view_end);
+                  ImGui::Text("%s: %" PRIu64 " in view, %" PRIu64 " total", track->name.c_str(), (uint64_t)(last - first), (uint64_t)track->size());
+                  ImGui::BeginChild("entries", ImVec2(-1, 150), true);
+                  ImGuiListClipper clipper;
+                  clipper.Begin(last - first);
+                  while (clipper.Step()) {
+                    for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++) {
+                      ImGui::Text("%" PRIu64 " ns  %s", track->timestamp(first + i), track->text(first + i).c_str());
+                    }
+                  }
+                  ImGui::EndChild();
+                }
+                ImGui::PopID();
+              }
+              ImGui::TreePop();
+            }
+            ImGui::PopID();
+          }
+          if (removed) {
+            if (csv_decoder == removed) csv_decoder = nullptr;
+            decoders.remove(removed);
+          }
+        }
+
+        if (ImGuiFileDialog::Instance()->Display("DecoderExportDlgKey", ImGuiWindowFlags_NoDocking))  {
+          if (ImGuiFileDialog::Instance()->IsOk() && csv_decoder) DecoderPipeline::export_csv(*csv_decoder, ImGuiFileDialog::Instance()->GetFilePathName());
+          ImGuiFileDialog::Instance()->Close();
+        }
       }
 
+      static VcdExporter exporter;
       static bool export_single_pin = false;
-      if (ImGui::Button("Export selected pin to file")) {
-        export_single_pin = true;
-        ImGuiFileDialog::Instance()->OpenDialog("PulseExportDlgKey", "Choose File", "Value Change Dump (*.vcd){.vcd},.*", ".");
+      static bool export_compressed = false;
+      const char* export_filter = export_compressed ? "Compressed Value Change Dump (*.vcd.gz){.gz},.*" : "Value Change Dump (*.vcd){.vcd},.*";
+      if (exporter.running()) {
+        ImGui::ProgressBar(exporter.progress(), ImVec2(-100, 0));
+        ImGui::SameLine();
+        if (ImGui::Button("Cancel")) exporter.cancel();
       }
+      else {
+        if (ImGui::Button("Export selected pin to file")) {
+          export_single_pin = true;
+          ImGuiFileDialog::Instance()->OpenDialog("PulseExportDlgKey", "Choose File", export_filter, ".");
+        }
+        ImGui::SameLine();
+        ImGui::Checkbox("gzip", &export_compressed);
 
-
-      if (ImGui::Button("Export pins matching regex to file")) {
-        export_single_pin = false;
-        ImGuiFileDialog::Instance()->OpenDialog("PulseExportDlgKey", "Choose File", "Value Change Dump (*.vcd){.vcd},.*", ".");
+        if (ImGui::Button("Export pins matching regex to file")) {
+          export_single_pin = false;
+          ImGuiFileDialog::Instance()->OpenDialog("PulseExportDlgKey", "Choose File", export_filter, ".");
+        }
+        if (exporter.result().size()) ImGui::Text("%s", exporter.result().c_str());
       }
 
       static char export_regex[128] = "";
@@ -171,64 +379,158 @@ Application::Application() {
       ImGui::InputText("Pin regex", export_regex, sizeof(export_regex));
 
       if (ImGuiFileDialog::Instance()->Display("PulseExportDlgKey", ImGuiWindowFlags_NoDocking))  {
-        try{
         if (ImGuiFileDialog::Instance()->IsOk()) {
-          std::string image_filename = ImGuiFileDialog::Instance()->GetFilePathName();
-
-          using namespace vcd;
-
-          HeadPtr head = makeVCDHeader(static_cast<TimeScale>(50), TimeScaleUnit::ns, utils::now());
-          VCDWriter writer{image_filename, std::move(head)};
-
+          std::vector<VcdExporter::Signal> signals;
           if (export_single_pin) {
-            std::string pin_name(active_label);
-            auto scope = pin_name.substr(0, pin_name.find_first_of('_'));
-            auto var = writer.register_var(scope, pin_name, VariableType::wire, 1);
-
-            if (Gpio::pin_map[monitor_pin].event_log.size() && pin_array[monitor_pin].is_digital) {
-              for (const auto &value : Gpio::pin_map[monitor_pin].event_log) {
-                writer.change(var, value.timestamp / 50, utils::format("%u", value.value));
-              }
-            }
+            if (pin_array[monitor_pin].is_digital) signals.push_back({(std::size_t)monitor_pin, active_label});
           }
           else {
-            std::map<size_t, VarPtr> pin_to_var_map;
-            std::regex expression(export_regex);
-
-            for (auto pin : pin_array) {
-              std::string pin_name(pin.name);
-              bool regex_match = strlen(export_regex) == 0 || std::regex_search(pin_name, expression);
-              auto scope = pin_name.substr(0, pin_name.find_first_of('_'));
-              if (pin.is_digital && regex_match)
-                pin_to_var_map[pin.pin] = writer.register_var(scope, pin_name, VariableType::wire, 1);
-            }
-
-            std::multimap<uint64_t, std::pair<pin_t, uint16_t> > timestamp_pin_change_map;
-
-            for (auto pin : pin_array) {
-              if (pin.is_digital && pin_to_var_map.find(pin.pin) != pin_to_var_map.end())
-                for (const auto &data : Gpio::pin_map[pin.pin].event_log)
-                {
-                  timestamp_pin_change_map.emplace(std::make_pair(data.timestamp, std::make_pair(pin.pin, data.value)));
-                }
+            try {
+              std::regex expression(export_regex);
+              for (auto pin : pin_array) {
+                std::string pin_name(pin.name);
+                bool regex_match = strlen(export_regex) == 0 || std::regex_search(pin_name, expression);
+                if (pin.is_digital && regex_match) signals.push_back({(std::size_t)pin.pin, pin_name});
+              }
             }
-
-            auto timestamp_offset = timestamp_pin_change_map.begin()->first;
-            for (const auto &timestamp : timestamp_pin_change_map) {
-              writer.change(pin_to_var_map[timestamp.second.first], (timestamp.first - timestamp_offset) / 50, utils::format("%u", timestamp.second.second));
+            catch (const std::regex_error&) {
+              // an incomplete expression matches nothing
             }
           }
-        }
-        }
-        catch (const std::exception& e)
-        {
-          auto test = e.what();
+          exporter.start(capture, ImGuiFileDialog::Instance()->GetFilePathName(), std::move(signals), export_compressed);
         }
         ImGuiFileDialog::Instance()->Close();
       }
     }
   });
 
+  user_interface.addElement<UiWindow>("Motion Analytics", [this](UiWindow* window){
+    auto analytics = VirtualPrinter::get_component<MotionAnalytics>("Motion Analytics");
+    if (!analytics) return;
+    bool record = analytics->recording();
+    if (ImGui::Checkbox("Record steps", &record)) analytics->set_recording(record);
+    ImGui::SameLine();
+    if (ImGui::Button("Clear")) analytics->clear();
+    ImGui::SameLine();
+    int bin_micros = analytics->get_bin_nanos() / 1000;
+    ImGui::PushItemWidth(100);
+    if (ImGui::InputInt("Bin (us)", &bin_micros, 100, 1000, ImGuiInputTextFlags_EnterReturnsTrue)) analytics->set_bin_nanos(uint64_t(std::max(bin_micros, 1)) * 1000);
+    ImGui::PopItemWidth();
+
+    if (ImGui::BeginTable("##MotionSummary", 6, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+      ImGui::TableSetupColumn("Axis");
+      ImGui::TableSetupColumn("Steps");
+      ImGui::TableSetupColumn("Max sustained");
+      ImGui::TableSetupColumn("Jitter rms");
+      ImGui::TableSetupColumn("Jitter max");
+      ImGui::TableSetupColumn("Dropped");
+      ImGui::TableHeadersRow();
+      for (auto& axis : analytics->axes) {
+        ImGui::TableNextRow();
+        ImGui::TableNextColumn();
+        ImGui::Text("%s", axis.axis.name.c_str());
+        ImGui::TableNextColumn();
+        ImGui::Text("%" PRIu64, axis.steps);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.0f steps/s (%.1f mm/s)", axis.max_rate, axis.max_rate * std::abs(axis.axis.mm_per_step));
+        ImGui::TableNextColumn();
+        ImGui::Text("%.0f ns", axis.jitter_count ? std::sqrt(axis.jitter_squares / axis.jitter_count) : 0.0);
+        ImGui::TableNextColumn();
+        ImGui::Text("%" PRIu64 " ns", axis.jitter_max);
+        ImGui::TableNextColumn();
+        ImGui::Text("%" PRIu64, axis.axis.stepper->step_log.dropped.load());
+      }
+      ImGui::EndTable();
+    }
+
+    static std::size_t selected = 0;
+    const char* effector_name = "Effector (XYZ)";
+    if (selected > analytics->axes.size() || (selected == analytics->axes.size() && !analytics->cartesian)) selected = 0;
+    if (ImGui::BeginCombo("Series", selected < analytics->axes.size() ? analytics->axes[selected].axis.name.c_str() : effector_name)) {
+      for (std::size_t i = 0; i < analytics->axes.size(); i++) {
+        if (ImGui::Selectable(analytics->axes[i].axis.name.c_str(), i == selected)) selected = i;
+      }
+      if (analytics->cartesian && ImGui::Selectable(effector_name, selected == analytics->axes.size())) selected = analytics->axes.size();
+      ImGui::EndCombo();
+    }
+
+    if (selected < analytics->axes.size()) {
+      auto& axis = analytics->axes[selected];
+      float intervals[KernelTimerStats::buckets], jitter[KernelTimerStats::buckets];
+      for (std::size_t i = 0; i < KernelTimerStats::buckets; i++) {
+        intervals[i] = axis.intervals[i];
+        jitter[i] = axis.jitter[i];
+      }
+      ImGui::Text("Buckets are powers of two in ns, jitter is against the mean of the neighbouring intervals");
+      ImGui::PushItemWidth(-100);
+      ImGui::PlotHistogram("Step interval", intervals, KernelTimerStats::buckets, 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 80));
+      ImGui::PlotHistogram("Jitter", jitter, KernelTimerStats::buckets, 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 80));
+      ImGui::PopItemWidth();
+    }
+
+    static float window = 10000000000.0f;
+    ImGui::SliderFloat("Window", &window, 10000000.f, 100000000000.f, "%.0f ns", ImGuiSliderFlags_Logarithmic);
+    double view_end = Kernel::SimulationRuntime::nanos(), view_start = std::max(0.0, view_end - window);
+    float width = std::max(1.0f, ImGui::GetContentRegionAvail().x);
+    auto& series = selected < analytics->axes.size() ? analytics->axes[selected].series : analytics->effector;
+    if (!ImPlot::GetCurrentContext()) ImPlot::CreateContext();
+    ImGui::PushID(int(selected));
+    plot_track(series.velocity, view_start, view_end, width);
+    plot_track(series.acceleration, view_start, view_end, width);
+    plot_track(series.jerk, view_start, view_end, width);
+    ImGui::PopID();
+
+    static bool export_intervals = false;
+    if (ImGui::Button("Export series to CSV")) {
+      export_intervals = false;
+      ImGuiFileDialog::Instance()->OpenDialog("MotionExportDlgKey", "Choose File", "CSV (*.csv){.csv},.*", ".");
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Export histograms to CSV")) {
+      export_intervals = true;
+      ImGuiFileDialog::Instance()->OpenDialog("MotionExportDlgKey", "Choose File", "CSV (*.csv){.csv},.*", ".");
+    }
+    if (ImGuiFileDialog::Instance()->Display("MotionExportDlgKey", ImGuiWindowFlags_NoDocking))  {
+      if (ImGuiFileDialog::Instance()->IsOk()) {
+        auto filename = ImGuiFileDialog::Instance()->GetFilePathName();
+        if (export_intervals) analytics->export_intervals_csv(filename);
+        else analytics->export_csv(filename);
+      }
+      ImGuiFileDialog::Instance()->Close();
+    }
+  });
+
+  if (motion_trace_replay.is_open()) {
+    // a seek back replays from the start, so the path drawn so far is rebuilt rather than added to
+    motion_trace_replay.on_rewind = [this](){ sim.vis.clear_path(); };
+    user_interface.addElement<UiWindow>("Trace Replay", [this](UiWindow* window){
+      auto& trace = motion_trace_replay.trace();
+      const uint64_t start = trace.start_timestamp(), end = trace.end_timestamp();
+      const uint64_t position = motion_trace_replay.position();
+      ImGui::Text("%s", motion_trace_replay.filename.c_str());
+      ImGui::Text("%zu channels, %" PRIu64 " events in %zu blocks", trace.channels().size(), trace.event_count(), trace.blocks().size());
+      ImGui::Text("%.3f / %.3f s%s", (position - start) / double(Kernel::TimeControl::ONE_BILLION), (end - start) / double(Kernel::TimeControl::ONE_BILLION),
+        motion_trace_replay.at_end() ? " (end)" : "");
+
+      // only seek on release, every seek back replays from the start of the trace
+      static float scrub = 0.0f;
+      static bool scrubbing = false;
+      if (!scrubbing) scrub = (position - start) / double(Kernel::TimeControl::ONE_BILLION);
+      ImGui::PushItemWidth(-1);
+      ImGui::SliderFloat("##TraceScrub", &scrub, 0.0f, (end - start) / double(Kernel::TimeControl::ONE_BILLION), "%.3f s");
+      ImGui::PopItemWidth();
+      scrubbing = ImGui::IsItemActive();
+      if (ImGui::IsItemDeactivatedAfterEdit()) motion_trace_replay.seek(start + uint64_t(double(scrub) * Kernel::TimeControl::ONE_BILLION));
+
+      constexpr uint64_t step = 10 * Kernel::TimeControl::ONE_BILLION;
+      if (ImGui::Button("Restart")) motion_trace_replay.seek(start);
+      ImGui::SameLine();
+      if (ImGui::Button("-10 s")) motion_trace_replay.seek(position > start + step ? position - step : start);
+      ImGui::SameLine();
+      if (ImGui::Button("+10 s")) motion_trace_replay.seek(std::min(position + step, end));
+    });
+  }
+
   user_interface.post_init = [&](){
     //serial1->select();
     //components->select();
@@ -43,6 +43,7 @@ public:
 
   Simulation() : vis(testPrinter) {
     testPrinter.build();
+    testPrinter.ui_init();
   }
 
   void process_event(SDL_Event& e) {}
@@ -1,123 +1,306 @@
+#include <cinttypes>
+#include <cstdio>
 #include <limits>
+#include <stdexcept>
 
 #include <debugbreak.h>
 
-#include "user_interface.h"
 #include "execution_control.h"
 
-#include "RawSocketSerial.h"
-extern RawSocketSerial net_serial;
-
 std::chrono::steady_clock Kernel::TimeControl::clock;
-std::chrono::steady_clock::time_point Kernel::TimeControl::last_clock_read(Kernel::TimeControl::clock.now());
-std::atomic_uint64_t Kernel::TimeControl::ticks{0};
-uint64_t Kernel::TimeControl::realtime_nanos = 0;
-std::atomic<float> Kernel::TimeControl::realtime_scale = 1.0;
-std::atomic_bool Kernel::debug_break_flag = false;
 
 extern void marlin_loop();
 extern "C" void TIMER0_IRQHandler();
 extern "C" void TIMER1_IRQHandler();
 extern void SYSTICK_IRQHandler();
-std::array<KernelTimer, 4> Kernel::Timers::timers({KernelTimer{"Stepper ISR", TIMER0_IRQHandler, 1}, {"Temperature ISR", TIMER1_IRQHandler, 10}, {"SysTick", SYSTICK_IRQHandler, 5}, {"Marlin Loop", marlin_loop, 100}});
 
-bool Kernel::timers_active = true;
-std::deque<KernelTimer*> Kernel::isr_stack;
-bool Kernel::quit_requested = false;
-std::atomic_uint64_t Kernel::isr_timing_error = 0;
+// The first timers are the fixed hardware timers, registered in the order of their MF_TIMER_* ids
+Kernel::State::State() {
+  Timers::insert(*this, "Stepper ISR", TIMER0_IRQHandler, 1);
+  Timers::insert(*this, "Temperature ISR", TIMER1_IRQHandler, 10);
+  Timers::insert(*this, "SysTick", SYSTICK_IRQHandler, 5);
+  Timers::insert(*this, "Marlin Loop", marlin_loop, 100);
+}
+
+Kernel::State Kernel::main_state;
 
 bool Kernel::is_initialized(bool known_state) {
-  static bool is_running = known_state;
-  is_running = is_running || known_state;
-  return is_running;
+  auto& kernel = state();
+  if (!kernel.initialized && known_state) kernel.host_start = TimeControl::clock.now();
+  kernel.initialized = kernel.initialized || known_state;
+  return kernel.initialized;
 }
 
 bool Kernel::execute_loop( uint64_t max_end_ticks) {
+  auto& kernel = state();
   // Marlin often gets into reentrant loops, this is the only way to unroll out of that call stack early
-  if (quit_requested) throw (std::runtime_error("Quit Requested"));
-  if (debug_break_flag) { debug_break_flag = false; debug_break(); }
+  if (kernel.quit_requested) throw (std::runtime_error("Quit Requested"));
+  if (kernel.debug_break_flag) { kernel.debug_break_flag = false; debug_break(); }
+  if (kernel.safe_point_pending && kernel.isr_stack.empty()) {
+    std::vector<std::function<void()>> tasks;
+    {
+      std::lock_guard<std::mutex> lock(kernel.safe_point_mutex);
+      tasks.swap(kernel.safe_point_tasks);
+      kernel.safe_point_pending = false;
+    }
+    for (auto& task : tasks) task();
+  }
 
   //simulation time lock
   TimeControl::realtime_sync();
 
-  //todo: investigate dataloss when pulling from SerialMonitor rather than pushing from here
-
-  //todo: bad chris, stop just making shit work, look at this mess
-  if (serial_stream_0.transmit_buffer.available()) {
-    char buffer[serial_stream_0.transmit_buffer_size];
-    auto count = serial_stream_0.transmit_buffer.read((uint8_t *)buffer, serial_stream_0.transmit_buffer_size - 1);
-    buffer[count] = '\0';
-    std::dynamic_pointer_cast<SerialMonitor>(UserInterface::ui_elements["Serial Monitor(0)"])->insert_text(buffer);
-  }
-  if (serial_stream_1.transmit_buffer.available()) {
-    char buffer[serial_stream_1.transmit_buffer_size];
-    auto count = serial_stream_1.transmit_buffer.read((uint8_t *)buffer, serial_stream_1.transmit_buffer_size - 1);
-    buffer[count] = '\0';
-    std::dynamic_pointer_cast<SerialMonitor>(UserInterface::ui_elements["Serial Monitor(1)"])->insert_text(buffer);
-  }
-  if (serial_stream_2.transmit_buffer.available()) {
-    char buffer[serial_stream_2.transmit_buffer_size];
-    auto count = serial_stream_2.transmit_buffer.read((uint8_t *)buffer, serial_stream_2.transmit_buffer_size - 1);
-    buffer[count] = '\0';
-    std::dynamic_pointer_cast<SerialMonitor>(UserInterface::ui_elements["Serial Monitor(2)"])->insert_text(buffer);
-  }
-
-  if (serial_stream_3.transmit_buffer.available()) {
-    char buffer[serial_stream_3.transmit_buffer_size];
-    auto count = serial_stream_3.transmit_buffer.read((uint8_t *)buffer, serial_stream_3.transmit_buffer_size - 1);
-    net_serial.write((uint8_t*)buffer, count);
-    buffer[count] = '\0';
-    std::dynamic_pointer_cast<SerialMonitor>(UserInterface::ui_elements["Serial Monitor(3)"])->insert_text(buffer);
-  }
-  if (net_serial.available()) {
-    char buffer[512];
-    auto count = net_serial.readBytes(buffer, 512);
-    serial_stream_3.receive_buffer.write((uint8_t *)buffer, count);
-  }
-
-
   uint64_t current_ticks = TimeControl::getTicks();
   uint64_t current_priority = std::numeric_limits<uint64_t>::max();
-  auto stack_size = isr_stack.size();
+  auto stack_size = kernel.isr_stack.size();
   if (stack_size) {
-    current_priority = isr_stack.back()->priority;
+    current_priority = kernel.isr_stack.back()->priority;
   }
 
-  uint64_t lowest_isr = std::numeric_limits<uint64_t>::max();
-  KernelTimer* next_isr = nullptr;
-  for (auto& timer : Timers::timers) {
-    uint64_t value = timer.next_interrupt(TimeControl::frequency);
-    if (timers_active && value < lowest_isr && value < max_end_ticks && timer.enabled() && !timer.running && timer.priority < current_priority) {
-      lowest_isr = value;
-      next_isr = &timer;
-    }
-  }
+  KernelTimer* next_isr = kernel.timers_active ? Timers::next_due(current_priority, max_end_ticks) : nullptr;
 
   if (next_isr != nullptr ) {
+    uint64_t lowest_isr = next_isr->next_tick;
+    uint64_t late_nanos = 0;
     if (current_ticks > lowest_isr) {
-      isr_timing_error = TimeControl::ticksToNanos(current_ticks - lowest_isr);
+      late_nanos = TimeControl::ticksToNanos(current_ticks - lowest_isr);
       next_isr->source_offset = current_ticks; // late interrupt
     } else {
-      next_isr->source_offset = next_isr->next_interrupt(TimeControl::frequency); // timer was reset when the interrupt fired
-      isr_timing_error = 0;
+      next_isr->source_offset = lowest_isr; // timer was reset when the interrupt fired
     }
+    kernel.isr_timing_error = late_nanos;
+    if (next_isr->one_shot) next_isr->active = false;
+    Timers::reschedule(*next_isr);
     TimeControl::setTicks(next_isr->source_offset);
-    isr_stack.push_back(next_isr);
+
+    kernel.isr_stack.push_back(next_isr);
+    if (!kernel.collect_statistics.load(std::memory_order_relaxed)) {
+      next_isr->execute();
+      kernel.isr_stack.pop_back();
+      return true;
+    }
+
+    kernel.isr_nested_nanos.push_back(0);
+    auto host_start = TimeControl::clock.now();
     next_isr->execute();
-    isr_stack.pop_back();
+    uint64_t host_nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(TimeControl::clock.now() - host_start).count();
+    uint64_t nested_nanos = std::min(kernel.isr_nested_nanos.back(), host_nanos);
+    kernel.isr_nested_nanos.pop_back();
+    kernel.isr_stack.pop_back();
+
+    // an interrupted isr is not charged for the time its preemption took
+    if (kernel.isr_nested_nanos.size()) kernel.isr_nested_nanos.back() += host_nanos;
+    next_isr->stats.record(late_nanos, host_nanos - nested_nanos);
     return true;
   }
 
   return false;
 }
 
+void Kernel::run_at_safe_point(std::function<void()> task) {
+  auto& kernel = state();
+  std::lock_guard<std::mutex> lock(kernel.safe_point_mutex);
+  kernel.safe_point_tasks.push_back(std::move(task));
+  kernel.safe_point_pending = true;
+}
+
+double Kernel::speed_ratio() {
+  double host_seconds = std::chrono::duration<double>(TimeControl::clock.now() - state().host_start).count();
+  return host_seconds > 0 ? SimulationRuntime::seconds() / host_seconds : 0.0;
+}
+
+void Kernel::reset_statistics() {
+  auto& kernel = state();
+  for (auto& timer : kernel.timers) timer.stats.reset();
+  kernel.pacing_nanos = 0;
+  kernel.pacing_sleeps = 0;
+}
+
+static void write_histogram(FILE* out, const std::atomic_uint64_t (&histogram)[KernelTimerStats::buckets]) {
+  // trailing empty buckets are left out, bucket n covers [2^(n-1), 2^n) ns
+  std::size_t used = KernelTimerStats::buckets;
+  while (used > 0 && histogram[used - 1] == 0) used--;
+  fputc('[', out);
+  for (std::size_t i = 0; i < used; i++) fprintf(out, "%s%" PRIu64, i ? "," : "", histogram[i].load());
+  fputc(']', out);
+}
+
+bool Kernel::write_statistics(const std::string& filename) {
+  auto& kernel = state();
+  FILE* out = fopen(filename.c_str(), "w");
+  if (out == nullptr) {
+    fprintf(stderr, "Kernel::write_statistics: unable to write %s\n", filename.c_str());
+    return false;
+  }
+
+  double host_seconds = std::chrono::duration<double>(TimeControl::clock.now() - kernel.host_start).count();
+  fprintf(out, "{\"sim_seconds\":%.6f,\"host_seconds\":%.6f,\"speed_ratio\":%.3f,\"pacing_seconds\":%.6f,\"pacing_sleeps\":%" PRIu64 ",\"timers\":[",
+    SimulationRuntime::seconds(), host_seconds, speed_ratio(), kernel.pacing_nanos / double(TimeControl::ONE_BILLION), kernel.pacing_sleeps.load());
+  for (auto& timer : kernel.timers) {
+    auto& stats = timer.stats;
+    fprintf(out, "%s\n  {\"name\":\"%s\",\"priority\":%" PRIu64 ",\"invocations\":%" PRIu64 ",\"late\":%" PRIu64 ",\"host_seconds\":%.6f,\"lateness_log2_ns\":",
+      timer.id ? "," : "", timer.name.c_str(), timer.priority, stats.invocations.load(), stats.late.load(), stats.host_nanos / double(TimeControl::ONE_BILLION));
+    write_histogram(out, stats.lateness);
+    fprintf(out, ",\"host_cost_log2_ns\":");
+    write_histogram(out, stats.host_cost);
+    fputc('}', out);
+  }
+  fprintf(out, "\n]}\n");
+
+  bool result = !ferror(out);
+  fclose(out);
+  return result;
+}
+
+std::size_t Kernel::Timers::add_timer(std::string name, void (*callback)(), uint64_t priority) {
+  return insert(state(), name, callback, priority);
+}
+
+std::size_t Kernel::Timers::add_timer(std::string name, KernelTimer::isr_t callback, void* context, uint64_t priority) {
+  return insert(state(), name, callback, context, priority);
+}
+
+std::size_t Kernel::Timers::add_event(std::string name, KernelTimer::isr_t callback, void* context) {
+  auto& kernel = state();
+  std::size_t id = insert(kernel, name, callback, context, device_event_priority);
+  auto& event = kernel.timers[id];
+  // next_interrupt() is source_offset + compare, so an event is due exactly at its source_offset
+  event.one_shot = true;
+  event.timer_frequency = TimeControl::frequency;
+  event.compare = 0;
+  return id;
+}
+
+// timers are constructed in place, their statistics are atomics and can not be moved
+template<typename... Args>
+std::size_t Kernel::Timers::insert(State& kernel, Args&&... args) {
+  auto& queue = kernel.timer_queue;
+  kernel.timers.emplace_back(std::forward<Args>(args)...);
+  kernel.timers.back().id = kernel.timers.size() - 1;
+  kernel.timers.back().queue_index = queue.size();
+  queue.push_back(&kernel.timers.back());
+  sift_up(queue, queue.size() - 1);
+  return kernel.timers.back().id;
+}
+
+void Kernel::Timers::reschedule(KernelTimer& timer) {
+  auto& queue = state().timer_queue;
+  timer.next_tick = timer.next_interrupt(TimeControl::frequency);
+  sift_up(queue, timer.queue_index);
+  sift_down(queue, timer.queue_index);
+}
+
+KernelTimer* Kernel::Timers::next_due(uint64_t current_priority, uint64_t max_end_ticks) {
+  auto& queue = state().timer_queue;
+  auto& search = state().timer_search;
+  if (queue.empty()) return nullptr;
+  auto may_run = [current_priority](const KernelTimer* timer) { return !timer->running && timer->priority < current_priority; };
+
+  // common case, the earliest timer is free to run
+  if (queue.front()->next_tick >= max_end_ticks) return nullptr;
+  if (may_run(queue.front())) return queue.front();
+
+  // the earliest timers are masked by the running isr, walk the heap in firing order until one is not
+  auto fires_later = [&queue](std::size_t a, std::size_t b) { return fires_before(queue[b], queue[a]); };
+  search.clear();
+  search.push_back(0);
+  while (search.size()) {
+    std::pop_heap(search.begin(), search.end(), fires_later);
+    std::size_t index = search.back();
+    search.pop_back();
+    if (queue[index]->next_tick >= max_end_ticks) break;
+    if (may_run(queue[index])) return queue[index];
+    for (std::size_t child = index * 2 + 1; child <= index * 2 + 2 && child < queue.size(); ++child) {
+      search.push_back(child);
+      std::push_heap(search.begin(), search.end(), fires_later);
+    }
+  }
+  return nullptr;
+}
+
+void Kernel::Timers::queue_swap(std::vector<KernelTimer*>& queue, std::size_t a, std::size_t b) {
+  std::swap(queue[a], queue[b]);
+  queue[a]->queue_index = a;
+  queue[b]->queue_index = b;
+}
+
+void Kernel::Timers::sift_up(std::vector<KernelTimer*>& queue, std::size_t index) {
+  while (index > 0) {
+    std::size_t parent = (index - 1) / 2;
+    if (!fires_before(queue[index], queue[parent])) break;
+    queue_swap(queue, index, parent);
+    index = parent;
+  }
+}
+
+void Kernel::Timers::sift_down(std::vector<KernelTimer*>& queue, std::size_t index) {
+  while (true) {
+    std::size_t first = index, left = index * 2 + 1, right = index * 2 + 2;
+    if (left < queue.size() && fires_before(queue[left], queue[first])) first = left;
+    if (right < queue.size() && fires_before(queue[right], queue[first])) first = right;
+    if (first == index) break;
+    queue_swap(queue, index, first);
+    index = first;
+  }
+}
+
 uint64_t Kernel::TimeControl::nanos() {
-  if (debug_break_flag) { debug_break_flag = false; debug_break();}  // break into debugger when stuck in time dependent loops
-  if (quit_requested) throw (std::runtime_error("Quit Requested"));  // quit program when stuck in time dependent loops
+  auto& kernel = state();
+  if (kernel.debug_break_flag) { kernel.debug_break_flag = false; debug_break();}  // break into debugger when stuck in time dependent loops
+  if (kernel.quit_requested) throw (std::runtime_error("Quit Requested"));  // quit program when stuck in time dependent loops
   addTicks(1 + nanosToTicks(100)); // Marlin has loops that only break after x ticks, so we need to increment ticks here
   return ticksToNanos(getTicks());
 }
 
+void Kernel::TimeControl::pace() {
+  auto& kernel = state();
+  // the sleep is not part of the cost of the isr that happened to be running
+  struct SleepAccounting {
+    State& kernel;
+    std::chrono::steady_clock::time_point start = clock.now();
+    ~SleepAccounting() {
+      uint64_t slept = std::chrono::duration_cast<std::chrono::nanoseconds>(clock.now() - start).count();
+      kernel.pacing_nanos += slept;
+      if (kernel.isr_nested_nanos.size()) kernel.isr_nested_nanos.back() += slept;
+    }
+  } accounting{kernel};
+  std::unique_lock<std::mutex> lock(kernel.pacer_mutex);
+  while (getTicks() > getRealtimeTicks()) {
+    if (kernel.quit_requested) throw (std::runtime_error("Quit Requested"));  // quit program when stuck at 0 speed
+    kernel.pacer_woken = false;
+    float scale = kernel.realtime_scale;
+    if (scale <= 0.0f) {
+      // paused, nothing to compute a deadline from
+      kernel.pacer_wake.wait(lock, [&kernel]{ return kernel.pacer_woken; });
+    } else {
+      auto ahead = std::chrono::nanoseconds(uint64_t((ticksToNanos(getTicks()) - kernel.realtime_nanos) / scale));
+      if (ahead < pacing_slack) return;
+      auto deadline = kernel.last_clock_read + ahead;
+      kernel.pacing_sleeps++;
+      if (!kernel.pacer_wake.wait_until(lock, deadline, [&kernel]{ return kernel.pacer_woken; })) {
+        int64_t overshoot = std::chrono::duration_cast<std::chrono::nanoseconds>(clock.now() - deadline).count();
+        kernel.pacing_error = (kernel.pacing_error * 7 + overshoot) / 8;
+      }
+    }
+    updateRealtime();
+  }
+}
+
+void Kernel::TimeControl::wake() {
+  auto& kernel = state();
+  {
+    std::lock_guard<std::mutex> lock(kernel.pacer_mutex);
+    kernel.pacer_woken = true;
+  }
+  kernel.pacer_wake.notify_all();
+}
+
+void Kernel::TimeControl::wait_for_wake(std::chrono::nanoseconds timeout) {
+  auto& kernel = state();
+  std::unique_lock<std::mutex> lock(kernel.pacer_mutex);
+  kernel.pacer_wake.wait_for(lock, timeout, [&kernel]{ return kernel.pacer_woken || kernel.quit_requested; });
+  kernel.pacer_woken = false;
+}
+
 // if a thread wants to wait, see what should be executed during that wait
 void Kernel::delayCycles(uint64_t cycles) {
   if (is_initialized()) {
@@ -130,15 +313,17 @@ void Kernel::delayCycles(uint64_t cycles) {
 // this is needed for when marlin loops idle waiting for an event with no delays (syncronize)
 void Kernel::yield() {
   if (is_initialized()) {
+    auto& isr_stack = state().isr_stack;
     if(isr_stack.size() == 0) {
       // Kernel not started?
       TimeControl::addTicks(TimeControl::nanosToTicks(100));
       return;
     }
-    auto max_yield = isr_stack.back()->next_interrupt(TimeControl::frequency);
+    auto max_yield = isr_stack.back()->next_tick;
     if(!execute_loop(max_yield)) { // dont wait longer than this threads exec period
       TimeControl::setTicks(max_yield);
       isr_stack.back()->source_offset = max_yield; // there was nothing to run, and we now overrun our next cycle.
+      Timers::reschedule(*isr_stack.back());
     }
   }
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <functional>
 #include <atomic>
@@ -9,96 +10,148 @@
 #include <map>
 #include <sstream>
 #include <deque>
+#include <vector>
+#include <limits>
 
 constexpr inline uint64_t tickConvertFrequency(std::uint64_t value, std::uint64_t from, std::uint64_t to) {
   return from > to ? value / (from / to) : value * (to / from);
 }
 
+// Execution statistics of one timer, written by the simulation thread and read by the UI
+struct KernelTimerStats {
+  // log2 histograms, bucket n counts values in [2^(n-1), 2^n) ns, bucket 0 counts zero
+  static constexpr std::size_t buckets = 32;
+
+  std::atomic_uint64_t invocations{0}, late{0}, host_nanos{0};
+  std::atomic_uint64_t lateness[buckets] = {};  // simulated ns between due and run
+  std::atomic_uint64_t host_cost[buckets] = {}; // host ns spent in the isr, excluding nested isrs and pacing
+
+  static std::size_t bucket(uint64_t nanos) {
+    return nanos ? std::min<std::size_t>(64 - __builtin_clzll(nanos), buckets - 1) : 0;
+  }
+
+  void record(uint64_t late_nanos, uint64_t cost_nanos) {
+    increment(invocations, 1);
+    if (late_nanos) increment(late, 1);
+    increment(lateness[bucket(late_nanos)], 1);
+    increment(host_cost[bucket(cost_nanos)], 1);
+    increment(host_nanos, cost_nanos);
+  }
+
+  void reset() {
+    invocations = late = host_nanos = 0;
+    for (auto& count : lateness) count = 0;
+    for (auto& count : host_cost) count = 0;
+  }
+
+private:
+  // only the simulation thread writes, so this avoids a locked read-modify-write
+  static void increment(std::atomic_uint64_t& counter, uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  }
+};
+
 struct KernelTimer {
-  KernelTimer(std::string name, void (*callback)(), uint64_t priority) : name(name), isr_function(callback), priority(priority) {}
+  typedef void (*isr_t)(void*);
+
+  KernelTimer(std::string name, void (*callback)(), uint64_t priority) : priority(priority) { set_isr(name, callback); }
+  KernelTimer(std::string name, isr_t callback, void* context, uint64_t priority) : priority(priority) { set_isr(name, callback, context); }
 
   bool interrupt(const uint64_t source_count, const uint64_t frequency) {
     return source_count > next_interrupt(frequency);
   }
 
   uint64_t next_interrupt(const uint64_t source_frequency) {
-    return active ? source_offset + tickConvertFrequency(compare, timer_frequency, source_frequency) : std::numeric_limits<uint64_t>::max();
+    return active && timer_frequency ? source_offset + tickConvertFrequency(compare, timer_frequency, source_frequency) : std::numeric_limits<uint64_t>::max();
   }
 
-  void initialise(const uint64_t timer_frequency) { this->timer_frequency = timer_frequency; }
-  void start(const uint64_t source_count, const uint64_t interrupt_frequency) {
-    compare = timer_frequency / interrupt_frequency;
-    source_offset = source_count;
-  }
-  void enable() { active = true; }
   bool enabled() { return active; }
-  void disable() { active = false; }
 
   // in timer frequency
-  void set_compare(const uint64_t compare) { this->compare = compare; }
   uint64_t get_compare() { return compare; }
   uint64_t get_count(const uint64_t source_count, const uint64_t source_frequency) { return tickConvertFrequency(source_count - source_offset, source_frequency, timer_frequency); }
 
-
   void set_isr(std::string name, void (*callback)()) {
-    isr_function = {callback};
+    // plain callbacks are dispatched through a trampoline so every timer is invoked the same way
+    set_isr(name, [](void* callback){ reinterpret_cast<void (*)()>(callback)(); }, reinterpret_cast<void*>(callback));
+  }
+  void set_isr(std::string name, isr_t callback, void* context) {
+    isr_function = callback;
+    isr_context = context;
     this->name = name;
   }
   void execute() {
     running = true;
-    isr_function();
+    isr_function(isr_context);
     running = false;
   }
 
   std::string name;
   bool active = false;
   bool running = false;
-  std::function<void()> isr_function;
+  bool one_shot = false; // a device event, disarmed when it fires
+  isr_t isr_function = nullptr;
+  void* isr_context = nullptr;
   uint64_t compare = 0, source_offset = 0, timer_frequency = 0, priority = 10;
+
+  // scheduler bookkeeping, next_tick is the cached next_interrupt() in kernel ticks
+  uint64_t next_tick = std::numeric_limits<uint64_t>::max();
+  std::size_t id = 0, queue_index = 0;
+
+  KernelTimerStats stats;
 };
 
 class Kernel {
 public:
+  struct State;
+
   class TimeControl {
   public:
     inline static void updateRealtime() {
       auto now = clock.now();
-      auto delta = now - last_clock_read;
+      auto delta = now - state().last_clock_read;
       uint64_t delta_uint64 = std::chrono::duration_cast<std::chrono::nanoseconds>(delta).count();
       if(delta_uint64 > std::numeric_limits<std::uint64_t>::max() - ONE_BILLION) {
         //printf("rt info: %ld : %f\n", delta_uint64, realtime_scale.load());
         //aparently time can go backwards, thread issue?
         delta_uint64 = 0;
       }
-      uint64_t delta_uint64_scaled = delta_uint64 * realtime_scale;
+      uint64_t delta_uint64_scaled = delta_uint64 * state().realtime_scale;
       if (delta_uint64_scaled != 0) {
-        last_clock_read = now;
-        realtime_nanos += delta_uint64_scaled;
+        state().last_clock_read = now;
+        state().realtime_nanos += delta_uint64_scaled;
       }
     }
 
     inline static void realtime_sync() {
+      if (!state().realtime_lock) return;
       updateRealtime();
-      if (getRealtimeTicks() > getTicks() || realtime_scale > 99.0f) {
-        realtime_nanos = nanos();
-      } else while (getTicks() > getRealtimeTicks()) {
-        if (quit_requested) throw (std::runtime_error("Quit Requested"));  // quit program when stuck at 0 speed
-        updateRealtime();
-        std::this_thread::yield();
+      if (getRealtimeTicks() > getTicks() || state().realtime_scale > 99.0f) {
+        state().realtime_nanos = nanos();
+      } else if (getTicks() > getRealtimeTicks()) {
+        pace();
       }
     }
 
-    inline static uint64_t getRealtimeTicks() { return nanosToTicks(realtime_nanos); }
+    // sleep until wall time catches up with simulated time, or until woken
+    static void pace();
+    // interrupt a pacing sleep so the deadline is recomputed (speed change, input, quit)
+    static void wake();
+    // idle wait for when there is nothing to execute
+    static void wait_for_wake(std::chrono::nanoseconds timeout);
+
+    inline static uint64_t getRealtimeTicks() { return nanosToTicks(state().realtime_nanos); }
 
     inline static uint64_t getTicks() {
-      return ticks.load();
+      return state().ticks.load();
     }
 
     inline static void setTicks(uint64_t new_ticks) {
-      ticks.store(new_ticks);
+      state().ticks.store(new_ticks);
     }
 
     inline static void addTicks(uint64_t delta_ticks) {
+      auto& ticks = state().ticks;
       ticks.store(ticks.load() + delta_ticks);
     }
 
@@ -137,10 +190,8 @@ public:
     static constexpr uint64_t ONE_THOUSAND = 1000;
 
     static std::chrono::steady_clock clock;
-    static std::chrono::steady_clock::time_point last_clock_read;
-    static std::atomic_uint64_t ticks;
-    static uint64_t realtime_nanos;
-    static std::atomic<float> realtime_scale;
+    // simulated time may run this far ahead (in host time) before the pacer sleeps, sleeps shorter than this overshoot
+    static constexpr std::chrono::nanoseconds pacing_slack = std::chrono::milliseconds(1);
     static constexpr uint64_t frequency = 100'000'000;
   };
 
@@ -154,64 +205,166 @@ public:
 
   class Timers {
   public:
-    inline static void timerInit(uint8_t timer_id, uint32_t rate) {
-      if (timer_id < timers.size()) {
-        timers[timer_id].timer_frequency = rate;
+    // Register a timer with the scheduler, the returned id is used with the timer* functions
+    static std::size_t add_timer(std::string name, void (*callback)(), uint64_t priority);
+    static std::size_t add_timer(std::string name, KernelTimer::isr_t callback, void* context, uint64_t priority);
+
+    inline static void timerInit(std::size_t timer_id, uint32_t rate) {
+      auto& kernel = state();
+      if (timer_id < kernel.timers.size()) {
+        kernel.timers[timer_id].timer_frequency = rate;
+        reschedule(kernel.timers[timer_id]);
         // printf("Timer[%d] Initialised( rate: %d )\n", timer_id, rate);
       }
     }
 
-    inline static void timerStart(uint8_t timer_id, uint32_t interrupt_frequency) {
-      if (timer_id < timers.size()) {
-        timers[timer_id].compare = timers[timer_id].timer_frequency / interrupt_frequency;
-        timers[timer_id].source_offset = TimeControl::getTicks();
-        // printf("Timer[%d] Started( frequency: %d compare: %ld)\n", timer_id, interrupt_frequency, timers[timer_id].compare);
+    inline static void timerStart(std::size_t timer_id, uint32_t interrupt_frequency) {
+      auto& kernel = state();
+      if (timer_id < kernel.timers.size()) {
+        kernel.timers[timer_id].compare = kernel.timers[timer_id].timer_frequency / interrupt_frequency;
+        kernel.timers[timer_id].source_offset = TimeControl::getTicks();
+        reschedule(kernel.timers[timer_id]);
+        // printf("Timer[%d] Started( frequency: %d compare: %ld)\n", timer_id, interrupt_frequency, kernel.timers[timer_id].compare);
       }
     }
 
-    inline static void timerEnable(uint8_t timer_id) {
-      if (timer_id < timers.size()) {
-        timers[timer_id].active = true;
+    inline static void timerEnable(std::size_t timer_id) {
+      auto& kernel = state();
+      if (timer_id < kernel.timers.size()) {
+        kernel.timers[timer_id].active = true;
+        reschedule(kernel.timers[timer_id]);
         // printf("Timer[%d] Enabled\n", timer_id);
       }
     }
 
-    inline static bool timerEnabled(uint8_t timer_id) {
-      if (timer_id < timers.size())
-        return timers[timer_id].active;
+    inline static bool timerEnabled(std::size_t timer_id) {
+      auto& kernel = state();
+      if (timer_id < kernel.timers.size())
+        return kernel.timers[timer_id].active;
       return false;
     }
 
-    inline static void timerDisable(uint8_t timer_id) {
-      if (timer_id < timers.size()) {
-        timers[timer_id].active = false;
+    inline static void timerDisable(std::size_t timer_id) {
+      auto& kernel = state();
+      if (timer_id < kernel.timers.size()) {
+        kernel.timers[timer_id].active = false;
+        reschedule(kernel.timers[timer_id]);
         //printf("Timer[%d] Disabled\n", timer_id);
       }
     }
 
-    inline static void timerSetCompare(uint8_t timer_id, uint64_t compare) {
-      if (timer_id < timers.size()) {
-        timers[timer_id].compare = compare;
+    inline static void timerSetCompare(std::size_t timer_id, uint64_t compare) {
+      auto& kernel = state();
+      if (timer_id < kernel.timers.size()) {
+        kernel.timers[timer_id].compare = compare;
+        reschedule(kernel.timers[timer_id]);
       }
     }
 
-    inline static uint64_t timerGetCount(uint8_t timer_id) {
-      if (timer_id < timers.size()) {
+    inline static uint64_t timerGetCount(std::size_t timer_id) {
+      auto& kernel = state();
+      if (timer_id < kernel.timers.size()) {
         //time must pass here for the stepper isr pulse counter (time + 100ns)
-        TimeControl::addTicks(1 + TimeControl::nanosToTicks(100, timers[timer_id].timer_frequency));
-        return timers[timer_id].get_count(TimeControl::getTicks(), TimeControl::frequency);
+        TimeControl::addTicks(1 + TimeControl::nanosToTicks(100, kernel.timers[timer_id].timer_frequency));
+        return kernel.timers[timer_id].get_count(TimeControl::getTicks(), TimeControl::frequency);
       }
       return 0;
     }
 
-    inline static uint64_t timerGetCompare(uint8_t timer_id) {
-      if (timer_id < timers.size())
-        return timers[timer_id].compare;
+    inline static uint64_t timerGetCompare(std::size_t timer_id) {
+      auto& kernel = state();
+      if (timer_id < kernel.timers.size())
+        return kernel.timers[timer_id].compare;
       return 0;
     }
-    static std::array<KernelTimer, 4> timers;
+
+    // Device events: one shot callbacks at an absolute simulated time, run on the simulation thread from the same
+    // queue as the timer isrs and at a priority that preempts them, hardware does not wait for the firmware.
+    // Register and first schedule before the simulation thread starts, after that schedule only from the simulation
+    // thread (pin interrupts, other event callbacks). A callback may schedule its own event again, scheduling a pending event moves it.
+    static constexpr uint64_t device_event_priority = 0;
+    static std::size_t add_event(std::string name, KernelTimer::isr_t callback, void* context);
+
+    inline static void schedule_event(std::size_t event_id, uint64_t nanos) {
+      auto& kernel = state();
+      if (event_id < kernel.timers.size()) {
+        // the first tick at or after nanos, an event never runs early
+        uint64_t ticks = TimeControl::nanosToTicks(nanos);
+        if (TimeControl::ticksToNanos(ticks) < nanos) ticks++;
+        kernel.timers[event_id].source_offset = ticks;
+        kernel.timers[event_id].active = true;
+        reschedule(kernel.timers[event_id]);
+      }
+    }
+
+    inline static void cancel_event(std::size_t event_id) {
+      timerDisable(event_id);
+    }
+
+    inline static bool event_pending(std::size_t event_id) {
+      return timerEnabled(event_id);
+    }
+
+    // Must be called whenever a timers compare, offset or state changes to keep the event queue ordered
+    static void reschedule(KernelTimer& timer);
+
+    // Earliest timer that fires before max_end_ticks and is allowed to preempt current_priority
+    static KernelTimer* next_due(uint64_t current_priority, uint64_t max_end_ticks);
+
+  private:
+    friend struct Kernel::State;
+    template<typename... Args> static std::size_t insert(State& kernel, Args&&... args);
+
+    static bool fires_before(const KernelTimer* a, const KernelTimer* b) {
+      if (a->next_tick != b->next_tick) return a->next_tick < b->next_tick;
+      if (a->priority != b->priority) return a->priority < b->priority;
+      return a->id < b->id;
+    }
+    static void queue_swap(std::vector<KernelTimer*>& queue, std::size_t a, std::size_t b);
+    static void sift_up(std::vector<KernelTimer*>& queue, std::size_t index);
+    static void sift_down(std::vector<KernelTimer*>& queue, std::size_t index);
   };
 
+  // Everything the running simulation mutates
+  struct State {
+    State(); // registers the hardware timers
+
+    std::chrono::steady_clock::time_point last_clock_read = TimeControl::clock.now();
+    std::atomic_uint64_t ticks{0};
+    uint64_t realtime_nanos = 0;
+    std::atomic<float> realtime_scale{1.0f};
+    std::atomic_bool realtime_lock{true}; // when false simulated time runs as fast as the host allows
+
+    std::mutex pacer_mutex;
+    std::condition_variable pacer_wake;
+    bool pacer_woken = false;
+    std::atomic_int64_t pacing_error{0};  // average host ns a timed sleep overshoots its deadline
+    std::atomic_uint64_t pacing_sleeps{0};
+    std::atomic_uint64_t pacing_nanos{0};   // host ns spent in pace()
+
+    // deque so references stay valid as timers are registered
+    std::deque<KernelTimer> timers;
+    std::vector<KernelTimer*> timer_queue;  // binary min-heap ordered by fires_before
+    std::vector<std::size_t> timer_search;  // scratch space for next_due
+
+    bool timers_active = true;
+    std::deque<KernelTimer*> isr_stack;
+    std::vector<uint64_t> isr_nested_nanos; // per isr_stack entry, host ns to leave out of its cost
+    std::atomic_bool quit_requested{false};
+    std::atomic_bool collect_statistics{false}; // see enable_statistics
+    std::atomic_uint64_t isr_timing_error{0};
+    std::atomic_bool debug_break_flag{false};
+    bool initialized = false;
+    std::chrono::steady_clock::time_point host_start = TimeControl::clock.now(); // reset when initialized
+
+    std::mutex safe_point_mutex;
+    std::vector<std::function<void()>> safe_point_tasks;
+    std::atomic_bool safe_point_pending{false};
+  };
+
+  inline static State& state() { return main_state; }
+  static State main_state;
+
   // To avoid issues with global initialization order, this should be called with a true value
   // to enable operation of execute_loop.
   static bool is_initialized(bool known_state = false);
@@ -223,15 +376,28 @@ public:
   // this was neede for when marlin loops idle waiting for an event with no delays
   static void yield();
 
-  static void execution_break() { debug_break_flag = true; }
+  static void execution_break() { state().debug_break_flag = true; }
+  // run task on the simulation thread the next time no interrupt is executing (snapshots)
+  static void run_at_safe_point(std::function<void()> task);
+  static void request_quit() { state().quit_requested = true; TimeControl::wake(); }
+
+  // Statistics, see KernelTimerStats
+  // simulated seconds per host second since the kernel was initialized
+  static double speed_ratio();
+  // timing an isr costs two host clock reads, so it is only done while enabled (--stats, ISR Statistics window)
+  static void enable_statistics(const bool enable) { state().collect_statistics = enable; }
+  static bool statistics_enabled() { return state().collect_statistics; }
+  // must run on the simulation thread, use run_at_safe_point from elsewhere
+  static void reset_statistics();
+  static bool write_statistics(const std::string& filename);
 
   //Timers
   inline static void disableInterrupts() {
-    timers_active = false;
+    state().timers_active = false;
   }
 
   inline static void enableInterrupts() {
-    timers_active = true;
+    state().timers_active = true;
   }
 
   inline static void delayNanos(uint64_t ns) {
@@ -249,10 +415,4 @@ public:
   inline static void delaySeconds(double secs) {
     delayCycles(TimeControl::nanosToTicks(secs * TimeControl::ONE_BILLION));
   }
-
-  static bool timers_active;
-  static std::deque<KernelTimer*> isr_stack;
-  static bool quit_requested;
-  static std::atomic_uint64_t isr_timing_error;
-  static std::atomic_bool debug_break_flag;
 };
@@ -9,13 +9,13 @@
 
 class EndStop : public VirtualPrinter::Component {
 public:
-  EndStop(pin_type endstop, bool invert_logic, std::function<bool()> triggered) : VirtualPrinter::Component("EndStop"), endstop(endstop), invert_logic(invert_logic), triggered(triggered) {
-    Gpio::attach(endstop, [this](GpioEvent& ev){ this->interrupt(ev); });
+  EndStop(pin_type endstop, bool invert_logic, std::function<bool()> triggered, std::function<bool()> ui_triggered) : VirtualPrinter::Component("EndStop"), endstop(endstop), invert_logic(invert_logic), triggered(triggered), ui_triggered(ui_triggered) {
+    Gpio::attach(endstop, GpioEvent::GET_VALUE_MASK, this);
   }
   ~EndStop() {}
 
   void ui_widget() {
-    bool value = (invert_logic ? !triggered() : triggered()) && enabled;
+    bool value = (invert_logic ? !ui_triggered() : ui_triggered()) && enabled;
     ImGui::Checkbox("Triggered", &value);
     value = enabled;
     ImGui::Checkbox("Enabled", &value);
@@ -32,5 +32,6 @@ private:
   const pin_type endstop;
   std::atomic_bool enabled = true;
   bool invert_logic;
-  std::function<bool()> triggered;
+  // triggered is evaluated on the simulation thread when the pin is read, ui_triggered on the UI thread
+  std::function<bool()> triggered, ui_triggered;
 };
\ No newline at end of file
@@ -7,7 +7,7 @@
 class FilamentRunoutSensor : public VirtualPrinter::Component {
 public:
   FilamentRunoutSensor(pin_type runout_pin, bool runtout_trigger_value) : VirtualPrinter::Component("FilamentRunoutSensor"), runout_pin(runout_pin), runtout_trigger_value(runtout_trigger_value) {
-    Gpio::attach(runout_pin, [this](GpioEvent& event){ this->interrupt(event); });
+    Gpio::attach(runout_pin, GpioEvent::GET_VALUE_MASK, this);
   }
 
   void interrupt(GpioEvent &ev) {
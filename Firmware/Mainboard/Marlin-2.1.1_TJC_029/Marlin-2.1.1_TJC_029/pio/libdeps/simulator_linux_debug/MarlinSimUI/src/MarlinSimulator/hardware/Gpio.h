@@ -4,9 +4,9 @@
 #include <atomic>
 #include <functional>
 #include <vector>
-#include <deque>
 
 #include "../execution_control.h"
+#include "GpioCapture.h"
 #include "src/inc/MarlinConfigPre.h"
 
 
@@ -22,6 +22,20 @@ struct GpioEvent {
     SETD,
     GET_VALUE
   };
+  static constexpr std::size_t type_count = GET_VALUE + 1;
+
+  // subscription masks for Gpio::attach, one bit per Type
+  enum Mask : uint8_t {
+    FALL_MASK      = 1 << FALL,
+    RISE_MASK      = 1 << RISE,
+    SET_VALUE_MASK = 1 << SET_VALUE,
+    SETM_MASK      = 1 << SETM,
+    SETD_MASK      = 1 << SETD,
+    GET_VALUE_MASK = 1 << GET_VALUE,
+    EDGE_MASK      = FALL_MASK | RISE_MASK,
+    ANY_MASK       = 0xFF
+  };
+
   uint64_t timestamp;
   pin_type pin_id;
   GpioEvent::Type event;
@@ -35,9 +49,11 @@ public:
   virtual void log(GpioEvent ev) = 0;
 };
 
-struct pin_log_data {
-  uint64_t timestamp;
-  uint16_t value;
+// plain function and context so dispatch never copies or allocates
+struct GpioSubscriber {
+  typedef void (*callback_t)(void* context, GpioEvent& event);
+  callback_t callback;
+  void* context;
 };
 
 struct pin_data {
@@ -62,17 +78,17 @@ struct pin_data {
     LOW,
     HIGH
   };
-  template<class... Args>
-  bool attach(Args... args) {
-    callbacks.push_back(std::function<void(GpioEvent&)>(args...));
+  bool attach(const uint8_t mask, GpioSubscriber subscriber) {
+    for (std::size_t type = 0; type < GpioEvent::type_count; type++) {
+      if (mask & (1 << type)) subscribers[type].push_back(subscriber);
+    }
     return true;
   }
   std::atomic_uint8_t pull;
   std::atomic_uint8_t dir;
   std::atomic_uint8_t mode;
   std::atomic_uint16_t value;
-  std::vector<std::function<void(GpioEvent&)>> callbacks;
-  std::deque<pin_log_data> event_log;
+  std::vector<GpioSubscriber> subscribers[GpioEvent::type_count]; // indexed by GpioEvent::Type
 };
 
 class Gpio {
@@ -82,22 +98,20 @@ public:
 
   static void set_pin_value(const pin_type pin, const uint16_t value) {
     if (!valid_pin(pin)) return;
-    if (value != pin_map[pin].value) { // Optimizes for size, but misses "meaningless" sets
-      pin_map[pin].value = value;
-      if (logging_enabled) {
-        pin_map[pin].event_log.push_back(pin_log_data{Kernel::TimeControl::nanos(), pin_map[pin].value});
-        if (pin_map[pin].event_log.size() > 100000) pin_map[pin].event_log.pop_front();
-      }
+    auto& pin_state = state().pin_map[pin];
+    if (value != pin_state.value) { // Optimizes for size, but misses "meaningless" sets
+      if (state().logging_enabled) log(pin, value, Kernel::TimeControl::getTicks());
+      pin_state.value = value;
     }
   }
 
   static uint16_t get_pin_value(const pin_type pin) {
     if (!valid_pin(pin)) return 0;
-    return pin_map[pin].value;
+    return state().pin_map[pin].value;
   }
 
   static inline constexpr bool valid_pin(const pin_type pin) {
-    return pin >= 0 && pin <= pin_count;
+    return pin >= 0 && pin < pin_count;
   }
 
   static inline void set(const pin_type pin) {
@@ -106,23 +120,26 @@ public:
 
   static void set(const pin_type pin, const uint16_t value) {
     if (!valid_pin(pin)) return;
-    if (value != pin_map[pin].value) { // Optimizes for size, but misses "meaningless" sets
-      GpioEvent::Type evt_type = value > 1 ? GpioEvent::SET_VALUE : value > pin_map[pin].value ? GpioEvent::RISE : value < pin_map[pin].value ? GpioEvent::FALL : GpioEvent::NOP;
-      pin_map[pin].value = value;
-      GpioEvent evt(Kernel::TimeControl::getTicks(), pin, evt_type);
-      if (logging_enabled) {
-        pin_map[pin].event_log.push_back(pin_log_data{Kernel::TimeControl::nanos(), pin_map[pin].value});
-        if (pin_map[pin].event_log.size() > 100000) pin_map[pin].event_log.pop_front();
-      }
-      for (auto callback : pin_map[pin].callbacks) callback(evt);
+    auto& pin_state = state().pin_map[pin];
+    if (value != pin_state.value) { // Optimizes for size, but misses "meaningless" sets
+      GpioEvent::Type evt_type = value > 1 ? GpioEvent::SET_VALUE : value > pin_state.value ? GpioEvent::RISE : value < pin_state.value ? GpioEvent::FALL : GpioEvent::NOP;
+      change(pin, pin_state, value, evt_type);
     }
   }
 
+  // analogWrite, any non zero duty is a SET_VALUE so a duty of 1 is not taken for a digital high
+  static void set_duty(const pin_type pin, const uint16_t value) {
+    if (!valid_pin(pin)) return;
+    auto& pin_state = state().pin_map[pin];
+    if (value == 0) set(pin, value);
+    else if (value != pin_state.value) change(pin, pin_state, value, GpioEvent::SET_VALUE);
+  }
+
   static uint16_t get(const pin_type pin) {
     if (!valid_pin(pin)) return 0;
-    GpioEvent evt(Kernel::TimeControl::getTicks(), pin, GpioEvent::GET_VALUE);
-    for (auto callback : pin_map[pin].callbacks) callback(evt);
-    return pin_map[pin].value;
+    auto& pin_state = state().pin_map[pin];
+    dispatch(pin, pin_state, GpioEvent::GET_VALUE);
+    return pin_state.value;
   }
 
   static inline void clear(const pin_type pin) {
@@ -131,76 +148,117 @@ public:
 
   static void setMode(const pin_type pin, const uint8_t value) {
     if (!valid_pin(pin)) return;
-    pin_map[pin].mode = pin_data::Mode::GPIO;
-
-    GpioEvent evt(Kernel::TimeControl::getTicks(), pin, GpioEvent::Type::SETM);
+    auto& pin_state = state().pin_map[pin];
+    pin_state.mode = pin_data::Mode::GPIO;
 
     if (value != 1) setDir(pin, pin_data::Direction::INPUT);
     else setDir(pin, pin_data::Direction::OUTPUT);
 
-    pin_map[pin].pull = value == 2 ? pin_data::Pull::PULLUP : value == 3 ? pin_data::Pull::PULLDOWN : pin_data::Pull::NONE;
-    if (pin_map[pin].pull == pin_data::Pull::PULLUP) set(pin, pin_data::State::HIGH);
+    pin_state.pull = value == 2 ? pin_data::Pull::PULLUP : value == 3 ? pin_data::Pull::PULLDOWN : pin_data::Pull::NONE;
+    if (pin_state.pull == pin_data::Pull::PULLUP) set(pin, pin_data::State::HIGH);
 
   }
 
   static inline uint8_t getMode(const pin_type pin) {
     if (!valid_pin(pin)) return 0;
-    return pin_map[pin].mode;
+    return state().pin_map[pin].mode;
   }
 
   static void setDir(const pin_type pin, const uint8_t value) {
     if (!valid_pin(pin)) return;
-    pin_map[pin].dir = value;
-    GpioEvent evt(Kernel::TimeControl::getTicks(), pin, GpioEvent::Type::SETD);
-    for (auto callback : pin_map[pin].callbacks) callback(evt);
+    auto& pin_state = state().pin_map[pin];
+    pin_state.dir = value;
+    dispatch(pin, pin_state, GpioEvent::SETD);
   }
 
   static inline uint8_t getDir(const pin_type pin) {
     if (!valid_pin(pin)) return 0;
-    return pin_map[pin].dir;
+    return state().pin_map[pin].dir;
   }
 
   static void write(const pin_type pin, const uint16_t value) {
     if (!valid_pin(pin)) return;
-    pin_map[pin].value = value;
-    GpioEvent evt(Kernel::TimeControl::getTicks(), pin, GpioEvent::SET_VALUE);
-    for (auto callback : pin_map[pin].callbacks) callback(evt);
+    auto& pin_state = state().pin_map[pin];
+    pin_state.value = value;
+    dispatch(pin, pin_state, GpioEvent::SET_VALUE);
   }
 
   static uint16_t read(const pin_type pin) {
     if (!valid_pin(pin)) return 0;
-    GpioEvent evt(Kernel::TimeControl::getTicks(), pin, GpioEvent::GET_VALUE);
-    for (auto callback : pin_map[pin].callbacks) callback(evt);
-    return pin_map[pin].value;
+    auto& pin_state = state().pin_map[pin];
+    dispatch(pin, pin_state, GpioEvent::GET_VALUE);
+    return pin_state.value;
   }
 
-  template<class... Args>
-  static bool attach(const pin_type pin, Args... args) {
-    if (!valid_pin(pin)) return false;
-    return pin_map[pin].attach(args...);
+  // callback runs for every event whose GpioEvent::Mask bit is set in mask
+  static bool attach(const pin_type pin, const uint8_t mask, GpioSubscriber::callback_t callback, void* context) {
+    if (!valid_pin(pin) || callback == nullptr) return false;
+    return state().pin_map[pin].attach(mask, GpioSubscriber{callback, context});
   }
 
+  // subscribe object->interrupt(GpioEvent&)
+  template<class T>
+  static bool attach(const pin_type pin, const uint8_t mask, T* object) {
+    return attach(pin, mask, [](void* context, GpioEvent& event){ static_cast<T*>(context)->interrupt(event); }, object);
+  }
+
+  // the capture is cleared by the simulation thread at the next logged change
   static void resetLogs() {
-    for (auto &pin : pin_map) {
-      // Seed each pin with an initial value to ensure important edges are not the first sample.
-      pin.event_log.clear();
-      pin.event_log.push_back(pin_log_data{Kernel::TimeControl::nanos(), pin.value});
-    }
+    state().reset_pending = true;
   }
 
   static void setLoggingEnabled(bool enable) {
-    if (!logging_enabled && enable) {
+    if (!state().logging_enabled && enable) {
       resetLogs();
     }
-    logging_enabled = enable;
+    state().logging_enabled = enable;
   }
 
   static bool isLoggingEnabled() {
-    return logging_enabled;
+    return state().logging_enabled;
   }
 
-  static pin_data pin_map[pin_count];
+  // called before pin_map is updated, so a reset seeds every pin with its level before this change
+  static void log(const pin_type pin, const uint16_t value, const uint64_t ticks) {
+    auto& capture = state().capture;
+    uint64_t timestamp = Kernel::TimeControl::ticksToNanos(ticks);
+    if (state().reset_pending.load(std::memory_order_relaxed)) {
+      state().reset_pending = false;
+      uint16_t values[pin_count];
+      for (pin_type i = 0; i < pin_count; i++) values[i] = state().pin_map[i].value;
+      capture.reset(timestamp, values);
+    }
+    capture.append(pin, timestamp, value);
+  }
+
+  static inline void dispatch(const pin_type pin, pin_data& pin_state, const GpioEvent::Type type, const uint64_t timestamp) {
+    auto& subscribers = pin_state.subscribers[type];
+    if (subscribers.empty()) return;
+    GpioEvent event(timestamp, pin, type);
+    for (auto& subscriber : subscribers) subscriber.callback(subscriber.context, event);
+  }
+
+  static inline void dispatch(const pin_type pin, pin_data& pin_state, const GpioEvent::Type type) {
+    if (pin_state.subscribers[type].empty()) return;
+    dispatch(pin, pin_state, type, Kernel::TimeControl::getTicks());
+  }
+
+  static inline void change(const pin_type pin, pin_data& pin_state, const uint16_t value, const GpioEvent::Type type) {
+    uint64_t timestamp = Kernel::TimeControl::getTicks();
+    if (state().logging_enabled) log(pin, value, timestamp);
+    pin_state.value = value;
+    dispatch(pin, pin_state, type, timestamp);
+  }
+
+  // Pin state of the simulated printer
+  struct State {
+    pin_data pin_map[pin_count] = {};
+    std::atomic_bool logging_enabled{false};
+    std::atomic_bool reset_pending{false};
+    GpioCapture capture;
+  };
+  static_assert(GpioCapture::pin_count == pin_count, "GpioCapture must cover every pin");
 
-private:
-  static bool logging_enabled;
+  inline static State& state() { return main_state; }
+  static State main_state;
 };
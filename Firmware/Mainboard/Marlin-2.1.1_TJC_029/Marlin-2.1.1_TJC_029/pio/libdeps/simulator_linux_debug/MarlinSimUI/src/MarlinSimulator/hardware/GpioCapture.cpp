@@ -0,0 +1,281 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/uio.h>
+  #include <unistd.h>
+#endif
+
+#include "GpioCapture.h"
+
+namespace {
+
+// spill records are a header followed by the delta and value columns
+struct SpillHeader {
+  uint64_t sequence;
+  uint64_t base_timestamp;
+  uint32_t pin;
+  uint32_t size;
+};
+
+} // namespace
+
+GpioCapture::~GpioCapture() {
+  #ifndef _WIN32
+    unmap_spill();
+    if (spill_fd >= 0) close(spill_fd);
+  #endif
+}
+
+GpioCapture::PinRing* GpioCapture::allocate(const std::size_t pin) {
+  // the ring is allocated once, the chunks are reused from then on
+  std::unique_ptr<PinRing> ring(new PinRing);
+  ring->pin = pin;
+  ring->last_value = start_values[pin];
+  ring->pyramid.clear(start_timestamp, ring->last_value);
+  std::lock_guard<std::mutex> lock(mutex);
+  rings[pin] = std::move(ring);
+  return rings[pin].get();
+}
+
+void GpioCapture::start_chunk(PinRing& ring, const uint64_t timestamp) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (ring.next_sequence) {
+    ring.chunks[(ring.next_sequence - 1) % ring_chunks].size = ring.active_size.load(std::memory_order_relaxed);
+  }
+  if (ring.next_sequence - ring.first_sequence == ring_chunks) evict_oldest(ring);
+
+  auto& chunk = ring.chunks[ring.next_sequence % ring_chunks];
+  chunk.sequence = ring.next_sequence;
+  chunk.base_timestamp = timestamp;
+  chunk.size = 0;
+  ring.active_size.store(0, std::memory_order_relaxed);
+  ring.next_sequence++;
+}
+
+void GpioCapture::evict_oldest(PinRing& ring) {
+  auto& chunk = ring.chunks[ring.first_sequence % ring_chunks];
+  ring.first_sequence++;
+
+  #ifndef _WIN32
+    if (spill_fd >= 0) {
+      SpillHeader header = {chunk.sequence, chunk.base_timestamp, uint32_t(ring.pin), chunk.size};
+      iovec parts[] = {
+        {&header, sizeof(header)},
+        {chunk.deltas, chunk.size * sizeof(chunk.deltas[0])},
+        {chunk.values, chunk.size * sizeof(chunk.values[0])},
+      };
+      uint64_t length = sizeof(header) + chunk.size * (sizeof(chunk.deltas[0]) + sizeof(chunk.values[0]));
+      if (pwritev(spill_fd, parts, 3, spill_size) == ssize_t(length)) {
+        ring.spilled.push_back({chunk.sequence, chunk.base_timestamp, spill_size + sizeof(header), chunk.size});
+        spill_size += length;
+        spilled_bytes += length;
+        return;
+      }
+      fprintf(stderr, "GpioCapture::evict_oldest: spill write failed, dropping chunks from now on\n");
+      close(spill_fd);
+      spill_fd = -1;
+    }
+  #endif
+  dropped_events += chunk.size;
+}
+
+void GpioCapture::reset(const uint64_t timestamp, const uint16_t (&values)[pin_count]) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto& ring : rings) {
+    if (!ring) continue;
+    ring->first_sequence = ring->next_sequence = 0;
+    ring->active_size.store(0, std::memory_order_relaxed);
+    ring->spilled.clear();
+    ring->last_value = values[ring->pin];
+    ring->pyramid.clear(timestamp, ring->last_value);
+  }
+  for (std::size_t pin = 0; pin < pin_count; pin++) start_values[pin] = peak_values[pin] = values[pin];
+  start_timestamp = timestamp;
+  dropped_events = 0;
+  generation++;
+
+  // earlier records are unreachable now, start the file over
+  #ifndef _WIN32
+    unmap_spill();
+    if (spill_fd >= 0 && ftruncate(spill_fd, 0) == 0) spill_size = 0;
+  #endif
+  spilled_bytes = 0;
+}
+
+bool GpioCapture::copy_chunk(const std::size_t pin, const uint64_t sequence, Chunk& out) {
+  if (pin >= pin_count) return false;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto& ring = rings[pin];
+  if (!ring) return false;
+
+  // older chunks can only be in the spill file
+  if (sequence < ring->first_sequence && !ring->spilled.empty()) {
+    auto spilled = std::lower_bound(ring->spilled.begin(), ring->spilled.end(), sequence, [](auto& chunk, uint64_t sequence){ return chunk.sequence < sequence; });
+    if (spilled != ring->spilled.end()) {
+      uint64_t end = spilled->offset + spilled->size * (sizeof(out.deltas[0]) + sizeof(out.values[0]));
+      if (map_spill(end)) {
+        out.sequence = spilled->sequence;
+        out.base_timestamp = spilled->base_timestamp;
+        out.size = spilled->size;
+        memcpy(out.deltas, spill_map + spilled->offset, out.size * sizeof(out.deltas[0]));
+        memcpy(out.values, spill_map + spilled->offset + out.size * sizeof(out.deltas[0]), out.size * sizeof(out.values[0]));
+        return true;
+      }
+    }
+  }
+
+  uint64_t next = std::max(sequence, ring->first_sequence);
+  if (next >= ring->next_sequence) return false;
+  auto& chunk = ring->chunks[next % ring_chunks];
+  out.sequence = chunk.sequence;
+  out.base_timestamp = chunk.base_timestamp;
+  out.size = next == ring->next_sequence - 1 ? ring->active_size.load(std::memory_order_acquire) : chunk.size;
+  memcpy(out.deltas, chunk.deltas, out.size * sizeof(out.deltas[0]));
+  memcpy(out.values, chunk.values, out.size * sizeof(out.values[0]));
+  return true;
+}
+
+void GpioCapture::Pyramid::clear(const uint64_t timestamp, const uint16_t value) {
+  for (auto& level : bucket) {
+    for (auto& slot : level) slot.index.store(0, std::memory_order_relaxed);
+  }
+  last_value.store(value, std::memory_order_relaxed);
+  last_timestamp.store(timestamp, std::memory_order_release);
+}
+
+void GpioCapture::trace(const std::size_t pin, uint64_t from, const uint64_t to, const uint64_t resolution, std::vector<Sample>& out) {
+  out.clear();
+  if (pin >= pin_count) return;
+  auto start = initial(pin);
+  from = std::max(from, start.timestamp);
+  if (to <= from) return;
+
+  PinRing* ring;
+  {
+    // rings are never freed once allocated
+    std::lock_guard<std::mutex> lock(mutex);
+    ring = rings[pin].get();
+  }
+  if (ring == nullptr) {
+    out.push_back({from, start.value});
+    out.push_back({to, start.value});
+    return;
+  }
+
+  auto& pyramid = ring->pyramid;
+  uint64_t last_timestamp = pyramid.last_timestamp.load(std::memory_order_acquire);
+  uint16_t last_value = pyramid.last_value.load(std::memory_order_relaxed);
+
+  // the finest level that is coarse enough, and still holds the start of the window
+  std::size_t level = 0;
+  while (level + 1 < Pyramid::levels && (uint64_t(1) << Pyramid::shift(level)) < resolution) level++;
+  while (level + 1 < Pyramid::levels && from < last_timestamp && (last_timestamp >> Pyramid::shift(level)) - (from >> Pyramid::shift(level)) >= Pyramid::buckets) level++;
+  const std::size_t shift = Pyramid::shift(level);
+
+  auto read = [&](uint64_t index, uint64_t& packed) {
+    auto& slot = pyramid.bucket[level][index % Pyramid::buckets];
+    if (slot.index.load(std::memory_order_acquire) != index) return false;
+    packed = slot.packed.load(std::memory_order_relaxed);
+    return slot.index.load(std::memory_order_relaxed) == index;
+  };
+
+  // each bucket is drawn as a vertical at its start, from the level it started with through its min and max
+  uint64_t newest = (last_timestamp >> shift) + 1, last = std::min((to >> shift) + 1, newest);
+  uint64_t x = from, packed;
+  for (uint64_t index = (from >> shift) + 1; index <= last; index++) {
+    if (!read(index, packed)) continue;
+    uint16_t first = packed;
+    out.push_back({x, first});
+    x = std::max(from, (index - 1) << shift);
+    out.push_back({x, first});
+    out.push_back({x, uint16_t(packed >> 16)});
+    out.push_back({x, uint16_t(packed >> 32)});
+  }
+
+  // the bucket's last level is where the next one starts
+  uint16_t end = last_value;
+  for (uint64_t index = last + 1; index <= newest && index - last <= Pyramid::buckets; index++) {
+    if (read(index, packed)) {
+      end = packed;
+      break;
+    }
+  }
+  out.push_back({x, end});
+  out.push_back({to, end});
+}
+
+bool GpioCapture::Cursor::next(GpioCapture& capture, const uint64_t end_sequence) {
+  if (index == chunk->size && next_sequence && chunk->size < chunk_events) {
+    // the chunk was still being filled when it was copied, it continues where it was left
+    uint64_t sequence = next_sequence - 1;
+    if (capture.copy_chunk(pin, sequence, *chunk) && chunk->sequence != sequence) {
+      index = 0;
+      timestamp = chunk->base_timestamp;
+      next_sequence = chunk->sequence + 1;
+    }
+  }
+  while (index == chunk->size) {
+    if (next_sequence >= end_sequence || !capture.copy_chunk(pin, next_sequence, *chunk)) return false;
+    // chunks dropped from the ring are skipped over
+    index = 0;
+    timestamp = chunk->base_timestamp;
+    next_sequence = chunk->sequence + 1;
+  }
+  index = chunk->next_event(index, timestamp, value);
+  return true;
+}
+
+uint64_t GpioCapture::end_sequence(const std::size_t pin) {
+  if (pin >= pin_count) return 0;
+  std::lock_guard<std::mutex> lock(mutex);
+  return rings[pin] ? rings[pin]->next_sequence : 0;
+}
+
+bool GpioCapture::map_spill(uint64_t length) {
+  #ifndef _WIN32
+    if (length <= spill_map_size) return true;
+    if (spill_fd < 0 || length > spill_size) return false;
+    unmap_spill();
+    // mapped up to the end of the file, so the map is only replaced after further spills
+    void* map = mmap(nullptr, spill_size, PROT_READ, MAP_SHARED, spill_fd, 0);
+    if (map == MAP_FAILED) return false;
+    spill_map = (const uint8_t*)map;
+    spill_map_size = spill_size;
+    return true;
+  #else
+    return false;
+  #endif
+}
+
+void GpioCapture::unmap_spill() {
+  #ifndef _WIN32
+    if (spill_map) munmap((void*)spill_map, spill_map_size);
+  #endif
+  spill_map = nullptr;
+  spill_map_size = 0;
+}
+
+bool GpioCapture::set_spill_file(const std::string& filename) {
+  #ifndef _WIN32
+    std::lock_guard<std::mutex> lock(mutex);
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      fprintf(stderr, "GpioCapture::set_spill_file: unable to create %s\n", filename.c_str());
+      return false;
+    }
+    unmap_spill();
+    if (spill_fd >= 0) close(spill_fd);
+    spill_fd = fd;
+    spill_size = 0;
+    // chunks in the old file are gone
+    for (auto& ring : rings) if (ring) ring->spilled.clear();
+    return true;
+  #else
+    fprintf(stderr, "GpioCapture::set_spill_file: spill files are not supported on this platform\n");
+    return false;
+  #endif
+}
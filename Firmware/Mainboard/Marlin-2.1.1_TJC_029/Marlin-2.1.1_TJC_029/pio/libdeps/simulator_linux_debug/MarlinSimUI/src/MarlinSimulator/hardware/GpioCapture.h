@@ -0,0 +1,243 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Pin level capture behind Gpio logging.
+ *
+ * A pin gets a preallocated ring of fixed size chunks the first time it changes. A chunk stores
+ * its events column wise, ns deltas from the previous event and the values, plus the absolute
+ * time of its first event. A gap too long for 32 bits is escaped in place, so a pin that changes
+ * only every few seconds still fills its chunks. The simulation thread appends without locking, the lock is only
+ * taken when it starts the next chunk. When the ring is full the oldest chunk is appended to the
+ * spill file if one is set (read back through a memory map), otherwise it is dropped.
+ *
+ * Readers copy a whole chunk at a time by sequence number, the copy is consistent even while
+ * the chunk is still being filled, and a reader never holds the lock while it processes data.
+ *
+ * Every ring also keeps a min/max pyramid of the pin level, updated as events are appended,
+ * so views of any time window cost about one bucket per point drawn (see trace()).
+ */
+class GpioCapture {
+public:
+  static constexpr std::size_t pin_count = 256;
+  static constexpr std::size_t chunk_events = 4096;
+  static constexpr std::size_t ring_chunks = 16;
+  // delta of an escaped gap, the next two deltas are the low and high words of the gap
+  static constexpr uint32_t long_gap = UINT32_MAX;
+
+  struct Chunk {
+    uint64_t sequence = 0;
+    uint64_t base_timestamp = 0; // ns, time of the first event
+    uint32_t size = 0; // slots used, an escaped gap takes three with the value in the last
+    uint32_t deltas[chunk_events]; // ns since the previous event, the first is 0
+    uint16_t values[chunk_events];
+
+    // decode the event at slot i, returns the slot of the next one
+    std::size_t next_event(const std::size_t i, uint64_t& timestamp, uint16_t& value) const {
+      if (deltas[i] == long_gap && i + 2 < size) {
+        timestamp += deltas[i + 1] | uint64_t(deltas[i + 2]) << 32;
+        value = values[i + 2];
+        return i + 3;
+      }
+      timestamp += deltas[i];
+      value = values[i];
+      return i + 1;
+    }
+
+    template<class F>
+    void for_each(F&& fn) const {
+      uint64_t timestamp = base_timestamp;
+      uint16_t value = 0;
+      for (std::size_t i = 0; i < size;) {
+        i = next_event(i, timestamp, value);
+        fn(timestamp, value);
+      }
+    }
+  };
+
+  struct Sample {
+    uint64_t timestamp;
+    uint16_t value;
+  };
+
+  // min/max decimation of one pin, buckets at level n are 64ns << 2n wide, each level keeps its newest buckets
+  struct Pyramid {
+    static constexpr std::size_t levels = 16;
+    static constexpr std::size_t buckets = 2048;
+    static constexpr std::size_t level0_shift = 6;
+
+    static constexpr std::size_t shift(const std::size_t level) { return level0_shift + 2 * level; }
+
+    // first is the level when the bucket started, index is the bucket number + 1, 0 when unused
+    struct Bucket {
+      std::atomic_uint64_t index{0};
+      std::atomic_uint64_t packed{0}; // first | min << 16 | max << 32
+    };
+    Bucket bucket[levels][buckets];
+    std::atomic_uint64_t last_timestamp{0};
+    std::atomic_uint16_t last_value{0};
+
+    static uint64_t pack(const uint16_t first, const uint16_t min, const uint16_t max) {
+      return uint64_t(first) | uint64_t(min) << 16 | uint64_t(max) << 32;
+    }
+
+    void update(const uint64_t timestamp, const uint16_t previous, const uint16_t value) {
+      for (std::size_t level = 0; level < levels; level++) {
+        uint64_t index = (timestamp >> shift(level)) + 1;
+        auto& slot = bucket[level][index % buckets];
+        if (slot.index.load(std::memory_order_relaxed) != index) {
+          slot.packed.store(pack(previous, std::min(previous, value), std::max(previous, value)), std::memory_order_relaxed);
+          slot.index.store(index, std::memory_order_release);
+          continue;
+        }
+        uint64_t packed = slot.packed.load(std::memory_order_relaxed);
+        uint16_t min = packed >> 16, max = packed >> 32;
+        // every coarser bucket spans this one, so it already covers the value too
+        if (value >= min && value <= max) break;
+        slot.packed.store(pack(uint16_t(packed), std::min(min, value), std::max(max, value)), std::memory_order_relaxed);
+      }
+      last_value.store(value, std::memory_order_relaxed);
+      last_timestamp.store(timestamp, std::memory_order_release);
+    }
+
+    void clear(const uint64_t timestamp, const uint16_t value);
+  };
+
+  // events of one pin in time order, following the capture as it grows
+  class Cursor {
+  public:
+    Cursor(const std::size_t pin) : pin(pin), chunk(new Chunk) {}
+    // false when everything captured so far (or before end_sequence) has been read, may be called again later
+    bool next(GpioCapture& capture, const uint64_t end_sequence = UINT64_MAX);
+    // chunks passed so far
+    uint64_t sequence() const { return next_sequence; }
+
+    std::size_t pin;
+    uint64_t timestamp = 0;
+    uint16_t value = 0;
+
+  private:
+    std::unique_ptr<Chunk> chunk;
+    uint64_t next_sequence = 0;
+    uint32_t index = 0;
+  };
+
+  GpioCapture() = default;
+  ~GpioCapture();
+  GpioCapture(const GpioCapture&) = delete;
+  GpioCapture& operator=(const GpioCapture&) = delete;
+
+  // Simulation thread
+  void append(const std::size_t pin, const uint64_t timestamp, const uint16_t value) {
+    if (pin >= pin_count) return;
+    PinRing* ring = rings[pin].get();
+    if (ring == nullptr) ring = allocate(pin);
+    uint32_t size = ring->active_size.load(std::memory_order_relaxed);
+    uint64_t delta = timestamp - ring->last_timestamp;
+    uint32_t slots = delta >= long_gap ? 3 : 1;
+    if (ring->next_sequence == 0 || size + slots > chunk_events) {
+      start_chunk(*ring, timestamp);
+      size = 0;
+      delta = 0;
+      slots = 1;
+    }
+    auto& chunk = ring->chunks[(ring->next_sequence - 1) % ring_chunks];
+    if (slots == 1) {
+      chunk.deltas[size] = delta;
+      chunk.values[size] = value;
+    } else {
+      chunk.deltas[size] = long_gap;
+      chunk.deltas[size + 1] = uint32_t(delta);
+      chunk.deltas[size + 2] = uint32_t(delta >> 32);
+      chunk.values[size] = chunk.values[size + 1] = chunk.values[size + 2] = value;
+    }
+    ring->last_timestamp = timestamp;
+    // readers only see the escape once all of it is written
+    ring->active_size.store(size + slots, std::memory_order_release);
+    ring->pyramid.update(timestamp, ring->last_value, value);
+    ring->last_value = value;
+    if (value > peak_values[pin].load(std::memory_order_relaxed)) peak_values[pin].store(value, std::memory_order_relaxed);
+  }
+
+  // drop everything and record the level of every pin at timestamp as the start of the capture
+  void reset(const uint64_t timestamp, const uint16_t (&values)[pin_count]);
+
+  // Any thread
+  // copy the chunk with the lowest sequence >= sequence, false when there is none
+  bool copy_chunk(const std::size_t pin, const uint64_t sequence, Chunk& out);
+
+  // visit every captured event of pin in time order, starting with the level at the start of the capture
+  template<class F>
+  void for_each(const std::size_t pin, F&& fn) {
+    auto start = initial(pin);
+    fn(start.timestamp, start.value);
+    std::unique_ptr<Chunk> chunk(new Chunk);
+    for (uint64_t sequence = 0; copy_chunk(pin, sequence, *chunk); sequence = chunk->sequence + 1) chunk->for_each(fn);
+  }
+
+  // one past the newest chunk
+  uint64_t end_sequence(const std::size_t pin);
+
+  // level of pin from `from` to `to` as step points, about resolution ns apart where the pin is busy
+  void trace(const std::size_t pin, uint64_t from, const uint64_t to, const uint64_t resolution, std::vector<Sample>& out);
+
+  Sample initial(const std::size_t pin) const {
+    return {start_timestamp.load(), pin < pin_count ? start_values[pin].load() : uint16_t(0)};
+  }
+
+  // highest value pin had since the capture started, above 1 for PWM and analog pins
+  uint16_t peak(const std::size_t pin) const {
+    return pin < pin_count ? peak_values[pin].load(std::memory_order_relaxed) : uint16_t(0);
+  }
+
+  // chunks evicted from now on are kept in filename, false if it could not be created
+  bool set_spill_file(const std::string& filename);
+
+  // incremented by every reset, readers following the capture start over when it changes
+  std::atomic_uint64_t generation{0};
+  std::atomic_uint64_t spilled_bytes{0};
+  std::atomic_uint64_t dropped_events{0};
+
+private:
+  struct SpilledChunk {
+    uint64_t sequence, base_timestamp, offset;
+    uint32_t size;
+  };
+
+  struct PinRing {
+    std::size_t pin = 0;
+    Chunk chunks[ring_chunks];
+    // chunks [first_sequence, next_sequence) are in memory, next_sequence - 1 is being filled
+    uint64_t first_sequence = 0, next_sequence = 0;
+    std::atomic_uint32_t active_size{0};
+    uint64_t last_timestamp = 0;
+    uint16_t last_value = 0;
+    std::vector<SpilledChunk> spilled;
+    Pyramid pyramid;
+  };
+
+  PinRing* allocate(const std::size_t pin);
+  void start_chunk(PinRing& ring, const uint64_t timestamp);
+  void evict_oldest(PinRing& ring);
+  bool map_spill(uint64_t length);
+  void unmap_spill();
+
+  std::mutex mutex;
+  std::unique_ptr<PinRing> rings[pin_count];
+
+  std::atomic_uint64_t start_timestamp{0};
+  std::atomic_uint16_t start_values[pin_count] = {};
+  std::atomic_uint16_t peak_values[pin_count] = {};
+
+  int spill_fd = -1;
+  uint64_t spill_size = 0;
+  const uint8_t* spill_map = nullptr;
+  uint64_t spill_map_size = 0;
+};
@@ -17,20 +17,16 @@
 HD44780Device::HD44780Device(pin_type rs, pin_type en, pin_type d4, pin_type d5, pin_type d6, pin_type d7, pin_type beeper, pin_type enc1, pin_type enc2, pin_type enc_but, pin_type back, pin_type kill)
   : rs_pin(rs), en_pin(en), d4_pin(d4), d5_pin(d5), d6_pin(d6), d7_pin(d7), beeper_pin(beeper), enc1_pin(enc1), enc2_pin(enc2), enc_but_pin(enc_but), back_pin(back), kill_pin(kill) {
 
-  Gpio::attach(rs_pin, [this](GpioEvent& event){ this->interrupt(event); });
+  Gpio::attach(rs_pin, GpioEvent::EDGE_MASK, this);
   data_is_command = !Gpio::get_pin_value(rs_pin); // make sure the initial state is updated
-  Gpio::attach(en_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(d4_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(d5_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(d6_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(d7_pin, [this](GpioEvent& event){ this->interrupt(event); });
-
-  Gpio::attach(beeper_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(enc1_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(enc2_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(enc_but_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(back_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(kill_pin, [this](GpioEvent& event){ this->interrupt(event); });
+  Gpio::attach(en_pin, GpioEvent::RISE_MASK, this); // d4-d7 are sampled on this edge
+
+  Gpio::attach(beeper_pin, GpioEvent::EDGE_MASK, this);
+  Gpio::attach(enc1_pin, GpioEvent::GET_VALUE_MASK, this);
+  Gpio::attach(enc2_pin, GpioEvent::GET_VALUE_MASK, this);
+  Gpio::attach(enc_but_pin, GpioEvent::GET_VALUE_MASK, this);
+  Gpio::attach(back_pin, GpioEvent::GET_VALUE_MASK, this);
+  Gpio::attach(kill_pin, GpioEvent::GET_VALUE_MASK, this);
 
   for (auto& pixel : texture_data) pixel = display_color;
 
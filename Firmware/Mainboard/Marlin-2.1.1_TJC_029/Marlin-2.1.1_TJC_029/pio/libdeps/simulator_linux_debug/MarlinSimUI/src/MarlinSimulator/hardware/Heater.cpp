@@ -1,31 +1,12 @@
+#include <cmath>
+
 #include <imgui.h>
 
 #include "pinmapping.h"
 #include "Heater.h"
+#include "../snapshot.h"
 
-constexpr double absolute_zero_offset = -273.15;
-double thermistor_ext_coef[] = {
-  7.611428226793945e-04,
-  2.011100481838449e-04,
-  1.914201231699539e-06,
-  1.561937567632929e-08
-};
-
-double temperature_to_resistance(double t) {
-	double r, u, v, p, q, b, c, d;
-	t = t - absolute_zero_offset;
-	d = (thermistor_ext_coef[0] - 1.0 / t) / thermistor_ext_coef[3];
-	c = thermistor_ext_coef[1] / thermistor_ext_coef[3];
-	b = thermistor_ext_coef[2] / thermistor_ext_coef[3];
-	q = 2.0 / 27.0 * b * b * b - 1.0 / 3.0 * b * c + d;
-	p = c - 1.0 / 3.0 * b * b;
-	v = - pow(q / 2.0 + sqrt(q * q / 4.0 + p * p * p / 27.0), 1.0 / 3.0);
-	u =   pow(-q / 2.0 + sqrt(q * q / 4.0 + p * p * p / 27.0), 1.0 / 3.0);
-	r  = exp(u + v - b / 3.0);
-	return r;
-}
-
-Heater::Heater(pin_type heater_pin, pin_type adc_pin, heater_data heater, hotend_data hotend, adc_data adc) : VirtualPrinter::Component("Heater"), heater_pin(heater_pin), adc_pin(analogInputToDigitalPin(adc_pin)) {
+Heater::Heater(pin_type heater_pin, pin_type adc_pin, heater_data heater, hotend_data hotend, adc_data adc) : VirtualPrinter::Component("Heater"), heater_pin(heater_pin), adc_pin(analogInputToDigitalPin(adc_pin)), thermistor(adc.thermistor, adc.pullup_resistance, adc.resolution) {
   heater_resistance = heater.resistance;
   heater_volts = heater.voltage;
 
@@ -36,31 +17,72 @@ Heater::Heater(pin_type heater_pin, pin_type adc_pin, heater_data heater, hotend
   adc_resolution = adc.resolution;
   adc_pullup_resistance = adc.pullup_resistance;
 
-  Gpio::attach(this->adc_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(this->heater_pin, [this](GpioEvent& event){ this->interrupt(event); });
+  Gpio::attach(this->adc_pin, GpioEvent::GET_VALUE_MASK, this);
+  Gpio::attach(this->heater_pin, GpioEvent::EDGE_MASK | GpioEvent::SET_VALUE_MASK, this);
   hotend_energy = hotend_ambient_temperature * (hotend_specific_heat * hotend_mass);
   hotend_temperature = hotend_ambient_temperature;
+
+  thermal_event = Kernel::Timers::add_event("Heater " + std::to_string(heater_pin), [](void* context){
+    auto heater = static_cast<Heater*>(context);
+    heater->advance(Kernel::TimeControl::getTicks());
+    Kernel::Timers::schedule_event(heater->thermal_event, Kernel::SimulationRuntime::nanos() + thermal_interval);
+  }, this);
+  Kernel::Timers::schedule_event(thermal_event, Kernel::SimulationRuntime::nanos() + thermal_interval);
 }
 
 Heater::~Heater() {
 }
 
-void Heater::update() {
+void Heater::ui_widget() {
+  ImGui::Text("Temperature: %f", hotend_temperature);
+}
+
+void Heater::save_state(SnapshotWriter& writer) {
+  writer.write(hotend_energy);
+  writer.write(pwm_period);
+  writer.write(pwm_duty);
+  writer.write(pwm_hightick);
+  writer.write(pwm_lowtick);
+  writer.write(pwm_last_update);
+  writer.write(heater_drive);
+}
 
+void Heater::restore_state(SnapshotReader& reader) {
+  reader.read(hotend_energy);
+  reader.read(pwm_period);
+  reader.read(pwm_duty);
+  reader.read(pwm_hightick);
+  reader.read(pwm_lowtick);
+  reader.read(pwm_last_update);
+  reader.read(heater_drive); // not in older snapshots, the current drive is kept
+  decay_ticks = 0;
+  hotend_temperature = hotend_energy / (hotend_specific_heat * hotend_mass);
 }
 
-void Heater::ui_widget() {
-  ImGui::Text("Temperature: %f", hotend_temperature);
+// exact solution of capacity * dT/dt = power * drive - conductance * (T - ambient) with the drive held constant,
+// so the result does not depend on how far apart the events are
+void Heater::advance(const uint64_t ticks) {
+  if (ticks <= pwm_last_update) return;
+  const double capacity = hotend_specific_heat * hotend_mass; // J/C
+  const double conductance = hotend_convection_transfer * hotend_surface_area; // W/C
+  if (ticks - pwm_last_update != decay_ticks) {
+    decay_ticks = ticks - pwm_last_update;
+    decay = std::exp(-(Kernel::TimeControl::ticksToNanos(decay_ticks) / (double)Kernel::TimeControl::ONE_BILLION) * conductance / capacity);
+  }
+  double settled = hotend_ambient_temperature + ((heater_volts * heater_volts) / heater_resistance) * heater_drive / conductance;
+  hotend_temperature = settled + (hotend_temperature - settled) * decay;
+  hotend_energy = hotend_temperature * capacity;
+  pwm_last_update = ticks;
 }
 
 void Heater::interrupt(GpioEvent& ev) {
-  // always update the temperature
-  double time_delta = Kernel::TimeControl::ticksToNanos(ev.timestamp - pwm_last_update) / (double)Kernel::TimeControl::ONE_BILLION;
-  double energy_in = ((heater_volts * heater_volts) / heater_resistance) * time_delta * Gpio::get_pin_value(heater_pin);
-  double energy_out = ((hotend_convection_transfer * hotend_surface_area * ( hotend_energy / (hotend_specific_heat * hotend_mass) - hotend_ambient_temperature)) * time_delta);
-  hotend_energy += energy_in - energy_out;
-  pwm_last_update = ev.timestamp;
-  hotend_temperature = hotend_energy / (hotend_specific_heat * hotend_mass);
+  // always update the temperature, the pin already holds the new level so the drive changes after
+  advance(ev.timestamp);
+  if (ev.pin_id == heater_pin) {
+    // soft PWM edges switch fully on or off, a SET_VALUE is an analogWrite duty out of 255
+    if (ev.event == ev.SET_VALUE) heater_drive = Gpio::get_pin_value(heater_pin) / 255.0;
+    else if (ev.event == ev.RISE || ev.event == ev.FALL) heater_drive = ev.event == ev.RISE;
+  }
 
   if (ev.event == ev.RISE && ev.pin_id == heater_pin) {
     if (pwm_hightick) pwm_period = ev.timestamp - pwm_hightick;
@@ -70,8 +92,6 @@ void Heater::interrupt(GpioEvent& ev) {
     pwm_lowtick = ev.timestamp;
     pwm_duty = ev.timestamp - pwm_hightick;
   } else if (ev.event == ev.GET_VALUE && ev.pin_id == adc_pin) {
-    double thermistor_resistance = temperature_to_resistance(hotend_temperature);
-    uint32_t adc_reading = (uint32_t)((((1U << adc_resolution) -1)  * thermistor_resistance) / (adc_pullup_resistance + thermistor_resistance));
-    Gpio::set_pin_value(adc_pin, adc_reading);
+    Gpio::set_pin_value(adc_pin, thermistor.reading(hotend_temperature));
   }
 }
@@ -3,6 +3,7 @@
 #include <cmath>
 
 #include "Gpio.h"
+#include "Thermistor.h"
 
 #include "../virtual_printer.h"
 
@@ -25,6 +26,7 @@ struct hotend_data {
 struct adc_data {
   double pullup_resistance;
   uint32_t resolution;
+  int16_t thermistor = 1; // Marlin TEMP_SENSOR_* number
 };
 
 class Heater: public VirtualPrinter::Component {
@@ -32,11 +34,16 @@ public:
   Heater(pin_type heater_pin, pin_type adc_pin, heater_data heater, hotend_data hotend, adc_data adc);
   virtual ~Heater();
   void interrupt(GpioEvent& ev);
-  void update();
   void ui_widget();
+  void save_state(SnapshotWriter& writer) override;
+  void restore_state(SnapshotReader& reader) override;
 
   pin_type heater_pin, adc_pin;
 
+  // the block cools and heats between pin events too, the model is advanced at least this often in simulated time
+  static constexpr uint64_t thermal_interval = 10'000'000; // ns
+  std::size_t thermal_event;
+
   //heater element
   double heater_volts = 12.0;
   double heater_resistance = 3.6; // 40Watts
@@ -65,7 +72,16 @@ public:
   double hotend_specific_heat = 0.897; // j/g/C (Aluminum)
   double hotend_convection_transfer = 0.001; // 0.001 W/cm^2 . C is an approximate often used for convective heat transfer into slow moving air
 
+private:
+  // move the block temperature from pwm_last_update to ticks with the heater drive held since then
+  void advance(const uint64_t ticks);
+
+  double heater_drive = 0.0; // 0..1, the fraction of full power since pwm_last_update
+  uint64_t decay_ticks = 0;  // PWM edges repeat their spacing, the last decay factor is reused
+  double decay = 1.0;
+
   //adc
   double adc_pullup_resistance = 4700;
   uint32_t adc_resolution = 12;
+  ThermistorTable thermistor;
 };
@@ -3,55 +3,123 @@
 #include <imgui.h>
 
 #include "KinematicSystem.h"
+#include "MotionAnalytics.h"
+#include "../options.h"
+#include "../snapshot.h"
 
 #include <src/inc/MarlinConfig.h>
 
 constexpr float steps_per_unit[] = DEFAULT_AXIS_STEPS_PER_UNIT;
 
+static uint64_t publish_interval_nanos() {
+  return simulator_options.kinematic_rate > 0 ? Kernel::TimeControl::ONE_BILLION / simulator_options.kinematic_rate : 0;
+}
+
+// distance per step signed like stepper_position
+static std::vector<MotionAnalytics::Axis> analysed_axes(const std::vector<std::shared_ptr<StepperDriver>>& steppers, const std::vector<std::string>& names) {
+  const double direction[] = { ((INVERT_X_DIR * 2) - 1) * -1.0, ((INVERT_Y_DIR * 2) - 1) * -1.0, ((INVERT_Z_DIR * 2) - 1) * -1.0, ((INVERT_E0_DIR * 2) - 1) * -1.0 };
+  std::vector<MotionAnalytics::Axis> axes;
+  for (std::size_t i = 0; i < steppers.size(); i++) axes.push_back({names[i], steppers[i], direction[i] / steps_per_unit[i]});
+  return axes;
+}
+
 KinematicSystem::KinematicSystem(std::function<void(glm::vec4)> on_kinematic_update) : VirtualPrinter::Component("Kinematic System"), on_kinematic_update(on_kinematic_update) {
 
-  steppers.push_back(add_component<StepperDriver>("Stepper0", X_ENABLE_PIN, X_DIR_PIN, X_STEP_PIN, [this](){ this->kinematic_update(); }));
-  steppers.push_back(add_component<StepperDriver>("Stepper1", Y_ENABLE_PIN, Y_DIR_PIN, Y_STEP_PIN, [this](){ this->kinematic_update(); }));
-  steppers.push_back(add_component<StepperDriver>("Stepper2", Z_ENABLE_PIN, Z_DIR_PIN, Z_STEP_PIN, [this](){ this->kinematic_update(); }));
-  steppers.push_back(add_component<StepperDriver>("Stepper3", E0_ENABLE_PIN, E0_DIR_PIN, E0_STEP_PIN, [this](){ this->kinematic_update(); }));
+  steppers.push_back(add_component<StepperDriver>("Stepper0", X_ENABLE_PIN, X_DIR_PIN, X_STEP_PIN, [this](){ this->on_step(); }));
+  steppers.push_back(add_component<StepperDriver>("Stepper1", Y_ENABLE_PIN, Y_DIR_PIN, Y_STEP_PIN, [this](){ this->on_step(); }));
+  steppers.push_back(add_component<StepperDriver>("Stepper2", Z_ENABLE_PIN, Z_DIR_PIN, Z_STEP_PIN, [this](){ this->on_step(); }));
+  steppers.push_back(add_component<StepperDriver>("Stepper3", E0_ENABLE_PIN, E0_DIR_PIN, E0_STEP_PIN, [this](){ this->on_step(); }));
+
+  add_component<MotionAnalytics>("Motion Analytics", analysed_axes(steppers, {"X", "Y", "Z", "E0"}), true);
+  publish_interval = publish_interval_nanos();
+  publish_event = Kernel::Timers::add_event("Kinematic publish", [](void* context){ static_cast<KinematicSystem*>(context)->on_publish_event(); }, this);
 
   srand(time(0));
   origin.x = (rand() % (int)((X_MAX_POS / 4) - X_MIN_POS)) + X_MIN_POS;
   origin.y = (rand() % (int)((Y_MAX_POS / 4) - Y_MIN_POS)) + Y_MIN_POS;
   origin.z = (rand() % (int)((Z_MAX_POS / 8) - Z_MIN_POS)) + Z_MIN_POS;
+  // the UI has a position before the first step
+  refresh();
 }
 
-void KinematicSystem::kinematic_update() {
+void KinematicSystem::on_step() {
+  dirty = true;
+  auto now = Kernel::SimulationRuntime::nanos();
+  if (now >= next_publish) {
+    next_publish = now + publish_interval;
+    kinematic_update();
+  }
+  else if (!unpublished) {
+    unpublished = true;
+    Kernel::Timers::schedule_event(publish_event, next_publish);
+  }
+}
+
+void KinematicSystem::on_publish_event() {
+  if (!unpublished) return; // published since, by the UI or a snapshot restore
+  next_publish = Kernel::SimulationRuntime::nanos() + publish_interval;
+  kinematic_update();
+}
+
+void KinematicSystem::refresh() {
+  if (!dirty) return;
   stepper_position = glm::vec4{
-    std::static_pointer_cast<StepperDriver>(steppers[0])->steps() / steps_per_unit[0] * (((INVERT_X_DIR * 2) - 1) * -1.0),
-    std::static_pointer_cast<StepperDriver>(steppers[1])->steps() / steps_per_unit[1] * (((INVERT_Y_DIR * 2) - 1) * -1.0),
-    std::static_pointer_cast<StepperDriver>(steppers[2])->steps() / steps_per_unit[2] * (((INVERT_Z_DIR * 2) - 1) * -1.0),
-    std::static_pointer_cast<StepperDriver>(steppers[3])->steps() / steps_per_unit[3] * (((INVERT_E0_DIR * 2) - 1) * -1.0)
+    steppers[0]->steps() / steps_per_unit[0] * (((INVERT_X_DIR * 2) - 1) * -1.0),
+    steppers[1]->steps() / steps_per_unit[1] * (((INVERT_Y_DIR * 2) - 1) * -1.0),
+    steppers[2]->steps() / steps_per_unit[2] * (((INVERT_Z_DIR * 2) - 1) * -1.0),
+    steppers[3]->steps() / steps_per_unit[3] * (((INVERT_E0_DIR * 2) - 1) * -1.0)
   };
 
   effector_position = glm::vec4(origin, 0.0f) + stepper_position;
+  {
+    std::lock_guard<std::mutex> lock(published_mutex);
+    published = {effector_position, stepper_position, origin};
+  }
+  dirty = false;
+}
+
+KinematicPosition KinematicSystem::published_position() {
+  std::lock_guard<std::mutex> lock(published_mutex);
+  return published;
+}
+
+void KinematicSystem::kinematic_update() {
+  dirty = true;
+  unpublished = false;
+  refresh();
   on_kinematic_update(effector_position);
 }
 
 void KinematicSystem::ui_widget() {
-  auto pos = (glm::vec4(origin, 0) + stepper_position);
+  auto pos = published_position().effector_position;
+  // the steppers keep moving, the origin is worked out against their position when the change is applied
   auto value = pos.x;
   if (ImGui::SliderFloat("X Position(mm)", &value, X_MIN_POS, X_MAX_POS)) {
-    origin.x = value - stepper_position.x;
-    kinematic_update();
+    Kernel::run_at_safe_point([this, value](){ refresh(); origin.x = value - stepper_position.x; kinematic_update(); });
   }
   value = pos.y;
   if (ImGui::SliderFloat("Y Position(mm)",  &value, Y_MIN_POS, Y_MAX_POS)) {
-    origin.y = value - stepper_position.y;
-    kinematic_update();
+    Kernel::run_at_safe_point([this, value](){ refresh(); origin.y = value - stepper_position.y; kinematic_update(); });
   }
   value = pos.z;
   if (ImGui::SliderFloat("Z Position(mm)",  &value, Z_MIN_POS, Z_MAX_POS)) {
-    origin.z = value - stepper_position.z;
-    kinematic_update();
+    Kernel::run_at_safe_point([this, value](){ refresh(); origin.z = value - stepper_position.z; kinematic_update(); });
   }
 }
 
+void KinematicSystem::save_state(SnapshotWriter& writer) {
+  writer.write(origin);
+}
+
+void KinematicSystem::restore_state(SnapshotReader& reader) {
+  // simulated time may have gone back (restore, replay seek), a pending publish or the
+  // rate limit would hold back updates until the old time comes round again
+  Kernel::Timers::cancel_event(publish_event);
+  next_publish = 0;
+  // the steppers are restored first, recompute the effector from their counts
+  if (reader.read(origin)) kinematic_update();
+}
+
 #if ENABLED(DELTA)
 #define A_AXIS 0
 #define B_AXIS 1
@@ -138,55 +206,103 @@ glm::vec3 DeltaKinematicSystem::forward_kinematics(const double z1, const double
 
 DeltaKinematicSystem::DeltaKinematicSystem(std::function<void(glm::vec4)> on_kinematic_update) : VirtualPrinter::Component("Delta Kinematic System"), on_kinematic_update(on_kinematic_update) {
 
-  steppers.push_back(add_component<StepperDriver>("Stepper0", X_ENABLE_PIN, X_DIR_PIN, X_STEP_PIN, [this](){ this->kinematic_update(); }));
-  steppers.push_back(add_component<StepperDriver>("Stepper1", Y_ENABLE_PIN, Y_DIR_PIN, Y_STEP_PIN, [this](){ this->kinematic_update(); }));
-  steppers.push_back(add_component<StepperDriver>("Stepper2", Z_ENABLE_PIN, Z_DIR_PIN, Z_STEP_PIN, [this](){ this->kinematic_update(); }));
-  steppers.push_back(add_component<StepperDriver>("Stepper3", E0_ENABLE_PIN, E0_DIR_PIN, E0_STEP_PIN, [this](){ this->kinematic_update(); }));
+  steppers.push_back(add_component<StepperDriver>("Stepper0", X_ENABLE_PIN, X_DIR_PIN, X_STEP_PIN, [this](){ this->on_step(); }));
+  steppers.push_back(add_component<StepperDriver>("Stepper1", Y_ENABLE_PIN, Y_DIR_PIN, Y_STEP_PIN, [this](){ this->on_step(); }));
+  steppers.push_back(add_component<StepperDriver>("Stepper2", Z_ENABLE_PIN, Z_DIR_PIN, Z_STEP_PIN, [this](){ this->on_step(); }));
+  steppers.push_back(add_component<StepperDriver>("Stepper3", E0_ENABLE_PIN, E0_DIR_PIN, E0_STEP_PIN, [this](){ this->on_step(); }));
+  add_component<MotionAnalytics>("Motion Analytics", analysed_axes(steppers, {"A", "B", "C", "E0"}), false);
   recalc_delta_settings();
+  publish_interval = publish_interval_nanos();
+  publish_event = Kernel::Timers::add_event("Kinematic publish", [](void* context){ static_cast<DeltaKinematicSystem*>(context)->on_publish_event(); }, this);
 
   // Add an offset as on deltas the linear rails are offset from the bed
   origin.x = 207.124;//215.0 + DELTA_HEIGHT;
   origin.y = 207.124;//215.0 + DELTA_HEIGHT;
   origin.z = 207.124;//215.0 + DELTA_HEIGHT;
+  refresh();
 }
 
-void DeltaKinematicSystem::kinematic_update() {
+void DeltaKinematicSystem::on_step() {
+  dirty = true;
+  auto now = Kernel::SimulationRuntime::nanos();
+  if (now >= next_publish) {
+    next_publish = now + publish_interval;
+    kinematic_update();
+  }
+  else if (!unpublished) {
+    unpublished = true;
+    Kernel::Timers::schedule_event(publish_event, next_publish);
+  }
+}
+
+void DeltaKinematicSystem::on_publish_event() {
+  if (!unpublished) return; // published since, by the UI or a snapshot restore
+  next_publish = Kernel::SimulationRuntime::nanos() + publish_interval;
+  kinematic_update();
+}
+
+void DeltaKinematicSystem::refresh() {
+  if (!dirty) return;
   stepper_position = glm::vec4{
-    std::static_pointer_cast<StepperDriver>(steppers[0])->steps() / steps_per_unit[0] * (((INVERT_X_DIR * 2) - 1) * -1.0),
-    std::static_pointer_cast<StepperDriver>(steppers[1])->steps() / steps_per_unit[1] * (((INVERT_Y_DIR * 2) - 1) * -1.0),
-    std::static_pointer_cast<StepperDriver>(steppers[2])->steps() / steps_per_unit[2] * (((INVERT_Z_DIR * 2) - 1) * -1.0),
-    std::static_pointer_cast<StepperDriver>(steppers[3])->steps() / steps_per_unit[3] * (((INVERT_E0_DIR * 2) - 1) * -1.0)
+    steppers[0]->steps() / steps_per_unit[0] * (((INVERT_X_DIR * 2) - 1) * -1.0),
+    steppers[1]->steps() / steps_per_unit[1] * (((INVERT_Y_DIR * 2) - 1) * -1.0),
+    steppers[2]->steps() / steps_per_unit[2] * (((INVERT_Z_DIR * 2) - 1) * -1.0),
+    steppers[3]->steps() / steps_per_unit[3] * (((INVERT_E0_DIR * 2) - 1) * -1.0)
   };
 
   // Add an offset to fudge the coordinate system onto the bed
   effector_position = glm::vec4{ forward_kinematics(stepper_position.x + origin.x, stepper_position.y + origin.y, stepper_position.z + origin.z), stepper_position.a} + glm::vec4{X_BED_SIZE / 2.0, Y_BED_SIZE / 2.0, 0, 0};
+  {
+    std::lock_guard<std::mutex> lock(published_mutex);
+    published = {effector_position, stepper_position, origin};
+  }
+  dirty = false;
+}
+
+KinematicPosition DeltaKinematicSystem::published_position() {
+  std::lock_guard<std::mutex> lock(published_mutex);
+  return published;
+}
+
+void DeltaKinematicSystem::kinematic_update() {
+  dirty = true;
+  unpublished = false;
+  refresh();
   on_kinematic_update(effector_position);
 }
 
 void DeltaKinematicSystem::ui_widget() {
-  auto value = stepper_position.x + origin.x;
+  auto position = published_position();
+  auto value = position.stepper_position.x + position.origin.x;
   if (ImGui::SliderFloat("Stepper(A) Position (mm)", &value, -100, DELTA_HEIGHT + 100)) {
-    origin.x = value - stepper_position.x;
-    kinematic_update();
+    Kernel::run_at_safe_point([this, value](){ refresh(); origin.x = value - stepper_position.x; kinematic_update(); });
   }
-  value = stepper_position.y + origin.y;
+  value = position.stepper_position.y + position.origin.y;
   if (ImGui::SliderFloat("Stepper(B) Position (mm)",  &value, -100, DELTA_HEIGHT + 100)) {
-    origin.y = value - stepper_position.y;
-    kinematic_update();
+    Kernel::run_at_safe_point([this, value](){ refresh(); origin.y = value - stepper_position.y; kinematic_update(); });
   }
-  value = stepper_position.z + origin.z;
+  value = position.stepper_position.z + position.origin.z;
   if (ImGui::SliderFloat("Stepper(C) Position (mm)",  &value, -100, DELTA_HEIGHT + 100)) {
-    origin.z = value - stepper_position.z;
-    kinematic_update();
+    Kernel::run_at_safe_point([this, value](){ refresh(); origin.z = value - stepper_position.z; kinematic_update(); });
   }
   ImGui::Text("Stepper Position:");
-  ImGui::Text("x: %f", stepper_position.x);
-  ImGui::Text("y: %f", stepper_position.y);
-  ImGui::Text("z: %f", stepper_position.z);
+  ImGui::Text("x: %f", position.stepper_position.x);
+  ImGui::Text("y: %f", position.stepper_position.y);
+  ImGui::Text("z: %f", position.stepper_position.z);
   ImGui::Text("Cartesian Position:");
-  ImGui::Text("x: %f", effector_position.x);
-  ImGui::Text("y: %f", effector_position.y);
-  ImGui::Text("z: %f", effector_position.z);
+  ImGui::Text("x: %f", position.effector_position.x);
+  ImGui::Text("y: %f", position.effector_position.y);
+  ImGui::Text("z: %f", position.effector_position.z);
+}
+
+void DeltaKinematicSystem::save_state(SnapshotWriter& writer) {
+  writer.write(origin);
+}
+
+void DeltaKinematicSystem::restore_state(SnapshotReader& reader) {
+  Kernel::Timers::cancel_event(publish_event);
+  next_publish = 0;
+  if (reader.read(origin)) kinematic_update();
 }
 
 #endif
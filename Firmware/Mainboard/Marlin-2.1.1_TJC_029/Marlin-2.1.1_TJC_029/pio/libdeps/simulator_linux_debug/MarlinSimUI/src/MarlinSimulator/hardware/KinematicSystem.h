@@ -1,7 +1,7 @@
 #pragma once
 
 #include <memory>
-#include <atomic>
+#include <mutex>
 #include <glm/glm.hpp>
 
 #include <imgui.h>
@@ -10,32 +10,85 @@
 #include "../virtual_printer.h"
 #include "StepperDriver.h"
 
+// what the UI thread reads of a kinematic system
+struct KinematicPosition {
+  glm::vec4 effector_position{}, stepper_position{};
+  glm::vec3 origin{};
+};
+
+/**
+ * Steps only mark the positions stale. They are recomputed when something reads them (endstops,
+ * probe) and pushed to on_kinematic_update at most publish_interval apart in simulated time,
+ * checked on the next step, so a burst of steps costs one recompute. Steps left over when a move
+ * stops are published by a kernel event at the end of the interval.
+ *
+ * Only the simulation thread recomputes. The UI reads the copy stored after each recompute and
+ * hands slider changes back to the simulation thread at a safe point.
+ */
 class KinematicSystem : public VirtualPrinter::Component {
 public:
   KinematicSystem(std::function<void(glm::vec4)> on_kinematic_update);
   ~KinematicSystem() {}
 
+  // UI thread
   void ui_widget();
+  // recompute now and publish, simulation thread
   void kinematic_update();
+  void save_state(SnapshotWriter& writer) override;
+  void restore_state(SnapshotReader& reader) override;
+
+  // simulation thread, the UI uses the published copy
+  const glm::vec4& get_effector_position() { refresh(); return effector_position; }
+  const glm::vec4& get_stepper_position() { refresh(); return stepper_position; }
+  KinematicPosition current_position() { refresh(); return {effector_position, stepper_position, origin}; }
+  // any thread, the copy stored by the last recompute
+  KinematicPosition published_position();
 
   glm::vec4 effector_position{}, stepper_position{};
   glm::vec3 origin{};
-  std::vector<std::shared_ptr<VirtualPrinter::Component>> steppers;
+  std::vector<std::shared_ptr<StepperDriver>> steppers;
   std::function<void(glm::vec4)> on_kinematic_update;
+  uint64_t publish_interval = 0;
+
+private:
+  void on_step();
+  void on_publish_event();
+  void refresh();
+
+  // simulation thread only
+  bool dirty = true, unpublished = false;
+  uint64_t next_publish = 0;
+  std::size_t publish_event;
+
+  std::mutex published_mutex;
+  KinematicPosition published;
 };
 
+// Same update model as KinematicSystem, the forward kinematics only run when a position is read or published
 class DeltaKinematicSystem : public VirtualPrinter::Component {
 public:
   DeltaKinematicSystem(std::function<void(glm::vec4)> on_kinematic_update);
   ~DeltaKinematicSystem() {}
 
+  // UI thread
   void ui_widget();
+  // recompute now and publish, simulation thread
   void kinematic_update();
+  void save_state(SnapshotWriter& writer) override;
+  void restore_state(SnapshotReader& reader) override;
+
+  // simulation thread, the UI uses the published copy
+  const glm::vec4& get_effector_position() { refresh(); return effector_position; }
+  const glm::vec4& get_stepper_position() { refresh(); return stepper_position; }
+  KinematicPosition current_position() { refresh(); return {effector_position, stepper_position, origin}; }
+  // any thread, the copy stored by the last recompute
+  KinematicPosition published_position();
 
   glm::vec4 effector_position{}, stepper_position{};
   glm::vec3 origin{};
-  std::vector<std::shared_ptr<VirtualPrinter::Component>> steppers;
+  std::vector<std::shared_ptr<StepperDriver>> steppers;
   std::function<void(glm::vec4)> on_kinematic_update;
+  uint64_t publish_interval = 0;
 
   double delta_radius = 140.0;
   double delta_diagonal_rod = 250.0;
@@ -47,4 +100,17 @@ public:
 
   glm::vec3 forward_kinematics(const double z1, const double z2, const double z3);
   void recalc_delta_settings();
+
+private:
+  void on_step();
+  void on_publish_event();
+  void refresh();
+
+  // simulation thread only
+  bool dirty = true, unpublished = false;
+  uint64_t next_publish = 0;
+  std::size_t publish_event;
+
+  std::mutex published_mutex;
+  KinematicPosition published;
 };
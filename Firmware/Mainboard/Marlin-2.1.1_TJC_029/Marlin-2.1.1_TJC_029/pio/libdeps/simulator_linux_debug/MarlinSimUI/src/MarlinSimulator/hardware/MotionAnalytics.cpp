@@ -0,0 +1,177 @@
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+
+#include <imgui.h>
+
+#include "MotionAnalytics.h"
+
+MotionAnalytics::MotionAnalytics(std::vector<Axis> axes, const bool cartesian) : VirtualPrinter::Component("MotionAnalytics"), cartesian(cartesian && axes.size() >= 3) {
+  for (auto& axis : axes) this->axes.emplace_back(std::move(axis));
+}
+
+void MotionAnalytics::set_recording(const bool enabled) {
+  if (enabled && !record) clear();
+  record = enabled;
+  for (auto& axis : axes) axis.axis.stepper->step_log.enabled = enabled;
+}
+
+void MotionAnalytics::set_bin_nanos(const uint64_t nanos) {
+  bin_nanos = std::max<uint64_t>(nanos, 1000);
+  clear();
+}
+
+void MotionAnalytics::clear() {
+  std::vector<AxisAnalytics> cleared;
+  for (auto& axis : axes) {
+    axis.axis.stepper->step_log.drain([](uint64_t, bool){});
+    cleared.emplace_back(axis.axis);
+  }
+  axes.swap(cleared);
+  effector.clear();
+  effector_velocity = effector_acceleration = {};
+  next_bin = Kernel::SimulationRuntime::nanos() / bin_nanos * bin_nanos;
+}
+
+void MotionAnalytics::analyse(AxisAnalytics& axis, const uint64_t timestamp, const bool forward) {
+  axis.steps++;
+  if (axis.move_steps && (forward != axis.forward || timestamp - axis.recent[(axis.move_steps - 1) % axis.recent.size()] > move_gap)) axis.move_steps = 0;
+  axis.forward = forward;
+
+  if (axis.move_steps) {
+    uint64_t interval = timestamp - axis.recent[(axis.move_steps - 1) % axis.recent.size()];
+    axis.intervals[KernelTimerStats::bucket(interval)]++;
+    // the previous interval against the mean of its neighbours
+    if (axis.move_steps >= 3) {
+      uint64_t error = std::llabs(int64_t(2 * axis.last_interval) - int64_t(axis.interval_before + interval)) / 2;
+      axis.jitter[KernelTimerStats::bucket(error)]++;
+      axis.jitter_max = std::max(axis.jitter_max, error);
+      axis.jitter_squares += double(error) * error;
+      axis.jitter_count++;
+    }
+    axis.interval_before = axis.last_interval;
+    axis.last_interval = interval;
+  }
+
+  axis.recent[axis.move_steps % axis.recent.size()] = timestamp;
+  axis.move_steps++;
+  if (axis.move_steps >= axis.recent.size()) {
+    uint64_t span = timestamp - axis.recent[axis.move_steps % axis.recent.size()];
+    if (span) axis.max_rate = std::max(axis.max_rate, sustain_steps * double(Kernel::TimeControl::ONE_BILLION) / span);
+  }
+}
+
+void MotionAnalytics::update() {
+  if (!record) return;
+  // a step is logged before simulated time moves past it, so every bin before this is complete
+  const uint64_t horizon = Kernel::SimulationRuntime::nanos() / bin_nanos * bin_nanos;
+  // simulated time went back (a restored snapshot, a trace replay seek), the binned series no longer line up
+  if (horizon + bin_nanos < next_bin) clear();
+  for (auto& axis : axes) {
+    axis.axis.stepper->step_log.drain([this, &axis](uint64_t timestamp, bool forward){
+      analyse(axis, timestamp, forward);
+      axis.pending.push_back({timestamp, forward});
+    });
+  }
+
+  const double bin_seconds = bin_nanos / double(Kernel::TimeControl::ONE_BILLION);
+  while (next_bin + bin_nanos <= horizon) {
+    const uint64_t end = next_bin + bin_nanos;
+    bool idle = true;
+    for (auto& axis : axes) {
+      int64_t steps = 0;
+      while (axis.pending.size() && axis.pending.front().timestamp < end) {
+        steps += axis.pending.front().forward ? 1 : -1;
+        axis.pending.pop_front();
+      }
+      double velocity = steps * axis.axis.mm_per_step / bin_seconds;
+      double acceleration = (velocity - axis.velocity) / bin_seconds;
+      double jerk = (acceleration - axis.acceleration) / bin_seconds;
+      axis.series.velocity.push(next_bin, velocity);
+      axis.series.acceleration.push(next_bin, acceleration);
+      axis.series.jerk.push(next_bin, jerk);
+      axis.velocity = velocity;
+      axis.acceleration = acceleration;
+      idle &= velocity == 0.0 && acceleration == 0.0 && jerk == 0.0;
+    }
+    if (cartesian) {
+      glm::dvec3 velocity{axes[0].velocity, axes[1].velocity, axes[2].velocity};
+      glm::dvec3 acceleration = (velocity - effector_velocity) / bin_seconds;
+      effector.velocity.push(next_bin, glm::length(velocity));
+      effector.acceleration.push(next_bin, glm::length(acceleration));
+      effector.jerk.push(next_bin, glm::length((acceleration - effector_acceleration) / bin_seconds));
+      effector_velocity = velocity;
+      effector_acceleration = acceleration;
+    }
+    next_bin = end;
+
+    // nothing moving, skip to the bin of the next step instead of filling the gap with zeros
+    if (idle) {
+      uint64_t next_step = horizon;
+      for (auto& axis : axes) if (axis.pending.size()) next_step = std::min(next_step, axis.pending.front().timestamp);
+      next_bin = std::max(next_bin, std::min(next_step, horizon) / bin_nanos * bin_nanos);
+    }
+  }
+}
+
+void MotionAnalytics::ui_widget() {
+  bool enabled = record;
+  if (ImGui::Checkbox("Record", &enabled)) set_recording(enabled);
+  for (auto& axis : axes) {
+    ImGui::Text("%s: %" PRIu64 " steps, max %.0f steps/s (%.1f mm/s), jitter rms %.0f ns", axis.axis.name.c_str(), axis.steps, axis.max_rate, axis.max_rate * axis.axis.mm_per_step,
+      axis.jitter_count ? std::sqrt(axis.jitter_squares / axis.jitter_count) : 0.0);
+    // the UI drains the step logs once a frame, a faster simulation can fill one in between
+    uint64_t dropped = axis.axis.stepper->step_log.dropped;
+    if (dropped) ImGui::Text("  %" PRIu64 " steps dropped, the figures above are incomplete", dropped);
+  }
+}
+
+bool MotionAnalytics::export_csv(const std::string& filename) const {
+  FILE* file = fopen(filename.c_str(), "w");
+  if (file == nullptr) {
+    fprintf(stderr, "MotionAnalytics::export_csv: unable to write %s\n", filename.c_str());
+    return false;
+  }
+  std::vector<std::pair<std::string, const Series*>> columns;
+  for (auto& axis : axes) columns.push_back({axis.axis.name, &axis.series});
+  if (cartesian) columns.push_back({"effector", &effector});
+
+  fprintf(file, "timestamp_ns");
+  for (auto& column : columns) fprintf(file, ",%s_velocity,%s_acceleration,%s_jerk", column.first.c_str(), column.first.c_str(), column.first.c_str());
+  fprintf(file, "\n");
+  // every series gets one entry per bin, so they stay aligned
+  std::size_t rows = columns.size() ? columns[0].second->velocity.size() : 0;
+  for (std::size_t i = 0; i < rows; i++) {
+    fprintf(file, "%" PRIu64, columns[0].second->velocity.timestamp(i));
+    for (auto& column : columns) fprintf(file, ",%g,%g,%g", column.second->velocity[i].value, column.second->acceleration[i].value, column.second->jerk[i].value);
+    fprintf(file, "\n");
+  }
+  fclose(file);
+  return true;
+}
+
+bool MotionAnalytics::export_intervals_csv(const std::string& filename) const {
+  FILE* file = fopen(filename.c_str(), "w");
+  if (file == nullptr) {
+    fprintf(stderr, "MotionAnalytics::export_intervals_csv: unable to write %s\n", filename.c_str());
+    return false;
+  }
+  fprintf(file, "axis,steps,max_rate_steps_per_s,jitter_rms_ns,jitter_max_ns,dropped\n");
+  for (auto& axis : axes) {
+    fprintf(file, "%s,%" PRIu64 ",%.1f,%.1f,%" PRIu64 ",%" PRIu64 "\n", axis.axis.name.c_str(), axis.steps, axis.max_rate,
+      axis.jitter_count ? std::sqrt(axis.jitter_squares / axis.jitter_count) : 0.0, axis.jitter_max, axis.axis.stepper->step_log.dropped.load());
+  }
+  // columns are the lower bound of each bucket in ns, bucket n counts values in [2^(n-1), 2^n)
+  fprintf(file, "\naxis,histogram");
+  for (std::size_t i = 0; i < KernelTimerStats::buckets; i++) fprintf(file, ",%" PRIu64, i ? uint64_t(1) << (i - 1) : uint64_t(0));
+  fprintf(file, "\n");
+  for (auto& axis : axes) {
+    fprintf(file, "%s,interval", axis.axis.name.c_str());
+    for (auto count : axis.intervals) fprintf(file, ",%" PRIu64, count);
+    fprintf(file, "\n%s,jitter", axis.axis.name.c_str());
+    for (auto count : axis.jitter) fprintf(file, ",%" PRIu64, count);
+    fprintf(file, "\n");
+  }
+  fclose(file);
+  return true;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "StepperDriver.h"
+#include "../signal_decoders.h"
+#include "../virtual_printer.h"
+
+/**
+ * What the stepper outputs actually did, from the step times the StepperDrivers record.
+ *
+ * Steps are binned on a fixed grid of simulated time: a bin's velocity is its net steps over the bin
+ * width, acceleration and jerk are differences between consecutive bins. Within a move (same direction,
+ * no pause longer than move_gap) every interval goes into a log2 histogram, the highest rate held over
+ * sustain_steps steps is kept, and jitter is how far an interval is from the mean of its neighbours,
+ * which is where a trapezoid or S-curve profile puts it to first order. Recording is off until
+ * enabled, the step logs are drained from update() on the UI frame.
+ */
+class MotionAnalytics : public VirtualPrinter::Component {
+public:
+  static constexpr uint64_t move_gap = 50'000'000;
+  static constexpr std::size_t sustain_steps = 100;
+
+  struct Axis {
+    std::string name;
+    std::shared_ptr<StepperDriver> stepper;
+    double mm_per_step;
+  };
+
+  struct Series {
+    Track<double> velocity{"Velocity (mm/s)"};
+    Track<double> acceleration{"Acceleration (mm/s^2)"};
+    Track<double> jerk{"Jerk (mm/s^3)"};
+
+    void clear() {
+      velocity.clear();
+      acceleration.clear();
+      jerk.clear();
+    }
+  };
+
+  struct AxisAnalytics {
+    AxisAnalytics(Axis axis) : axis(std::move(axis)) {}
+
+    Axis axis;
+    Series series;
+    // log2 histograms as KernelTimerStats, of step intervals and of the jitter magnitude
+    std::array<uint64_t, KernelTimerStats::buckets> intervals{}, jitter{};
+    uint64_t steps = 0, jitter_count = 0, jitter_max = 0;
+    double jitter_squares = 0.0;
+    double max_rate = 0.0; // steps/s
+
+  private:
+    friend class MotionAnalytics;
+    struct Step { uint64_t timestamp; bool forward; };
+    std::deque<Step> pending; // not yet binned
+    std::array<uint64_t, sustain_steps + 1> recent{}; // step times of the move, a ring
+    uint64_t move_steps = 0, last_interval = 0, interval_before = 0;
+    bool forward = true;
+    double velocity = 0.0, acceleration = 0.0;
+  };
+
+  // effector series are only derived for cartesian machines, the first three axes are X, Y and Z
+  MotionAnalytics(std::vector<Axis> axes, const bool cartesian);
+
+  void update();
+  void ui_widget();
+
+  void set_recording(const bool enabled);
+  bool recording() const { return record; }
+  void clear();
+  // changes the bin width and clears the series
+  void set_bin_nanos(const uint64_t nanos);
+  uint64_t get_bin_nanos() const { return bin_nanos; }
+
+  // the series, one row per bin
+  bool export_csv(const std::string& filename) const;
+  // the histograms and per axis summary
+  bool export_intervals_csv(const std::string& filename) const;
+
+  std::vector<AxisAnalytics> axes;
+  const bool cartesian;
+  // magnitudes of the XYZ velocity, acceleration and jerk vectors
+  Series effector;
+
+private:
+  void analyse(AxisAnalytics& axis, const uint64_t timestamp, const bool forward);
+
+  bool record = false;
+  // a bin resolves velocity to one step per bin, narrower bins make acceleration and jerk noisy
+  uint64_t bin_nanos = 10'000'000;
+  uint64_t next_bin = 0;
+  glm::dvec3 effector_velocity{}, effector_acceleration{};
+};
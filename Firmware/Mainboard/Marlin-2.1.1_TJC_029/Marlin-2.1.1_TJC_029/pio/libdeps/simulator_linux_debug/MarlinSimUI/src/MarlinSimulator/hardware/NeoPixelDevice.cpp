@@ -3,37 +3,18 @@
 #include "pinmapping.h"
 #include "NeoPixelDevice.h"
 
-NeoPixelDevice::NeoPixelDevice(pin_type neopixel_pin, const uint8_t led_type, const uint16_t led_count) : VirtualPrinter::Component("NeoPixel"), neopixel_pin(neopixel_pin), led_type(led_type), led_count(led_count) {
-  bits_per_word = led_type == NEO_GRBW ? 32 : 24;
-  Gpio::attach(this->neopixel_pin, [this](GpioEvent& event){ this->interrupt(event); });
+NeoPixelDevice::NeoPixelDevice(pin_type neopixel_pin, const uint8_t led_type, const uint16_t led_count) : VirtualPrinter::Component("NeoPixel"), neopixel_pin(neopixel_pin), receiver(led_type == NEO_GRBW ? 32 : 24), led_type(led_type), led_count(led_count) {
+  Gpio::attach(this->neopixel_pin, GpioEvent::EDGE_MASK, this);
+  latch_event = Kernel::Timers::add_event("NeoPixel latch", [](void* context){
+    auto device = static_cast<NeoPixelDevice*>(context);
+    uint32_t colour;
+    if (device->receiver.idle(Kernel::SimulationRuntime::nanos(), colour)) device->update_led(colour);
+  }, this);
 }
 
 NeoPixelDevice::~NeoPixelDevice() {
 }
 
-void NeoPixelDevice::update() {
-  if (Kernel::SimulationRuntime::nanos() - last_clock > 50000 && state != SignalState::INACTIVE) {
-    if (bit_count == bits_per_word - 1) {
-      if (state == SignalState::LOW_ZERO) {
-          ++ bit_count;
-          data_word <<= 1;
-      } else if (state == SignalState::LOW_ONE) {
-          ++ bit_count;
-          data_word <<= 1;
-          ++ data_word;
-      }
-      //printf("0x%08X\n", data_word);
-      data_word <<= (32 - bit_count);
-      update_led(data_word);
-    } else {
-      //printf("!TIMEOUT INACTIVE! (%d bits, 0x%08X)\n", bit_count, data_word);
-    }
-    state = SignalState::INACTIVE;
-    bit_count = 0;
-    data_word = 0;
-  }
-}
-
 void NeoPixelDevice::ui_widget() {
   for (auto led : leds_display) {
     ImGui::Text("|"); ImGui::SameLine();
@@ -44,48 +25,12 @@ void NeoPixelDevice::ui_widget() {
   }
 }
 
-// models energy transfer but not time lag as it tranfers through the medium.
 void NeoPixelDevice::interrupt(GpioEvent& ev) {
   if (ev.pin_id == neopixel_pin && (ev.event == ev.RISE || ev.event == ev.FALL)) {
-    auto timestamp = Kernel::TimeControl::ticksToNanos(ev.timestamp);
-    auto data = (uint32_t)(timestamp - last_clock);
-    last_clock = timestamp;
-
-    switch (state) {
-      case SignalState::INACTIVE:
-        data_word = 0;
-        bit_count = 0;
-        if (ev.event == ev.RISE) { state = SignalState::HIGH; }
-        break;
-      case SignalState::HIGH:
-        if (ev.event != ev.FALL) { state = SignalState::INACTIVE;}
-        else if (data > 200 && data < 500) { state = SignalState::LOW_ZERO;}
-        else if (data > 550 && data < 5500) { state = SignalState::LOW_ONE;}
-        else { state = SignalState::INACTIVE;}
-        break;
-      case SignalState::LOW_ZERO:
-        ++ bit_count;
-        data_word <<= 1;
-        if (data > 450 && data < 5000 && ev.event == ev.RISE) {
-          state = SignalState::HIGH;
-        } else { state = SignalState::INACTIVE; }
-        break;
-      case SignalState::LOW_ONE:
-        ++ bit_count;
-        data_word <<= 1;
-        ++ data_word;
-        if (data > 450 && data < 5000 && ev.event == ev.RISE) {
-          state = SignalState::HIGH;
-        } else { state = SignalState::INACTIVE; }
-        break;
-    }
-
-    if (bit_count == bits_per_word) {
-      data_word <<= (32 - bit_count);
-      bit_count = 0;
-      update_led(data_word);
-      data_word = 0;
-    }
+    uint32_t colour;
+    uint64_t timestamp = Kernel::TimeControl::ticksToNanos(ev.timestamp);
+    if (receiver.edge(timestamp, ev.event == ev.RISE, colour)) update_led(colour);
+    Kernel::Timers::schedule_event(latch_event, timestamp + Ws2812Receiver::reset_nanos + 1);
   }
 }
 
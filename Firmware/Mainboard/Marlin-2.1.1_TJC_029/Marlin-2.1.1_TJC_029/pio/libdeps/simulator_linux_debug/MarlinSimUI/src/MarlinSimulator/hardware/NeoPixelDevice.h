@@ -5,6 +5,7 @@
 
 #include "Gpio.h"
 
+#include "../signal_decoders.h"
 #include "../virtual_printer.h"
 #include <imgui.h>
 
@@ -52,21 +53,12 @@ public:
   NeoPixelDevice(pin_type neopixel_pin, const uint8_t led_type, const uint16_t led_count);
   virtual ~NeoPixelDevice();
   void interrupt(GpioEvent& ev);
-  void update();
   void ui_widget();
   void update_led(uint32_t color);
 
   pin_type neopixel_pin;
-  uint64_t last_clock = 0;
-  enum class SignalState {
-    INACTIVE,
-    HIGH,
-    LOW_ONE,
-    LOW_ZERO
-  } state = SignalState::INACTIVE;
-  uint8_t bit_count = 0;
-  uint32_t data_word = 0;
-  uint32_t bits_per_word;
+  Ws2812Receiver receiver;
+  std::size_t latch_event; // the reset timeout after the last edge
   const uint8_t led_type;
   const uint16_t led_count;
   std::deque<ImVec4> leds_display;
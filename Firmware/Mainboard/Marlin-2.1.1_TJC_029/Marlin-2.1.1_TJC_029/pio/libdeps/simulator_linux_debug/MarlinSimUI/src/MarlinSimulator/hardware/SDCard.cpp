@@ -1,7 +1,29 @@
 
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
 #include "SDCard.h"
+#include "../snapshot.h"
 #include <src/sd/SdInfo.h>
 
+namespace {
+
+constexpr uint8_t r1_address_error = 0x20;
+constexpr uint8_t data_res_write_error = 0x0D;
+// CMD59 is not answered so the host leaves CRCs off
+uint8_t read_token[] = {0xFF, DATA_START_BLOCK}; // a gap byte, the host waits through 0xFF for the token
+uint8_t no_crc[] = {0xFF, 0xFF};
+
+} // namespace
+
 constexpr char empty_disk_100[] =
     "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
     "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
@@ -70,28 +92,60 @@ constexpr char empty_disk_100[] =
 // + zeroed 100031488 bytes
 void SDCard::generate_empty_image(std::string filename) {
   auto fp = fopen(filename.c_str(), "w+b");
+  if (fp == nullptr) return;
   fwrite(empty_disk_100, sizeof(empty_disk_100) - 1, 1, fp);
-  char zeros[512]{};
-  for (std::size_t i = 0; i < 195374; i++) {
-    fwrite(zeros, sizeof(zeros), 1, fp);
-  }
+  // the zeros are a hole, only the last byte is written
+  fseek(fp, 195374L * 512 - 1, SEEK_CUR);
+  fputc(0, fp);
   fclose(fp);
 }
 
+SDCard::SDCard(SpiBus& spi_bus, pin_type cs, pin_type sd_detect, bool sd_detect_state) : SPISlavePeripheral(spi_bus, cs), sd_detect(sd_detect), sd_detect_state(sd_detect_state), image_filename(simulator_options.sd_image.size() ? simulator_options.sd_image : SD_SIMULATOR_FAT_IMAGE) {
+  if (Gpio::valid_pin(sd_detect)) {
+    Gpio::attach(sd_detect, GpioEvent::GET_VALUE_MASK, this);
+  }
+  sd_present = image_exists();
+  Gpio::set_pin_value(sd_detect, sd_present);
+  flush_event = Kernel::Timers::add_event("SD cache flush", [](void* context){ static_cast<SDCard*>(context)->flush_cache(); }, this);
+  if (simulator_options.sd_profile.size() && !SdTimingProfile::load(simulator_options.sd_profile, timing)) {
+    fprintf(stderr, "SDCard: using the %s timing profile\n", timing.name.c_str());
+  }
+  if (timing.bus_time) spi_bus.timed = true;
+}
+
+SDCard::~SDCard() {
+  unmap_image();
+}
+
 void SDCard::onByteReceived(uint8_t _byte) {
   SPISlavePeripheral::onByteReceived(_byte);
   if (getCurrentToken() != 0xFF || _byte == 0xFF) return;
 
+  // data tokens of a pending write, the block and its CRC follow
+  if ((transfer == Transfer::WRITE_SINGLE && _byte == DATA_START_BLOCK) || (transfer == Transfer::WRITE_MULTIPLE && _byte == WRITE_MULTIPLE_TOKEN)) {
+    setRequestedDataSize(_byte, block_size + 2);
+    return;
+  }
+  if (transfer == Transfer::WRITE_MULTIPLE && _byte == STOP_TRAN_TOKEN) {
+    transfer = Transfer::NONE;
+    return;
+  }
+
   // 1 byte (cmd) + 4 byte (arg) + 1 byte (crc)
   const uint8_t cmd = _byte - 0x40;
   switch (cmd) {
     case CMD0:
     case CMD8:
+    case CMD9:
+    case CMD12:
     case CMD55:
     case CMD58:
     case CMD17: //read block
+    case CMD18: //read multiple blocks
     case CMD24: //write block
+    case CMD25: //write multiple blocks
     case CMD13:
+    case ACMD23:
     case ACMD41:
       setRequestedDataSize(cmd, 5);
       break;
@@ -110,6 +164,7 @@ void SDCard::onRequestedDataReceived(uint8_t token, uint8_t* _data, size_t count
       currentArg |= _data[i];
     }
     crc = _data[4];
+    busy(timing.command_nanos, 0xFF);
   }
 
   UNUSED(crc);
@@ -120,57 +175,427 @@ void SDCard::onRequestedDataReceived(uint8_t token, uint8_t* _data, size_t count
   // printf("CMD: %d, currentArg: %d, crc: %d, count: %d\n", token, currentArg, crc, count);
   switch (token) {
     case CMD0:
-      if (fp) fclose(fp);
-      fp = fopen(image_filename.c_str(), "rb+");
-      if (fp)
+      transfer = Transfer::NONE;
+      if (map_image())
         setResponse(R1_IDLE_STATE);
       else
         setResponse(0);
       break;
-    case CMD8:
-      if (true/*_type == SD_CARD_TYPE_SD1*/) {
-        setResponse((R1_ILLEGAL_COMMAND | R1_IDLE_STATE));
-      }
-      else {
-        memset(buf, 0xAA, 4);
-        setResponse(buf, 4);
-      }
+    case CMD8: // R7, voltage accepted and the check pattern echoed, a version 2 card
+      buf[0] = R1_IDLE_STATE;
+      buf[1] = buf[2] = 0;
+      buf[3] = (currentArg >> 8) & 0x0F;
+      buf[4] = currentArg & 0xFF;
+      setResponse(buf, 5);
       break;
-    case CMD58:
+    case CMD9: { // CSD version 2, the capacity is (C_SIZE + 1) * 512KiB
+      const uint32_t c_size = block_count >= 1024 ? block_count / 1024 - 1 : 0;
+      const uint8_t csd[16] = {0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00, uint8_t((c_size >> 16) & 0x3F), uint8_t(c_size >> 8), uint8_t(c_size), 0x7F, 0x80, 0x0A, 0x40, 0x00, 0x01};
       buf[0] = R1_READY_STATE;
-      memset(buf+1, 0xC0, 3);
-      setResponse(buf, 4);
+      memcpy(buf + 1, read_token, sizeof(read_token));
+      memcpy(buf + 3, csd, sizeof(csd));
+      memcpy(buf + 19, no_crc, sizeof(no_crc));
+      setResponse(buf, 21);
       break;
-    case CMD17: //read block
+    }
+    case CMD12: // a stuff byte before R1
+      transfer = Transfer::NONE;
+      buf[0] = 0xFF;
+      buf[1] = R1_READY_STATE;
+      setResponse(buf, 2);
+      break;
+    case CMD58: // R3, powered up and CCS set: SDHC, block addressed
       buf[0] = R1_READY_STATE;
-      buf[1] = DATA_START_BLOCK;
-      if (true  /*_type != SD_CARD_TYPE_SDHC*/) {
-        currentArg >>= 9;
+      buf[1] = 0xC0;
+      buf[2] = 0xFF;
+      buf[3] = 0x80;
+      buf[4] = 0x00;
+      setResponse(buf, 5);
+      break;
+    case CMD17: //read block
+    case CMD18: //read multiple blocks
+      if (currentArg >= block_count) {
+        setResponse(r1_address_error);
+        break;
       }
-      fseek(fp, 512 * currentArg, SEEK_SET);
-      fread(buf + 2, 512, 1, fp);
-      buf[512 + 2] = 0; //crc
-      setResponse(buf, 512 + 3);
+      setResponse(R1_READY_STATE);
+      transfer = token == CMD17 ? Transfer::READ_SINGLE : Transfer::READ_MULTIPLE;
+      transfer_block = currentArg;
+      read_phase = ReadPhase::COMMAND;
+      read_requested = Kernel::SimulationRuntime::nanos();
+      access_log.record(read_requested, transfer_block, SdAccessLog::READ);
       break;
     case CMD24: //write block
-      if (true  /*_type != SD_CARD_TYPE_SDHC*/) {
-        currentArg >>= 9;
+    case CMD25: //write multiple blocks
+      if (currentArg >= block_count) {
+        setResponse(r1_address_error);
+        break;
       }
       setResponse(R1_READY_STATE);
-      setRequestedDataSize(DATA_START_BLOCK, 512 + 1 + 2 + 1); //token + ff (from this response) + data + 2 crc
+      transfer = token == CMD24 ? Transfer::WRITE_SINGLE : Transfer::WRITE_MULTIPLE;
+      transfer_block = currentArg;
+      break;
+    case CMD13: // R2, no error
+      buf[0] = buf[1] = R1_READY_STATE;
+      setResponse(buf, 2);
       break;
-    case CMD13:
     case CMD55:
+    case ACMD23:
     case ACMD41:
       setResponse(R1_READY_STATE);
       break;
-    case DATA_START_BLOCK: // CMD24 write block
-      fseek(fp, 512 * currentArg, SEEK_SET);
-      fwrite(_data + 2, 512, 1, fp);
-      fflush(fp);
-      buf[0] = DATA_RES_ACCEPTED;
-      buf[1] = 0xFF; // ack for finish write
-      setResponse(buf, 2);
+    case DATA_START_BLOCK:
+    case WRITE_MULTIPLE_TOKEN:
+      buf[0] = receive_block(_data) ? DATA_RES_ACCEPTED : data_res_write_error;
+      if (token == DATA_START_BLOCK || buf[0] != DATA_RES_ACCEPTED) transfer = Transfer::NONE;
+      setResponse(buf, 1);
+      break;
+  }
+}
+
+// chains the parts of a read, the block itself is sent straight from the mapping or made up by the volume
+void SDCard::onResponseSent() {
+  SPISlavePeripheral::onResponseSent();
+  if (busy_after_response) {
+    busy(busy_after_response, 0x00);
+    busy_after_response = 0;
+  }
+  if (transfer != Transfer::READ_SINGLE && transfer != Transfer::READ_MULTIPLE) return;
+
+  const uint64_t now = Kernel::SimulationRuntime::nanos();
+  switch (read_phase) {
+    case ReadPhase::COMMAND:
+      read_phase = ReadPhase::TOKEN;
+      busy(timing.read_nanos, 0xFF);
+      setResponse(read_token, sizeof(read_token));
+      break;
+    case ReadPhase::TOKEN:
+      read_phase = ReadPhase::DATA;
+      if (image != nullptr) {
+        setResponse(image + uint64_t(transfer_block) * block_size, block_size);
+        break;
+      }
+      volume.read(transfer_block, read_buffer.data());
+      setResponse(read_buffer.data(), block_size);
+      break;
+    case ReadPhase::DATA:
+      access_log.record_read_latency(now - read_requested);
+      read_phase = ReadPhase::CRC;
+      setResponse(no_crc, sizeof(no_crc));
+      break;
+    case ReadPhase::CRC:
+      transfer_block++;
+      if (transfer == Transfer::READ_SINGLE || transfer_block >= block_count) {
+        transfer = Transfer::NONE;
+        break;
+      }
+      read_phase = ReadPhase::TOKEN;
+      read_requested = now;
+      access_log.record(now, transfer_block, SdAccessLog::READ);
+      busy(timing.next_block_nanos, 0xFF);
+      setResponse(read_token, sizeof(read_token));
       break;
   }
 }
+
+void SDCard::onBytesSent(uint8_t* into, size_t count) {
+  if (Kernel::SimulationRuntime::nanos() < busy_until) {
+    memset(into, busy_line, count);
+    return;
+  }
+  SPISlavePeripheral::onBytesSent(into, count);
+}
+
+void SDCard::busy(const uint64_t nanos, const uint8_t line) {
+  busy_until = Kernel::SimulationRuntime::nanos() + nanos;
+  busy_line = line;
+}
+
+bool SDCard::receive_block(const uint8_t* _data) {
+  if ((image == nullptr && !volume.is_open()) || transfer_block >= block_count) return false;
+  access_log.record(Kernel::SimulationRuntime::nanos(), transfer_block, SdAccessLog::WRITE);
+  busy_after_response = timing.write_nanos;
+  if (timing.stall_chance > 0 && std::bernoulli_distribution(timing.stall_chance)(stall_random)) busy_after_response += timing.stall_nanos;
+  if (!original_blocks.count(transfer_block)) read_block(transfer_block, original_blocks[transfer_block]);
+  if (image != nullptr) {
+    memcpy(image + uint64_t(transfer_block) * block_size, _data, block_size);
+    block_written(transfer_block);
+  }
+  else volume.write(transfer_block, _data);
+  transfer_block++;
+  return true;
+}
+
+bool SDCard::map_image() {
+  std::error_code error;
+  if (std::filesystem::is_directory(image_filename, error)) {
+    // scanned again on every card init, new files show up after M21, unless that would drop Marlin's writes
+    if (volume_rescan || !volume.is_open() || volume.directory() != image_filename || !volume.written()) {
+      volume_rescan = false;
+      unmap_image();
+      if (!volume.open(image_filename)) return false;
+    }
+    block_count = volume.block_count();
+    return true;
+  }
+  unmap_image();
+  #ifndef _WIN32
+    int fd = open(image_filename.c_str(), O_RDWR);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < off_t(block_size)) {
+      close(fd);
+      return false;
+    }
+    // private, so only persist() changes the file
+    void* map = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      fprintf(stderr, "SDCard::map_image: unable to map %s\n", image_filename.c_str());
+      close(fd);
+      return false;
+    }
+    image_fd = fd;
+    image = (uint8_t*)map;
+    image_size = info.st_size;
+  #else
+    fp = fopen(image_filename.c_str(), "rb+");
+    if (fp == nullptr) return false;
+    fseek(fp, 0, SEEK_END);
+    image_copy.resize(ftell(fp));
+    fseek(fp, 0, SEEK_SET);
+    if (image_copy.size() < block_size || fread(image_copy.data(), image_copy.size(), 1, fp) != 1) {
+      unmap_image();
+      return false;
+    }
+    image = image_copy.data();
+    image_size = image_copy.size();
+  #endif
+  block_count = image_size / block_size;
+  return true;
+}
+
+void SDCard::unmap_image() {
+  flush_cache();
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  #ifndef _WIN32
+    if (image != nullptr) munmap(image, image_size);
+    if (image_fd >= 0) close(image_fd);
+    image_fd = -1;
+  #else
+    if (fp != nullptr) fclose(fp);
+    fp = nullptr;
+    image_copy = std::vector<uint8_t>();
+  #endif
+  volume.close();
+  image = nullptr;
+  image_size = 0;
+  block_count = 0;
+  transfer = Transfer::NONE;
+}
+
+void SDCard::block_written(uint32_t block) {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  stats.writes++;
+  auto entry = dirty_index.find(block);
+  if (entry != dirty_index.end()) {
+    stats.write_hits++;
+    sector_hits[block]++;
+    dirty.splice(dirty.begin(), dirty, entry->second);
+  }
+  else {
+    dirty.push_front(block);
+    dirty_index[block] = dirty.begin();
+    if (dirty.size() > cache_blocks) {
+      persist(dirty.back(), 1);
+      sync_image();
+      stats.flushed_blocks++;
+      dirty_index.erase(dirty.back());
+      dirty.pop_back();
+    }
+  }
+
+  if (simulator_options.sd_flush_interval > 0 && !Kernel::Timers::event_pending(flush_event)) {
+    Kernel::Timers::schedule_event(flush_event, Kernel::SimulationRuntime::nanos() + uint64_t(simulator_options.sd_flush_interval * 1e9));
+  }
+}
+
+void SDCard::flush_cache() {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  if (dirty.empty()) return;
+  std::vector<uint32_t> blocks(dirty.begin(), dirty.end());
+  dirty.clear();
+  dirty_index.clear();
+  if (image == nullptr) return;
+
+  // runs of consecutive sectors are persisted together
+  std::sort(blocks.begin(), blocks.end());
+  for (std::size_t first = 0, last = 0; first < blocks.size(); first = last) {
+    for (last = first + 1; last < blocks.size() && blocks[last] == blocks[last - 1] + 1; last++);
+    persist(blocks[first], last - first);
+  }
+  sync_image();
+  stats.flushes++;
+  stats.flushed_blocks += blocks.size();
+}
+
+void SDCard::persist(const uint32_t first_block, const uint32_t count) {
+  if (image == nullptr || simulator_options.sd_sync == SimulatorOptions::SdSync::NONE) return;
+  const uint64_t offset = uint64_t(first_block) * block_size, length = uint64_t(count) * block_size;
+  #ifndef _WIN32
+    if (pwrite(image_fd, image + offset, length, offset) != ssize_t(length)) {
+      fprintf(stderr, "SDCard::persist: unable to write sectors %u-%u\n", first_block, first_block + count - 1);
+    }
+  #else
+    fseek(fp, offset, SEEK_SET);
+    fwrite(image + offset, length, 1, fp);
+  #endif
+}
+
+void SDCard::sync_image() {
+  if (image == nullptr || simulator_options.sd_sync != SimulatorOptions::SdSync::FULL) return;
+  #ifndef _WIN32
+    if (fdatasync(image_fd) != 0) fprintf(stderr, "SDCard::sync_image: fdatasync failed for %s\n", image_filename.c_str());
+  #else
+    fflush(fp);
+  #endif
+}
+
+SDCard::CacheStats SDCard::cache_stats() {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  CacheStats current = stats;
+  current.dirty = dirty.size();
+  return current;
+}
+
+std::vector<std::pair<uint32_t, uint64_t>> SDCard::hot_sectors(const std::size_t count) {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  std::vector<std::pair<uint32_t, uint64_t>> sectors(sector_hits.begin(), sector_hits.end());
+  const std::size_t shown = std::min(count, sectors.size());
+  std::partial_sort(sectors.begin(), sectors.begin() + shown, sectors.end(), [](auto& a, auto& b){ return a.second > b.second; });
+  sectors.resize(shown);
+  return sectors;
+}
+
+void SDCard::cache_widget() {
+  auto cache = cache_stats();
+  ImGui::Text("Sector writes: %" PRIu64 ", %" PRIu64 " to sectors still dirty", cache.writes, cache.write_hits);
+  ImGui::Text("Dirty sectors: %zu, persisted: %" PRIu64 " in %" PRIu64 " flushes", cache.dirty, cache.flushed_blocks, cache.flushes);
+  if (ImGui::Button("Flush Cache")) flush_cache();
+  for (auto& sector : hot_sectors(5)) {
+    ImGui::Text("  sector %u: %" PRIu64 " rewrites", sector.first, sector.second);
+  }
+}
+
+void SDCard::timing_widget() {
+  auto log = access_log.summary();
+  ImGui::Text("Timing profile: %s", timing.name.c_str());
+  ImGui::Text("Block reads: %" PRIu64 ", writes: %" PRIu64 ", sequential: %.0f%%", log.reads, log.writes, log.reads + log.writes ? 100.0 * log.sequential / (log.reads + log.writes) : 0.0);
+  ImGui::Text("Read latency: mean %.0f us, max %.0f us", log.timed_reads ? log.read_nanos / 1000.0 / log.timed_reads : 0.0, log.max_read_nanos / 1000.0);
+  float latency[KernelTimerStats::buckets];
+  for (std::size_t i = 0; i < KernelTimerStats::buckets; i++) latency[i] = log.read_latency[i];
+  ImGui::PushItemWidth(-100);
+  ImGui::PlotHistogram("Read latency", latency, KernelTimerStats::buckets, 0, "log2 ns buckets", 0.0f, FLT_MAX, ImVec2(0, 60));
+  ImGui::PopItemWidth();
+  if (ImGui::Button("Clear Access Log")) access_log.clear();
+  ImGui::SameLine();
+  if (ImGui::Button("Export Access Log")) {
+    ImGuiFileDialog::Instance()->OpenDialog("SdAccessLogDlgKey", "Choose File", "CSV (*.csv){.csv},.*", ".");
+  }
+  if (ImGuiFileDialog::Instance()->Display("SdAccessLogDlgKey", ImGuiWindowFlags_NoDocking))  {
+    if (ImGuiFileDialog::Instance()->IsOk()) access_log.export_csv(ImGuiFileDialog::Instance()->GetFilePathName());
+    ImGuiFileDialog::Instance()->Close();
+  }
+}
+
+void SDCard::volume_widget() {
+  auto info = volume.stats();
+  ImGui::Text("Virtual FAT32: %u files in %u directories, %.1f MiB", info.files, info.directories, info.file_bytes / 1048576.0);
+  ImGui::Text("Read from host files: %" PRIu64 " sectors, %.1f MiB", info.host_reads, info.host_bytes / 1048576.0);
+  ImGui::Text("Sectors written by Marlin (kept in memory): %zu", info.overlay_blocks);
+  if (ImGui::Button("Rescan Directory")) volume_rescan = true;
+  if (ImGui::IsItemHovered()) ImGui::SetTooltip("on the next card init (M21), Marlin's writes are dropped");
+}
+
+bool SDCard::read_block(uint32_t block, block_data& data) {
+  data.fill(0);
+  if (volume.is_open()) {
+    if (block >= block_count) return false;
+    volume.read(block, data.data());
+    return true;
+  }
+  if (image != nullptr) {
+    if (block >= block_count) return false;
+    memcpy(data.data(), image + uint64_t(block) * block_size, block_size);
+    return true;
+  }
+  FILE* file = fopen(image_filename.c_str(), "rb");
+  if (file == nullptr) return false;
+  bool result = fseek(file, 512L * block, SEEK_SET) == 0 && fread(data.data(), data.size(), 1, file) == 1;
+  fclose(file);
+  return result;
+}
+
+bool SDCard::write_block(uint32_t block, const block_data& data) {
+  if (volume.is_open()) {
+    if (block >= block_count) return false;
+    volume.write(block, data.data());
+    return true;
+  }
+  if (image != nullptr) {
+    if (block >= block_count) return false;
+    memcpy(image + uint64_t(block) * block_size, data.data(), block_size);
+    block_written(block);
+    return true;
+  }
+  FILE* file = fopen(image_filename.c_str(), "rb+");
+  if (file == nullptr) return false;
+  bool result = fseek(file, 512L * block, SEEK_SET) == 0 && fwrite(data.data(), data.size(), 1, file) == 1;
+  fclose(file);
+  return result;
+}
+
+// only the blocks written since startup are saved, with their original content so a restore can undo newer writes
+void SDCard::save_state(SnapshotWriter& writer) {
+  writer.write_string(image_filename);
+  writer.write<uint8_t>(sd_present);
+  writer.write<uint32_t>(original_blocks.size());
+  block_data current;
+  for (auto& block : original_blocks) {
+    read_block(block.first, current);
+    writer.write(block.first);
+    writer.write(block.second);
+    writer.write(current);
+  }
+}
+
+void SDCard::restore_state(SnapshotReader& reader) {
+  std::string snapshot_image;
+  uint8_t present = 0;
+  uint32_t block_count = 0;
+  if (!reader.read_string(snapshot_image) || !reader.read(present) || !reader.read(block_count)) return;
+  if (snapshot_image != image_filename) {
+    fprintf(stderr, "SDCard::restore_state: snapshot uses image %s, not restoring blocks\n", snapshot_image.c_str());
+    return;
+  }
+
+  std::map<uint32_t, std::pair<block_data, block_data>> snapshot_blocks;
+  for (uint32_t i = 0; i < block_count; i++) {
+    uint32_t block = 0;
+    std::pair<block_data, block_data> data;
+    if (!reader.read(block) || !reader.read(data.first) || !reader.read(data.second)) return;
+    snapshot_blocks[block] = data;
+  }
+
+  // blocks first written after the snapshot go back to their original content
+  for (auto& block : original_blocks) {
+    if (!snapshot_blocks.count(block.first)) write_block(block.first, block.second);
+  }
+  original_blocks.clear();
+  for (auto& block : snapshot_blocks) {
+    write_block(block.first, block.second.second);
+    original_blocks[block.first] = block.second.first;
+  }
+
+  sd_present = present;
+  Gpio::set_pin_value(sd_detect, sd_present);
+}
@@ -1,8 +1,21 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <filesystem>
+#include <list>
+#include <map>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
 #include "../user_interface.h"
+#include "../options.h"
 
 #include "SPISlavePeripheral.h"
+#include "SDCardTiming.h"
+#include "VirtualFatVolume.h"
 
 /**
   * Instructions for create a FAT image:
@@ -13,22 +26,33 @@
   * 3) Copy files to the image:
   *    $ mcopy -i fs.img CFFFP_flow_calibrator.gcode ::/
   * 4) Set the path for SD_SIMULATOR_FAT_IMAGE
+  *
+  * Or skip the image: a directory given as the image (--sd-image DIR) is served as a FAT32 volume of its files.
   */
  //#define SD_SIMULATOR_FAT_IMAGE "/full/path/to/fs.img"
 #ifndef SD_SIMULATOR_FAT_IMAGE
   #define SD_SIMULATOR_FAT_IMAGE "fs.img"
 #endif
 
+/**
+ * An SDHC card in SPI mode, block addressed, backed by a private copy on write mapping of the image (read whole
+ * on Windows). Reads, single (CMD17) or streamed (CMD18 until CMD12), are answered from the mapping in place: the
+ * response is chained R1, token, the block, CRC through onResponseSent. Writes (CMD24, CMD25 until the stop token)
+ * are copied into the mapping, which the file never sees. A directory is served through VirtualFatVolume instead,
+ * blocks are made up as they are read and writes stay in memory.
+ *
+ * Written blocks are held in a write-back cache, an LRU of dirty sectors: rewriting a dirty sector (Marlin's
+ * power loss recovery file) costs nothing more, the sectors are written to the image file when the oldest is
+ * evicted, on CMD0, card removal, exit and every --sd-flush seconds of simulated time. --sd-sync none keeps
+ * them in memory only, full waits for the disk after each flush.
+ *
+ * The --sd-profile timing holds the card busy after commands, before each data token and after each write,
+ * the line reads 0xFF (not ready) or 0x00 (programming) until then, checked at the start of each transfer.
+ */
 class SDCard: public SPISlavePeripheral {
 public:
-  SDCard(SpiBus& spi_bus, pin_type cs, pin_type sd_detect = -1, bool sd_detect_state = true) : SPISlavePeripheral(spi_bus, cs), sd_detect(sd_detect), sd_detect_state(sd_detect_state), image_filename(SD_SIMULATOR_FAT_IMAGE) {
-    if (Gpio::valid_pin(sd_detect)) {
-      Gpio::attach(sd_detect, [this](GpioEvent& event){ this->interrupt(event); });
-    }
-    sd_present = image_exists();
-    Gpio::set_pin_value(sd_detect, sd_present);
-  }
-  virtual ~SDCard() {};
+  SDCard(SpiBus& spi_bus, pin_type cs, pin_type sd_detect = -1, bool sd_detect_state = true);
+  virtual ~SDCard();
 
   void update() {}
 
@@ -36,8 +60,13 @@ public:
     if (ImGui::Button("Select Image (FAT32)")) {
       ImGuiFileDialog::Instance()->OpenDialog("ChooseFileDlgKey", "Choose File", "FAT32 Disk Image(*.img){.img},.*", ".");
     }
+    ImGui::SameLine();
+    if (ImGui::Button("Select Directory")) {
+      ImGuiFileDialog::Instance()->OpenDialog("ChooseFileDlgKey", "Choose Directory", nullptr, ".");
+    }
     if (ImGuiFileDialog::Instance()->Display("ChooseFileDlgKey", ImGuiWindowFlags_NoDocking))  {
       if (ImGuiFileDialog::Instance()->IsOk()) {
+        flush_cache();
         image_filename = ImGuiFileDialog::Instance()->GetFilePathName();
         sd_present = image_exists();
         Gpio::set_pin_value(sd_detect, sd_present);
@@ -47,8 +76,11 @@ public:
 
     ImGui::Text("FileSystem image \"%s\" selected", image_filename.c_str());
     if (Gpio::valid_pin(sd_detect)) {
-      ImGui::Checkbox("SD Card Present ", (bool*)&sd_present);
+      if (ImGui::Checkbox("SD Card Present ", (bool*)&sd_present) && !sd_present) flush_cache();
     }
+    if (volume.is_open()) volume_widget();
+    else cache_widget();
+    timing_widget();
 
     if (!sd_present) {
       if (ImGui::Button("Generate Empty Image")) {
@@ -66,6 +98,11 @@ public:
 
   void onByteReceived(uint8_t _byte) override;
   void onRequestedDataReceived(uint8_t token, uint8_t* _data, size_t count) override;
+  void onResponseSent() override;
+  void onBytesSent(uint8_t* into, size_t count) override;
+
+  void save_state(SnapshotWriter& writer) override;
+  void restore_state(SnapshotReader& reader) override;
 
   void interrupt(GpioEvent &ev) {
     if (ev.pin_id == sd_detect && ev.event == GpioEvent::GET_VALUE) {
@@ -74,6 +111,8 @@ public:
   }
 
   bool image_exists() {
+    std::error_code error;
+    if (std::filesystem::is_directory(image_filename, error)) return true;
     auto image_fp = fopen(image_filename.c_str(), "rb+");
     if (image_fp == nullptr) {
       return false;
@@ -83,11 +122,87 @@ public:
   }
   void generate_empty_image(std::string filename);
 
-  int32_t currentArg = 0;
-  uint8_t buf[1024];
-  FILE *fp = nullptr;
+  static constexpr uint32_t block_size = 512;
+  typedef std::array<uint8_t, block_size> block_data;
+  bool read_block(uint32_t block, block_data& data);
+  bool write_block(uint32_t block, const block_data& data);
+
+  bool map_image();
+  void unmap_image();
+  // the block was changed in the mapping
+  void block_written(uint32_t block);
+
+  static constexpr std::size_t cache_blocks = 1024;
+  struct CacheStats {
+    uint64_t writes = 0, write_hits = 0, flushes = 0, flushed_blocks = 0;
+    std::size_t dirty = 0;
+  };
+  // persists every dirty sector
+  void flush_cache();
+  CacheStats cache_stats();
+  // the sectors most often rewritten while dirty, most first
+  std::vector<std::pair<uint32_t, uint64_t>> hot_sectors(const std::size_t count);
+  void cache_widget();
+  void timing_widget();
+  void volume_widget();
+
+  enum class Transfer : uint8_t {
+    NONE,
+    READ_SINGLE,
+    READ_MULTIPLE,
+    WRITE_SINGLE,
+    WRITE_MULTIPLE
+  };
+  // what the chained read response is sending
+  enum class ReadPhase : uint8_t {
+    COMMAND,
+    TOKEN,
+    DATA,
+    CRC
+  };
+  bool receive_block(const uint8_t* _data);
+  // the card answers with line from now for nanos
+  void busy(const uint64_t nanos, const uint8_t line);
+  void persist(const uint32_t first_block, const uint32_t count);
+  // waits for the disk with --sd-sync full
+  void sync_image();
+
+  uint32_t currentArg = 0;
+  uint8_t buf[32];
+  uint8_t *image = nullptr;
+  uint64_t image_size = 0;
+  uint32_t block_count = 0;
+  #ifdef _WIN32
+    FILE *fp = nullptr;
+    std::vector<uint8_t> image_copy;
+  #else
+    int image_fd = -1; // dirty sectors are written back through it
+  #endif
+  VirtualFatVolume volume;
+  std::atomic_bool volume_rescan{false}; // set by the UI, applied on the next CMD0
+  block_data read_buffer; // a block of the volume being sent
+  Transfer transfer = Transfer::NONE;
+  ReadPhase read_phase = ReadPhase::COMMAND;
+  uint32_t transfer_block = 0;
+
+  SdTimingProfile timing;
+  SdAccessLog access_log;
+  std::mt19937 stall_random; // default seeded, runs repeat
+  uint64_t busy_until = 0, busy_after_response = 0, read_requested = 0;
+  uint8_t busy_line = 0xFF;
   bool sd_present = false;
   pin_type sd_detect;
   bool sd_detect_state = true;
   std::string image_filename;
+
+  // dirty sectors, most recently written first, guarded by cache_mutex as the UI flushes too
+  std::mutex cache_mutex;
+  std::list<uint32_t> dirty;
+  std::unordered_map<uint32_t, std::list<uint32_t>::iterator> dirty_index;
+  std::unordered_map<uint32_t, uint64_t> sector_hits;
+  CacheStats stats;
+  std::size_t flush_event;
+
+  // content of every block before its first write, lets a snapshot undo later writes
+  std::map<uint32_t, block_data> original_blocks;
 };
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "SDCardTiming.h"
+
+const std::vector<SdTimingProfile>& SdTimingProfile::builtin() {
+  static const std::vector<SdTimingProfile> profiles = {
+    {"instant"},
+    // a no name class 4 card, slow random reads and writes that now and then stall for a quarter second
+    {"cheap-8gb", 5'000, 1'800'000, 600'000, 1'500'000, 250'000'000, 0.004, true},
+    // an A1 rated card, 1500 random read and 500 write IOPS with short stalls
+    {"fast-a1", 2'000, 250'000, 60'000, 300'000, 40'000'000, 0.0005, true},
+  };
+  return profiles;
+}
+
+bool SdTimingProfile::load(const std::string& name, SdTimingProfile& profile) {
+  for (auto& known : builtin()) {
+    if (known.name == name) {
+      profile = known;
+      return true;
+    }
+  }
+
+  FILE* file = fopen(name.c_str(), "r");
+  if (file == nullptr) {
+    fprintf(stderr, "SdTimingProfile::load: %s is not a profile name or a readable file\n", name.c_str());
+    return false;
+  }
+  SdTimingProfile loaded;
+  loaded.name = name;
+  loaded.bus_time = true;
+  char line[256];
+  int number = 0;
+  bool valid = true;
+  while (fgets(line, sizeof(line), file)) {
+    number++;
+    if (auto comment = strchr(line, '#')) *comment = '\0';
+    char key[64];
+    double value = 0;
+    if (sscanf(line, " %63[a-z_] = %lf", key, &value) != 2) {
+      if (strspn(line, " \t\r\n") != strlen(line)) {
+        fprintf(stderr, "SdTimingProfile::load: %s:%d is not \"key = value\"\n", name.c_str(), number);
+        valid = false;
+      }
+      continue;
+    }
+    const uint64_t nanos = uint64_t(std::max(0.0, value) * 1000);
+    if (!strcmp(key, "command_us")) loaded.command_nanos = nanos;
+    else if (!strcmp(key, "read_us")) loaded.read_nanos = nanos;
+    else if (!strcmp(key, "next_block_us")) loaded.next_block_nanos = nanos;
+    else if (!strcmp(key, "write_us")) loaded.write_nanos = nanos;
+    else if (!strcmp(key, "stall_us")) loaded.stall_nanos = nanos;
+    else if (!strcmp(key, "stall_chance")) loaded.stall_chance = std::min(1.0, std::max(0.0, value));
+    else {
+      fprintf(stderr, "SdTimingProfile::load: %s:%d unknown key %s\n", name.c_str(), number, key);
+      valid = false;
+    }
+  }
+  fclose(file);
+  if (valid) profile = loaded;
+  return valid;
+}
+
+void SdAccessLog::record(const uint64_t timestamp, const uint32_t block, const Kind kind) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (kind == READ) totals.reads++;
+  else totals.writes++;
+  if (kind == last_kind && block == last_block + 1) totals.sequential++;
+  last_block = block;
+  last_kind = kind;
+
+  if (accesses.size() < capacity) accesses.push_back({timestamp, block, kind});
+  else accesses[next] = {timestamp, block, kind};
+  next = (next + 1) % capacity;
+}
+
+void SdAccessLog::record_read_latency(const uint64_t nanos) {
+  std::lock_guard<std::mutex> lock(mutex);
+  totals.read_latency[KernelTimerStats::bucket(nanos)]++;
+  totals.read_nanos += nanos;
+  totals.max_read_nanos = std::max(totals.max_read_nanos, nanos);
+  totals.timed_reads++;
+}
+
+SdAccessLog::Summary SdAccessLog::summary() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return totals;
+}
+
+void SdAccessLog::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  accesses.clear();
+  next = 0;
+  totals = Summary();
+  last_block = UINT32_MAX;
+}
+
+bool SdAccessLog::export_csv(const std::string& filename) {
+  FILE* file = fopen(filename.c_str(), "w");
+  if (file == nullptr) {
+    fprintf(stderr, "SdAccessLog::export_csv: unable to write %s\n", filename.c_str());
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  fprintf(file, "timestamp_ns,block,access\n");
+  // until the ring is full next is its end, afterwards also the oldest entry
+  const std::size_t first = accesses.size() < capacity ? 0 : next;
+  for (std::size_t i = 0; i < accesses.size(); i++) {
+    auto& access = accesses[(first + i) % accesses.size()];
+    fprintf(file, "%" PRIu64 ",%u,%s\n", access.timestamp, access.block, access.kind == READ ? "read" : "write");
+  }
+  // columns are the lower bound of each bucket in ns, bucket n counts values in [2^(n-1), 2^n)
+  fprintf(file, "\nreads,writes,sequential,mean_read_ns,max_read_ns\n%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n", totals.reads, totals.writes, totals.sequential,
+    totals.timed_reads ? totals.read_nanos / totals.timed_reads : 0, totals.max_read_nanos);
+  fprintf(file, "\nhistogram");
+  for (std::size_t i = 0; i < KernelTimerStats::buckets; i++) fprintf(file, ",%" PRIu64, i ? uint64_t(1) << (i - 1) : uint64_t(0));
+  fprintf(file, "\nread_latency");
+  for (auto count : totals.read_latency) fprintf(file, ",%" PRIu64, count);
+  fprintf(file, "\n");
+  fclose(file);
+  return true;
+}
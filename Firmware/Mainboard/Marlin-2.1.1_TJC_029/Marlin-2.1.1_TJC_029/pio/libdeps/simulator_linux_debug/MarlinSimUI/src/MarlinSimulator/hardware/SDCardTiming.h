@@ -0,0 +1,76 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../execution_control.h"
+
+/**
+ * How long the simulated SD card takes to answer, as a named profile or a file of "key = value" lines that
+ * override the instant profile (times in microseconds, # starts a comment):
+ *
+ *   command_us = 5         command to R1
+ *   read_us = 1500         R1 to the data token of a block read
+ *   next_block_us = 400    between the blocks of a CMD18 stream
+ *   write_us = 1200        busy after each block written
+ *   stall_us = 150000      an occasional long busy after a write, the card erasing or remapping
+ *   stall_chance = 0.005   per block written
+ *
+ * Firmware code runs in no simulated time, the card only gets through a busy period while Marlin polls it, so
+ * every profile but instant (the default) also has the HAL take the bytes at the SPI clock Marlin selected.
+ */
+struct SdTimingProfile {
+  std::string name = "instant";
+  uint64_t command_nanos = 0, read_nanos = 0, next_block_nanos = 0, write_nanos = 0, stall_nanos = 0;
+  double stall_chance = 0.0;
+  bool bus_time = false;
+
+  static const std::vector<SdTimingProfile>& builtin();
+  // a built in profile by name, otherwise name is read as a profile file
+  static bool load(const std::string& name, SdTimingProfile& profile);
+};
+
+/**
+ * What the firmware asked the card for: the most recent block accesses, how many continued the previous
+ * one, and a log2 histogram (as KernelTimerStats) of read latency, from the command or the end of the
+ * previous block of a stream to the last byte of the block, the wait Marlin sees.
+ */
+class SdAccessLog {
+public:
+  static constexpr std::size_t capacity = 1 << 16;
+
+  enum Kind : uint8_t {
+    READ,
+    WRITE
+  };
+
+  struct Access {
+    uint64_t timestamp;
+    uint32_t block;
+    Kind kind;
+  };
+
+  struct Summary {
+    uint64_t reads = 0, writes = 0, sequential = 0;
+    uint64_t read_nanos = 0, max_read_nanos = 0, timed_reads = 0;
+    std::array<uint64_t, KernelTimerStats::buckets> read_latency{};
+  };
+
+  void record(const uint64_t timestamp, const uint32_t block, const Kind kind);
+  void record_read_latency(const uint64_t nanos);
+  Summary summary();
+  void clear();
+  // the accesses kept, oldest first, then the histogram
+  bool export_csv(const std::string& filename);
+
+private:
+  std::mutex mutex;
+  std::vector<Access> accesses; // a ring once full
+  std::size_t next = 0;
+  Summary totals;
+  uint32_t last_block = UINT32_MAX;
+  Kind last_kind = READ;
+};
@@ -1,8 +1,11 @@
+#include <algorithm>
+#include <cstring>
+
 #include "SPISlavePeripheral.h"
 
 SPISlavePeripheral::SPISlavePeripheral(SpiBus& spi_bus, pin_type cs) : VirtualPrinter::Component("SPISlavePeripheral"), spi_bus(spi_bus), cs_pin(cs) {
-  Gpio::attach(cs_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  spi_bus.attach([this](SpiEvent& event){ this->interrupt(event); });
+  Gpio::attach(cs_pin, GpioEvent::EDGE_MASK, [](void* context, GpioEvent& event){ static_cast<SPISlavePeripheral*>(context)->interrupt(event); }, this);
+  spi_bus.attach([](void* context, SpiEvent& event){ static_cast<SPISlavePeripheral*>(context)->interrupt(event); }, this);
 }
 
 SPISlavePeripheral::~SPISlavePeripheral() {};
@@ -18,7 +21,7 @@ void SPISlavePeripheral::onBeginTransaction() {
 void SPISlavePeripheral::onEndTransaction() {
   // check for pending data to receive
   if (requestedDataSize > 0) {
-    onRequestedDataReceived(currentToken, requestedData, requestedDataIndex);
+    onRequestedDataReceived(currentToken, requestedData.data(), requestedDataIndex);
   }
   setRequestedDataSize(0xFF, 0);
   insideTransaction = false;
@@ -27,17 +30,30 @@ void SPISlavePeripheral::onEndTransaction() {
 }
 
 
-void SPISlavePeripheral::onByteReceived(uint8_t _byte) {
-  //printf("%s::onByteReceived: 0x%X\n", name.c_str(), _byte);
-  if (requestedDataSize > 0) {
-    requestedData[requestedDataIndex++] = _byte;
-    if (requestedDataIndex == requestedDataSize) {
-      requestedDataSize = 0;
-      onRequestedDataReceived(currentToken, requestedData, requestedDataIndex);
+void SPISlavePeripheral::onBytesReceived(const uint8_t* _bytes, size_t count) {
+  while (count > 0) {
+    if (requestedDataSize > 0) {
+      const size_t run = std::min(count, requestedDataSize - requestedDataIndex);
+      memcpy(requestedData.data() + requestedDataIndex, _bytes, run);
+      requestedDataIndex += run;
+      _bytes += run;
+      count -= run;
+      if (requestedDataIndex == requestedDataSize) {
+        requestedDataSize = 0;
+        onRequestedDataReceived(currentToken, requestedData.data(), requestedDataIndex);
+      }
+    }
+    else {
+      onByteReceived(*_bytes++);
+      count--;
     }
   }
 }
 
+void SPISlavePeripheral::onByteReceived(uint8_t _byte) {
+  //printf("%s::onByteReceived: 0x%X\n", name.c_str(), _byte);
+}
+
 void SPISlavePeripheral::onResponseSent() {
   // printf("SPISlavePeripheral::onResponseSent\n");
   hasDataToSend = false;
@@ -47,16 +63,31 @@ void SPISlavePeripheral::onRequestedDataReceived(uint8_t token, uint8_t* _data,
   //printf("%s::onRequestedDataReceived\n", name.c_str());
 }
 
-void SPISlavePeripheral::onByteSent(uint8_t _byte) {
-  //printf("%s::onByteSent: %d\n", name.c_str(), _byte);
-  if (responseDataSize > 0) {
-    outgoing_byte = *responseData;
-    responseData++;
-    responseDataSize--;
-  }
-  else {
-    if (hasDataToSend) onResponseSent();
-    outgoing_byte = 0xFF;
+void SPISlavePeripheral::onBytesSent(uint8_t* into, size_t count) {
+  while (count > 0) {
+    *into++ = outgoing_byte;
+    count--;
+    if (responseDataSize > 0) {
+      // the rest of the response in one copy, its last byte stays in outgoing_byte for the next transfer
+      const size_t run = std::min(count, responseDataSize - 1);
+      memcpy(into, responseData, run);
+      into += run;
+      count -= run;
+      responseData += run;
+      responseDataSize -= run;
+      outgoing_byte = *responseData;
+      responseData++;
+      responseDataSize--;
+    }
+    else {
+      // onResponseSent can chain the next response
+      outgoing_byte = 0xFF;
+      if (hasDataToSend) onResponseSent();
+      if (!hasDataToSend) {
+        memset(into, 0xFF, count);
+        return;
+      }
+    }
   }
 }
 
@@ -91,29 +122,37 @@ void SPISlavePeripheral::setRequestedDataSize(uint8_t token, size_t _count) {
   currentToken = token;
   requestedDataSize = _count;
   requestedDataIndex = 0;
-  delete[] requestedData;
-  if (_count > 0) {
-    requestedData = new uint8_t[_count];
-  }
-  else {
-    requestedData = nullptr;
-  }
+  if (requestedData.size() < _count) requestedData.resize(_count);
 }
 
 void SPISlavePeripheral::interrupt(SpiEvent& ev) {
   //printf("SPI(%s): interrupt\n", name.c_str());
   if (Gpio::get_pin_value(cs_pin) != 0 || !insideTransaction) return;
 
-  for (size_t i = 0; i < ev.length; i++) {
-    if (ev.read_into != nullptr) {
-      ev.read_into[i] = outgoing_byte;
-      onByteSent(outgoing_byte);
-      //printf("SPI(%s): data out\n", name.c_str());
+  if (ev.read_into != nullptr && ev.write_from != nullptr) {
+    // full duplex, a reply can depend on the byte just before it
+    for (size_t i = 0; i < ev.length; i++) {
+      onBytesSent(ev.read_into + i, 1);
+      const uint8_t value = ev.byte(i);
+      onBytesReceived(&value, 1);
+    }
+  }
+  else if (ev.read_into != nullptr) {
+    onBytesSent(ev.read_into, ev.length);
+  }
+  else if (ev.write_from != nullptr) {
+    if (ev.contiguous()) {
+      onBytesReceived(ev.write_from, ev.length);
+      return;
     }
-    if (ev.write_from != nullptr) {
-      incoming_byte = ev.source_increment ? ev.write_from[i] : ev.write_from[i % ev.source_format] ;
-      onByteReceived(incoming_byte);
-      //printf("SPI(%s): data in\n", name.c_str());
+    // 16 bit and repeated sources are expanded a chunk at a time, a repeated word only once
+    uint8_t chunk[256];
+    for (size_t i = 0; i < ev.length; i += sizeof(chunk)) {
+      const size_t count = std::min(sizeof(chunk), ev.length - i);
+      if (i == 0 || ev.source_increment) {
+        for (size_t j = 0; j < count; j++) chunk[j] = ev.byte(i + j);
+      }
+      onBytesReceived(chunk, count);
     }
   }
 }
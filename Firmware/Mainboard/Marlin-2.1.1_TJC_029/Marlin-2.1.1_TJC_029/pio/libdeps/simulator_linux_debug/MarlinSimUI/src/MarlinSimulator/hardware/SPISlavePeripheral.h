@@ -1,11 +1,17 @@
 #pragma once
 
+#include <vector>
+
 #include "../virtual_printer.h"
 #include "Gpio.h"
 #include "bus/spi.h"
 
 /**
  * Class to Easily Handle SPI Slave communication
+ *
+ * A burst from the master arrives as one onBytesReceived/onBytesSent call. The defaults copy requested data and
+ * responses in bulk and only hand the remaining bytes (commands) to onByteReceived one at a time, a peripheral
+ * streaming data of its own (a display's pixels) overrides onBytesReceived.
  */
 class SPISlavePeripheral : public VirtualPrinter::Component {
 public:
@@ -16,10 +22,11 @@ public:
   virtual void onBeginTransaction();
   virtual void onEndTransaction();
 
+  virtual void onBytesReceived(const uint8_t* _bytes, size_t count);
   virtual void onByteReceived(uint8_t _byte);
   virtual void onRequestedDataReceived(uint8_t token, uint8_t* _data, size_t count);
 
-  virtual void onByteSent(uint8_t _byte);
+  virtual void onBytesSent(uint8_t* into, size_t count);
   virtual void onResponseSent();
 
 
@@ -38,8 +45,6 @@ protected:
   pin_type cs_pin;
 
 private:
-  uint8_t incoming_byte = 0;
-  uint8_t incoming_byte_count = 0;
   uint8_t outgoing_byte = 0xFF;
 
   uint8_t *responseData = nullptr;
@@ -47,7 +52,7 @@ private:
   bool insideTransaction = false;
   bool hasDataToSend = false;
   uint8_t currentToken = 0xFF;
-  uint8_t *requestedData = nullptr;
+  std::vector<uint8_t> requestedData; // only grows, reused by every command
   size_t requestedDataSize = 0;
   size_t requestedDataIndex = 0;
   SpiBus &spi_bus;
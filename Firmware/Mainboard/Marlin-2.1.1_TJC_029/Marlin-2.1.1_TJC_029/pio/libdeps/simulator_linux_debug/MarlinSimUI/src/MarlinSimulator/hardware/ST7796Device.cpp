@@ -21,13 +21,8 @@
 ST7796Device::ST7796Device(SpiBus& spi_bus, pin_type tft_cs, SpiBus& touch_spi_bus, pin_type touch_cs, pin_type dc, pin_type beeper, pin_type enc1, pin_type enc2, pin_type enc_but, pin_type back, pin_type kill)
   : SPISlavePeripheral(spi_bus, tft_cs), dc_pin(dc), beeper_pin(beeper), enc1_pin(enc1), enc2_pin(enc2), enc_but_pin(enc_but), back_pin(back), kill_pin(kill) {
   touch = add_component<XPT2046Device>("Touch", touch_spi_bus, touch_cs);
-  Gpio::attach(dc_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(beeper_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(kill_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(enc_but_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(back_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(enc1_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(enc2_pin, [this](GpioEvent& event){ this->interrupt(event); });
+  Gpio::attach(dc_pin, GpioEvent::FALL_MASK, this);
+  Gpio::attach(beeper_pin, GpioEvent::EDGE_MASK, this);
 }
 
 ST7796Device::~ST7796Device() {}
@@ -86,27 +81,41 @@ void ST7796Device::onEndTransaction() {
   data.clear();
 };
 
+void ST7796Device::write_pixel(const uint16_t pixel) {
+  graphic_ram[graphic_ram_index_x + (graphic_ram_index_y * width)] = pixel;
+  if (graphic_ram_index_x >= xMax) {
+    graphic_ram_index_x = xMin;
+    graphic_ram_index_y++;
+  }
+  else {
+    graphic_ram_index_x++;
+  }
+  if (graphic_ram_index_y >= yMax && graphic_ram_index_x >= xMax) {
+    dirty = true;
+  }
+  if (graphic_ram_index_y >= height) graphic_ram_index_y = yMin;
+}
+
+// a memory write burst goes straight to the graphic ram, a pair of bytes per pixel
+void ST7796Device::onBytesReceived(const uint8_t* _bytes, size_t count) {
+  if (command != ST7796S_RAMWR || !Gpio::get_pin_value(dc_pin)) {
+    SPISlavePeripheral::onBytesReceived(_bytes, count);
+    return;
+  }
+  size_t i = 0;
+  if (data.size() == 1 && count > 0) {
+    write_pixel((data[0] << 8) + _bytes[0]);
+    data.clear();
+    i = 1;
+  }
+  for (; i + 1 < count; i += 2) write_pixel((_bytes[i] << 8) + _bytes[i + 1]);
+  if (i < count) data.push_back(_bytes[i]);
+}
+
 void ST7796Device::onByteReceived(uint8_t _byte) {
   SPISlavePeripheral::onByteReceived(_byte);
   if (Gpio::get_pin_value(dc_pin)) {
     data.push_back(_byte);
-    //direct write to memory, to optimize
-    if (command == ST7796S_RAMWR && data.size() == 2) {
-      auto pixel = (data[0] << 8) + data[1];
-      graphic_ram[graphic_ram_index_x + (graphic_ram_index_y * width)] = pixel;
-      if (graphic_ram_index_x >= xMax) {
-        graphic_ram_index_x = xMin;
-        graphic_ram_index_y++;
-      }
-      else {
-        graphic_ram_index_x++;
-      }
-      if (graphic_ram_index_y >= yMax && graphic_ram_index_x >= xMax) {
-        dirty = true;
-      }
-      if (graphic_ram_index_y >= height) graphic_ram_index_y = yMin;
-      data.clear();
-    }
   }
   else {
     //command
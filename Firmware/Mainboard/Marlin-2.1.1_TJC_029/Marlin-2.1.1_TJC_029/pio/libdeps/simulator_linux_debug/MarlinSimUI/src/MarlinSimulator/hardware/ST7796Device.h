@@ -40,8 +40,10 @@ public:
   void ui_init();
   void ui_widget();
 
+  void onBytesReceived(const uint8_t* _bytes, size_t count) override;
   void onByteReceived(uint8_t _byte) override;
   void onEndTransaction() override;
+  void write_pixel(const uint16_t pixel);
 
   static constexpr uint32_t width = TFT_WIDTH, height = TFT_HEIGHT;
   bool render_integer_scaling = false, render_popout = false;
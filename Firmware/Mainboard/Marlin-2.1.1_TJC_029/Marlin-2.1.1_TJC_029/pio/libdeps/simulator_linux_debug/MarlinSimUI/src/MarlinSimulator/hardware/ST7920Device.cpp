@@ -14,14 +14,14 @@
 ST7920Device::ST7920Device(pin_type clk, pin_type mosi, pin_type cs, pin_type beeper, pin_type enc1, pin_type enc2, pin_type enc_but, pin_type back, pin_type kill)
   : clk_pin(clk), mosi_pin(mosi), cs_pin(cs), beeper_pin(beeper), enc1_pin(enc1), enc2_pin(enc2), enc_but_pin(enc_but), back_pin(back), kill_pin(kill) {
 
-  Gpio::attach(clk_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(cs_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(beeper_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(enc1_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(enc2_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(enc_but_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(back_pin, [this](GpioEvent& event){ this->interrupt(event); });
-  Gpio::attach(kill_pin, [this](GpioEvent& event){ this->interrupt(event); });
+  Gpio::attach(clk_pin, GpioEvent::FALL_MASK, this);
+  Gpio::attach(cs_pin, GpioEvent::RISE_MASK, this);
+  Gpio::attach(beeper_pin, GpioEvent::EDGE_MASK, this);
+  Gpio::attach(enc1_pin, GpioEvent::GET_VALUE_MASK, this);
+  Gpio::attach(enc2_pin, GpioEvent::GET_VALUE_MASK, this);
+  Gpio::attach(enc_but_pin, GpioEvent::GET_VALUE_MASK, this);
+  Gpio::attach(back_pin, GpioEvent::GET_VALUE_MASK, this);
+  Gpio::attach(kill_pin, GpioEvent::GET_VALUE_MASK, this);
 }
 
 ST7920Device::~ST7920Device() {}
@@ -1,26 +1,62 @@
 #pragma once
 
 #include <atomic>
+#include <cinttypes>
+#include <memory>
 
 #include <imgui.h>
 
 #include "Gpio.h"
 #include "../virtual_printer.h"
+#include "../snapshot.h"
+
+// Step times for MotionAnalytics, pushed by the simulation thread and drained by the UI
+class StepLog {
+public:
+  static constexpr std::size_t capacity = 1 << 16;
+
+  // the timestamp in ns, the direction in the low bit
+  void push(const uint64_t timestamp, const bool forward) {
+    auto head = this->head.load(std::memory_order_relaxed);
+    if (head - tail.load(std::memory_order_acquire) == capacity) {
+      dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      return;
+    }
+    entries[head % capacity] = timestamp << 1 | forward;
+    this->head.store(head + 1, std::memory_order_release);
+  }
+
+  template<typename F>
+  void drain(F fn) {
+    auto tail = this->tail.load(std::memory_order_relaxed), head = this->head.load(std::memory_order_acquire);
+    for (; tail != head; tail++) fn(entries[tail % capacity] >> 1, bool(entries[tail % capacity] & 1));
+    this->tail.store(tail, std::memory_order_release);
+  }
+
+  std::atomic_bool enabled{false};
+  std::atomic_uint64_t dropped{0};
+
+private:
+  std::unique_ptr<uint64_t[]> entries{new uint64_t[capacity]};
+  std::atomic_uint64_t head{0}, tail{0};
+};
 
 class StepperDriver : public VirtualPrinter::Component {
 public:
   StepperDriver(pin_type enable, pin_type dir, pin_type step, std::function<void()> step_callback = [](){} ) : VirtualPrinter::Component("StepperDriver"), enable(enable), dir(dir), step(step), step_callback(step_callback) {
-    Gpio::attach(step, [this](GpioEvent& ev){ this->interrupt(ev); });
+    Gpio::attach(step, GpioEvent::RISE_MASK, this);
   }
   ~StepperDriver() {}
 
   void ui_widget() {
-    ImGui::Text("Steps: %ld", step_count.load());
+    ImGui::Text("Steps: %" PRId64, step_count.load());
   }
 
   void interrupt(GpioEvent& ev) {
     if (ev.pin_id == step && ev.event == ev.RISE && Gpio::get_pin_value(enable) == 0) {
-      step_count += ((Gpio::get_pin_value(dir) * 2) - 1);
+      bool forward = Gpio::get_pin_value(dir);
+      step_count += forward ? 1 : -1;
+      if (step_log.enabled) step_log.push(Kernel::TimeControl::ticksToNanos(ev.timestamp), forward);
       step_callback();
     }
   }
@@ -29,7 +65,17 @@ public:
     return step_count;
   }
 
+  void save_state(SnapshotWriter& writer) override {
+    writer.write<int64_t>(step_count);
+  }
+
+  void restore_state(SnapshotReader& reader) override {
+    int64_t steps = 0;
+    if (reader.read(steps)) step_count = steps;
+  }
+
   std::atomic_int64_t step_count = 0;
   const pin_type enable, dir, step;
   std::function<void()> step_callback;
+  StepLog step_log;
 };
@@ -0,0 +1,62 @@
+#include <cmath>
+#include <cstdio>
+
+#include "Thermistor.h"
+
+namespace {
+
+constexpr double absolute_zero_offset = -273.15;
+double thermistor_ext_coef[] = {
+  7.611428226793945e-04,
+  2.011100481838449e-04,
+  1.914201231699539e-06,
+  1.561937567632929e-08
+};
+
+double temperature_to_resistance(double t) {
+	double r, u, v, p, q, b, c, d;
+	t = t - absolute_zero_offset;
+	d = (thermistor_ext_coef[0] - 1.0 / t) / thermistor_ext_coef[3];
+	c = thermistor_ext_coef[1] / thermistor_ext_coef[3];
+	b = thermistor_ext_coef[2] / thermistor_ext_coef[3];
+	q = 2.0 / 27.0 * b * b * b - 1.0 / 3.0 * b * c + d;
+	p = c - 1.0 / 3.0 * b * b;
+	v = - pow(q / 2.0 + sqrt(q * q / 4.0 + p * p * p / 27.0), 1.0 / 3.0);
+	u =   pow(-q / 2.0 + sqrt(q * q / 4.0 + p * p * p / 27.0), 1.0 / 3.0);
+	r  = exp(u + v - b / 3.0);
+	return r;
+}
+
+// resistance at 25C and beta, as in Marlin's thermistor tables
+struct BetaModel {
+  int16_t sensor;
+  double r25, beta;
+};
+
+constexpr BetaModel beta_models[] = {
+  {  5, 100000, 4267 }, // ATC Semitec 104GT-2 / 104NT-4-R025H42G
+  { 11, 100000, 3950 }, // QU-BD silicone bed QWG-104F-3950
+  { 13, 100000, 3950 }, // Hisens 3950
+};
+
+}
+
+double ThermistorTable::resistance(const int16_t sensor, const double temperature) {
+  for (auto& model : beta_models) {
+    if (model.sensor == sensor) return model.r25 * std::exp(model.beta * (1.0 / (temperature - absolute_zero_offset) - 1.0 / (25.0 - absolute_zero_offset)));
+  }
+  return temperature_to_resistance(temperature);
+}
+
+ThermistorTable::ThermistorTable(const int16_t sensor, const double pullup_resistance, const uint32_t resolution) {
+  bool known = sensor == 1;
+  for (auto& model : beta_models) known |= model.sensor == sensor;
+  if (!known) fprintf(stderr, "ThermistorTable: no model for TEMP_SENSOR %d, using 1 (EPCOS 100k)\n", sensor);
+
+  const double full_scale = (1U << resolution) - 1;
+  readings.resize(std::size_t(std::lround((max_temperature - min_temperature) / step)) + 1);
+  for (std::size_t i = 0; i < readings.size(); i++) {
+    double thermistor_resistance = resistance(sensor, min_temperature + i * step);
+    readings[i] = full_scale * thermistor_resistance / (pullup_resistance + thermistor_resistance);
+  }
+}
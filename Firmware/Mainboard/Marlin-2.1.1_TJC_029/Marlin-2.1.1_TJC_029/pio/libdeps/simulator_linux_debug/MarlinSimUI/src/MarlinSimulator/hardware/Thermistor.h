@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * ADC readings of a thermistor voltage divider by temperature, tabulated once so a conversion is an
+ * interpolation between two entries rather than the model's cube roots and exponential.
+ *
+ * The model is picked by Marlin's TEMP_SENSOR_* number: 1 uses the extended Steinhart-Hart fit this
+ * simulator always used, a few common 100k parts use their beta, anything else falls back to 1.
+ */
+class ThermistorTable {
+public:
+  static constexpr double min_temperature = -50.0, max_temperature = 500.0, step = 0.1; // C
+
+  ThermistorTable(const int16_t sensor, const double pullup_resistance, const uint32_t resolution);
+
+  // temperatures outside the table read as its end
+  uint32_t reading(const double temperature) const {
+    double position = (temperature - min_temperature) / step;
+    if (position <= 0.0) return uint32_t(readings.front());
+    if (position >= readings.size() - 1) return uint32_t(readings.back());
+    std::size_t index = std::size_t(position);
+    double fraction = position - index;
+    return uint32_t(readings[index] + (readings[index + 1] - readings[index]) * fraction);
+  }
+
+  // the model, ohms at temperature C
+  static double resistance(const int16_t sensor, const double temperature);
+
+private:
+  std::vector<float> readings;
+};
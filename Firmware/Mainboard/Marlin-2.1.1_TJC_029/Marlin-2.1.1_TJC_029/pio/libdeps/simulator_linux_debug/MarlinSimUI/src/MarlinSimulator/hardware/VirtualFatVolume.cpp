@@ -0,0 +1,431 @@
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <set>
+
+#include <sys/stat.h>
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+#include "VirtualFatVolume.h"
+
+namespace {
+
+constexpr uint32_t end_of_chain = 0x0FFFFFFF;
+constexpr uint32_t volume_id = 0x4D53494D;
+constexpr uint8_t attribute_directory = 0x10, attribute_archive = 0x20, attribute_long_name = 0x0F;
+// where the 13 UCS-2 characters of a long name entry go
+constexpr uint8_t long_name_offsets[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+void put16(uint8_t* into, const uint16_t value) {
+  into[0] = value;
+  into[1] = value >> 8;
+}
+
+void put32(uint8_t* into, const uint32_t value) {
+  put16(into, value);
+  put16(into + 2, value >> 16);
+}
+
+// characters outside the BMP become '_'
+std::u16string utf16(const std::string& name) {
+  std::u16string result;
+  for (std::size_t i = 0; i < name.size();) {
+    const uint8_t lead = name[i++];
+    uint32_t code = lead;
+    int extra = 0;
+    if ((lead >> 5) == 0x06) code = lead & 0x1F, extra = 1;
+    else if ((lead >> 4) == 0x0E) code = lead & 0x0F, extra = 2;
+    else if ((lead >> 3) == 0x1E) code = lead & 0x07, extra = 3;
+    else if (lead >= 0x80) code = '_';
+    for (; extra && i < name.size(); extra--, i++) code = (code << 6) | (name[i] & 0x3F);
+    result.push_back(code > 0xFFFF ? u'_' : char16_t(code));
+  }
+  return result;
+}
+
+void dos_time(const time_t modified, uint16_t& date, uint16_t& time) {
+  const std::tm* local = std::localtime(&modified);
+  if (local == nullptr || local->tm_year < 80) {
+    date = (1 << 5) | 1; // 1980-01-01
+    time = 0;
+    return;
+  }
+  date = ((local->tm_year - 80) << 9) | ((local->tm_mon + 1) << 5) | local->tm_mday;
+  time = (local->tm_hour << 11) | (local->tm_min << 5) | (local->tm_sec / 2);
+}
+
+uint8_t short_name_checksum(const uint8_t* name) {
+  uint8_t sum = 0;
+  for (int i = 0; i < 11; i++) sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+  return sum;
+}
+
+uint32_t long_name_entries(const std::u16string& name) {
+  return (name.size() + 12) / 13;
+}
+
+void directory_entry(uint8_t* into, const uint8_t* name, const uint8_t attributes, const uint32_t cluster, const uint32_t size, const uint16_t date, const uint16_t time) {
+  memcpy(into, name, 11);
+  into[11] = attributes;
+  put16(into + 14, time);
+  put16(into + 16, date);
+  put16(into + 18, date);
+  put16(into + 20, cluster >> 16);
+  put16(into + 22, time);
+  put16(into + 24, date);
+  put16(into + 26, cluster);
+  put32(into + 28, size);
+}
+
+} // namespace
+
+bool VirtualFatVolume::open(const std::string& directory) {
+  close();
+  std::error_code error;
+  if (!std::filesystem::is_directory(directory, error)) return false;
+  root_path = directory;
+  scan(directory, -1);
+  for (int32_t node = 0; node < int32_t(nodes.size()); node++) allocate(node);
+
+  cluster_count = next_cluster - 2 + free_clusters;
+  fat_sectors = ((cluster_count + 2) * 4 + block_size - 1) / block_size;
+  data_start = reserved_sectors + 2 * fat_sectors;
+  // whole 512KiB units so the CSD capacity is exact
+  blocks = (partition_start + data_start + cluster_count * sectors_per_cluster + 1023) / 1024 * 1024;
+
+  uint32_t files = 0;
+  uint64_t bytes = 0;
+  for (auto& node : nodes) {
+    if (node.directory) continue;
+    files++;
+    bytes += node.size;
+  }
+  file_count = files;
+  directory_count = nodes.size() - files;
+  file_bytes = bytes;
+  return true;
+}
+
+void VirtualFatVolume::close() {
+  #ifndef _WIN32
+    if (open_fd >= 0) ::close(open_fd);
+    open_fd = -1;
+  #else
+    if (open_fp != nullptr) fclose(open_fp);
+    open_fp = nullptr;
+  #endif
+  open_node = -1;
+  nodes.clear();
+  runs.clear();
+  overlay.clear();
+  overlay_size = 0;
+  next_cluster = 2;
+  cluster_count = fat_sectors = data_start = blocks = 0;
+}
+
+int32_t VirtualFatVolume::scan(const std::string& path, const int32_t parent) {
+  const int32_t index = nodes.size();
+  nodes.emplace_back();
+  nodes[index].path = path;
+  nodes[index].directory = true;
+  nodes[index].parent = parent;
+  struct stat info;
+  if (stat(path.c_str(), &info) == 0) dos_time(info.st_mtime, nodes[index].date, nodes[index].time);
+
+  // sorted so the layout, and the short name tails, are the same every time
+  std::vector<std::filesystem::directory_entry> listing;
+  std::error_code error;
+  for (auto& entry : std::filesystem::directory_iterator(path, error)) listing.push_back(entry);
+  std::sort(listing.begin(), listing.end(), [](auto& a, auto& b){ return a.path().filename() < b.path().filename(); });
+
+  for (auto& entry : listing) {
+    const std::string name = entry.path().filename().string();
+    if (name.empty() || name[0] == '.') continue;
+    int32_t child = -1;
+    if (entry.is_directory(error)) {
+      child = scan(entry.path().string(), index);
+    }
+    else if (entry.is_regular_file(error)) {
+      const uint64_t size = entry.file_size(error);
+      if (error || size > UINT32_MAX) {
+        fprintf(stderr, "VirtualFatVolume::scan: skipping %s, FAT32 files are under 4GiB\n", entry.path().string().c_str());
+        continue;
+      }
+      child = nodes.size();
+      nodes.emplace_back();
+      nodes[child].path = entry.path().string();
+      nodes[child].size = size;
+      nodes[child].parent = index;
+      if (stat(nodes[child].path.c_str(), &info) == 0) dos_time(info.st_mtime, nodes[child].date, nodes[child].time);
+    }
+    else continue;
+    nodes[child].long_name = utf16(name);
+    if (nodes[child].long_name.size() > 255) {
+      fprintf(stderr, "VirtualFatVolume::scan: %s is over 255 characters, shortened\n", name.c_str());
+      nodes[child].long_name.resize(255);
+    }
+    nodes[index].children.push_back(child);
+  }
+  assign_short_names(nodes[index]);
+  return index;
+}
+
+// Windows style: upper case, invalid characters as '_', a ~N tail when anything was lost or the name is taken.
+// The long name is kept only when the short one differs from it.
+void VirtualFatVolume::assign_short_names(Node& directory) {
+  std::set<std::string> taken;
+  for (auto child : directory.children) {
+    Node& node = nodes[child];
+    std::string name;
+    for (auto c : node.long_name) name.push_back(c < 0x80 ? char(c) : '\x80');
+    const std::size_t dot = name.rfind('.');
+    const bool has_extension = dot != std::string::npos && dot > 0;
+    bool lossy = false;
+    auto convert = [&](const std::string& part, const std::size_t limit) {
+      std::string result;
+      for (char c : part) {
+        if (c == ' ' || c == '.') {
+          lossy = true;
+          continue;
+        }
+        if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+        else if (!((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("$%'-_@~`!(){}^#&", c))) {
+          c = '_';
+          lossy = true;
+        }
+        result.push_back(c);
+      }
+      if (result.size() > limit) {
+        result.resize(limit);
+        lossy = true;
+      }
+      return result;
+    };
+    std::string base = convert(has_extension ? name.substr(0, dot) : name, 8);
+    const std::string extension = has_extension ? convert(name.substr(dot + 1), 3) : "";
+    if (base.empty()) {
+      base = "_";
+      lossy = true;
+    }
+
+    auto padded = [&](const std::string& stem) {
+      std::string result = stem;
+      result.resize(8, ' ');
+      result += extension;
+      result.resize(11, ' ');
+      return result;
+    };
+    std::string short_name = padded(base);
+    for (uint32_t n = 1; lossy || taken.count(short_name); n++) {
+      const std::string tail = "~" + std::to_string(n);
+      short_name = padded(base.substr(0, 8 - tail.size()) + tail);
+      lossy = false;
+    }
+    taken.insert(short_name);
+    memcpy(node.short_name, short_name.data(), 11);
+
+    std::string plain = short_name.substr(0, short_name.find_last_not_of(' ', 7) + 1);
+    if (extension.size()) plain += "." + extension;
+    if (plain == name) node.long_name.clear();
+  }
+}
+
+void VirtualFatVolume::allocate(const int32_t index) {
+  Node& node = nodes[index];
+  uint64_t bytes = node.size;
+  if (node.directory) {
+    uint32_t entries = node.parent >= 0 ? 2 : 0;
+    for (auto child : node.children) entries += long_name_entries(nodes[child].long_name) + 1;
+    bytes = std::max<uint64_t>(uint64_t(entries) * 32, 1);
+  }
+  node.clusters = (bytes + cluster_size - 1) / cluster_size;
+  if (node.clusters == 0) return;
+  node.first_cluster = next_cluster;
+  next_cluster += node.clusters;
+  runs.emplace_back(node.first_cluster, index);
+}
+
+void VirtualFatVolume::build_entries(Node& directory) {
+  auto& entries = directory.entries;
+  uint8_t entry[32];
+  auto append = [&]() { entries.insert(entries.end(), entry, entry + sizeof(entry)); };
+
+  if (directory.parent >= 0) {
+    const Node& parent = nodes[directory.parent];
+    uint8_t name[11];
+    memset(name, ' ', sizeof(name));
+    name[0] = '.';
+    memset(entry, 0, sizeof(entry));
+    directory_entry(entry, name, attribute_directory, directory.first_cluster, 0, directory.date, directory.time);
+    append();
+    name[1] = '.';
+    memset(entry, 0, sizeof(entry));
+    directory_entry(entry, name, attribute_directory, parent.parent >= 0 ? parent.first_cluster : 0, 0, parent.date, parent.time);
+    append();
+  }
+
+  for (auto child : directory.children) {
+    const Node& node = nodes[child];
+    const uint32_t count = long_name_entries(node.long_name);
+    const uint8_t checksum = short_name_checksum(node.short_name);
+    for (uint32_t order = count; order > 0; order--) {
+      memset(entry, 0, sizeof(entry));
+      entry[0] = order | (order == count ? 0x40 : 0);
+      entry[11] = attribute_long_name;
+      entry[13] = checksum;
+      for (uint32_t i = 0; i < 13; i++) {
+        const std::size_t position = (order - 1) * 13 + i;
+        const uint16_t c = position < node.long_name.size() ? node.long_name[position] : position == node.long_name.size() ? 0x0000 : 0xFFFF;
+        put16(entry + long_name_offsets[i], c);
+      }
+      append();
+    }
+    memset(entry, 0, sizeof(entry));
+    directory_entry(entry, node.short_name, node.directory ? attribute_directory : attribute_archive, node.first_cluster, node.directory ? 0 : node.size, node.date, node.time);
+    append();
+  }
+}
+
+int32_t VirtualFatVolume::owner(const uint32_t cluster) const {
+  auto run = std::upper_bound(runs.begin(), runs.end(), std::make_pair(cluster, INT32_MAX));
+  if (run == runs.begin()) return -1;
+  --run;
+  const Node& node = nodes[run->second];
+  return cluster < node.first_cluster + node.clusters ? run->second : -1;
+}
+
+uint32_t VirtualFatVolume::fat_entry(const uint32_t cluster) const {
+  if (cluster == 0) return 0x0FFFFFF8;
+  if (cluster == 1) return end_of_chain;
+  const int32_t node = owner(cluster);
+  if (node < 0) return 0;
+  return cluster == nodes[node].first_cluster + nodes[node].clusters - 1 ? end_of_chain : cluster + 1;
+}
+
+void VirtualFatVolume::boot_sector(uint8_t* into) const {
+  const uint8_t jump[] = {0xEB, 0x58, 0x90};
+  memcpy(into, jump, sizeof(jump));
+  memcpy(into + 3, "MARLNSIM", 8);
+  put16(into + 11, block_size);
+  into[13] = sectors_per_cluster;
+  put16(into + 14, reserved_sectors);
+  into[16] = 2;    // FATs
+  into[21] = 0xF8; // fixed disk
+  put16(into + 24, 63);
+  put16(into + 26, 255);
+  put32(into + 28, partition_start);
+  put32(into + 32, data_start + cluster_count * sectors_per_cluster);
+  put32(into + 36, fat_sectors);
+  put32(into + 44, 2); // root directory cluster
+  put16(into + 48, 1); // FSInfo
+  put16(into + 50, 6); // backup boot sector
+  into[64] = 0x80;
+  into[66] = 0x29;
+  put32(into + 67, volume_id);
+  memcpy(into + 71, "MARLIN SIM FAT32   ", 19);
+  into[510] = 0x55;
+  into[511] = 0xAA;
+}
+
+void VirtualFatVolume::read(const uint32_t block, uint8_t* into) {
+  auto written = overlay.find(block);
+  if (written != overlay.end()) {
+    memcpy(into, written->second.data(), block_size);
+    return;
+  }
+  memset(into, 0, block_size);
+
+  if (block < partition_start) {
+    if (block != 0) return;
+    // MBR, one FAT32 LBA partition
+    const uint8_t partition[] = {0x00, 0xFE, 0xFF, 0xFF, 0x0C, 0xFE, 0xFF, 0xFF};
+    memcpy(into + 446, partition, sizeof(partition));
+    put32(into + 454, partition_start);
+    put32(into + 458, data_start + cluster_count * sectors_per_cluster);
+    into[510] = 0x55;
+    into[511] = 0xAA;
+    return;
+  }
+
+  const uint32_t sector = block - partition_start;
+  if (sector < reserved_sectors) {
+    if (sector == 0 || sector == 6) boot_sector(into);
+    else if (sector == 1 || sector == 7) {
+      // free count and next free left unknown, Marlin's writes would make them stale
+      put32(into, 0x41615252);
+      put32(into + 484, 0x61417272);
+      put32(into + 488, 0xFFFFFFFF);
+      put32(into + 492, 0xFFFFFFFF);
+      into[510] = 0x55;
+      into[511] = 0xAA;
+    }
+    return;
+  }
+
+  if (sector < data_start) {
+    const uint32_t first = (sector - reserved_sectors) % fat_sectors * (block_size / 4);
+    for (uint32_t i = 0; i < block_size / 4; i++) put32(into + i * 4, fat_entry(first + i));
+    return;
+  }
+
+  const uint32_t cluster = 2 + (sector - data_start) / sectors_per_cluster;
+  const int32_t index = owner(cluster);
+  if (index < 0) return;
+  Node& node = nodes[index];
+  const uint64_t offset = uint64_t(cluster - node.first_cluster) * cluster_size + (sector - data_start) % sectors_per_cluster * block_size;
+  if (!node.directory) {
+    read_file(index, offset, into);
+    return;
+  }
+  if (node.entries.empty()) build_entries(node);
+  if (offset < node.entries.size()) memcpy(into, node.entries.data() + offset, std::min<uint64_t>(block_size, node.entries.size() - offset));
+}
+
+void VirtualFatVolume::read_file(const int32_t index, const uint64_t offset, uint8_t* into) {
+  const Node& node = nodes[index];
+  if (offset >= node.size) return;
+  const std::size_t length = std::min<uint64_t>(block_size, node.size - offset);
+  bool result = false;
+  #ifndef _WIN32
+    if (open_node != index) {
+      if (open_fd >= 0) ::close(open_fd);
+      open_fd = ::open(node.path.c_str(), O_RDONLY);
+      open_node = index;
+    }
+    result = open_fd >= 0 && pread(open_fd, into, length, offset) >= 0;
+  #else
+    if (open_node != index) {
+      if (open_fp != nullptr) fclose(open_fp);
+      open_fp = fopen(node.path.c_str(), "rb");
+      open_node = index;
+    }
+    result = open_fp != nullptr && _fseeki64(open_fp, offset, SEEK_SET) == 0 && fread(into, 1, length, open_fp) > 0;
+  #endif
+  if (!result) {
+    fprintf(stderr, "VirtualFatVolume::read_file: unable to read %s\n", node.path.c_str());
+    return;
+  }
+  host_reads++;
+  host_bytes += length;
+}
+
+void VirtualFatVolume::write(const uint32_t block, const uint8_t* from) {
+  if (block >= blocks) return;
+  memcpy(overlay[block].data(), from, block_size);
+  overlay_size = overlay.size();
+}
+
+VirtualFatVolume::Stats VirtualFatVolume::stats() const {
+  Stats current;
+  current.files = file_count;
+  current.directories = directory_count;
+  current.file_bytes = file_bytes;
+  current.host_reads = host_reads;
+  current.host_bytes = host_bytes;
+  current.overlay_blocks = overlay_size;
+  return current;
+}
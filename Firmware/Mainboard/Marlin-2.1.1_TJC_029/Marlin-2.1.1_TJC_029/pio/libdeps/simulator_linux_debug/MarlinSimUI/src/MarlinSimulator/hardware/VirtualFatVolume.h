@@ -0,0 +1,91 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * A FAT32 view of a host directory, for the SD card without an image. Opening only walks the directory and
+ * lays the files out as contiguous cluster runs after their directories, every sector is made up when it is
+ * read: the MBR, boot sector and FSInfo from the layout, FAT sectors from the runs, directory sectors from the
+ * entries (built on first read, with long names), file sectors read from the host file at their offset.
+ *
+ * Nothing is written back to the host: sectors Marlin writes (power loss recovery, M28 uploads and the FAT and
+ * directory updates that go with them) are kept in an overlay that reads come from first, until the volume is
+ * opened again. Files added to the directory show up on the next open.
+ */
+class VirtualFatVolume {
+public:
+  static constexpr uint32_t block_size = 512;
+  static constexpr uint32_t partition_start = 2048;
+  static constexpr uint32_t reserved_sectors = 32;
+  static constexpr uint32_t sectors_per_cluster = 64;              // 32KiB clusters
+  static constexpr uint32_t cluster_size = sectors_per_cluster * block_size;
+  static constexpr uint32_t free_clusters = 65536;                 // 2GiB for Marlin's writes, keeps it FAT32
+  typedef std::array<uint8_t, block_size> block_data;
+
+  struct Stats {
+    uint32_t files = 0, directories = 0;
+    uint64_t file_bytes = 0, host_reads = 0, host_bytes = 0;
+    std::size_t overlay_blocks = 0;
+  };
+
+  ~VirtualFatVolume() { close(); }
+
+  bool open(const std::string& directory);
+  void close();
+  bool is_open() const { return !nodes.empty(); }
+  const std::string& directory() const { return root_path; }
+  uint32_t block_count() const { return blocks; }
+  // Marlin has written to the volume, opening it again would drop that
+  bool written() const { return !overlay.empty(); }
+
+  void read(const uint32_t block, uint8_t* into);
+  void write(const uint32_t block, const uint8_t* from);
+  Stats stats() const;
+
+private:
+  struct Node {
+    std::string path;
+    bool directory = false;
+    uint64_t size = 0;
+    uint32_t first_cluster = 0, clusters = 0;
+    uint16_t date = 0, time = 0;
+    uint8_t short_name[11];
+    std::u16string long_name; // empty when the short name says it all
+    int32_t parent = -1;
+    std::vector<int32_t> children;
+    std::vector<uint8_t> entries; // directories, built on first read
+  };
+
+  int32_t scan(const std::string& path, const int32_t parent);
+  void assign_short_names(Node& directory);
+  void build_entries(Node& directory);
+  void allocate(const int32_t node);
+  // the node whose cluster run holds cluster, -1 when it is free
+  int32_t owner(const uint32_t cluster) const;
+  uint32_t fat_entry(const uint32_t cluster) const;
+  void boot_sector(uint8_t* into) const;
+  void read_file(const int32_t file, const uint64_t offset, uint8_t* into);
+
+  std::string root_path;
+  std::vector<Node> nodes; // the root directory first
+  std::vector<std::pair<uint32_t, int32_t>> runs; // (first cluster, node), in cluster order
+  uint32_t next_cluster = 2, cluster_count = 0, fat_sectors = 0, data_start = 0, blocks = 0;
+  std::unordered_map<uint32_t, block_data> overlay;
+  // the last file read from stays open, Marlin reads one at a time
+  int32_t open_node = -1;
+  #ifndef _WIN32
+    int open_fd = -1;
+  #else
+    FILE* open_fp = nullptr;
+  #endif
+  // read by the UI
+  std::atomic_uint32_t file_count{0}, directory_count{0};
+  std::atomic_uint64_t file_bytes{0}, host_reads{0}, host_bytes{0};
+  std::atomic_size_t overlay_size{0};
+};
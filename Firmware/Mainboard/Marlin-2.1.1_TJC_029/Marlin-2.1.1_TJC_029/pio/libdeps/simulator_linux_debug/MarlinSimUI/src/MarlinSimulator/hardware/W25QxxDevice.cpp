@@ -1,6 +1,79 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
 #include "W25QxxDevice.h"
+#include "../options.h"
+#include "../snapshot.h"
 #include "src/libs/W25Qxx.h"
 
+W25QxxDevice::W25QxxDevice(SpiBus& spi_bus, pin_type cs, size_t flash_size) : SPISlavePeripheral(spi_bus, cs), flash_size(flash_size), sector_erases(flash_size / sector_size) {
+  if (!map_image()) fprintf(stderr, "W25QxxDevice: unable to open %s, the flash reads erased\n", SPI_FLASH_IMAGE);
+  // the busy time only passes while Marlin polls, over a clocked bus
+  if (simulator_options.flash_timing) spi_bus.timed = true;
+}
+
+W25QxxDevice::~W25QxxDevice() {
+  unmap_image();
+}
+
+// a new image is created erased, a shorter one is extended with erased bytes
+bool W25QxxDevice::map_image() {
+  #ifndef _WIN32
+    int fd = open(SPI_FLASH_IMAGE, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t(info.st_size) < flash_size && ftruncate(fd, flash_size) != 0)) {
+      close(fd);
+      return false;
+    }
+    void* map = mmap(nullptr, flash_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (map == MAP_FAILED) return false;
+    data = (uint8_t*)map;
+    if (size_t(info.st_size) < flash_size) memset(data + info.st_size, 0xFF, flash_size - info.st_size);
+  #else
+    image_copy.assign(flash_size, 0xFF);
+    data = image_copy.data();
+    fp = fopen(SPI_FLASH_IMAGE, "rb+");
+    if (fp == nullptr) {
+      fp = fopen(SPI_FLASH_IMAGE, "wb+");
+      if (fp == nullptr) return false;
+      fwrite(data, 1, flash_size, fp);
+    } else fread(data, 1, flash_size, fp);
+  #endif
+  return true;
+}
+
+void W25QxxDevice::unmap_image() {
+  #ifndef _WIN32
+    if (data != nullptr) munmap(data, flash_size);
+  #else
+    if (fp != nullptr) fclose(fp);
+    fp = nullptr;
+    image_copy = std::vector<uint8_t>();
+  #endif
+  data = nullptr;
+}
+
+void W25QxxDevice::persist(const uint32_t address, const uint32_t length) {
+  #ifdef _WIN32
+    if (fp == nullptr) return;
+    fseek(fp, address, SEEK_SET);
+    fwrite(data + address, 1, length, fp);
+  #else
+    UNUSED(address);
+    UNUSED(length);
+  #endif
+}
+
 void W25QxxDevice::onByteReceived(uint8_t _byte) {
   SPISlavePeripheral::onByteReceived(_byte);
   if (getCurrentToken() != 0xFF) return;
@@ -12,11 +85,14 @@ void W25QxxDevice::onByteReceived(uint8_t _byte) {
     case W25X_BlockErase:
       setRequestedDataSize(_byte, 3);
       break;
+    case W25X_ChipErase:
+      erase(0, flash_size, chip_erase_nanos);
+      break;
     case W25X_WriteEnable:
       break;
     case W25X_ReadStatusReg:
-      fflush(fp);
-      setResponse(0);
+      // the status repeats until CS goes high
+      status_polling = true;
       break;
     default:
       break;
@@ -25,38 +101,37 @@ void W25QxxDevice::onByteReceived(uint8_t _byte) {
 
 void W25QxxDevice::onRequestedDataReceived(uint8_t token, uint8_t* _data, size_t count) {
   SPISlavePeripheral::onRequestedDataReceived(token, _data, count);
+  if (data == nullptr) return;
   switch (token) {
     case W25X_ReadData:
-      currentAddress = (_data[0] << 16) | (_data[1] << 8) | _data[2];
+      currentAddress = ((_data[0] << 16) | (_data[1] << 8) | _data[2]) % flash_size;
       setResponse(data + currentAddress, flash_size - currentAddress);
+      reading = true;
+      reads++;
       currentAddress = -1;
       break;
     case W25X_PageProgram:
       // receivind data to write!
       if (currentAddress > -1) {
-        memcpy(data + currentAddress, _data, count);
-        fwrite(_data, 1, count, fp);
+        // programming clears bits, past the end of the page it wraps to its start
+        const uint32_t page = currentAddress & ~(SPI_FLASH_PerWritePageSize - 1);
+        for (size_t i = 0; i < count; i++) data[page + (currentAddress + i) % SPI_FLASH_PerWritePageSize] &= _data[i];
+        persist(page, SPI_FLASH_PerWritePageSize);
+        programs++;
+        programmed_bytes += count;
+        if (simulator_options.flash_timing) busy_until = Kernel::SimulationRuntime::nanos() + page_program_nanos;
         currentAddress = -1;
       }
       else {
-        currentAddress = (_data[0] << 16) | (_data[1] << 8) | _data[2];
-        fseek(fp, currentAddress, SEEK_SET);
+        currentAddress = ((_data[0] << 16) | (_data[1] << 8) | _data[2]) % flash_size;
         setRequestedDataSize(W25X_PageProgram, SPI_FLASH_PerWritePageSize);
       }
       break;
     case W25X_SectorErase:
-      currentAddress = (_data[0] << 16) | (_data[1] << 8) | _data[2];
-      memset(data + currentAddress, 0xFF, SPI_FLASH_SectorSize);
-      fseek(fp, currentAddress, SEEK_SET);
-      fwrite(data + currentAddress, 1, SPI_FLASH_SectorSize, fp);
-      currentAddress = -1;
+      erase(((_data[0] << 16) | (_data[1] << 8) | _data[2]) % flash_size, sector_size, sector_erase_nanos);
       break;
     case W25X_BlockErase:
-      currentAddress = (_data[0] << 16) | (_data[1] << 8) | _data[2];
-      memset(data + currentAddress, 0xFF, 65536); //64kb
-      fseek(fp, currentAddress, SEEK_SET);
-      fwrite(data + currentAddress, 1, 65536, fp);
-      currentAddress = -1;
+      erase(((_data[0] << 16) | (_data[1] << 8) | _data[2]) % flash_size, block_size, block_erase_nanos);
       break;
     default:
       break;
@@ -66,4 +141,88 @@ void W25QxxDevice::onRequestedDataReceived(uint8_t token, uint8_t* _data, size_t
 
 void W25QxxDevice::onEndTransaction() {
   SPISlavePeripheral::onEndTransaction();
+  reading = status_polling = false;
+}
+
+void W25QxxDevice::onBytesSent(uint8_t* into, size_t count) {
+  if (status_polling) {
+    memset(into, status(), count);
+    return;
+  }
+  if (reading) read_bytes += count;
+  SPISlavePeripheral::onBytesSent(into, count);
+}
+
+void W25QxxDevice::erase(const uint32_t address, const uint32_t length, const uint64_t nanos) {
+  if (data == nullptr) return;
+  const uint32_t start = address & ~(length - 1);
+  memset(data + start, 0xFF, length);
+  persist(start, length);
+  for (uint32_t sector = start / sector_size; sector < (start + length) / sector_size; sector++) sector_erases[sector]++;
+  erased_bytes += length;
+  if (simulator_options.flash_timing) busy_until = Kernel::SimulationRuntime::nanos() + nanos;
+}
+
+uint8_t W25QxxDevice::status() {
+  return Kernel::SimulationRuntime::nanos() < busy_until ? 0x01 : 0; // WIP, write in progress
+}
+
+W25QxxDevice::Stats W25QxxDevice::stats() {
+  Stats current;
+  current.reads = reads;
+  current.read_bytes = read_bytes;
+  current.programs = programs;
+  current.programmed_bytes = programmed_bytes;
+  current.erased_bytes = erased_bytes;
+  for (uint32_t sector = 0; sector < sector_erases.size(); sector++) {
+    if (sector_erases[sector] > current.max_erases) {
+      current.max_erases = sector_erases[sector];
+      current.worn_sector = sector;
+    }
+  }
+  return current;
+}
+
+std::vector<std::pair<uint32_t, uint32_t>> W25QxxDevice::worn_sectors(const std::size_t count) {
+  std::vector<std::pair<uint32_t, uint32_t>> sectors;
+  for (uint32_t sector = 0; sector < sector_erases.size(); sector++) {
+    if (sector_erases[sector]) sectors.emplace_back(sector, sector_erases[sector]);
+  }
+  const std::size_t shown = std::min(count, sectors.size());
+  std::partial_sort(sectors.begin(), sectors.begin() + shown, sectors.end(), [](auto& a, auto& b){ return a.second > b.second; });
+  sectors.resize(shown);
+  return sectors;
+}
+
+void W25QxxDevice::reset_stats() {
+  reads = read_bytes = programs = programmed_bytes = erased_bytes = 0;
+  for (auto& erases : sector_erases) erases = 0;
+}
+
+void W25QxxDevice::ui_widget() {
+  auto current = stats();
+  ImGui::Text("Read: %" PRIu64 " commands, %.1f KiB", current.reads, current.read_bytes / 1024.0);
+  ImGui::Text("Programmed: %" PRIu64 " pages, %.1f KiB", current.programs, current.programmed_bytes / 1024.0);
+  ImGui::Text("Erased: %.1f KiB", current.erased_bytes / 1024.0);
+  // bytes the chip erased for every byte the firmware programmed
+  if (current.programmed_bytes) ImGui::Text("Write amplification: %.2f", double(current.erased_bytes) / current.programmed_bytes);
+  ImGui::Text("Most erased sector: %u (0x%06X), %u erases", current.worn_sector, current.worn_sector * sector_size, current.max_erases);
+  for (auto& sector : worn_sectors(5)) {
+    ImGui::Text("  sector %u (0x%06X): %u erases", sector.first, sector.first * sector_size, sector.second);
+  }
+  if (ImGui::Button("Reset Counters")) reset_stats();
+}
+
+// the whole array is saved, erased (0xFF) and unchanged regions compress away
+void W25QxxDevice::save_state(SnapshotWriter& writer) {
+  if (data == nullptr) return;
+  writer.write<uint64_t>(flash_size);
+  writer.write_bytes(data, flash_size);
+}
+
+void W25QxxDevice::restore_state(SnapshotReader& reader) {
+  uint64_t size = 0;
+  if (data == nullptr || !reader.read(size) || size != flash_size) return;
+  if (!reader.read_bytes(data, flash_size)) return;
+  persist(0, flash_size);
 }
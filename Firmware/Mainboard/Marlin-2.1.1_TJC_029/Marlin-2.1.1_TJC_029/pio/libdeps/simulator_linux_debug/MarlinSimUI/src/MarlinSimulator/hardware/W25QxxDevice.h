@@ -1,11 +1,22 @@
 #pragma once
 
+#include <atomic>
+#include <vector>
+
 #include "../user_interface.h"
 
 #include "SPISlavePeripheral.h"
 
 /**
  * SPI Flash W25Qxx device
+ *
+ * The image is mapped shared (read whole on Windows): reads are answered from the mapping in place, programs and
+ * erases change it directly and are left to the OS to write back. A page program only clears bits, as the chip's.
+ * With --flash-timing a program or erase keeps WIP set in the status register for the datasheet's typical time,
+ * Marlin's busy polling then takes that long in simulated time.
+ *
+ * Erases are counted per 4KiB sector, with the bytes read, programmed and erased, to show the wear and the
+ * traffic (the TFT assets) the firmware causes.
  **/
  #define SPI_FLASH_IMAGE "./spi_flash.bin"
  #ifndef SPI_FLASH_IMAGE
@@ -14,30 +25,49 @@
 
 class W25QxxDevice: public SPISlavePeripheral {
 public:
-  W25QxxDevice(SpiBus& spi_bus, pin_type cs, size_t flash_size) : SPISlavePeripheral(spi_bus, cs), flash_size(flash_size) {
-    // read current data
-    data = new uint8_t[flash_size];
-    memset(data, 0xFF, flash_size);
-
-    fp = fopen(SPI_FLASH_IMAGE, "rb");
-    if (fp == nullptr) {
-      fp = fopen(SPI_FLASH_IMAGE, "wb+");
-      assert(fp);
-      fwrite(data, 1, flash_size, fp);
-    } else fread(data, 1, flash_size, fp);
-  }
-  virtual ~W25QxxDevice() {
-    fclose(fp);
-    delete[] data;
-  };
+  W25QxxDevice(SpiBus& spi_bus, pin_type cs, size_t flash_size);
+  virtual ~W25QxxDevice();
 
   size_t flash_size;
 
   void onByteReceived(uint8_t _byte) override;
   void onEndTransaction() override;
   void onRequestedDataReceived(uint8_t token, uint8_t* _data, size_t count) override;
+  void onBytesSent(uint8_t* into, size_t count) override;
+  void save_state(SnapshotWriter& writer) override;
+  void restore_state(SnapshotReader& reader) override;
+  void ui_widget() override;
+
+  static constexpr uint32_t sector_size = 4096, block_size = 65536;
+  // W25Q128JV typical program and erase times
+  static constexpr uint64_t page_program_nanos = 400'000, sector_erase_nanos = 45'000'000, block_erase_nanos = 150'000'000, chip_erase_nanos = 40'000'000'000;
+
+  struct Stats {
+    uint64_t reads = 0, read_bytes = 0, programs = 0, programmed_bytes = 0, erased_bytes = 0;
+    uint32_t worn_sector = 0, max_erases = 0;
+  };
+  Stats stats();
+  // the sectors erased most, most first
+  std::vector<std::pair<uint32_t, uint32_t>> worn_sectors(const std::size_t count);
+  void reset_stats();
+
+  bool map_image();
+  void unmap_image();
+  void erase(const uint32_t address, const uint32_t length, const uint64_t nanos);
+  uint8_t status();
 
-  FILE *fp = nullptr;
-  uint8_t *data;
+  void persist(const uint32_t address, const uint32_t length);
+
+  uint8_t *data = nullptr;
+  #ifdef _WIN32
+    FILE *fp = nullptr;
+    std::vector<uint8_t> image_copy;
+  #endif
   int32_t currentAddress = -1;
+  bool reading = false, status_polling = false;
+  uint64_t busy_until = 0;
+
+  // read by the UI
+  std::atomic_uint64_t reads{0}, read_bytes{0}, programs{0}, programmed_bytes{0}, erased_bytes{0};
+  std::vector<std::atomic_uint32_t> sector_erases;
 };
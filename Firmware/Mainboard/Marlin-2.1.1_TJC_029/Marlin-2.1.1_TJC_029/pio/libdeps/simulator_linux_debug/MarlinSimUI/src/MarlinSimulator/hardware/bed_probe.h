@@ -6,26 +6,28 @@
 
 class BedProbe : public VirtualPrinter::Component {
 public:
-  BedProbe(pin_type probe, glm::vec3 offset, glm::vec4& position, PrintBed& bed) : VirtualPrinter::Component("BedProbe"), probe_pin(probe), offset(offset), position(position), bed(bed) {
-    Gpio::attach(probe, [this](GpioEvent& event){ this->interrupt(event); });
+  BedProbe(pin_type probe, glm::vec3 offset, std::function<glm::vec4()> position, std::function<glm::vec4()> ui_position, PrintBed& bed) : VirtualPrinter::Component("BedProbe"), probe_pin(probe), offset(offset), position(position), ui_position(ui_position), bed(bed) {
+    Gpio::attach(probe, GpioEvent::GET_VALUE_MASK, this);
   }
 
   void interrupt(GpioEvent& event) {
-    Gpio::set_pin_value(event.pin_id, triggered());
+    Gpio::set_pin_value(event.pin_id, triggered(position()));
   }
 
   void ui_widget() {
-    auto has_triggered = triggered();
+    auto position = ui_position();
+    auto has_triggered = triggered(position);
     ImGui::Checkbox("Triggered State", &has_triggered);
     ImGui::Text("Nozel Distance Above Bed: %f", position.z - bed.calculate_z({position.x + offset.x, position.y + offset.y}));
   }
 
-  bool triggered() {
+  bool triggered(const glm::vec4& position) {
     return position.z <= bed.calculate_z({position.x + offset.x, position.y + offset.y}) - offset.z;
   }
 
   pin_type probe_pin;
   glm::vec3 offset;
-  glm::vec4& position;
+  // nozzle position, pulled when the pin is read, and the copy the UI may read
+  std::function<glm::vec4()> position, ui_position;
   PrintBed& bed;
 };
@@ -1,16 +1,36 @@
 #pragma once
 
 #include <cstdint>
+#include <cstddef>
 #include <vector>
-#include <functional>
 
 #include "../Gpio.h"
 
+// one burst from the master, the source is read in place: 16 bit words are in host order and go out msb first,
+// without source_increment the first word is repeated for the whole length
 struct SpiEvent {
-  uint8_t *write_from, *read_into;
-  size_t length;
+  const uint8_t *write_from;
+  uint8_t *read_into;
+  size_t length; // in bytes
   bool source_increment = true;
   uint8_t source_format = 1;
+
+  // the source can be handed on as is
+  bool contiguous() const { return source_format == 1 && source_increment; }
+
+  uint8_t byte(const size_t i) const {
+    const size_t word = source_increment ? i / source_format : 0;
+    if (source_format == 1) return write_from[word];
+    const uint16_t value = reinterpret_cast<const uint16_t*>(write_from)[word];
+    return (i & 1) ? value & 0xFF : value >> 8;
+  }
+};
+
+// plain function and context so dispatch never copies or allocates
+struct SpiSubscriber {
+  typedef void (*callback_t)(void* context, SpiEvent& event);
+  callback_t callback;
+  void* context;
 };
 
 class SpiBus {
@@ -21,68 +41,59 @@ public:
 
   void write(uint8_t value) {
     auto evt = SpiEvent{&value, nullptr, 1};
-    for (auto callback : callbacks) callback(evt);
+    dispatch(evt);
   }
 
   uint8_t read() {
     uint8_t value;
     auto evt = SpiEvent{nullptr, &value, 1};
-    for (auto callback : callbacks) callback(evt);
+    dispatch(evt);
     return value;
   }
 
   uint8_t transfer(uint8_t write_value) {
     uint8_t read_value = 0xFF;
     auto evt = SpiEvent{&write_value, &read_value, 1};
-    for (auto callback : callbacks) callback(evt);
+    dispatch(evt);
     return read_value;
   }
 
+  // the whole buffer as one event, length is in DataType words
   template<typename DataType>
-  void transfer(DataType* write_from, DataType* read_into, size_t length, bool source_increment = true) {
-    uint8_t* data = nullptr;
-
-    // uint16_t Endian swap hack
-    if (sizeof(DataType) == 2) {
-      if (source_increment) {
-        data = new uint8_t[sizeof(DataType) * length];
-        for (size_t i = 0; i < length; i ++) {
-          data[(i * 2)] = (write_from[i] >> 8) & 0xFF;
-          data[(i * 2) + 1] = (write_from[i] & 0xFF);
-        }
-      } else {
-        data = new uint8_t[sizeof(DataType)];
-        data[0] = (write_from[0] >> 8) & 0xFF;
-        data[1] = (write_from[0] & 0xFF);
-      }
-    } else {
-      data = (uint8_t*)write_from;
-    }
-
-    auto evt = SpiEvent{data, (uint8_t*)read_into, sizeof(DataType) * length, source_increment, sizeof(DataType)};
-    for (auto callback : callbacks) callback(evt);
-
-    if ((void*)data != (void*)write_from) delete data;
+  void transfer(const DataType* write_from, DataType* read_into, size_t length, bool source_increment = true) {
+    static_assert(sizeof(DataType) <= 2, "SpiBus::transfer: 8 or 16 bit words only");
+    auto evt = SpiEvent{(const uint8_t*)write_from, (uint8_t*)read_into, sizeof(DataType) * length, source_increment, sizeof(DataType)};
+    dispatch(evt);
   }
 
-  template<class... Args>
-  void attach(Args... args) {
-    callbacks.push_back(std::function<void(SpiEvent&)>(args...));
+  void attach(SpiSubscriber::callback_t callback, void* context) {
+    subscribers.push_back(SpiSubscriber{callback, context});
   }
 
+  // the host's SCK rate, and whether a device on the bus wants transfers to take that long
+  uint32_t clock = 20000000; // until the host sets it
+  bool timed = false;
+
   void acquire() { if(busy == true) printf("spi bus contention!\n"); busy = true; }
   void release() { busy = false; }
   bool is_busy() { return busy; }
 
 private:
-  std::vector<std::function<void(SpiEvent&)>> callbacks;
+  void dispatch(SpiEvent& evt) {
+    for (auto& subscriber : subscribers) subscriber.callback(subscriber.context, evt);
+  }
+
+  std::vector<SpiSubscriber> subscribers;
   bool busy = false;
 };
 
-extern SpiBus SpiBus0;
-extern SpiBus SpiBus1;
-extern SpiBus SpiBus2;
-extern SpiBus SpiBus3;
+// The buses of the simulated printer
+struct SpiBuses {
+  SpiBus bus[4];
+
+  inline static SpiBuses& active() { return main_buses; }
+  static SpiBuses main_buses;
+};
 
 template <pin_type CLK, pin_type MOSI, pin_type MISO>
 SpiBus& spi_bus_by_pins();
@@ -0,0 +1,138 @@
+#include <thread>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "execution_control.h"
+#include "headless.h"
+
+static std::string json_escape(const std::string& text) {
+  std::string escaped;
+  for (char c : text) {
+    if (c == '"' || c == '\\') escaped.push_back('\\');
+    if ((unsigned char)c < 0x20) continue;
+    escaped.push_back(c);
+  }
+  return escaped;
+}
+
+HeadlessRunner::HeadlessRunner(const SimulatorOptions& options) : options(options) {
+  if (options.gcode_file.size()) {
+    gcode.open(options.gcode_file);
+    if (!gcode.is_open()) {
+      fprintf(stderr, "HeadlessRunner: unable to open %s\n", options.gcode_file.c_str());
+      status = Status::NO_INPUT;
+    }
+  } else input_finished = final_sync_sent = true; // nothing to print, options require a timeout then
+}
+
+const char* HeadlessRunner::status_name(Status status) {
+  switch (status) {
+    case Status::RUNNING:    return "running";
+    case Status::COMPLETE:   return "complete";
+    case Status::TIMEOUT:    return "timeout";
+    case Status::KILLED:     return "killed";
+    case Status::TERMINATED: return "terminated";
+    case Status::NO_INPUT:   return "no_input";
+  }
+  return "unknown";
+}
+
+// next non empty command with comments and surrounding whitespace removed
+bool HeadlessRunner::next_command(std::string& command) {
+  std::string line;
+  while (std::getline(gcode, line)) {
+    auto comment = line.find(';');
+    if (comment != std::string::npos) line.erase(comment);
+    auto first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos) continue;
+    auto last = line.find_last_not_of(" \t\r");
+    command = line.substr(first, last - first + 1) + '\n';
+    return true;
+  }
+  return false;
+}
+
+std::size_t HeadlessRunner::receive(uint8_t* data, std::size_t length) {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::size_t count = 0;
+  while (status == Status::RUNNING) {
+    if (pending_command.empty()) {
+      if (!input_finished && !next_command(pending_command)) input_finished = true;
+      if (input_finished) {
+        if (final_sync_sent) break;
+        pending_command = "M400\n";
+        final_sync_sent = true;
+      }
+    }
+    // commands are never split so a partial line can not be parsed early
+    if (length - count < pending_command.size()) break;
+    memcpy(data + count, pending_command.data(), pending_command.size());
+    count += pending_command.size();
+    bytes_sent += pending_command.size();
+    commands_sent++;
+    pending_command.clear();
+  }
+  return count;
+}
+
+void HeadlessRunner::process_line(const std::string& line) {
+  if (line.rfind("ok", 0) == 0) ok_received++;
+  else if (line.rfind("Error:", 0) == 0) {
+    errors_received++;
+    if (line.find("Printer halted") != std::string::npos) status = Status::KILLED;
+  }
+}
+
+void HeadlessRunner::transmit(const uint8_t* data, std::size_t length) {
+  std::lock_guard<std::mutex> lock(mutex);
+  bytes_received += length;
+  if (options.echo_serial) fwrite(data, 1, length, stderr);
+  for (std::size_t i = 0; i < length; i++) {
+    if (data[i] == '\n') {
+      if (receive_line.size() && receive_line.back() == '\r') receive_line.pop_back();
+      process_line(receive_line);
+      receive_line.clear();
+    } else receive_line.push_back(data[i]);
+  }
+}
+
+int HeadlessRunner::run(const std::atomic_bool& simulation_finished) {
+  host_start = std::chrono::steady_clock::now();
+
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      sim_seconds = Kernel::SimulationRuntime::seconds();
+      if (status == Status::RUNNING) {
+        if (input_finished && final_sync_sent && pending_command.empty() && commands_sent && ok_received >= commands_sent) status = Status::COMPLETE;
+        else if (options.timeout > 0 && sim_seconds >= options.timeout) status = Status::TIMEOUT;
+        else if (simulation_finished) status = Status::TERMINATED;
+      }
+      if (status != Status::RUNNING) break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  host_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - host_start).count();
+  return status == Status::COMPLETE ? 0 : 1;
+}
+
+void HeadlessRunner::write_summary() {
+  FILE* out = stdout;
+  if (options.summary_file.size()) {
+    out = fopen(options.summary_file.c_str(), "w");
+    if (out == nullptr) {
+      fprintf(stderr, "HeadlessRunner: unable to write %s\n", options.summary_file.c_str());
+      out = stdout;
+    }
+  }
+
+  fprintf(out, "{\"status\":\"%s\",\"gcode\":\"%s\",\"commands_sent\":%" PRIu64 ",\"ok_received\":%" PRIu64 ",\"errors\":%" PRIu64 ","
+               "\"bytes_sent\":%" PRIu64 ",\"bytes_received\":%" PRIu64 ",\"sim_seconds\":%.6f,\"host_seconds\":%.6f,\"speedup\":%.3f}\n",
+    status_name(status), json_escape(options.gcode_file).c_str(), commands_sent, ok_received, errors_received,
+    bytes_sent, bytes_received, sim_seconds, host_seconds, host_seconds > 0 ? sim_seconds / host_seconds : 0.0);
+
+  if (out != stdout) fclose(out);
+  else fflush(out);
+}
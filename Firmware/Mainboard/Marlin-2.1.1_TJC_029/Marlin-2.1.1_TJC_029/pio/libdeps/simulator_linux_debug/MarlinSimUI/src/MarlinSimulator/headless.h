@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+#include "options.h"
+#include "serial_transport.h"
+
+/**
+ * Host side of a headless run, acts as a minimal print host on one serial port.
+ *
+ * G-code is stripped of comments and streamed into the receive buffer as space allows,
+ * every command sent is matched against an "ok" from Marlin. A trailing M400 makes the
+ * final "ok" mean all motion has completed. Serial traffic arrives on the transport thread,
+ * run() only watches for the end of the print.
+ */
+class HeadlessRunner : public SerialSink {
+public:
+  enum class Status {
+    RUNNING,
+    COMPLETE,
+    TIMEOUT,
+    KILLED,
+    TERMINATED,
+    NO_INPUT
+  };
+
+  HeadlessRunner(const SimulatorOptions& options);
+
+  // blocks until the print completes or the run is aborted, returns the process exit code
+  int run(const std::atomic_bool& simulation_finished);
+  void write_summary();
+
+  void transmit(const uint8_t* data, std::size_t length) override;
+  std::size_t receive(uint8_t* data, std::size_t length) override;
+
+private:
+  void process_line(const std::string& line);
+  bool next_command(std::string& command);
+
+  static const char* status_name(Status status);
+
+  const SimulatorOptions& options;
+  std::mutex mutex; // serial state is shared with the transport thread
+  std::ifstream gcode;
+
+  Status status = Status::RUNNING;
+  std::string pending_command;
+  std::string receive_line;
+  bool input_finished = false;
+  bool final_sync_sent = false;
+
+  uint64_t commands_sent = 0;
+  uint64_t ok_received = 0;
+  uint64_t errors_received = 0;
+  uint64_t bytes_sent = 0;
+  uint64_t bytes_received = 0;
+  double sim_seconds = 0;
+  std::chrono::steady_clock::time_point host_start;
+  double host_seconds = 0;
+};
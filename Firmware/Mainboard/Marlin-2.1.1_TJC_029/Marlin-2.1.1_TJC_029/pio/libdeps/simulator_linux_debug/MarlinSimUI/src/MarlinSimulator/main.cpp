@@ -3,6 +3,14 @@
 
 #include "application.h"
 #include "execution_control.h"
+#include "hardware/Gpio.h"
+#include "hardware/SDCard.h"
+#include "headless.h"
+#include "marlin_hal_impl/eeprom.h"
+#include "motion_trace.h"
+#include "options.h"
+#include "serial_transport.h"
+#include "snapshot.h"
 
 #include "src/inc/MarlinConfig.h"
 
@@ -12,6 +20,8 @@ RawSocketSerial net_serial{};
 
 std::atomic_bool main_finished = false;
 
+MotionTraceWriter trace_writer;
+
 void HAL_idletask() {
   Kernel::yield();
 }
@@ -27,6 +37,8 @@ void marlin_loop() {
       SERIAL_FLUSHTX();
     #endif
     HAL_timer_init();
+    // Marlin's RAM is not in a snapshot, from here on one would not match the firmware
+    Snapshot::firmware_started();
     setup();
   } else loop();
 }
@@ -44,22 +56,136 @@ void simulation_main() {
   Kernel::Timers::timerEnable(3);
   Kernel::is_initialized(true);
 
+  if (simulator_options.restore_file.size()) {
+    // runs on the first pass through execute_loop, before the firmware's setup()
+    Kernel::run_at_safe_point([](){
+      Snapshot snapshot;
+      if (snapshot.load(simulator_options.restore_file)) snapshot.apply();
+    });
+  }
+
   while(!main_finished) {
     try {
-      Kernel::execute_loop();
+      // nothing is due when every timer is disabled, wait for the UI instead of spinning
+      if (!Kernel::execute_loop()) Kernel::TimeControl::wait_for_wake(std::chrono::milliseconds(10));
     } catch (std::runtime_error& e) {
       // stack unrolled by exception in order to exit cleanly
       // todo: use a custom exception
-      printf("Exception: %s\n", e.what());
-      printf("Marlin thread terminated\n");
+      fprintf(stderr, "Exception: %s\n", e.what());
+      fprintf(stderr, "Marlin thread terminated\n");
       main_finished = true;
     }
-    std::this_thread::yield();
   }
 }
 
+// Runs the devices from a motion trace, the firmware is never started
+void replay_main() {
+  #ifdef __APPLE__
+    pthread_setname_np("trace_replay");
+  #else
+    pthread_setname_np(pthread_self(), "trace_replay");
+  #endif
+
+  try {
+    motion_trace_replay.run(main_finished);
+  } catch (std::runtime_error& e) {
+    fprintf(stderr, "Exception: %s\n", e.what());
+    fprintf(stderr, "Replay thread terminated\n");
+    main_finished = true;
+  }
+}
+
+// the port Marlin takes commands on (MYSERIAL1), a native USB port (-1) is not simulated
+std::size_t host_serial_port() {
+  const int port = simulator_options.serial_port >= 0 ? simulator_options.serial_port : SERIAL_PORT;
+  return port >= 0 && port < int(SerialTransport::port_count) ? port : 0;
+}
+
+// Sinks available in every mode, the UI and the headless runner attach their own
+void attach_serial_sinks() {
+  if (simulator_options.serial_log_file.size()) {
+    SerialTransport::attach(host_serial_port(), std::make_shared<FileSink>(simulator_options.serial_log_file));
+  }
+  if (simulator_options.serial_pty) {
+    auto pty = std::make_shared<PtySink>();
+    if (pty->is_open()) {
+      fprintf(stderr, "Serial %u is available at %s\n", unsigned(host_serial_port()), pty->path().c_str());
+      SerialTransport::attach(host_serial_port(), pty);
+    }
+  }
+}
+
+void configure_capture() {
+  if (simulator_options.capture_spill_file.size()) Gpio::state().capture.set_spill_file(simulator_options.capture_spill_file);
+  if (simulator_options.capture) Gpio::setLoggingEnabled(true);
+}
+
+// enable and dir are listed before step, events at the same timestamp replay in this order
+void configure_trace() {
+  if (simulator_options.trace_file.empty()) return;
+  trace_writer.open(simulator_options.trace_file, {
+    {X_ENABLE_PIN, "X_ENABLE"}, {Y_ENABLE_PIN, "Y_ENABLE"}, {Z_ENABLE_PIN, "Z_ENABLE"}, {E0_ENABLE_PIN, "E0_ENABLE"},
+    {X_DIR_PIN, "X_DIR"}, {Y_DIR_PIN, "Y_DIR"}, {Z_DIR_PIN, "Z_DIR"}, {E0_DIR_PIN, "E0_DIR"},
+    {X_STEP_PIN, "X_STEP"}, {Y_STEP_PIN, "Y_STEP"}, {Z_STEP_PIN, "Z_STEP"}, {E0_STEP_PIN, "E0_STEP"},
+    {HEATER_0_PIN, "HEATER_0"}, {HEATER_BED_PIN, "HEATER_BED"}
+  }, simulator_options.trace_compress);
+}
+
+void write_sd_log() {
+  #ifdef SDSUPPORT
+    if (simulator_options.sd_log_file.empty()) return;
+    auto card = VirtualPrinter::get_component<SDCard>("SD Card");
+    if (card) card->access_log.export_csv(simulator_options.sd_log_file);
+  #endif
+}
+
+void write_eeprom_wear() {
+  #if ENABLED(EEPROM_SETTINGS)
+    if (simulator_options.eeprom_wear_file.size()) export_eeprom_wear(simulator_options.eeprom_wear_file);
+  #endif
+}
+
+// No SDL, OpenGL or ImGui, the simulation runs unthrottled until the G-code has been printed
+int headless_main() {
+  Kernel::state().realtime_lock = false;
+  VirtualPrinter::build();
+
+  auto runner = std::make_shared<HeadlessRunner>(simulator_options);
+  SerialTransport::attach(host_serial_port(), runner);
+  attach_serial_sinks();
+  configure_capture();
+  configure_trace();
+  SerialTransport::start();
+
+  std::thread simulation_loop(simulation_main);
+  int result = runner->run(main_finished);
+
+  main_finished = true;
+  Kernel::request_quit();
+  simulation_loop.join();
+  SerialTransport::stop();
+  trace_writer.close();
+  write_sd_log();
+  write_eeprom_wear();
+
+  runner->write_summary();
+  if (simulator_options.stats_file.size()) Kernel::write_statistics(simulator_options.stats_file);
+  return result;
+}
+
 // Main code
-int main(int, char**) {
+int main(int argc, char** argv) {
+  if (!simulator_options.parse(argc, argv)) return 2;
+  if (simulator_options.stats_file.size()) Kernel::enable_statistics(true);
+  if (simulator_options.replay_file.size()) {
+    if (simulator_options.headless) {
+      fprintf(stderr, "--replay needs the UI, it cannot be combined with --headless\n");
+      return 2;
+    }
+    if (!motion_trace_replay.open(simulator_options.replay_file)) return 1;
+  }
+  if (simulator_options.headless) return headless_main();
+
   SDL_Init(0);
   SDLNet_Init();
 
@@ -68,7 +194,12 @@ int main(int, char**) {
   net_serial.listen_on_port(8099);
 
   Application app;
-  std::thread simulation_loop(simulation_main);
+  SerialTransport::attach(3, std::make_shared<SocketSink>(net_serial));
+  attach_serial_sinks();
+  configure_capture();
+  configure_trace();
+  SerialTransport::start();
+  std::thread simulation_loop(motion_trace_replay.is_open() ? replay_main : simulation_main);
 
   while (app.active) {
     app.update();
@@ -77,9 +208,14 @@ int main(int, char**) {
   }
 
   main_finished = true;
-  Kernel::quit_requested = true;
+  Kernel::request_quit();
   simulation_loop.join();
+  SerialTransport::stop();
+  trace_writer.close();
+  write_sd_log();
+  write_eeprom_wear();
   net_serial.stop();
+  if (simulator_options.stats_file.size()) Kernel::write_statistics(simulator_options.stats_file);
 
   SDLNet_Quit();
   SDL_Quit();
@@ -31,10 +31,18 @@
 #include <pinmapping.h>
 #include "../hardware/bus/spi.h"
 
-static SpiBus &spi_bus = spi_bus_by_pins<SD_SCK_PIN, SD_MOSI_PIN, SD_MISO_PIN>();
+// the bus wired to the SD card pins
+static SpiBus& spi_bus() { return spi_bus_by_pins<SD_SCK_PIN, SD_MOSI_PIN, SD_MISO_PIN>(); }
+
+// simulated time for count bytes at the bus clock, before they are handed to the devices
+static SpiBus& clocked_bus(const size_t count) {
+  auto& bus = spi_bus();
+  if (bus.timed && bus.clock) Kernel::delayNanos(count * 8 * 1000000000ULL / bus.clock);
+  return bus;
+}
 
 uint8_t spiTransfer(uint8_t b) {
-  return spi_bus.transfer(b);
+  return clocked_bus(1).transfer(b);
 }
 
 void spiBegin() {
@@ -46,6 +54,8 @@ void spiBegin() {
 
 void spiInit(uint8_t spiRate) {
   // SPI_speed = swSpiInit(spiRate, SD_SCK_PIN, SD_MOSI_PIN);
+  // full speed 20MHz, each step halves, SPI_SPEED_6 (~300kHz) is card init
+  spi_bus().clock = 20000000 >> _MIN(spiRate, 6);
   WRITE(SD_MOSI_PIN, HIGH);
   WRITE(SD_SCK_PIN, LOW);
 }
@@ -53,18 +63,18 @@ void spiInit(uint8_t spiRate) {
 uint8_t spiRec() { return spiTransfer(0xFF); }
 
 void spiRead(uint8_t*buf, uint16_t nbyte) {
-  spi_bus.transfer<uint8_t>(nullptr, buf, nbyte);
+  clocked_bus(nbyte).transfer<uint8_t>(nullptr, buf, nbyte);
 }
 
 void spiSend(uint8_t b) { (void)spiTransfer(b); }
 
 void spiSend(const uint8_t* buf, size_t nbyte) {
-  spi_bus.transfer<uint8_t>((uint8_t*)buf, nullptr, nbyte);
+  clocked_bus(nbyte).transfer<uint8_t>((uint8_t*)buf, nullptr, nbyte);
 }
 
 void spiSendBlock(uint8_t token, const uint8_t* buf) {
   (void)spiTransfer(token);
-  spi_bus.transfer<uint8_t>((uint8_t*)buf, nullptr, 512);
+  clocked_bus(512).transfer<uint8_t>((uint8_t*)buf, nullptr, 512);
 }
 
 SPIClass::SPIClass(uint8_t spiPortNumber) {
@@ -116,12 +126,8 @@ void SPIClass::read(uint8_t *buf, uint32_t len) {
 }
 
 void SPIClass::dmaSend(void *buf, uint16_t length, bool minc) {
-  uint8_t *ptr = (uint8_t*)buf;
-  while(length--) {
-    if (_currentSetting->dataSize == DATA_SIZE_16BIT) spiSend(*(ptr + 1));
-    spiSend(*ptr);
-    if (minc) ptr += _currentSetting->dataSize;
-  }
+  if (_currentSetting->dataSize == DATA_SIZE_16BIT) clocked_bus(length * 2).transfer<uint16_t>((uint16_t*)buf, nullptr, length, minc);
+  else clocked_bus(length).transfer<uint8_t>((uint8_t*)buf, nullptr, length, minc);
 }
 
 uint8_t SPIClass::dmaTransfer(const void * transmitBuf, void * receiveBuf, uint16_t length) {
@@ -136,6 +142,12 @@ void SPIClass::setModule(uint8_t device) {
 
 void SPIClass::setClock(uint32_t clock) {
   _currentSetting->clock = clock;
+  if (clock) spi_bus().clock = clock;
+}
+
+// SPI_CLOCK_DIV2 (0) is full speed, each step halves it
+void SPIClass::setClockDivider(uint32_t clock) {
+  setClock(20000000 >> _MIN(clock, 6));
 }
 
 void SPIClass::setBitOrder(uint8_t bitOrder) {
@@ -26,48 +26,178 @@
 #include <src/HAL/shared/eeprom_api.h>
 #include <stdio.h>
 
+#include <bitset>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+  #include <unistd.h>
+#endif
+
+#include "../options.h"
+#include "../snapshot.h"
+#include "eeprom.h"
+
 #ifndef MARLIN_EEPROM_SIZE
   #define MARLIN_EEPROM_SIZE 0x1000 // 4KB of Emulated EEPROM
 #endif
 
+/**
+ * The store is read once, with the journal the last run left, and Marlin works on buffer. access_finish commits
+ * the bytes write_data touched that changed as one transaction appended to <eeprom>.journal: a crash can only
+ * leave a torn transaction at its end, which fails the checksum and is dropped. Once the journal outgrows
+ * journal_limit it is compacted, the image is written to a temporary file, synced and renamed over the store.
+ * Each commit counts the addresses it changed, --eeprom-wear writes the counts at exit.
+ */
 uint8_t buffer[MARLIN_EEPROM_SIZE];
-char filename[] = "eeprom.dat";
-
-size_t PersistentStore::capacity() { return MARLIN_EEPROM_SIZE; }
 
-bool PersistentStore::access_start() {
-  const char eeprom_erase_value = 0xFF;
-  FILE * eeprom_file = fopen(filename, "rb");
-  if (eeprom_file == nullptr) {
-    eeprom_file = fopen(filename, "wb");
-    if (eeprom_file == nullptr) return false;
-    for (size_t i = 0; i < MARLIN_EEPROM_SIZE; i++) fputc('\0', eeprom_file);
-    fclose(eeprom_file);
-    eeprom_file = fopen(filename, "rb");
-    if (eeprom_file == nullptr) return false;
+static constexpr uint32_t journal_magic = 0x314A454D; // "MEJ1"
+static constexpr std::size_t journal_limit = MARLIN_EEPROM_SIZE * 4;
+
+static uint8_t committed[MARLIN_EEPROM_SIZE];
+static std::bitset<MARLIN_EEPROM_SIZE> dirty;
+static uint32_t address_writes[MARLIN_EEPROM_SIZE];
+static bool loaded = false;
+static FILE* journal = nullptr;
+static std::size_t journal_size = 0;
+
+static const bool eeprom_snapshot_registered = Snapshot::register_section("eeprom",
+  [](SnapshotWriter& writer) { writer.write_bytes(buffer, sizeof(buffer)); },
+  [](SnapshotReader& reader) {
+    // --restore comes before setup(), a later first load would overwrite the restored content
+    if (!PersistentStore::access_start() || !reader.read_bytes(buffer, sizeof(buffer))) return;
+    dirty.set();
+    PersistentStore::access_finish();
   }
+);
+
+static std::string journal_path() { return simulator_options.eeprom_file + ".journal"; }
+
+// replaces the store with committed and empties the journal
+static bool compact() {
+  if (journal != nullptr) fclose(journal);
+  journal = nullptr;
+  const std::string temporary = simulator_options.eeprom_file + ".tmp";
+  FILE* image = fopen(temporary.c_str(), "wb");
+  if (image == nullptr) return false;
+  bool written = fwrite(committed, 1, sizeof(committed), image) == sizeof(committed) && fflush(image) == 0;
+  #ifndef _WIN32
+    written = written && fsync(fileno(image)) == 0;
+  #endif
+  fclose(image);
+  std::error_code error;
+  if (written) std::filesystem::rename(temporary, simulator_options.eeprom_file, error);
+  if (!written || error) {
+    fprintf(stderr, "PersistentStore::compact: unable to replace %s\n", simulator_options.eeprom_file.c_str());
+    std::filesystem::remove(temporary, error);
+    return false;
+  }
+  // a crash before this replays the journal onto the new image, which changes nothing
+  journal = fopen(journal_path().c_str(), "wb");
+  journal_size = 0;
+  return journal != nullptr;
+}
 
-  fseek(eeprom_file, 0L, SEEK_END);
-  std::size_t file_size = ftell(eeprom_file);
+// transactions are the magic, the payload size, the payload (offset, length, bytes ...) and its crc16
+static bool replay(FILE* old) {
+  uint32_t header[2];
+  std::vector<uint8_t> payload;
+  while (fread(header, sizeof(header), 1, old) == 1 && header[0] == journal_magic && header[1] <= journal_limit) {
+    payload.resize(header[1] + sizeof(uint16_t));
+    if (fread(payload.data(), 1, payload.size(), old) != payload.size()) return false;
+    uint16_t crc = 0;
+    crc16(&crc, payload.data(), header[1]);
+    if (memcmp(&crc, payload.data() + header[1], sizeof(crc))) return false;
+    for (std::size_t pos = 0; pos + 4 <= header[1];) {
+      uint16_t range[2];
+      memcpy(range, payload.data() + pos, sizeof(range));
+      pos += sizeof(range);
+      if (range[0] + range[1] > MARLIN_EEPROM_SIZE || pos + range[1] > header[1]) return false;
+      memcpy(buffer + range[0], payload.data() + pos, range[1]);
+      pos += range[1];
+    }
+  }
+  return true;
+}
 
-  if (file_size < MARLIN_EEPROM_SIZE) {
-    memset(buffer + file_size, eeprom_erase_value, MARLIN_EEPROM_SIZE - file_size);
+static bool load() {
+  bool complete = false;
+  if (FILE* image = fopen(simulator_options.eeprom_file.c_str(), "rb")) {
+    const std::size_t size = fread(buffer, 1, sizeof(buffer), image);
+    fclose(image);
+    if (size < sizeof(buffer)) memset(buffer + size, 0xFF, sizeof(buffer) - size);
+    complete = size == sizeof(buffer);
   }
-  else {
-    fseek(eeprom_file, 0L, SEEK_SET);
-    fread(buffer, sizeof(uint8_t), sizeof(buffer), eeprom_file);
+  FILE* old = fopen(journal_path().c_str(), "rb");
+  if (old != nullptr) {
+    if (!replay(old)) fprintf(stderr, "PersistentStore::load: dropped a torn transaction at the end of %s\n", journal_path().c_str());
+    fclose(old);
   }
+  memcpy(committed, buffer, sizeof(buffer));
+  // appending after a torn transaction would hide the new ones, so the run starts on an empty journal
+  if (!complete || old != nullptr) return compact();
+  journal = fopen(journal_path().c_str(), "wb");
+  return journal != nullptr;
+}
 
-  fclose(eeprom_file);
-  return true;
+size_t PersistentStore::capacity() { return MARLIN_EEPROM_SIZE; }
+
+bool PersistentStore::access_start() {
+  if (!loaded) loaded = load();
+  return loaded;
 }
 
 bool PersistentStore::access_finish() {
-  FILE * eeprom_file = fopen(filename, "wb");
-  if (!eeprom_file) return false;
-  fwrite(buffer, sizeof(uint8_t), sizeof(buffer), eeprom_file);
-  fclose(eeprom_file);
-  return true;
+  if (!access_start()) return false;
+
+  // the changed bytes Marlin wrote, in ranges, a gap shorter than a range header is carried along
+  std::vector<uint8_t> transaction(sizeof(uint32_t) * 2);
+  int first = -1, last = 0;
+  auto add_range = [&]() {
+    if (first < 0) return;
+    const uint16_t range[2] = { uint16_t(first), uint16_t(last - first) };
+    transaction.insert(transaction.end(), (const uint8_t*)range, (const uint8_t*)range + sizeof(range));
+    transaction.insert(transaction.end(), buffer + first, buffer + last);
+    first = -1;
+  };
+  for (int address = 0; address < MARLIN_EEPROM_SIZE; address++) {
+    if (!dirty[address] || buffer[address] == committed[address]) continue;
+    if (first >= 0 && address - last >= 4) add_range();
+    if (first < 0) first = address;
+    last = address + 1;
+    address_writes[address]++;
+  }
+  add_range();
+  dirty.reset();
+  if (transaction.size() == sizeof(uint32_t) * 2) return true;
+
+  const uint32_t header[2] = { journal_magic, uint32_t(transaction.size() - sizeof(header)) };
+  memcpy(transaction.data(), header, sizeof(header));
+  uint16_t crc = 0;
+  crc16(&crc, transaction.data() + sizeof(header), header[1]);
+  transaction.insert(transaction.end(), (const uint8_t*)&crc, (const uint8_t*)&crc + sizeof(crc));
+  // one write, a crash leaves the whole transaction or a torn one
+  if (journal == nullptr || fwrite(transaction.data(), 1, transaction.size(), journal) != transaction.size() || fflush(journal) != 0) {
+    fprintf(stderr, "PersistentStore::access_finish: unable to append to %s\n", journal_path().c_str());
+    return false;
+  }
+  memcpy(committed, buffer, sizeof(buffer));
+  journal_size += transaction.size();
+  return journal_size < journal_limit || compact();
+}
+
+void export_eeprom_wear(const std::string& filename) {
+  FILE* out = fopen(filename.c_str(), "w");
+  if (out == nullptr) {
+    fprintf(stderr, "export_eeprom_wear: unable to open %s\n", filename.c_str());
+    return;
+  }
+  fprintf(out, "address,writes\n");
+  for (std::size_t address = 0; address < MARLIN_EEPROM_SIZE; address++) {
+    if (address_writes[address]) fprintf(out, "%zu,%u\n", address, address_writes[address]);
+  }
+  fclose(out);
 }
 
 bool PersistentStore::write_data(int &pos, const uint8_t *value, size_t size, uint16_t *crc) {
@@ -75,6 +205,7 @@ bool PersistentStore::write_data(int &pos, const uint8_t *value, size_t size, ui
 
   for (std::size_t i = 0; i < size; i++) {
     buffer[pos+i] = value[i];
+    dirty[pos+i] = true;
     bytes_written ++;
   }
 
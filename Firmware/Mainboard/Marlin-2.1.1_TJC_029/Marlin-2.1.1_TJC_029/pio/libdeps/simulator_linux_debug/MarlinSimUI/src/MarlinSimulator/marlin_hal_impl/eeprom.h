@@ -0,0 +1,6 @@
+#pragma once
+
+#include <string>
+
+// the number of commits that changed each EEPROM address, as CSV
+void export_eeprom_wear(const std::string& filename);
@@ -27,7 +27,7 @@
 #include HAL_PATH(src/HAL, tft/tft_spi.h)
 #include "../../hardware/bus/spi.h"
 
-static SpiBus &spi_bus = spi_bus_by_pins<TFT_SCK_PIN, TFT_MOSI_PIN, TFT_MISO_PIN>();
+static SpiBus& spi_bus() { return spi_bus_by_pins<TFT_SCK_PIN, TFT_MOSI_PIN, TFT_MISO_PIN>(); }
 
 //TFT_SPI tft;
 
@@ -120,7 +120,7 @@ uint32_t TFT_SPI::ReadID(uint16_t Reg) {
 
     LOOP_L_N(i, 4) {
       //spiRead(&d, 1);
-      spi_bus.transfer<uint8_t>(nullptr, &d, 1);
+      spi_bus().transfer<uint8_t>(nullptr, &d, 1);
       data = (data << 8) | d;
     }
 
@@ -139,14 +139,14 @@ void TFT_SPI::Abort() {
 }
 
 void TFT_SPI::Transmit(uint16_t Data) {
-  spi_bus.write(Data);
+  spi_bus().write(Data);
 }
 
 void TFT_SPI::TransmitDMA(uint32_t MemoryIncrease, uint16_t *Data, uint16_t Count) {
   DataTransferBegin();
   TFT_DC_H;
-  if (MemoryIncrease == DMA_MINC_ENABLE) spi_bus.transfer<uint16_t>(Data, nullptr, Count);
-  else spi_bus.transfer<uint16_t>(Data, nullptr, Count, false);
+  if (MemoryIncrease == DMA_MINC_ENABLE) spi_bus().transfer<uint16_t>(Data, nullptr, Count);
+  else spi_bus().transfer<uint16_t>(Data, nullptr, Count, false);
   DataTransferEnd();
 }
 
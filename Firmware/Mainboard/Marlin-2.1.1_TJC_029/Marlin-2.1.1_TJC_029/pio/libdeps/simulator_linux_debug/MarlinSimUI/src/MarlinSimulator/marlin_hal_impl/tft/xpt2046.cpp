@@ -24,7 +24,7 @@
 #include HAL_PATH(src/HAL, tft/xpt2046.h)
 #include "../../hardware/bus/spi.h"
 
-static SpiBus &spi_bus = spi_bus_by_pins<TOUCH_SCK_PIN, TOUCH_MOSI_PIN, TOUCH_MISO_PIN>();
+static SpiBus& spi_bus() { return spi_bus_by_pins<TOUCH_SCK_PIN, TOUCH_MOSI_PIN, TOUCH_MISO_PIN>(); }
 
 uint16_t delta(uint16_t a, uint16_t b) { return a > b ? a - b : b - a; }
 
@@ -115,7 +115,7 @@ uint16_t XPT2046::IO(uint16_t data) {
 #endif
 
 uint16_t XPT2046::SoftwareIO(uint16_t data) {
-  return spi_bus.transfer(data & 0xFF);
+  return spi_bus().transfer(data & 0xFF);
 }
 
 void XPT2046::DataTransferBegin() { WRITE(TOUCH_CS_PIN, LOW); };
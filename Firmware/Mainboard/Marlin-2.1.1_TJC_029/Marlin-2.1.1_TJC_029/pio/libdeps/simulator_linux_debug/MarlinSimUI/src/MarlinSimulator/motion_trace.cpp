@@ -0,0 +1,426 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <chrono>
+
+#include <zlib.h>
+
+#include "execution_control.h"
+#include "motion_trace.h"
+
+MotionTraceReplay motion_trace_replay;
+
+namespace {
+
+// per event: varint (delta << 2 | code), code 0/1 is the new level, 2 is followed by a varint value
+enum Code : uint8_t {
+  CODE_LOW = 0,
+  CODE_HIGH = 1,
+  CODE_VALUE = 2
+};
+
+template<typename T>
+void put(FILE* file, const T& value) { fwrite(&value, sizeof(T), 1, file); }
+
+template<typename T>
+bool get(FILE* file, T& value) { return fread(&value, sizeof(T), 1, file) == 1; }
+
+void put_varint(std::vector<uint8_t>& output, uint64_t value) {
+  while (value >= 0x80) {
+    output.push_back(uint8_t(value | 0x80));
+    value >>= 7;
+  }
+  output.push_back(uint8_t(value));
+}
+
+bool get_varint(const uint8_t* input, std::size_t size, std::size_t& position, uint64_t& value) {
+  value = 0;
+  for (int shift = 0; position < size && shift < 64; shift += 7) {
+    uint8_t byte = input[position++];
+    value |= uint64_t(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+void put_block_header(FILE* file, const MotionTrace::Block& block) {
+  put(file, block.channel);
+  put(file, block.compression);
+  put(file, block.events);
+  put(file, block.raw_size);
+  put(file, block.stored_size);
+  put(file, block.first_timestamp);
+  put(file, block.last_timestamp);
+  put(file, block.value_before);
+}
+
+bool get_block_header(FILE* file, MotionTrace::Block& block) {
+  return get(file, block.channel) && get(file, block.compression) && get(file, block.events) && get(file, block.raw_size)
+      && get(file, block.stored_size) && get(file, block.first_timestamp) && get(file, block.last_timestamp) && get(file, block.value_before);
+}
+
+}
+
+bool MotionTraceWriter::open(const std::string& filename, std::vector<MotionTrace::Channel> channel_list, const bool compress) {
+  close();
+  file = fopen(filename.c_str(), "wb");
+  if (file == nullptr) {
+    fprintf(stderr, "MotionTraceWriter::open: unable to write %s\n", filename.c_str());
+    return false;
+  }
+  this->compress = compress;
+  channels.clear();
+  std::fill(std::begin(channel_of), std::end(channel_of), -1);
+  for (auto& channel : channel_list) {
+    if (!Gpio::valid_pin(channel.pin) || channel_of[channel.pin] != -1) continue; // unused or shared pins
+    channel.initial_value = Gpio::get_pin_value(channel.pin);
+    channel_of[channel.pin] = channels.size();
+    channels.push_back(channel);
+  }
+  streams.assign(channels.size(), Stream{});
+  for (std::size_t i = 0; i < channels.size(); i++) streams[i].value = channels[i].initial_value;
+  index.clear();
+
+  fwrite(MotionTrace::file_magic, sizeof(MotionTrace::file_magic), 1, file);
+  put(file, MotionTrace::version);
+  put<uint32_t>(file, channels.size());
+  for (auto& channel : channels) {
+    put(file, channel.pin);
+    put(file, channel.initial_value);
+    put<uint32_t>(file, channel.name.size());
+    fwrite(channel.name.data(), 1, channel.name.size(), file);
+  }
+
+  // the level written is read back from the pin, so PWM duty changes are recorded as well as edges
+  for (auto& channel : channels) Gpio::attach(channel.pin, GpioEvent::EDGE_MASK | GpioEvent::SET_VALUE_MASK, on_event, this);
+  return true;
+}
+
+void MotionTraceWriter::on_event(void* context, GpioEvent& event) {
+  auto writer = static_cast<MotionTraceWriter*>(context);
+  if (writer->file == nullptr) return;
+  writer->record(writer->channel_of[event.pin_id], Kernel::TimeControl::ticksToNanos(event.timestamp), Gpio::get_pin_value(event.pin_id));
+}
+
+void MotionTraceWriter::record(const uint16_t channel, const uint64_t timestamp, const uint16_t value) {
+  auto& stream = streams[channel];
+  if (stream.events == 0) {
+    stream.first_timestamp = stream.last_timestamp = timestamp;
+    stream.value_before = stream.value;
+  }
+  // a restored snapshot moves time backwards, the trace stays monotonic and keeps those events at the last timestamp
+  uint64_t delta = timestamp > stream.last_timestamp ? timestamp - stream.last_timestamp : 0;
+  if (value <= 1) put_varint(stream.data, delta << 2 | (value ? CODE_HIGH : CODE_LOW));
+  else {
+    put_varint(stream.data, delta << 2 | CODE_VALUE);
+    put_varint(stream.data, value);
+  }
+  stream.last_timestamp += delta;
+  stream.value = value;
+  if (++stream.events >= MotionTrace::block_events) flush(channel);
+}
+
+void MotionTraceWriter::flush(const uint16_t channel) {
+  auto& stream = streams[channel];
+  if (stream.events == 0) return;
+
+  MotionTrace::Block block{channel, MotionTrace::NONE, stream.events, uint32_t(stream.data.size()), uint32_t(stream.data.size()),
+    stream.first_timestamp, stream.last_timestamp, stream.value_before, 0};
+  const uint8_t* payload = stream.data.data();
+  std::vector<uint8_t> compressed;
+  if (compress) {
+    uLongf size = compressBound(stream.data.size());
+    compressed.resize(size);
+    // stored raw when compression does not pay off
+    if (compress2(compressed.data(), &size, stream.data.data(), stream.data.size(), 6) == Z_OK && size < stream.data.size()) {
+      block.compression = MotionTrace::ZLIB;
+      block.stored_size = size;
+      payload = compressed.data();
+    }
+  }
+
+  put(file, MotionTrace::block_magic);
+  put_block_header(file, block);
+  block.offset = ftell(file);
+  fwrite(payload, 1, block.stored_size, file);
+  index.push_back(block);
+
+  stream.data.clear();
+  stream.events = 0;
+}
+
+void MotionTraceWriter::close() {
+  if (file == nullptr) return;
+  for (std::size_t i = 0; i < streams.size(); i++) flush(i);
+
+  uint64_t index_offset = ftell(file);
+  for (auto& block : index) {
+    put_block_header(file, block);
+    put(file, block.offset);
+  }
+  put(file, index_offset);
+  put<uint32_t>(file, index.size());
+  fwrite(MotionTrace::index_magic, sizeof(MotionTrace::index_magic), 1, file);
+  if (ferror(file)) fprintf(stderr, "MotionTraceWriter::close: write error, the trace is incomplete\n");
+  fclose(file);
+  file = nullptr;
+}
+
+bool MotionTraceReader::open(const std::string& filename) {
+  close();
+  file = fopen(filename.c_str(), "rb");
+  if (file == nullptr) {
+    fprintf(stderr, "MotionTraceReader::open: unable to read %s\n", filename.c_str());
+    return false;
+  }
+
+  char magic[sizeof(MotionTrace::file_magic)];
+  uint32_t version = 0, channel_count = 0;
+  if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, MotionTrace::file_magic, sizeof(magic))
+      || !get(file, version) || version != MotionTrace::version || !get(file, channel_count)) {
+    fprintf(stderr, "MotionTraceReader::open: %s is not a motion trace\n", filename.c_str());
+    close();
+    return false;
+  }
+  for (uint32_t i = 0; i < channel_count; i++) {
+    MotionTrace::Channel channel{};
+    uint32_t name_length = 0;
+    if (!get(file, channel.pin) || !get(file, channel.initial_value) || !get(file, name_length) || name_length > 256) {
+      fprintf(stderr, "MotionTraceReader::open: %s has a truncated header\n", filename.c_str());
+      close();
+      return false;
+    }
+    channel.name.resize(name_length);
+    if (name_length && fread(&channel.name[0], 1, name_length, file) != name_length) {
+      close();
+      return false;
+    }
+    channel_list.push_back(channel);
+  }
+  data_start = ftell(file);
+
+  if (!read_index() && !scan_blocks()) {
+    fprintf(stderr, "MotionTraceReader::open: %s has no readable blocks\n", filename.c_str());
+    close();
+    return false;
+  }
+
+  cursors.assign(channel_list.size(), Cursor{});
+  first_timestamp = UINT64_MAX;
+  for (std::size_t i = 0; i < index.size(); i++) {
+    auto& block = index[i];
+    if (block.channel >= cursors.size()) continue;
+    cursors[block.channel].blocks.push_back(i);
+    first_timestamp = std::min(first_timestamp, block.first_timestamp);
+    last_timestamp = std::max(last_timestamp, block.last_timestamp);
+    total_events += block.events;
+  }
+  if (first_timestamp == UINT64_MAX) first_timestamp = 0;
+  rewind();
+  return true;
+}
+
+void MotionTraceReader::close() {
+  if (file) fclose(file);
+  file = nullptr;
+  channel_list.clear();
+  index.clear();
+  cursors.clear();
+  heap.clear();
+  first_timestamp = last_timestamp = total_events = 0;
+}
+
+bool MotionTraceReader::read_index() {
+  char magic[sizeof(MotionTrace::index_magic)];
+  uint64_t index_offset = 0;
+  uint32_t count = 0;
+  constexpr long footer_size = sizeof(index_offset) + sizeof(count) + sizeof(magic);
+  if (fseek(file, -footer_size, SEEK_END) || !get(file, index_offset) || !get(file, count)
+      || fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, MotionTrace::index_magic, sizeof(magic))) return false;
+  if (fseek(file, index_offset, SEEK_SET)) return false;
+  index.resize(count);
+  for (auto& block : index) {
+    if (!get_block_header(file, block) || !get(file, block.offset)) {
+      index.clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+// the recorder did not close the file, every complete block is still usable
+bool MotionTraceReader::scan_blocks() {
+  index.clear();
+  fseek(file, data_start, SEEK_SET);
+  uint32_t magic = 0;
+  MotionTrace::Block block{};
+  while (get(file, magic) && magic == MotionTrace::block_magic && get_block_header(file, block)) {
+    block.offset = ftell(file);
+    if (fseek(file, block.stored_size, SEEK_CUR)) break;
+    // fseek past the end succeeds, a truncated payload shows up as a short read of the next header
+    index.push_back(block);
+  }
+  fseek(file, 0, SEEK_END);
+  if (index.size() && uint64_t(ftell(file)) < index.back().offset + index.back().stored_size) index.pop_back();
+  return index.size();
+}
+
+bool MotionTraceReader::load_block(const uint16_t channel) {
+  auto& cursor = cursors[channel];
+  cursor.events.clear();
+  cursor.position = 0;
+  while (cursor.events.empty() && cursor.next_block < cursor.blocks.size()) {
+    auto& block = index[cursor.blocks[cursor.next_block++]];
+    std::vector<uint8_t> stored(block.stored_size), raw;
+    if (fseek(file, block.offset, SEEK_SET) || (block.stored_size && fread(stored.data(), 1, stored.size(), file) != stored.size())) {
+      fprintf(stderr, "MotionTraceReader::load_block: unable to read block at %" PRIu64 "\n", block.offset);
+      continue;
+    }
+    if (block.compression == MotionTrace::ZLIB) {
+      raw.resize(block.raw_size);
+      uLongf size = raw.size();
+      if (uncompress(raw.data(), &size, stored.data(), stored.size()) != Z_OK || size != raw.size()) {
+        fprintf(stderr, "MotionTraceReader::load_block: corrupt block at %" PRIu64 "\n", block.offset);
+        continue;
+      }
+    } else raw.swap(stored);
+
+    uint64_t timestamp = block.first_timestamp, token = 0, value = 0;
+    std::size_t position = 0;
+    cursor.events.reserve(block.events);
+    for (uint32_t i = 0; i < block.events && get_varint(raw.data(), raw.size(), position, token); i++) {
+      value = token & 3;
+      if (value == CODE_VALUE && !get_varint(raw.data(), raw.size(), position, value)) break;
+      timestamp += token >> 2;
+      cursor.events.push_back({timestamp, uint16_t(value)});
+    }
+  }
+  return cursor.events.size();
+}
+
+void MotionTraceReader::push_heap(const uint16_t channel) {
+  auto& cursor = cursors[channel];
+  if (cursor.position >= cursor.events.size() && !load_block(channel)) return;
+  heap.push_back({cursor.events[cursor.position].first, channel});
+  std::push_heap(heap.begin(), heap.end(), std::greater<>());
+}
+
+void MotionTraceReader::rewind() {
+  heap.clear();
+  for (uint16_t i = 0; i < cursors.size(); i++) {
+    cursors[i].next_block = 0;
+    cursors[i].events.clear();
+    cursors[i].position = 0;
+    push_heap(i);
+  }
+}
+
+bool MotionTraceReader::next(MotionTrace::Event& event) {
+  if (heap.empty()) return false;
+  std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+  uint16_t channel = heap.back().second;
+  heap.pop_back();
+  auto& cursor = cursors[channel];
+  event = {cursor.events[cursor.position].first, channel, cursor.events[cursor.position].second};
+  cursor.position++;
+  push_heap(channel);
+  return true;
+}
+
+bool MotionTraceReplay::open(const std::string& filename) {
+  loaded = reader.open(filename);
+  if (loaded) this->filename = filename;
+  return loaded;
+}
+
+void MotionTraceReplay::seek(const uint64_t timestamp) {
+  seek_target = timestamp;
+  Kernel::TimeControl::wake();
+}
+
+void MotionTraceReplay::apply(const MotionTrace::Event& event) {
+  Gpio::set(reader.channels()[event.channel].pin, event.value);
+}
+
+void MotionTraceReplay::rewind() {
+  start.apply();
+  Gpio::resetLogs();
+  reader.rewind();
+  has_pending = false;
+  current = reader.start_timestamp();
+  if (on_rewind) on_rewind();
+}
+
+// device events due before timestamp (heater model, latch timeouts) run first, as they did while recording
+void MotionTraceReplay::advance_to(const uint64_t timestamp) {
+  const uint64_t ticks = Kernel::TimeControl::nanosToTicks(timestamp);
+  while (Kernel::execute_loop(ticks));
+  Kernel::TimeControl::setTicks(std::max(ticks, Kernel::TimeControl::getTicks()));
+}
+
+// events up to timestamp are applied as fast as they decode
+void MotionTraceReplay::fast_forward(const uint64_t timestamp) {
+  while (current < timestamp) {
+    if (!has_pending && !(has_pending = reader.next(pending))) break;
+    if (pending.timestamp > timestamp) break;
+    advance_to(pending.timestamp);
+    apply(pending);
+    current = pending.timestamp;
+    has_pending = false;
+  }
+  current = std::max<uint64_t>(current, std::min(timestamp, reader.end_timestamp()));
+  advance_to(current);
+  // pacing restarts from here rather than waiting out the skipped time
+  Kernel::state().realtime_nanos = current;
+  Kernel::state().last_clock_read = Kernel::TimeControl::clock.now();
+}
+
+// the firmware's timers are never started, the only kernel timers that fire are device events
+void MotionTraceReplay::run(std::atomic_bool& finished) {
+  auto& kernel = Kernel::state();
+  // the replay paces itself between events, so a pause or a seek never blocks inside the kernel
+  const bool paced = kernel.realtime_lock.exchange(false);
+  Kernel::is_initialized(true);
+  for (auto& channel : reader.channels()) Gpio::set_pin_value(channel.pin, channel.initial_value);
+  Kernel::TimeControl::setTicks(Kernel::TimeControl::nanosToTicks(reader.start_timestamp()));
+  start = Snapshot::capture();
+  rewind();
+  fast_forward(reader.start_timestamp());
+
+  while (!finished) {
+    uint64_t target = seek_target.exchange(no_seek);
+    if (target != no_seek) {
+      if (target < current) rewind();
+      fast_forward(target);
+    }
+
+    // safe point tasks, and device events that are already due
+    Kernel::execute_loop(Kernel::TimeControl::getTicks());
+    if (!has_pending && !(has_pending = reader.next(pending))) {
+      ended = true;
+      Kernel::TimeControl::wait_for_wake(std::chrono::milliseconds(10));
+      continue;
+    }
+    ended = false;
+
+    // simulated time follows the scaled wall clock up to the next event, waits are short and woken by seeks and
+    // speed changes; unlimited speed replays as fast as the devices keep up
+    Kernel::TimeControl::updateRealtime();
+    if (paced && kernel.realtime_scale <= 99.0f) {
+      if (kernel.realtime_nanos < pending.timestamp) {
+        uint64_t now = std::max<uint64_t>(current, kernel.realtime_nanos);
+        advance_to(now);
+        float scale = kernel.realtime_scale;
+        auto ahead = std::chrono::nanoseconds(scale > 0.0f ? uint64_t((pending.timestamp - now) / scale) : UINT64_MAX / 2);
+        Kernel::TimeControl::wait_for_wake(std::min<std::chrono::nanoseconds>(ahead, std::chrono::milliseconds(10)));
+        continue;
+      }
+      // running behind the wall clock, catch up without building a backlog
+      kernel.realtime_nanos = pending.timestamp;
+    }
+    advance_to(pending.timestamp);
+    apply(pending);
+    current = pending.timestamp;
+    has_pending = false;
+  }
+}
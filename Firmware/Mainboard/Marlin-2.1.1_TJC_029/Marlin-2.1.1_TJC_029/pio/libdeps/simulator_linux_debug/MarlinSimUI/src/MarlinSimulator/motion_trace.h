@@ -0,0 +1,168 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "hardware/Gpio.h"
+#include "snapshot.h"
+
+/**
+ * Compact recording of the pins that describe a print: step, dir and enable of every stepper and the heater
+ * outputs, enough to replay the motion and heating without running the firmware.
+ *
+ * Each channel (one pin) is encoded into its own stream, an event is a varint of (delta << 2 | code) where delta is
+ * nanoseconds since the channel's previous event and code 0/1 is the new level, code 2 means an explicit varint value
+ * follows (PWM). A stream is cut into blocks of at most block_events events, each with a header carrying the channel,
+ * the time span and the level before the block, optionally zlib compressed. Closing the file appends an index of
+ * every block header and a footer pointing at it, a file without one (the recorder was killed) is indexed by walking
+ * the block headers instead.
+ */
+namespace MotionTrace {
+  constexpr char file_magic[8] = {'M', 'S', 'I', 'M', 'T', 'R', 'C', 'E'};
+  constexpr char index_magic[8] = {'M', 'S', 'I', 'M', 'T', 'I', 'D', 'X'};
+  constexpr uint32_t block_magic = 0x4B4C4254; // "TBLK"
+  constexpr uint32_t version = 1;
+  constexpr uint32_t block_events = 4096;
+
+  enum Compression : uint8_t {
+    NONE = 0,
+    ZLIB = 1
+  };
+
+  struct Channel {
+    pin_type pin;
+    std::string name;
+    uint16_t initial_value = 0;
+  };
+
+  struct Block {
+    uint16_t channel;
+    uint8_t compression;
+    uint32_t events, raw_size, stored_size;
+    uint64_t first_timestamp, last_timestamp;
+    uint16_t value_before;
+    uint64_t offset; // of the payload
+  };
+
+  struct Event {
+    uint64_t timestamp;
+    uint16_t channel;
+    uint16_t value;
+  };
+}
+
+// Records channel changes as they are dispatched on the simulation thread, attach before that thread starts
+class MotionTraceWriter {
+public:
+  ~MotionTraceWriter() { close(); }
+
+  bool open(const std::string& filename, std::vector<MotionTrace::Channel> channels, const bool compress);
+  // flushes every stream and writes the index
+  void close();
+  bool is_open() const { return file != nullptr; }
+
+private:
+  struct Stream {
+    std::vector<uint8_t> data;
+    uint32_t events = 0;
+    uint64_t first_timestamp = 0, last_timestamp = 0;
+    uint16_t value_before = 0, value = 0;
+  };
+
+  static void on_event(void* context, GpioEvent& event);
+  void record(const uint16_t channel, const uint64_t timestamp, const uint16_t value);
+  void flush(const uint16_t channel);
+
+  FILE* file = nullptr;
+  bool compress = false;
+  std::vector<MotionTrace::Channel> channels;
+  std::vector<Stream> streams;
+  std::vector<MotionTrace::Block> index;
+  int16_t channel_of[Gpio::pin_count];
+};
+
+// Merges the channel streams back into one time ordered sequence, decoding one block per channel at a time.
+// Events at the same timestamp come out in channel order, list enable and dir before step when recording.
+class MotionTraceReader {
+public:
+  ~MotionTraceReader() { close(); }
+
+  bool open(const std::string& filename);
+  void close();
+
+  const std::vector<MotionTrace::Channel>& channels() const { return channel_list; }
+  const std::vector<MotionTrace::Block>& blocks() const { return index; }
+  uint64_t start_timestamp() const { return first_timestamp; }
+  uint64_t end_timestamp() const { return last_timestamp; }
+  uint64_t event_count() const { return total_events; }
+
+  void rewind();
+  // the next event in time order, false at the end of the trace
+  bool next(MotionTrace::Event& event);
+
+private:
+  struct Cursor {
+    std::vector<std::size_t> blocks; // into index, in time order
+    std::size_t next_block = 0;
+    std::vector<std::pair<uint64_t, uint16_t>> events;
+    std::size_t position = 0;
+  };
+
+  bool read_index();
+  bool scan_blocks();
+  bool load_block(const uint16_t channel);
+  void push_heap(const uint16_t channel);
+
+  FILE* file = nullptr;
+  std::vector<MotionTrace::Channel> channel_list;
+  std::vector<MotionTrace::Block> index;
+  std::vector<Cursor> cursors;
+  std::vector<std::pair<uint64_t, uint16_t>> heap; // (next timestamp, channel), a min heap
+  uint64_t data_start = 0, first_timestamp = 0, last_timestamp = 0, total_events = 0;
+};
+
+/**
+ * Drives the printer's devices from a trace instead of the firmware: simulated time is set to each event and the
+ * pin is written through Gpio::set, so the steppers, kinematics, visualisation, analytics and heaters see exactly
+ * what they saw when the trace was recorded, device events on kernel timers run in between. Pacing follows the simulation speed like a normal run, seeking back
+ * restores the snapshot taken before the first event and fast forwards without pacing.
+ */
+class MotionTraceReplay {
+public:
+  bool open(const std::string& filename);
+  bool is_open() const { return loaded; }
+  // the replay thread, returns when finished is set or the kernel is asked to quit
+  void run(std::atomic_bool& finished);
+
+  // thread safe, applied by the replay thread before its next event
+  void seek(const uint64_t timestamp);
+
+  uint64_t position() const { return current; }
+  bool at_end() const { return ended; }
+  const MotionTraceReader& trace() const { return reader; }
+  std::string filename;
+
+  // called on the replay thread when seeking back, before the fast forward, e.g. to clear the print path
+  std::function<void()> on_rewind;
+
+private:
+  void apply(const MotionTrace::Event& event);
+  void advance_to(const uint64_t timestamp);
+  void rewind();
+  void fast_forward(const uint64_t timestamp);
+
+  static constexpr uint64_t no_seek = UINT64_MAX;
+  MotionTraceReader reader;
+  Snapshot start;
+  bool loaded = false;
+  MotionTrace::Event pending{};
+  bool has_pending = false;
+  std::atomic_uint64_t current{0}, seek_target{no_seek};
+  std::atomic_bool ended{false};
+};
+
+extern MotionTraceReplay motion_trace_replay;
@@ -0,0 +1,108 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "options.h"
+
+SimulatorOptions simulator_options;
+
+static void print_usage(const char* program) {
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "  --headless          run without a window, as fast as possible, needs --gcode or --timeout\n"
+    "  --gcode FILE        (headless) stream FILE to the host serial port and exit when printed\n"
+    "  --sd-image FILE     FAT image used by the simulated SD card, or a directory of files to serve as one\n"
+    "  --sd-flush SECONDS  persist dirty SD sectors every SECONDS of simulated time (default 1, 0 on reset and exit only)\n"
+    "  --sd-sync MODE      none (writes stay in memory), async (default) or full (fsync), how SD sectors reach the image file\n"
+    "  --sd-profile NAME   SD card timing: instant (default), cheap-8gb, fast-a1 or a profile file\n"
+    "  --sd-log FILE       write the SD card block access log as CSV to FILE at exit\n"
+    "  --flash-timing      SPI flash programs and erases take the datasheet time\n"
+    "  --eeprom FILE       file backing the emulated EEPROM (default eeprom.dat)\n"
+    "  --eeprom-wear FILE  write the EEPROM writes per address as CSV to FILE at exit\n"
+    "  --summary FILE      (headless) write the JSON summary to FILE instead of stdout\n"
+    "  --timeout SECONDS   (headless) stop after SECONDS of simulated time\n"
+    "  --echo              (headless) copy Marlin serial output to stderr\n"
+    "  --restore FILE      restore a hardware snapshot before the firmware starts\n"
+    "  --serial-log FILE   copy Marlin output on the host serial port to FILE\n"
+    "  --pty               expose the host serial port as a pseudo terminal\n"
+    "  --serial-port N     host serial port, 0-3 (default Marlin's SERIAL_PORT)\n"
+    "  --stats FILE        collect interrupt execution statistics, written as JSON to FILE at exit\n"
+    "  --capture           start with pin logging enabled\n"
+    "  --capture-spill FILE  spill pin log chunks evicted from memory to FILE\n"
+    "  --kinematic-rate HZ  effector position updates per simulated second (default 1000, 0 every step)\n"
+    "  --trace FILE        record stepper and heater pin changes to a motion trace\n"
+    "  --trace-compress    zlib compress the motion trace\n"
+    "  --replay FILE       replay a motion trace instead of running the firmware\n",
+    program);
+}
+
+bool SimulatorOptions::parse(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    auto value = [&]() -> const char* {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Missing value for %s\n", arg);
+        return nullptr;
+      }
+      return argv[++i];
+    };
+
+    if (!strcmp(arg, "--headless")) headless = true;
+    else if (!strcmp(arg, "--echo")) echo_serial = true;
+    else if (!strcmp(arg, "--pty")) serial_pty = true;
+    else if (!strcmp(arg, "--capture")) capture = true;
+    else if (!strcmp(arg, "--trace-compress")) trace_compress = true;
+    else if (!strcmp(arg, "--flash-timing")) flash_timing = true;
+    else if (!strcmp(arg, "--gcode")    ) { auto v = value(); if (!v) return false; gcode_file = v; }
+    else if (!strcmp(arg, "--sd-image") ) { auto v = value(); if (!v) return false; sd_image = v; }
+    else if (!strcmp(arg, "--sd-flush") ) { auto v = value(); if (!v) return false; sd_flush_interval = atof(v); }
+    else if (!strcmp(arg, "--sd-sync")  ) {
+      auto v = value();
+      if (!v) return false;
+      if (!strcmp(v, "none")) sd_sync = SdSync::NONE;
+      else if (!strcmp(v, "async")) sd_sync = SdSync::ASYNC;
+      else if (!strcmp(v, "full")) sd_sync = SdSync::FULL;
+      else {
+        fprintf(stderr, "Unknown --sd-sync mode: %s\n", v);
+        return false;
+      }
+    }
+    else if (!strcmp(arg, "--sd-profile")) { auto v = value(); if (!v) return false; sd_profile = v; }
+    else if (!strcmp(arg, "--sd-log")   ) { auto v = value(); if (!v) return false; sd_log_file = v; }
+    else if (!strcmp(arg, "--eeprom")   ) { auto v = value(); if (!v) return false; eeprom_file = v; }
+    else if (!strcmp(arg, "--eeprom-wear")) { auto v = value(); if (!v) return false; eeprom_wear_file = v; }
+    else if (!strcmp(arg, "--summary")  ) { auto v = value(); if (!v) return false; summary_file = v; }
+    else if (!strcmp(arg, "--timeout")  ) { auto v = value(); if (!v) return false; timeout = atof(v); }
+    else if (!strcmp(arg, "--restore")  ) { auto v = value(); if (!v) return false; restore_file = v; }
+    else if (!strcmp(arg, "--stats")    ) { auto v = value(); if (!v) return false; stats_file = v; }
+    else if (!strcmp(arg, "--serial-port")) {
+      auto v = value();
+      if (!v) return false;
+      serial_port = atoi(v);
+      if (serial_port < 0 || serial_port > 3) {
+        fprintf(stderr, "Invalid --serial-port: %s\n", v);
+        return false;
+      }
+    }
+    else if (!strcmp(arg, "--serial-log")) { auto v = value(); if (!v) return false; serial_log_file = v; }
+    else if (!strcmp(arg, "--capture-spill")) { auto v = value(); if (!v) return false; capture_spill_file = v; }
+    else if (!strcmp(arg, "--kinematic-rate")) { auto v = value(); if (!v) return false; kinematic_rate = atof(v); }
+    else if (!strcmp(arg, "--trace")    ) { auto v = value(); if (!v) return false; trace_file = v; }
+    else if (!strcmp(arg, "--replay")   ) { auto v = value(); if (!v) return false; replay_file = v; }
+    else if (!strcmp(arg, "--help") || !strcmp(arg, "-h")) {
+      print_usage(argv[0]);
+      return false;
+    }
+    else {
+      fprintf(stderr, "Unknown option: %s\n", arg);
+      print_usage(argv[0]);
+      return false;
+    }
+  }
+  // nothing else ends a headless run
+  if (headless && gcode_file.empty() && timeout <= 0) {
+    fprintf(stderr, "--headless needs --gcode FILE or --timeout SECONDS\n");
+    return false;
+  }
+  return true;
+}
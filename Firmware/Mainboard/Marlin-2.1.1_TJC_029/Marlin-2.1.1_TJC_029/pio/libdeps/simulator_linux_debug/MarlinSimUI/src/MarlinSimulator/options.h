@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+/**
+ * Command line configuration
+ *
+ *  --headless          run without SDL/OpenGL/ImGui and without the realtime lock, needs --gcode or --timeout
+ *  --gcode FILE        (headless) stream FILE to the host serial port and exit when it has been printed
+ *  --sd-image FILE     FAT image used by the simulated SD card, or a directory served as a FAT32 volume
+ *  --sd-flush SECONDS  persist the SD card's dirty sectors every SECONDS of simulated time, 0 only on reset, removal and exit
+ *  --sd-sync MODE      how persisted SD sectors reach the image: none (never, writes stay in memory), async (written to the file, the default) or full (and waits for the disk)
+ *  --sd-profile NAME  SD card timing: instant (the default), cheap-8gb, fast-a1 or a profile FILE
+ *  --sd-log FILE       write the SD card block access log as CSV to FILE at exit
+ *  --flash-timing      hold the SPI flash busy for the datasheet program and erase times
+ *  --eeprom FILE       file backing the emulated EEPROM
+ *  --eeprom-wear FILE  write how many commits changed each EEPROM address as CSV to FILE at exit
+ *  --summary FILE      (headless) write the JSON run summary to FILE instead of stdout
+ *  --timeout SECONDS   (headless) give up after SECONDS of simulated time
+ *  --echo              (headless) copy Marlin serial output to stderr
+ *  --restore FILE      restore a hardware snapshot before the firmware starts
+ *  --serial-log FILE   copy everything Marlin sends on the host serial port to FILE
+ *  --pty               expose the host serial port as a pseudo terminal for host software
+ *  --serial-port N     serial port (0-3) the options above use, Marlin's SERIAL_PORT by default
+ *  --stats FILE        collect per interrupt execution statistics, written as JSON to FILE at exit
+ *  --capture           start with pin logging enabled
+ *  --capture-spill FILE  keep pin log chunks evicted from memory in FILE instead of dropping them
+ *  --kinematic-rate HZ  publish the effector position to the visualisation at most HZ times per simulated second, 0 on every step
+ *  --trace FILE        record stepper and heater pin changes to the motion trace FILE
+ *  --trace-compress    zlib compress the motion trace blocks
+ *  --replay FILE       drive the printer from the motion trace FILE instead of running the firmware
+ */
+struct SimulatorOptions {
+  enum class SdSync : uint8_t {
+    NONE,
+    ASYNC,
+    FULL
+  };
+
+  bool headless = false;
+  bool echo_serial = false;
+  bool serial_pty = false;
+  bool capture = false;
+  bool trace_compress = false;
+  bool flash_timing = false;
+  int serial_port = -1; // Marlin's SERIAL_PORT
+  double timeout = 0.0;
+  double kinematic_rate = 1000.0;
+  double sd_flush_interval = 1.0;
+  SdSync sd_sync = SdSync::ASYNC;
+  std::string gcode_file;
+  std::string sd_image;
+  std::string sd_profile = "instant";
+  std::string sd_log_file;
+  std::string eeprom_file = "eeprom.dat";
+  std::string eeprom_wear_file;
+  std::string summary_file;
+  std::string restore_file;
+  std::string stats_file;
+  std::string serial_log_file;
+  std::string capture_spill_file;
+  std::string trace_file;
+  std::string replay_file;
+
+  // returns false when the program should exit (bad arguments or --help)
+  bool parse(int argc, char** argv);
+};
+
+extern SimulatorOptions simulator_options;
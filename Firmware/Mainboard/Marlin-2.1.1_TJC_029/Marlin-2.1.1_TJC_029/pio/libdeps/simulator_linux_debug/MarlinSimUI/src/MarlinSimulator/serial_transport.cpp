@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <termios.h>
+  #include <unistd.h>
+#endif
+
+#include "execution_control.h"
+#include "serial_transport.h"
+
+// after the kernel, the HAL serial yields to it
+#include <serial.h>
+
+// declared by Marlin's HAL, MYSERIALn is serial_stream_<SERIAL_PORT...>
+extern MSerialT serial_stream_0;
+extern MSerialT serial_stream_1;
+extern MSerialT serial_stream_2;
+extern MSerialT serial_stream_3;
+
+namespace {
+
+MSerialT* const serial_streams[SerialTransport::port_count] = {&serial_stream_0, &serial_stream_1, &serial_stream_2, &serial_stream_3};
+
+struct Transport {
+  std::mutex sink_mutex;
+  std::vector<std::shared_ptr<SerialSink>> sinks[SerialTransport::port_count];
+
+  std::mutex wake_mutex;
+  std::condition_variable wake;
+  bool woken = false;
+  // set while the transport waits, HalSerial only notifies then
+  std::atomic_bool idle{false};
+
+  std::atomic_bool running{false};
+  std::thread thread;
+  uint8_t buffer[HalSerial::receive_buffer_size];
+};
+
+Transport& transport() {
+  static Transport instance;
+  return instance;
+}
+
+// called by HalSerial after every byte, only the first call after the transport went idle wakes it
+void port_activity() {
+  auto& state = transport();
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (state.idle.load(std::memory_order_relaxed) && state.idle.exchange(false)) SerialTransport::notify();
+}
+
+} // namespace
+
+void SerialTransport::attach(std::size_t port, std::shared_ptr<SerialSink> sink) {
+  if (port >= port_count || !sink) return;
+  {
+    std::lock_guard<std::mutex> lock(transport().sink_mutex);
+    transport().sinks[port].push_back(std::move(sink));
+  }
+  // the new sink may poll for input
+  notify();
+}
+
+void SerialTransport::detach(std::size_t port, const std::shared_ptr<SerialSink>& sink) {
+  if (port >= port_count) return;
+  std::lock_guard<std::mutex> lock(transport().sink_mutex);
+  auto& sinks = transport().sinks[port];
+  sinks.erase(std::remove(sinks.begin(), sinks.end(), sink), sinks.end());
+}
+
+void SerialTransport::start() {
+  auto& state = transport();
+  if (state.running) return;
+  state.running = true;
+  HalSerial::on_activity = port_activity;
+  state.thread = std::thread(execute);
+}
+
+void SerialTransport::stop() {
+  auto& state = transport();
+  if (!state.running) return;
+  state.running = false;
+  HalSerial::on_activity = nullptr;
+  notify();
+  state.thread.join();
+}
+
+void SerialTransport::notify() {
+  auto& state = transport();
+  {
+    std::lock_guard<std::mutex> lock(state.wake_mutex);
+    state.woken = true;
+  }
+  state.wake.notify_one();
+}
+
+void SerialTransport::execute() {
+  #ifdef __APPLE__
+    pthread_setname_np("serial_transport");
+  #else
+    pthread_setname_np(pthread_self(), "serial_transport");
+  #endif
+
+  auto& state = transport();
+  // sinks are called on a copy, a slow sink never holds up attach() or detach()
+  std::vector<std::shared_ptr<SerialSink>> port_sinks[port_count];
+  std::size_t receive_space[port_count] = {};
+  while (state.running) {
+    {
+      std::lock_guard<std::mutex> lock(state.sink_mutex);
+      for (std::size_t port = 0; port < port_count; port++) port_sinks[port] = state.sinks[port];
+    }
+
+    bool moved = false, polled = false;
+    for (std::size_t port = 0; port < port_count; port++) {
+      auto& sinks = port_sinks[port];
+      auto& serial = *serial_streams[port];
+
+      // sinks read straight out of the ring, two spans cover everything buffered when it wraps,
+      // a port without sinks is still drained, HalSerial::write waits for space
+      for (int pass = 0; pass < 2; pass++) {
+        auto span = serial.transmit_buffer.peek_span();
+        if (!span.length) break;
+        for (auto& sink : sinks) sink->transmit(span.data, span.length);
+        serial.transmit_buffer.consume(span.length);
+        moved = true;
+      }
+
+      // input is staged so a sink always sees all the free space, not just the span before the wrap
+      bool received = false;
+      for (auto& sink : sinks) {
+        std::size_t space = std::min(serial.receive_buffer.free(), sizeof(state.buffer));
+        if (!space) break;
+        std::size_t count = sink->receive(state.buffer, space);
+        if (count) {
+          serial.receive_buffer.write(state.buffer, count);
+          received = true;
+        }
+      }
+      if (received) {
+        // Marlin may be idle waiting for input
+        Kernel::TimeControl::wake();
+        moved = true;
+      }
+      receive_space[port] = serial.receive_buffer.free();
+      for (auto& sink : sinks) polled |= sink->polls_input();
+    }
+
+    if (!moved) {
+      state.idle = true;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      // activity from before idle was set is caught here instead of by a notify
+      auto ready = [&state, &receive_space]{
+        if (state.woken) return true;
+        for (std::size_t port = 0; port < port_count; port++) {
+          auto& serial = *serial_streams[port];
+          if (serial.transmit_buffer.available() || serial.receive_buffer.free() != receive_space[port]) return true;
+        }
+        return false;
+      };
+      std::unique_lock<std::mutex> lock(state.wake_mutex);
+      if (polled) state.wake.wait_for(lock, idle_wait, ready);
+      else state.wake.wait(lock, ready);
+      state.woken = false;
+      state.idle = false;
+    }
+  }
+}
+
+FileSink::FileSink(const std::string& filename) {
+  file = fopen(filename.c_str(), "wb");
+  if (file == nullptr) fprintf(stderr, "FileSink: unable to write %s\n", filename.c_str());
+}
+
+FileSink::~FileSink() {
+  if (file) fclose(file);
+}
+
+void FileSink::transmit(const uint8_t* data, std::size_t length) {
+  if (file) fwrite(data, 1, length, file);
+}
+
+#ifndef _WIN32
+
+PtySink::PtySink() {
+  fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (fd < 0 || grantpt(fd) || unlockpt(fd) || ptsname(fd) == nullptr) {
+    fprintf(stderr, "PtySink: unable to open a pseudo terminal\n");
+    if (fd >= 0) close(fd);
+    fd = -1;
+    return;
+  }
+  device_path = ptsname(fd);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  // raw, so line endings and flow control characters reach Marlin untouched
+  termios settings;
+  if (tcgetattr(fd, &settings) == 0) {
+    cfmakeraw(&settings);
+    tcsetattr(fd, TCSANOW, &settings);
+  }
+}
+
+PtySink::~PtySink() {
+  if (fd >= 0) close(fd);
+}
+
+void PtySink::transmit(const uint8_t* data, std::size_t length) {
+  // output is dropped while nobody has the terminal open and its buffer is full
+  while (fd >= 0 && length) {
+    auto written = write(fd, data, length);
+    if (written <= 0) break;
+    data += written;
+    length -= written;
+  }
+}
+
+std::size_t PtySink::receive(uint8_t* data, std::size_t length) {
+  if (fd < 0) return 0;
+  auto count = read(fd, data, length);
+  return count > 0 ? count : 0;
+}
+
+#else
+
+// no pseudo terminals, is_open() stays false
+PtySink::PtySink() {
+  fprintf(stderr, "PtySink: pseudo terminals are not supported on this platform\n");
+}
+PtySink::~PtySink() {}
+void PtySink::transmit(const uint8_t* data, std::size_t length) {}
+std::size_t PtySink::receive(uint8_t* data, std::size_t length) { return 0; }
+
+#endif
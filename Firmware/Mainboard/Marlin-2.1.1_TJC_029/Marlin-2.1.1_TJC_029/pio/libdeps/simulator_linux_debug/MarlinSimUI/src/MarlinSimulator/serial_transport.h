@@ -0,0 +1,78 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+/**
+ * Host end of the simulated UARTs.
+ *
+ * Marlin only ever sees the MSerialT ring buffers. The transport thread is the single
+ * consumer of every transmit buffer and the single producer of every receive buffer:
+ * it hands Marlin's output to the sinks attached to the port and moves whatever the
+ * sinks have queued into the receive buffer. The simulation thread never touches UI
+ * objects or sockets. Output of a port without sinks is discarded.
+ *
+ * The transport sleeps until HalSerial reports output or freed input space, or a sink
+ * calls notify(). Sinks are called outside the lock that attach() and detach() take, so a
+ * detached sink may still see the call already in flight.
+ */
+class SerialSink {
+public:
+  virtual ~SerialSink() {}
+  // bytes Marlin transmitted, called on the transport thread
+  virtual void transmit(const uint8_t* data, std::size_t length) = 0;
+  // copy up to length bytes of input for Marlin into data, called on the transport thread
+  virtual std::size_t receive(uint8_t* data, std::size_t length) { return 0; }
+  // input that arrives without a SerialTransport::notify() has to be polled for every idle_wait
+  virtual bool polls_input() const { return false; }
+};
+
+class SerialTransport {
+public:
+  static constexpr std::size_t port_count = 4;
+
+  static void attach(std::size_t port, std::shared_ptr<SerialSink> sink);
+  static void detach(std::size_t port, const std::shared_ptr<SerialSink>& sink);
+
+  static void start();
+  static void stop();
+  // input was queued on a sink, end the idle wait early
+  static void notify();
+
+  // how long the transport sleeps when no port moved any data and a sink polls for input
+  static constexpr std::chrono::milliseconds idle_wait = std::chrono::milliseconds(1);
+
+private:
+  static void execute();
+};
+
+// Copy of everything Marlin sends, flushed when the sink is destroyed
+class FileSink : public SerialSink {
+public:
+  FileSink(const std::string& filename);
+  ~FileSink();
+  void transmit(const uint8_t* data, std::size_t length) override;
+
+private:
+  FILE* file = nullptr;
+};
+
+// Pseudo terminal that host software (Pronterface, OctoPrint) can open like a real port
+class PtySink : public SerialSink {
+public:
+  PtySink();
+  ~PtySink();
+  void transmit(const uint8_t* data, std::size_t length) override;
+  std::size_t receive(uint8_t* data, std::size_t length) override;
+  bool polls_input() const override { return fd >= 0; }
+
+  bool is_open() const { return fd >= 0; }
+  const std::string& path() const { return device_path; }
+
+private:
+  int fd = -1;
+  std::string device_path;
+};
@@ -0,0 +1,354 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+
+#include "execution_control.h"
+#include "signal_decoders.h"
+
+std::string describe(const int64_t value) {
+  char text[32];
+  snprintf(text, sizeof(text), "%" PRId64, value);
+  return text;
+}
+
+std::string describe(const double value) {
+  char text[32];
+  snprintf(text, sizeof(text), "%.1f", value);
+  return text;
+}
+
+std::string describe(const uint8_t value) {
+  char text[16];
+  snprintf(text, sizeof(text), value >= 0x20 && value < 0x7F ? "0x%02X '%c'" : "0x%02X", value, value);
+  return text;
+}
+
+std::string describe(const uint32_t value) {
+  char text[16];
+  snprintf(text, sizeof(text), "0x%08X", value);
+  return text;
+}
+
+std::string describe(const SpiTransaction& value) {
+  // long transactions (display frames, SD blocks) are cut short
+  static constexpr std::size_t shown = 16;
+  auto bytes = [](const std::vector<uint8_t>& data) {
+    std::string text;
+    char byte[4];
+    for (std::size_t i = 0; i < std::min(data.size(), shown); i++) {
+      snprintf(byte, sizeof(byte), "%02X ", data[i]);
+      text += byte;
+    }
+    if (data.size() > shown) text += "... ";
+    return text;
+  };
+  return std::to_string(value.mosi.size()) + " bytes, MOSI " + bytes(value.mosi) + "MISO " + bytes(value.miso);
+}
+
+const std::vector<SignalDecoder::Type>& SignalDecoder::types() {
+  static const std::vector<Type> types = {
+    {"Step/Dir", {"STEP", "DIR", "ENABLE"}, nullptr, 0, [](std::string name, std::vector<pin_type> pins, uint32_t) {
+      return std::unique_ptr<SignalDecoder>(new StepDirDecoder(name, pins[0], pins[1], pins[2]));
+    }},
+    {"SPI", {"CS", "MOSI", "MISO", "SCK"}, nullptr, 0, [](std::string name, std::vector<pin_type> pins, uint32_t) {
+      return std::unique_ptr<SignalDecoder>(new SpiDecoder(name, pins[0], pins[1], pins[2], pins[3]));
+    }, "Bit banged SPI only, transfers through the HAL SPI (SD card, SPI flash) never reach the pins"},
+    {"UART", {"TX"}, "Baud", 115200, [](std::string name, std::vector<pin_type> pins, uint32_t baud) {
+      return std::unique_ptr<SignalDecoder>(new UartDecoder(name, pins[0], baud));
+    }, "Software serial only, the HAL serial ports never toggle a TX pin"},
+    {"WS2812", {"DATA"}, "Bits per LED", 24, [](std::string name, std::vector<pin_type> pins, uint32_t bits) {
+      return std::unique_ptr<SignalDecoder>(new Ws2812Decoder(name, pins[0], bits));
+    }},
+  };
+  return types;
+}
+
+// Step/Dir, DIR and ENABLE come first so a step latches them when they change at the same time
+StepDirDecoder::StepDirDecoder(std::string name, pin_type step, pin_type dir, pin_type enable) : SignalDecoder(name, {dir, enable, step}) {
+  tracks = {&position, &velocity};
+}
+
+void StepDirDecoder::reset() {
+  steps = 0;
+  last_step = 0;
+  moving = false;
+}
+
+void StepDirDecoder::change(const std::size_t input, const uint64_t timestamp, const uint16_t value) {
+  if (input != STEP || !value || levels[STEP] || levels[ENABLE]) return;
+  int direction = levels[DIR] ? 1 : -1;
+  steps += direction;
+  position.push(timestamp, steps);
+  velocity.push(timestamp, moving ? direction * double(Kernel::TimeControl::ONE_BILLION) / (timestamp - last_step) : 0.0);
+  last_step = timestamp;
+  moving = true;
+}
+
+void StepDirDecoder::idle(const uint64_t timestamp) {
+  if (moving && timestamp - last_step > stopped_after) {
+    velocity.push(last_step + stopped_after, 0.0);
+    moving = false;
+  }
+}
+
+SpiDecoder::SpiDecoder(std::string name, pin_type cs, pin_type mosi, pin_type miso, pin_type sck) : SignalDecoder(name, {cs, mosi, miso, sck}) {
+  tracks = {&transactions};
+}
+
+void SpiDecoder::reset() {
+  selected = false;
+  current = {};
+  bits = 0;
+}
+
+void SpiDecoder::start(const uint64_t timestamp) {
+  selected = !levels[CS];
+  selected_at = timestamp;
+}
+
+void SpiDecoder::change(const std::size_t input, const uint64_t timestamp, const uint16_t value) {
+  if (input == CS) {
+    if (!value && !selected) {
+      selected = true;
+      selected_at = timestamp;
+      bits = 0;
+    }
+    else if (value && selected) {
+      finish(timestamp);
+      selected = false;
+    }
+  }
+  else if (input == SCK && value && !levels[SCK] && selected) {
+    mosi_byte = mosi_byte << 1 | (levels[MOSI] != 0);
+    miso_byte = miso_byte << 1 | (levels[MISO] != 0);
+    if (++bits == 8) {
+      current.mosi.push_back(mosi_byte);
+      current.miso.push_back(miso_byte);
+      bits = 0;
+      // a chip select that is never released still shows up
+      if (current.mosi.size() == max_transaction) {
+        finish(timestamp);
+        selected_at = timestamp;
+      }
+    }
+  }
+}
+
+void SpiDecoder::finish(const uint64_t timestamp) {
+  if (current.mosi.size()) {
+    current.end = timestamp;
+    transactions.push(selected_at, std::move(current));
+  }
+  current = {};
+}
+
+UartDecoder::UartDecoder(std::string name, pin_type tx, uint32_t baud) : SignalDecoder(name, {tx}), bit_nanos(Kernel::TimeControl::ONE_BILLION / std::max(baud, uint32_t(1))) {
+  tracks = {&bytes};
+}
+
+void UartDecoder::reset() {
+  receiving = false;
+}
+
+void UartDecoder::sample(const uint64_t timestamp) {
+  // sample k is taken in the middle of bit k: the start bit, 8 data bits then the stop bit
+  while (receiving && frame_start + bit * bit_nanos + bit_nanos / 2 < timestamp) {
+    bool level = levels[0] != 0;
+    if (bit == 0) receiving = !level;
+    else if (bit <= 8) data |= level << (bit - 1);
+    else {
+      if (level) bytes.push(frame_start, data);
+      receiving = false;
+    }
+    bit++;
+  }
+}
+
+void UartDecoder::change(const std::size_t input, const uint64_t timestamp, const uint16_t value) {
+  sample(timestamp);
+  if (!receiving && !value && levels[0]) {
+    receiving = true;
+    frame_start = timestamp;
+    bit = 0;
+    data = 0;
+  }
+}
+
+void UartDecoder::idle(const uint64_t timestamp) {
+  sample(timestamp);
+}
+
+// models energy transfer but not time lag as it tranfers through the medium.
+bool Ws2812Receiver::edge(const uint64_t timestamp, const bool rising, uint32_t& word) {
+  auto data = (uint32_t)(timestamp - last_edge);
+  last_edge = timestamp;
+
+  switch (state) {
+    case SignalState::INACTIVE:
+      data_word = 0;
+      bit_count = 0;
+      if (rising) { state = SignalState::HIGH; }
+      break;
+    case SignalState::HIGH:
+      if (rising) { state = SignalState::INACTIVE;}
+      else if (data > 200 && data < 500) { state = SignalState::LOW_ZERO;}
+      else if (data > 550 && data < 5500) { state = SignalState::LOW_ONE;}
+      else { state = SignalState::INACTIVE;}
+      break;
+    case SignalState::LOW_ZERO:
+      ++ bit_count;
+      data_word <<= 1;
+      if (data > 450 && data < 5000 && rising) {
+        state = SignalState::HIGH;
+      } else { state = SignalState::INACTIVE; }
+      break;
+    case SignalState::LOW_ONE:
+      ++ bit_count;
+      data_word <<= 1;
+      ++ data_word;
+      if (data > 450 && data < 5000 && rising) {
+        state = SignalState::HIGH;
+      } else { state = SignalState::INACTIVE; }
+      break;
+  }
+
+  if (bit_count == bits_per_word) {
+    word = data_word << (32 - bit_count);
+    bit_count = 0;
+    data_word = 0;
+    return true;
+  }
+  return false;
+}
+
+bool Ws2812Receiver::idle(const uint64_t timestamp, uint32_t& word) {
+  if (timestamp - last_edge <= reset_nanos || state == SignalState::INACTIVE) return false;
+  bool latched = false;
+  // the last bit of a word ends with the reset, not with an edge
+  if (bit_count == bits_per_word - 1) {
+    if (state == SignalState::LOW_ZERO) {
+        ++ bit_count;
+        data_word <<= 1;
+    } else if (state == SignalState::LOW_ONE) {
+        ++ bit_count;
+        data_word <<= 1;
+        ++ data_word;
+    }
+    word = data_word << (32 - bit_count);
+    latched = true;
+  }
+  state = SignalState::INACTIVE;
+  bit_count = 0;
+  data_word = 0;
+  return latched;
+}
+
+Ws2812Decoder::Ws2812Decoder(std::string name, pin_type data, uint8_t bits_per_word) : SignalDecoder(name, {data}), bits_per_word(bits_per_word), receiver(bits_per_word) {
+  tracks = {&words};
+}
+
+void Ws2812Decoder::reset() {
+  receiver = Ws2812Receiver(bits_per_word);
+}
+
+void Ws2812Decoder::change(const std::size_t input, const uint64_t timestamp, const uint16_t value) {
+  uint32_t word;
+  if (receiver.edge(timestamp, value > levels[0], word)) words.push(timestamp, word);
+}
+
+void Ws2812Decoder::idle(const uint64_t timestamp) {
+  uint32_t word;
+  // stamped with the last edge so the result does not depend on when the capture was polled
+  if (receiver.idle(timestamp, word)) words.push(receiver.idle_since(), word);
+}
+
+void DecoderPipeline::add(std::unique_ptr<SignalDecoder> decoder) {
+  Stage stage;
+  for (auto pin : decoder->pins) stage.cursors.emplace_back(pin);
+  stage.pending.resize(decoder->pins.size());
+  stage.decoder = std::move(decoder);
+  stages.push_back(std::move(stage));
+}
+
+void DecoderPipeline::remove(SignalDecoder* decoder) {
+  stages.erase(std::remove_if(stages.begin(), stages.end(), [decoder](const Stage& stage){ return stage.decoder.get() == decoder; }), stages.end());
+}
+
+void DecoderPipeline::restart() {
+  for (auto& stage : stages) {
+    stage.decoder->clear();
+    stage.cursors.clear();
+    for (auto pin : stage.decoder->pins) stage.cursors.emplace_back(pin);
+    std::fill(stage.pending.begin(), stage.pending.end(), false);
+    stage.started = false;
+  }
+}
+
+void DecoderPipeline::poll(GpioCapture& capture, uint64_t budget) {
+  if (capture.generation != generation) {
+    generation = capture.generation;
+    restart();
+  }
+
+  // the simulation thread publishes a change before simulated time moves past it,
+  // so nothing earlier than this can still turn up on an input that looks idle now
+  const uint64_t horizon = Kernel::SimulationRuntime::nanos();
+
+  for (auto& stage : stages) {
+    auto& decoder = *stage.decoder;
+    const std::size_t inputs = stage.cursors.size();
+    if (!stage.started) {
+      GpioCapture::Sample start{};
+      for (std::size_t i = 0; i < inputs; i++) {
+        start = capture.initial(stage.cursors[i].pin);
+        decoder.levels[i] = start.value;
+      }
+      decoder.start(start.timestamp);
+      stage.started = true;
+    }
+
+    // an input that ran out is not read again until the next poll, the newest chunk is copied on every attempt
+    std::vector<bool> exhausted(inputs);
+    bool caught_up = true;
+    while (true) {
+      std::size_t next = inputs;
+      for (std::size_t i = 0; i < inputs; i++) {
+        if (!stage.pending[i] && !exhausted[i]) {
+          stage.pending[i] = stage.cursors[i].next(capture);
+          exhausted[i] = !stage.pending[i];
+        }
+        if (stage.pending[i] && stage.cursors[i].timestamp < horizon && (next == inputs || stage.cursors[i].timestamp < stage.cursors[next].timestamp)) next = i;
+      }
+      if (next == inputs) break;
+      if (budget == 0) {
+        caught_up = false;
+        break;
+      }
+      budget--;
+
+      auto& cursor = stage.cursors[next];
+      if (cursor.value != decoder.levels[next]) {
+        decoder.change(next, cursor.timestamp, cursor.value);
+        decoder.levels[next] = cursor.value;
+      }
+      stage.pending[next] = false;
+    }
+    if (caught_up) decoder.idle(horizon);
+  }
+}
+
+bool DecoderPipeline::export_csv(const SignalDecoder& decoder, const std::string& filename) {
+  FILE* file = fopen(filename.c_str(), "w");
+  if (file == nullptr) {
+    fprintf(stderr, "DecoderPipeline::export_csv: unable to write %s\n", filename.c_str());
+    return false;
+  }
+  fprintf(file, "track,timestamp_ns,value\n");
+  for (auto track : decoder.tracks) {
+    for (std::size_t i = 0; i < track->size(); i++) {
+      fprintf(file, "\"%s\",%" PRIu64 ",\"%s\"\n", track->name.c_str(), track->timestamp(i), track->text(i).c_str());
+    }
+  }
+  fclose(file);
+  return true;
+}
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "hardware/Gpio.h"
+
+/**
+ * Protocol decoders over the pin capture.
+ *
+ * A decoder names the pins it reads and gets their changes merged in time order, changes at the
+ * same time arrive in input order (decoders list clocks after the data they latch). Results go into
+ * time indexed tracks that the Signal Analyser draws and exports. The pipeline follows the capture
+ * as it grows and starts over when the capture is reset, so decoding only sees what pin logging
+ * recorded.
+ *
+ * Only bit banged buses show up there. The HAL's SpiBus and HalSerial hand bytes straight to the
+ * simulated devices and the host without toggling a pin, so the SPI and UART decoders see nothing
+ * of the SD card, SPI flash, displays on the hardware SPI or the serial ports.
+ */
+
+// Output of a decoder, one value per timestamp in time order, the oldest are dropped past capacity
+class DecoderTrack {
+public:
+  DecoderTrack(std::string name) : name(std::move(name)) {}
+  virtual ~DecoderTrack() {}
+  virtual std::size_t size() const = 0;
+  virtual uint64_t timestamp(const std::size_t index) const = 0;
+  // first entry at or after timestamp
+  virtual std::size_t lower_bound(const uint64_t timestamp) const = 0;
+  virtual void clear() = 0;
+  // plotted when numeric, listed otherwise
+  virtual bool numeric() const = 0;
+  virtual double number(const std::size_t index) const = 0;
+  virtual std::string text(const std::size_t index) const = 0;
+
+  const std::string name;
+  static constexpr std::size_t capacity = 1000000;
+};
+
+struct SpiTransaction {
+  uint64_t end;
+  std::vector<uint8_t> mosi, miso;
+};
+
+std::string describe(const int64_t value);
+std::string describe(const double value);
+std::string describe(const uint8_t value);
+std::string describe(const uint32_t value);
+std::string describe(const SpiTransaction& value);
+
+template<typename T>
+class Track : public DecoderTrack {
+public:
+  struct Entry {
+    uint64_t timestamp;
+    T value;
+  };
+
+  using DecoderTrack::DecoderTrack;
+
+  void push(const uint64_t timestamp, T value) {
+    entries.push_back(Entry{timestamp, std::move(value)});
+    if (entries.size() > capacity) entries.pop_front();
+  }
+  const Entry& operator[](const std::size_t index) const { return entries[index]; }
+
+  std::size_t size() const override { return entries.size(); }
+  uint64_t timestamp(const std::size_t index) const override { return entries[index].timestamp; }
+  std::size_t lower_bound(const uint64_t timestamp) const override {
+    return std::lower_bound(entries.begin(), entries.end(), timestamp, [](const Entry& entry, uint64_t timestamp){ return entry.timestamp < timestamp; }) - entries.begin();
+  }
+  void clear() override { entries.clear(); }
+  bool numeric() const override { return std::is_arithmetic<T>::value; }
+  double number(const std::size_t index) const override {
+    if constexpr (std::is_arithmetic<T>::value) return entries[index].value;
+    else return 0;
+  }
+  std::string text(const std::size_t index) const override { return describe(entries[index].value); }
+
+private:
+  std::deque<Entry> entries;
+};
+
+class SignalDecoder {
+public:
+  SignalDecoder(std::string name, std::vector<pin_type> pins) : name(std::move(name)), pins(std::move(pins)), levels(this->pins.size()) {}
+  virtual ~SignalDecoder() {}
+
+  // back to the state before the first change
+  virtual void reset() {}
+  // levels holds every input at the start of the capture
+  virtual void start(const uint64_t timestamp) {}
+  // input changed to value, levels still holds the previous level of every input
+  virtual void change(const std::size_t input, const uint64_t timestamp, const uint16_t value) = 0;
+  // no input changes before timestamp, ends frames that finish on an idle line
+  virtual void idle(const uint64_t timestamp) {}
+
+  void clear() {
+    reset();
+    for (auto track : tracks) track->clear();
+  }
+
+  const std::string name;
+  const std::vector<pin_type> pins;
+  std::vector<uint16_t> levels;
+  std::vector<DecoderTrack*> tracks;
+
+  // built in decoders, for the UI to offer
+  struct Type {
+    const char* name;
+    std::vector<const char*> inputs;
+    const char* parameter; // nullptr when there is none
+    uint32_t default_parameter;
+    std::function<std::unique_ptr<SignalDecoder>(std::string name, std::vector<pin_type> pins, uint32_t parameter)> create;
+    const char* limitation = nullptr; // shown where the decoder is selected
+  };
+  static const std::vector<Type>& types();
+};
+
+// STEP rising edges while ENABLE is low, counted up while DIR is high, like StepperDriver
+class StepDirDecoder : public SignalDecoder {
+public:
+  StepDirDecoder(std::string name, pin_type step, pin_type dir, pin_type enable);
+  void reset() override;
+  void change(const std::size_t input, const uint64_t timestamp, const uint16_t value) override;
+  void idle(const uint64_t timestamp) override;
+
+  Track<int64_t> position{"Position (steps)"};
+  Track<double> velocity{"Velocity (steps/s)"};
+
+  // velocity drops to 0 after this long without a step
+  static constexpr uint64_t stopped_after = 50'000'000;
+
+private:
+  enum Input { DIR, ENABLE, STEP };
+  int64_t steps = 0;
+  uint64_t last_step = 0;
+  bool moving = false;
+};
+
+// mode 0 SPI, chip select active low, MOSI and MISO sampled MSB first on SCK rising
+class SpiDecoder : public SignalDecoder {
+public:
+  SpiDecoder(std::string name, pin_type cs, pin_type mosi, pin_type miso, pin_type sck);
+  void reset() override;
+  void start(const uint64_t timestamp) override;
+  void change(const std::size_t input, const uint64_t timestamp, const uint16_t value) override;
+
+  Track<SpiTransaction> transactions{"Transactions"};
+
+  // longer transfers are split into several transactions
+  static constexpr std::size_t max_transaction = 65536;
+
+private:
+  enum Input { CS, MOSI, MISO, SCK };
+  void finish(const uint64_t timestamp);
+  bool selected = false;
+  uint64_t selected_at = 0;
+  SpiTransaction current;
+  uint8_t bits = 0, mosi_byte = 0, miso_byte = 0;
+};
+
+// 8N1 UART, idle high, LSB first
+class UartDecoder : public SignalDecoder {
+public:
+  UartDecoder(std::string name, pin_type tx, uint32_t baud);
+  void reset() override;
+  void change(const std::size_t input, const uint64_t timestamp, const uint16_t value) override;
+  void idle(const uint64_t timestamp) override;
+
+  Track<uint8_t> bytes{"Bytes"};
+
+private:
+  // sample the line up to timestamp, it has held levels[0] since the last change
+  void sample(const uint64_t timestamp);
+
+  const uint64_t bit_nanos;
+  bool receiving = false;
+  uint64_t frame_start = 0;
+  uint8_t bit = 0, data = 0;
+};
+
+// Bit level WS2812 receiver, shared with NeoPixelDevice
+class Ws2812Receiver {
+public:
+  Ws2812Receiver(const uint8_t bits_per_word) : bits_per_word(bits_per_word) {}
+
+  // an edge at timestamp (ns), true when it completed a word, left aligned in word
+  bool edge(const uint64_t timestamp, const bool rising, uint32_t& word);
+  // the line has been idle until timestamp, true when that latched a word missing only its last low phase
+  bool idle(const uint64_t timestamp, uint32_t& word);
+  uint64_t idle_since() const { return last_edge; }
+
+  // the line resets after this long without an edge
+  static constexpr uint64_t reset_nanos = 50000;
+
+private:
+  enum class SignalState {
+    INACTIVE,
+    HIGH,
+    LOW_ONE,
+    LOW_ZERO
+  } state = SignalState::INACTIVE;
+  uint8_t bits_per_word;
+  uint64_t last_edge = 0;
+  uint8_t bit_count = 0;
+  uint32_t data_word = 0;
+};
+
+// Colours sent to a WS2812 chain, as transmitted (the channel order depends on the LED type)
+class Ws2812Decoder : public SignalDecoder {
+public:
+  Ws2812Decoder(std::string name, pin_type data, uint8_t bits_per_word);
+  void reset() override;
+  void change(const std::size_t input, const uint64_t timestamp, const uint16_t value) override;
+  void idle(const uint64_t timestamp) override;
+
+  Track<uint32_t> words{"Words"};
+
+private:
+  const uint8_t bits_per_word;
+  Ws2812Receiver receiver;
+};
+
+class DecoderPipeline {
+public:
+  void add(std::unique_ptr<SignalDecoder> decoder);
+  void remove(SignalDecoder* decoder);
+
+  // decode what the capture recorded since the last call, at most budget changes
+  void poll(GpioCapture& capture, uint64_t budget);
+  // decode the capture again from its start
+  void restart();
+
+  // write every track of decoder as CSV
+  static bool export_csv(const SignalDecoder& decoder, const std::string& filename);
+
+  struct Stage {
+    std::unique_ptr<SignalDecoder> decoder;
+    std::vector<GpioCapture::Cursor> cursors;
+    std::vector<bool> pending;
+    bool started = false;
+  };
+  std::vector<Stage> stages;
+
+private:
+  uint64_t generation = 0;
+};
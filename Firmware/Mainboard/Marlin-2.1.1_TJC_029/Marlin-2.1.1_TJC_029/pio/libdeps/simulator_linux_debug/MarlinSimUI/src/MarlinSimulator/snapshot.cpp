@@ -0,0 +1,367 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+
+#include "execution_control.h"
+#include "hardware/Gpio.h"
+#include "virtual_printer.h"
+#include "snapshot.h"
+
+namespace {
+
+constexpr char snapshot_magic[8] = {'M', 'S', 'I', 'M', 'S', 'N', 'A', 'P'};
+constexpr int max_base_depth = 16;
+
+std::atomic_bool firmware_running{false};
+
+enum Encoding : uint8_t {
+  RLE = 0,
+  XOR_RLE = 1
+};
+
+struct ExternalSection {
+  Snapshot::save_function save;
+  Snapshot::restore_function restore;
+};
+
+std::map<std::string, ExternalSection>& external_sections() {
+  static std::map<std::string, ExternalSection> sections;
+  return sections;
+}
+
+void put_varint(std::vector<uint8_t>& output, uint64_t value) {
+  while (value >= 0x80) {
+    output.push_back(uint8_t(value | 0x80));
+    value >>= 7;
+  }
+  output.push_back(uint8_t(value));
+}
+
+bool get_varint(const uint8_t* input, std::size_t size, std::size_t& position, uint64_t& value) {
+  value = 0;
+  for (int shift = 0; position < size && shift < 64; shift += 7) {
+    uint8_t byte = input[position++];
+    value |= uint64_t(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+// varint header (length << 1 | repeat), a repeat is followed by one byte, a literal by length bytes
+void rle_encode(const std::vector<uint8_t>& input, std::vector<uint8_t>& output) {
+  constexpr std::size_t min_run = 4;
+  std::size_t i = 0, literal_start = 0;
+  auto flush_literal = [&](std::size_t end) {
+    if (end == literal_start) return;
+    put_varint(output, (end - literal_start) << 1);
+    output.insert(output.end(), input.begin() + literal_start, input.begin() + end);
+  };
+  while (i < input.size()) {
+    std::size_t run = 1;
+    while (i + run < input.size() && input[i + run] == input[i]) run++;
+    if (run >= min_run) {
+      flush_literal(i);
+      put_varint(output, (run << 1) | 1);
+      output.push_back(input[i]);
+      literal_start = i + run;
+    }
+    i += run;
+  }
+  flush_literal(input.size());
+}
+
+bool rle_decode(const uint8_t* input, std::size_t size, std::vector<uint8_t>& output, std::size_t expected) {
+  output.clear();
+  // runs expand, so the input only bounds what a literal section needs up front
+  output.reserve(std::min<std::size_t>(expected, size));
+  std::size_t position = 0;
+  while (position < size) {
+    uint64_t header = 0;
+    if (!get_varint(input, size, position, header)) return false;
+    uint64_t length = header >> 1;
+    if (length > expected - output.size()) return false;
+    if (header & 1) {
+      if (position >= size) return false;
+      output.insert(output.end(), length, input[position++]);
+    } else {
+      if (length > size - position) return false;
+      output.insert(output.end(), input + position, input + position + length);
+      position += length;
+    }
+  }
+  return output.size() == expected;
+}
+
+// FNV-1a, identifies the base section a delta was xor'ed with
+uint64_t section_hash(const std::vector<uint8_t>& data) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (auto byte : data) hash = (hash ^ byte) * 0x100000001b3ULL;
+  return hash;
+}
+
+template<typename T>
+void put(FILE* file, const T& value) { fwrite(&value, sizeof(T), 1, file); }
+
+template<typename T>
+bool get(FILE* file, T& value) { return fread(&value, sizeof(T), 1, file) == 1; }
+
+void save_kernel(SnapshotWriter& writer) {
+  auto& kernel = Kernel::state();
+  writer.write<uint64_t>(Kernel::TimeControl::getTicks());
+  writer.write<uint8_t>(kernel.initialized);
+  writer.write<uint32_t>(kernel.timers.size());
+  for (auto& timer : kernel.timers) {
+    writer.write<uint8_t>(timer.active);
+    writer.write(timer.compare);
+    writer.write(timer.source_offset);
+    writer.write(timer.timer_frequency);
+  }
+}
+
+void restore_kernel(SnapshotReader& reader) {
+  auto& kernel = Kernel::state();
+  uint64_t ticks = 0;
+  uint8_t initialized = 0;
+  uint32_t timer_count = 0;
+  if (!reader.read(ticks) || !reader.read(initialized) || !reader.read(timer_count)) return;
+
+  Kernel::TimeControl::setTicks(ticks);
+  // keep the realtime lock from waiting for (or racing to) the restored time
+  kernel.realtime_nanos = Kernel::TimeControl::ticksToNanos(ticks);
+  Kernel::is_initialized(initialized);
+
+  // timers are matched by id, ones registered later than the snapshot keep their state
+  for (std::size_t id = 0; id < timer_count; id++) {
+    uint8_t active = 0;
+    uint64_t compare = 0, source_offset = 0, timer_frequency = 0;
+    if (!reader.read(active) || !reader.read(compare) || !reader.read(source_offset) || !reader.read(timer_frequency)) return;
+    if (id >= kernel.timers.size()) continue;
+    auto& timer = kernel.timers[id];
+    timer.active = active;
+    timer.compare = compare;
+    timer.source_offset = source_offset;
+    timer.timer_frequency = timer_frequency;
+    Kernel::Timers::reschedule(timer);
+  }
+}
+
+void save_gpio(SnapshotWriter& writer) {
+  for (auto& pin : Gpio::state().pin_map) {
+    writer.write<uint16_t>(pin.value);
+    writer.write<uint8_t>(pin.dir);
+    writer.write<uint8_t>(pin.mode);
+    writer.write<uint8_t>(pin.pull);
+  }
+}
+
+void restore_gpio(SnapshotReader& reader) {
+  for (auto& pin : Gpio::state().pin_map) {
+    uint16_t value = 0;
+    uint8_t dir = 0, mode = 0, pull = 0;
+    if (!reader.read(value) || !reader.read(dir) || !reader.read(mode) || !reader.read(pull)) return;
+    pin.value = value;
+    pin.dir = dir;
+    pin.mode = mode;
+    pin.pull = pull;
+  }
+}
+
+const std::string component_prefix = "component:";
+const std::string external_prefix = "external:";
+
+} // namespace
+
+bool Snapshot::register_section(std::string name, save_function save, restore_function restore) {
+  external_sections()[name] = ExternalSection{save, restore};
+  return true;
+}
+
+Snapshot Snapshot::capture() {
+  Snapshot snapshot;
+  SnapshotWriter kernel, gpio;
+  save_kernel(kernel);
+  save_gpio(gpio);
+  snapshot.sections["kernel"] = std::move(kernel.data);
+  snapshot.sections["gpio"] = std::move(gpio.data);
+
+  for (auto& component : VirtualPrinter::state().components) {
+    SnapshotWriter writer;
+    component->save_state(writer);
+    if (writer.data.size()) snapshot.sections[component_prefix + component->name] = std::move(writer.data);
+  }
+
+  for (auto& section : external_sections()) {
+    SnapshotWriter writer;
+    section.second.save(writer);
+    snapshot.sections[external_prefix + section.first] = std::move(writer.data);
+  }
+  return snapshot;
+}
+
+void Snapshot::firmware_started() {
+  firmware_running = true;
+}
+
+bool Snapshot::apply() const {
+  if (firmware_running) {
+    fprintf(stderr, "Snapshot::apply: the firmware is running, snapshots can only be restored at startup (--restore)\n");
+    return false;
+  }
+
+  auto restore = [this](const std::string& name, const std::function<void(SnapshotReader&)>& restore_function) {
+    auto section = sections.find(name);
+    if (section == sections.end()) return;
+    SnapshotReader reader(section->second);
+    restore_function(reader);
+    if (!reader.good()) fprintf(stderr, "Snapshot::apply: section %s is truncated\n", name.c_str());
+  };
+
+  restore("kernel", restore_kernel);
+  restore("gpio", restore_gpio);
+
+  // components are restored in creation order, so children (steppers) come before their owners
+  for (auto& component : VirtualPrinter::state().components) {
+    restore(component_prefix + component->name, [&component](SnapshotReader& reader) { component->restore_state(reader); });
+  }
+
+  for (auto& section : external_sections()) {
+    restore(external_prefix + section.first, section.second.restore);
+  }
+  return true;
+}
+
+bool Snapshot::save(const std::string& filename, const std::string& base_filename) const {
+  if (base_filename.size() && filename == base_filename) {
+    fprintf(stderr, "Snapshot::save: %s can not be its own base\n", filename.c_str());
+    return false;
+  }
+
+  Snapshot base;
+  if (base_filename.size() && !base.load(base_filename)) {
+    fprintf(stderr, "Snapshot::save: unable to load base %s\n", base_filename.c_str());
+    return false;
+  }
+
+  FILE* file = fopen(filename.c_str(), "wb");
+  if (file == nullptr) {
+    fprintf(stderr, "Snapshot::save: unable to write %s\n", filename.c_str());
+    return false;
+  }
+
+  fwrite(snapshot_magic, sizeof(snapshot_magic), 1, file);
+  put<uint32_t>(file, version);
+  put<uint32_t>(file, sections.size());
+  put<uint32_t>(file, base_filename.size());
+  fwrite(base_filename.data(), 1, base_filename.size(), file);
+
+  std::vector<uint8_t> delta, stored;
+  for (auto& section : sections) {
+    const std::vector<uint8_t>* payload = &section.second;
+    uint8_t encoding = RLE;
+    uint64_t base_hash = 0;
+
+    auto base_section = base.sections.find(section.first);
+    if (base_section != base.sections.end() && base_section->second.size() == section.second.size()) {
+      delta.resize(section.second.size());
+      for (std::size_t i = 0; i < delta.size(); i++) delta[i] = section.second[i] ^ base_section->second[i];
+      payload = &delta;
+      encoding = XOR_RLE;
+      base_hash = section_hash(base_section->second);
+    }
+
+    stored.clear();
+    rle_encode(*payload, stored);
+
+    put<uint32_t>(file, section.first.size());
+    fwrite(section.first.data(), 1, section.first.size(), file);
+    put<uint8_t>(file, encoding);
+    put<uint64_t>(file, section.second.size());
+    put<uint64_t>(file, stored.size());
+    if (encoding == XOR_RLE) put<uint64_t>(file, base_hash);
+    fwrite(stored.data(), 1, stored.size(), file);
+  }
+
+  bool result = !ferror(file);
+  fclose(file);
+  return result;
+}
+
+bool Snapshot::load(const std::string& filename) {
+  return load(filename, 0);
+}
+
+bool Snapshot::load(const std::string& filename, int depth) {
+  if (depth > max_base_depth) {
+    fprintf(stderr, "Snapshot::load: base chain of %s is too deep\n", filename.c_str());
+    return false;
+  }
+
+  std::unique_ptr<FILE, decltype(&fclose)> file(fopen(filename.c_str(), "rb"), &fclose);
+  if (!file) {
+    fprintf(stderr, "Snapshot::load: unable to open %s\n", filename.c_str());
+    return false;
+  }
+
+  // every size in the file is checked against what is left of it
+  fseek(file.get(), 0, SEEK_END);
+  const uint64_t file_size = ftell(file.get());
+  fseek(file.get(), 0, SEEK_SET);
+  auto remaining = [&file, file_size]() { return file_size - uint64_t(ftell(file.get())); };
+
+  char magic[sizeof(snapshot_magic)] = {};
+  uint32_t file_version = 0, section_count = 0, base_length = 0;
+  if (fread(magic, sizeof(magic), 1, file.get()) != 1 || memcmp(magic, snapshot_magic, sizeof(magic))
+      || !get(file.get(), file_version) || !get(file.get(), section_count) || !get(file.get(), base_length)) {
+    fprintf(stderr, "Snapshot::load: %s is not a snapshot\n", filename.c_str());
+    return false;
+  }
+  if (file_version != version) {
+    fprintf(stderr, "Snapshot::load: %s has unsupported version %u\n", filename.c_str(), file_version);
+    return false;
+  }
+
+  if (base_length > remaining()) return false;
+  std::string base_filename(base_length, '\0');
+  if (base_length && fread(&base_filename[0], 1, base_length, file.get()) != base_length) return false;
+
+  Snapshot base;
+  if (base_length && !base.load(base_filename, depth + 1)) return false;
+
+  sections.clear();
+  std::vector<uint8_t> stored;
+  for (uint32_t index = 0; index < section_count; index++) {
+    uint32_t name_length = 0;
+    uint8_t encoding = 0;
+    uint64_t size = 0, stored_size = 0;
+    if (!get(file.get(), name_length) || name_length > remaining()) return false;
+    std::string name(name_length, '\0');
+    if (name_length && fread(&name[0], 1, name_length, file.get()) != name_length) return false;
+    uint64_t base_hash = 0;
+    if (!get(file.get(), encoding) || !get(file.get(), size) || !get(file.get(), stored_size)) return false;
+    if (encoding == XOR_RLE && !get(file.get(), base_hash)) return false;
+    if (stored_size > remaining() || size > max_section_size) {
+      fprintf(stderr, "Snapshot::load: section %s of %s has an invalid size\n", name.c_str(), filename.c_str());
+      return false;
+    }
+
+    stored.resize(stored_size);
+    if (stored_size && fread(stored.data(), 1, stored_size, file.get()) != stored_size) return false;
+
+    auto& payload = sections[name];
+    if (!rle_decode(stored.data(), stored.size(), payload, size)) {
+      fprintf(stderr, "Snapshot::load: section %s of %s is corrupt\n", name.c_str(), filename.c_str());
+      return false;
+    }
+
+    if (encoding == XOR_RLE) {
+      auto base_section = base.sections.find(name);
+      if (base_section == base.sections.end() || base_section->second.size() != size || section_hash(base_section->second) != base_hash) {
+        fprintf(stderr, "Snapshot::load: section %s of %s does not match its base, was %s overwritten?\n", name.c_str(), filename.c_str(), base_filename.c_str());
+        return false;
+      }
+      for (std::size_t i = 0; i < payload.size(); i++) payload[i] ^= base_section->second[i];
+    }
+  }
+  return true;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Serialises one snapshot section, values are written in host byte order
+ */
+class SnapshotWriter {
+public:
+  template<typename T>
+  void write(const T& value) {
+    static_assert(std::is_trivially_copyable<T>::value, "only plain values can be written directly");
+    write_bytes(&value, sizeof(T));
+  }
+
+  void write_bytes(const void* source, std::size_t size) {
+    auto bytes = (const uint8_t*)source;
+    data.insert(data.end(), bytes, bytes + size);
+  }
+
+  void write_string(const std::string& value) {
+    write<uint32_t>(value.size());
+    write_bytes(value.data(), value.size());
+  }
+
+  std::vector<uint8_t> data;
+};
+
+/**
+ * Reads back a section written by SnapshotWriter, reads past the end leave the
+ * destination untouched and clear good()
+ */
+class SnapshotReader {
+public:
+  SnapshotReader(const std::vector<uint8_t>& data) : data(data) {}
+
+  template<typename T>
+  bool read(T& value) {
+    static_assert(std::is_trivially_copyable<T>::value, "only plain values can be read directly");
+    return read_bytes(&value, sizeof(T));
+  }
+
+  bool read_bytes(void* destination, std::size_t size) {
+    if (!valid || size > data.size() - position) return valid = false;
+    memcpy(destination, data.data() + position, size);
+    position += size;
+    return true;
+  }
+
+  bool read_string(std::string& value) {
+    uint32_t size = 0;
+    if (!read(size) || size > data.size() - position) return valid = false;
+    value.assign((const char*)data.data() + position, size);
+    position += size;
+    return true;
+  }
+
+  bool good() const { return valid; }
+
+private:
+  const std::vector<uint8_t>& data;
+  std::size_t position = 0;
+  bool valid = true;
+};
+
+/**
+ * Checkpoint of the simulated hardware
+ *
+ * A snapshot is a set of named sections: the kernel clock and timers, pin states, one
+ * section per component that implements save_state and any registered external section
+ * (the EEPROM). Marlin's own RAM (planner, stepper, thermal state) is not part of it, so a
+ * snapshot can only be applied before the firmware's setup() has run: with --restore or to
+ * rewind a replay. Once the firmware has started apply() refuses.
+ *
+ * File layout, integers in host byte order:
+ *   "MSIMSNAP" u32 version, u32 section count, u32 base path length, base path
+ *   per section: u32 name length, name, u8 encoding, u64 size, u64 stored size,
+ *                [u64 hash of the base section when xor'ed], stored bytes
+ * Sections are run length encoded, when a base snapshot is given a section of the same size
+ * in the base is xor'ed in first so unchanged state stores as a few bytes. The base is only
+ * named by its path, so the hash of every base section used is kept and a delta whose base
+ * has since been overwritten fails to load. Sizes read from a file are checked against its
+ * length and max_section_size before anything is allocated.
+ *
+ * capture() and apply() must run on the simulation thread between interrupts, use
+ * Kernel::run_at_safe_point() from other threads.
+ */
+class Snapshot {
+public:
+  static constexpr uint32_t version = 2;
+  static constexpr uint64_t max_section_size = 1ULL << 30;
+
+  typedef std::function<void(SnapshotWriter&)> save_function;
+  typedef std::function<void(SnapshotReader&)> restore_function;
+
+  static Snapshot capture();
+  // false once the firmware has started
+  bool apply() const;
+  // called before Marlin's setup()
+  static void firmware_started();
+
+  // filename can not be base_filename, a delta never overwrites its own base
+  bool save(const std::string& filename, const std::string& base_filename = "") const;
+  bool load(const std::string& filename);
+
+  // state that lives outside the component tree, returns true so it can initialise a static
+  static bool register_section(std::string name, save_function save, restore_function restore);
+
+  std::map<std::string, std::vector<uint8_t>> sections;
+
+private:
+  bool load(const std::string& filename, int depth);
+};
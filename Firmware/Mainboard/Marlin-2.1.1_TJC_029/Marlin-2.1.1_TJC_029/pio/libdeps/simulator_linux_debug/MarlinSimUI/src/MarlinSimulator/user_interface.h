@@ -4,7 +4,9 @@
 #include <vector>
 #include <deque>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <cstring>
 #include <sstream>
 #include <algorithm>
 
@@ -199,13 +201,11 @@ struct StatusWindow : public UiWindow {
 };
 
 #include <serial.h>
-extern MSerialT serial_stream_0;
-extern MSerialT serial_stream_1;
-extern MSerialT serial_stream_2;
-extern MSerialT serial_stream_3;
+#include "serial_transport.h"
 
-struct SerialMonitor : public UiWindow {
-  SerialMonitor(std::string name, MSerialT& serial_stream) : UiWindow(name), serial_stream(serial_stream) {};
+// Marlin output is queued by the transport thread and parsed into lines by the UI thread
+struct SerialMonitor : public UiWindow, public SerialSink {
+  SerialMonitor(std::string name) : UiWindow(name) {};
   char InputBuf[256] = {};
   std::string working_buffer;
   struct line_meta {
@@ -221,9 +221,33 @@ struct SerialMonitor : public UiWindow {
   bool streaming = false;
   std::size_t stream_sent = 0, stream_total = 0;
 
-  MSerialT& serial_stream;
   std::ifstream input_file;
 
+  std::mutex transport_mutex;
+  std::string transmitted;   // from Marlin, not yet split into lines
+  std::string pending_input; // to Marlin, waiting for receive buffer space
+
+  void transmit(const uint8_t* data, std::size_t length) override {
+    std::lock_guard<std::mutex> lock(transport_mutex);
+    transmitted.append((const char*)data, length);
+  }
+
+  std::size_t receive(uint8_t* data, std::size_t length) override {
+    std::lock_guard<std::mutex> lock(transport_mutex);
+    length = std::min(length, pending_input.size());
+    memcpy(data, pending_input.data(), length);
+    pending_input.erase(0, length);
+    return length;
+  }
+
+  void queue_input(const char* data, std::size_t length) {
+    {
+      std::lock_guard<std::mutex> lock(transport_mutex);
+      pending_input.append(data, length);
+    }
+    SerialTransport::notify();
+  }
+
   int input_callback(ImGuiInputTextCallbackData* data) {
     switch (data->EventFlag) {
       case ImGuiInputTextFlags_CallbackCompletion:   // TODO: just search history?
@@ -268,12 +292,24 @@ struct SerialMonitor : public UiWindow {
   }
 
   void show() {
-      // File read into serial port
-    if (input_file.is_open() && serial_stream.receive_buffer.free() && streaming) {
-      uint8_t buffer[HalSerial::receive_buffer_size]{};
-      size_t read_size = std::min(serial_stream.receive_buffer.free(), stream_total - stream_sent);
-      input_file.read((char*)buffer, read_size);
-      serial_stream.receive_buffer.write(buffer, read_size);
+    std::string received;
+    {
+      std::lock_guard<std::mutex> lock(transport_mutex);
+      received.swap(transmitted);
+    }
+    if (received.size()) insert_text(received);
+
+      // File read into serial port, at most one receive buffer ahead of Marlin
+    std::size_t queued = 0;
+    {
+      std::lock_guard<std::mutex> lock(transport_mutex);
+      queued = pending_input.size();
+    }
+    if (input_file.is_open() && queued < HalSerial::receive_buffer_size && streaming) {
+      char buffer[HalSerial::receive_buffer_size];
+      size_t read_size = std::min(HalSerial::receive_buffer_size - queued, stream_total - stream_sent);
+      input_file.read(buffer, read_size);
+      queue_input(buffer, read_size);
       stream_sent += read_size;
       if (stream_sent >= stream_total) {
         input_file.close();
@@ -341,7 +377,7 @@ struct SerialMonitor : public UiWindow {
     size.y -= 25; // TODO: there must be a better way to fill 2 items on a line
     if (ImGui::BeginChild(child_id, size, true, child_flags)) {
       for (auto line : line_buffer) {
-        if (line.count > 1) ImGui::TextWrapped("[%ld] %s", line.count, (char *)line.text.c_str());
+        if (line.count > 1) ImGui::TextWrapped("[%zu] %s", line.count, (char *)line.text.c_str());
         else  ImGui::TextWrapped("%s", (char *)line.text.c_str());
       }
       ImGui::TextWrapped("%s", (char *)working_buffer.c_str());
@@ -370,8 +406,7 @@ struct SerialMonitor : public UiWindow {
           if (command_history.size() == 0 || command_history.front() != input) command_history.push_front(input);
           history_index = 0;
           input.push_back('\n');
-          std::size_t count = serial_stream.receive_buffer.free();
-          serial_stream.receive_buffer.write((uint8_t *)input.c_str(), std::min({count, input.size()}));
+          queue_input(input.c_str(), input.size());
         }
         strcpy((char*)InputBuf, "");
         reclaim_focus = true;
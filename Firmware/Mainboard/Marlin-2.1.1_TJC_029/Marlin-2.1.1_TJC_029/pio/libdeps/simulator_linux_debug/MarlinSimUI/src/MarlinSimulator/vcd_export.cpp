@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+
+#include <zlib.h>
+
+#include "vcd_export.h"
+
+namespace {
+
+// buffered output to a plain or gzip file
+class VcdOutput {
+public:
+  VcdOutput(const std::string& filename, const bool compress) {
+    if (compress) gz = gzopen(filename.c_str(), "wb6");
+    else file = fopen(filename.c_str(), "wb");
+    buffer.reserve(buffer_size);
+  }
+
+  ~VcdOutput() {
+    flush();
+    if (gz) gzclose(gz);
+    if (file) fclose(file);
+  }
+
+  bool is_open() const { return gz || file; }
+  bool failed() const { return error; }
+
+  void append(const char* text, std::size_t length) {
+    if (buffer.size() + length > buffer_size) flush();
+    buffer.insert(buffer.end(), text, text + length);
+  }
+  void append(const std::string& text) { append(text.data(), text.size()); }
+  void append(const char c) {
+    if (buffer.size() == buffer_size) flush();
+    buffer.push_back(c);
+  }
+  void append(uint64_t value) {
+    char digits[20];
+    std::size_t count = 0;
+    do { digits[count++] = '0' + value % 10; value /= 10; } while (value);
+    while (count) append(digits[--count]);
+  }
+
+  void flush() {
+    if (buffer.empty()) return;
+    if (gz) error |= gzwrite(gz, buffer.data(), buffer.size()) != int(buffer.size());
+    else if (file) error |= fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size();
+    buffer.clear();
+  }
+
+private:
+  static constexpr std::size_t buffer_size = 1 << 20;
+  std::vector<char> buffer;
+  gzFile gz = nullptr;
+  FILE* file = nullptr;
+  bool error = false;
+};
+
+struct Cursor : GpioCapture::Cursor {
+  Cursor(const std::size_t pin, std::string id, const uint64_t end_sequence, const bool vector) : GpioCapture::Cursor(pin), id(id), end_sequence(end_sequence), vector(vector) {}
+
+  bool advance(GpioCapture& capture, std::atomic_uint64_t& chunks_done) {
+    uint64_t passed = sequence();
+    bool more = next(capture, end_sequence);
+    chunks_done += (more ? sequence() : end_sequence) - passed;
+    return more;
+  }
+
+  std::string id;
+  uint64_t end_sequence;
+  bool vector;
+};
+
+constexpr std::size_t vector_width = 16;
+
+// scalar changes are "0id", vector changes "b101 id" with leading zeros dropped
+void append_change(VcdOutput& output, const Cursor& cursor, const uint16_t value) {
+  if (cursor.vector) {
+    output.append('b');
+    int bit = vector_width - 1;
+    while (bit > 0 && !(value >> bit & 1)) bit--;
+    for (; bit >= 0; bit--) output.append(char('0' + (value >> bit & 1)));
+    output.append(' ');
+  } else output.append(value ? '1' : '0');
+  output.append(cursor.id);
+  output.append('\n');
+}
+
+// VCD identifiers are short strings of printable characters
+std::string identifier(std::size_t index) {
+  std::string id;
+  do { id += char('!' + index % 94); index /= 94; } while (index);
+  return id;
+}
+
+std::string scope_of(const std::string& name) {
+  return name.substr(0, name.find_first_of('_'));
+}
+
+} // namespace
+
+VcdExporter::~VcdExporter() {
+  cancel();
+}
+
+bool VcdExporter::start(GpioCapture& capture, const std::string& filename, std::vector<Signal> signals, const bool compress) {
+  if (active) return false;
+  if (thread.joinable()) thread.join();
+  cancelled = false;
+  chunks_done = 0;
+  chunks_total = 0;
+  active = true;
+  thread = std::thread(&VcdExporter::execute, this, std::ref(capture), filename, std::move(signals), compress);
+  return true;
+}
+
+void VcdExporter::cancel() {
+  cancelled = true;
+  if (thread.joinable()) thread.join();
+}
+
+float VcdExporter::progress() const {
+  uint64_t total = chunks_total;
+  return total ? std::min(1.0f, float(chunks_done) / total) : 0.0f;
+}
+
+void VcdExporter::execute(GpioCapture& capture, const std::string filename, std::vector<Signal> signals, const bool compress) {
+  #ifdef __APPLE__
+    pthread_setname_np("vcd_export");
+  #else
+    pthread_setname_np(pthread_self(), "vcd_export");
+  #endif
+
+  auto started = std::chrono::steady_clock::now();
+  uint64_t events = 0;
+  {
+    VcdOutput output(filename, compress);
+    if (!output.is_open()) {
+      status = "Unable to write " + filename;
+      active = false;
+      return;
+    }
+
+    // signals are declared grouped by scope, the first part of the pin name
+    std::stable_sort(signals.begin(), signals.end(), [](const Signal& a, const Signal& b){ return scope_of(a.name) < scope_of(b.name); });
+
+    std::vector<Cursor> cursors;
+    cursors.reserve(signals.size());
+    for (std::size_t i = 0; i < signals.size(); i++) {
+      cursors.push_back(Cursor{signals[i].pin, identifier(i), capture.end_sequence(signals[i].pin), capture.peak(signals[i].pin) > 1});
+      chunks_total += cursors.back().end_sequence;
+    }
+
+    time_t now = time(nullptr);
+    char date[64];
+    strftime(date, sizeof(date), "%c", localtime(&now));
+    output.append(std::string("$date\n  ") + date + "\n$end\n$version\n  MarlinSimulator\n$end\n$timescale 1 ns $end\n");
+    std::string scope;
+    for (std::size_t i = 0; i < signals.size(); i++) {
+      if (i == 0 || scope_of(signals[i].name) != scope) {
+        if (i) output.append("$upscope $end\n");
+        scope = scope_of(signals[i].name);
+        output.append("$scope module " + scope + " $end\n");
+      }
+      if (cursors[i].vector) output.append("$var wire " + std::to_string(vector_width) + " " + cursors[i].id + " " + signals[i].name + " [" + std::to_string(vector_width - 1) + ":0] $end\n");
+      else output.append("$var wire 1 " + cursors[i].id + " " + signals[i].name + " $end\n");
+    }
+    if (signals.size()) output.append("$upscope $end\n");
+    output.append("$enddefinitions $end\n");
+
+    // times are relative to the start of the capture, where every pin has a known level
+    uint64_t origin = UINT64_MAX;
+    output.append("$dumpvars\n");
+    for (auto& cursor : cursors) {
+      auto start = capture.initial(cursor.pin);
+      origin = std::min(origin, start.timestamp);
+      append_change(output, cursor, start.value);
+    }
+    output.append("$end\n");
+
+    // min heap on (timestamp, signal), ties keep declaration order
+    auto later = [&cursors](std::size_t a, std::size_t b) {
+      return cursors[a].timestamp != cursors[b].timestamp ? cursors[a].timestamp > cursors[b].timestamp : a > b;
+    };
+    std::vector<std::size_t> heap;
+    heap.reserve(cursors.size());
+    for (std::size_t i = 0; i < cursors.size(); i++) {
+      if (cursors[i].advance(capture, chunks_done)) heap.push_back(i);
+    }
+    std::make_heap(heap.begin(), heap.end(), later);
+
+    uint64_t current = UINT64_MAX;
+    while (heap.size() && !cancelled) {
+      std::pop_heap(heap.begin(), heap.end(), later);
+      auto& cursor = cursors[heap.back()];
+      if (cursor.timestamp != current) {
+        current = cursor.timestamp;
+        output.append('#');
+        output.append(current - std::min(current, origin));
+        output.append('\n');
+      }
+      append_change(output, cursor, cursor.value);
+      events++;
+
+      if (cursor.advance(capture, chunks_done)) std::push_heap(heap.begin(), heap.end(), later);
+      else heap.pop_back();
+    }
+
+    output.flush();
+    if (output.failed()) status = "Error writing " + filename;
+    else if (cancelled) status = "Export cancelled";
+    else {
+      char summary[128];
+      snprintf(summary, sizeof(summary), "Exported %" PRIu64 " events from %" PRIu64 " pins in %.2fs", events, (uint64_t)signals.size(),
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+      status = summary;
+    }
+  }
+  active = false;
+}
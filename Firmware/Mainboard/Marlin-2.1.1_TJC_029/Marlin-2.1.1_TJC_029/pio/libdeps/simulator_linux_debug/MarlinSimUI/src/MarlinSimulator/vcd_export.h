@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hardware/GpioCapture.h"
+
+/**
+ * Value Change Dump export of captured pins.
+ *
+ * Each pin's capture is already in time order, so the pins are merged through a heap holding
+ * one cursor per pin instead of being sorted. Memory use is one chunk per pin whatever the length
+ * of the capture. The file is written on a background thread through a large buffer, gzip
+ * compressed when requested. Events captured after the export started are not included.
+ * Pins that only ever were 0 or 1 are 1 bit wires, PWM and analog pins 16 bit vectors.
+ */
+class VcdExporter {
+public:
+  struct Signal {
+    std::size_t pin;
+    std::string name;
+  };
+
+  ~VcdExporter();
+
+  // false if an export is still running
+  bool start(GpioCapture& capture, const std::string& filename, std::vector<Signal> signals, const bool compress);
+  void cancel();
+
+  bool running() const { return active; }
+  // fraction of the captured chunks written so far
+  float progress() const;
+  // summary of the last export, only valid while nothing is running
+  const std::string& result() const { return status; }
+
+private:
+  void execute(GpioCapture& capture, const std::string filename, std::vector<Signal> signals, const bool compress);
+
+  std::thread thread;
+  std::atomic_bool active{false};
+  std::atomic_bool cancelled{false};
+  std::atomic_uint64_t chunks_done{0};
+  std::atomic_uint64_t chunks_total{0};
+  std::string status;
+};
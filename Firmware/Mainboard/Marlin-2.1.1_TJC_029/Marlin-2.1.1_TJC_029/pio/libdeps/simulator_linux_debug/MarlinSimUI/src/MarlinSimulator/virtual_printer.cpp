@@ -28,10 +28,17 @@
   #define SD_DETECT_STATE HIGH
 #endif
 
-std::function<void(glm::vec4)> VirtualPrinter::on_kinematic_update;
-std::map<std::string, std::shared_ptr<VirtualPrinter::Component>> VirtualPrinter::component_map;
-std::vector<std::shared_ptr<VirtualPrinter::Component>> VirtualPrinter::components;
-std::shared_ptr<VirtualPrinter::Component> VirtualPrinter::root;
+VirtualPrinter::State VirtualPrinter::main_state;
+
+namespace {
+
+// the firmware reads the endstop through the live position, the UI through the published copy
+template<typename Kinematics>
+void add_endstop(std::shared_ptr<VirtualPrinter::Component> parent, std::string name, pin_type pin, bool inverting, std::shared_ptr<Kinematics> kinematics, std::function<bool(const KinematicPosition&)> test) {
+  parent->add_component<EndStop>(name, pin, inverting, [kinematics, test](){ return test(kinematics->current_position()); }, [kinematics, test](){ return test(kinematics->published_position()); });
+}
+
+}
 
 void VirtualPrinter::Component::ui_widgets() {
   ui_widget();
@@ -47,28 +54,30 @@ void VirtualPrinter::Component::ui_widgets() {
 }
 
 void VirtualPrinter::build() {
-  root = add_component<Component>("root");
+  auto& on_kinematic_update = state().on_kinematic_update;
+  if (!on_kinematic_update) on_kinematic_update = [](glm::vec4){}; // nothing to visualise when headless
+  auto root = state().root = add_component<Component>("root");
 
   #if ENABLED(DELTA)
     auto kinematics = root->add_component<DeltaKinematicSystem>("Delta Kinematic System", on_kinematic_update);
-    root->add_component<EndStop>("Endstop(Tower A Max)", X_MAX_PIN, X_MAX_ENDSTOP_INVERTING, [kinematics](){ return kinematics->stepper_position.x >= Z_MAX_POS; });
-    root->add_component<EndStop>("Endstop(Tower B Max)", Y_MAX_PIN, Y_MAX_ENDSTOP_INVERTING, [kinematics](){ return kinematics->stepper_position.y >= Z_MAX_POS; });
-    root->add_component<EndStop>("Endstop(Tower C Max)", Z_MAX_PIN, Z_MAX_ENDSTOP_INVERTING, [kinematics](){ return kinematics->stepper_position.z >= Z_MAX_POS; });
+    add_endstop(root, "Endstop(Tower A Max)", X_MAX_PIN, X_MAX_ENDSTOP_INVERTING, kinematics, [](const KinematicPosition& p){ return p.stepper_position.x >= Z_MAX_POS; });
+    add_endstop(root, "Endstop(Tower B Max)", Y_MAX_PIN, Y_MAX_ENDSTOP_INVERTING, kinematics, [](const KinematicPosition& p){ return p.stepper_position.y >= Z_MAX_POS; });
+    add_endstop(root, "Endstop(Tower C Max)", Z_MAX_PIN, Z_MAX_ENDSTOP_INVERTING, kinematics, [](const KinematicPosition& p){ return p.stepper_position.z >= Z_MAX_POS; });
   #else
     auto kinematics = root->add_component<KinematicSystem>("Cartesian Kinematic System", on_kinematic_update);
-    root->add_component<EndStop>("Endstop(X Min)", X_MIN_PIN, X_MIN_ENDSTOP_INVERTING, [kinematics](){ return kinematics->effector_position.x <= X_MIN_POS; });
-    root->add_component<EndStop>("Endstop(Y Min)", Y_MIN_PIN, Y_MIN_ENDSTOP_INVERTING, [kinematics](){ return kinematics->effector_position.y <= Y_MIN_POS; });
-    root->add_component<EndStop>("Endstop(Z Min)", Z_MIN_PIN, Z_MIN_ENDSTOP_INVERTING, [kinematics](){ return kinematics->effector_position.z <= Z_MIN_POS; });
+    add_endstop(root, "Endstop(X Min)", X_MIN_PIN, X_MIN_ENDSTOP_INVERTING, kinematics, [](const KinematicPosition& p){ return p.effector_position.x <= X_MIN_POS; });
+    add_endstop(root, "Endstop(Y Min)", Y_MIN_PIN, Y_MIN_ENDSTOP_INVERTING, kinematics, [](const KinematicPosition& p){ return p.effector_position.y <= Y_MIN_POS; });
+    add_endstop(root, "Endstop(Z Min)", Z_MIN_PIN, Z_MIN_ENDSTOP_INVERTING, kinematics, [](const KinematicPosition& p){ return p.effector_position.z <= Z_MIN_POS; });
   #endif
 
   auto print_bed = root->add_component<PrintBed>("Print Bed", glm::vec2{X_BED_SIZE, Y_BED_SIZE});
 
   #if HAS_BED_PROBE
-    root->add_component<BedProbe>("Probe", Z_MIN_PROBE_PIN, glm::vec3 NOZZLE_TO_PROBE_OFFSET, kinematics->effector_position, *print_bed);
+    root->add_component<BedProbe>("Probe", Z_MIN_PROBE_PIN, glm::vec3 NOZZLE_TO_PROBE_OFFSET, [kinematics](){ return kinematics->get_effector_position(); }, [kinematics](){ return kinematics->published_position().effector_position; }, *print_bed);
   #endif
 
-  root->add_component<Heater>("Hotend Heater", HEATER_0_PIN, TEMP_0_PIN, heater_data{12, 3.6}, hotend_data{13, 20, 0.897}, adc_data{4700, 12});
-  root->add_component<Heater>("Bed Heater", HEATER_BED_PIN, TEMP_BED_PIN, heater_data{12, 1.2}, hotend_data{325, 824, 0.897}, adc_data{4700, 12});
+  root->add_component<Heater>("Hotend Heater", HEATER_0_PIN, TEMP_0_PIN, heater_data{12, 3.6}, hotend_data{13, 20, 0.897}, adc_data{4700, 12, TEMP_SENSOR_0});
+  root->add_component<Heater>("Bed Heater", HEATER_BED_PIN, TEMP_BED_PIN, heater_data{12, 1.2}, hotend_data{325, 824, 0.897}, adc_data{4700, 12, TEMP_SENSOR_BED});
   #if HAS_SPI_FLASH
     //root->add_component<W25QxxDevice>("SPI Flash", SPI_FLASH_SCK_PIN, SPI_FLASH_MISO_PIN, SPI_FLASH_MOSI_PIN, SPI_FLASH_CS_PIN, SPI_FLASH_SIZE);
     root->add_component<W25QxxDevice>("SPI Flash", spi_bus_by_pins<SPI_FLASH_SCK_PIN, SPI_FLASH_MOSI_PIN, SPI_FLASH_MISO_PIN>(), SPI_FLASH_CS_PIN, SPI_FLASH_SIZE);
@@ -93,11 +102,14 @@ void VirtualPrinter::build() {
     root->add_component<NeoPixelDevice>("NeoPixelDevice", NEOPIXEL_PIN, NEOPIXEL_TYPE, NEOPIXEL_PIXELS);
   #endif
 
-  for(auto const& component : components) component->ui_init();
-
   kinematics->kinematic_update();
 }
 
+// Components create their textures here, so this is only called when there is a GL context
+void VirtualPrinter::ui_init() {
+  for(auto const& component : state().components) component->ui_init();
+}
+
 void VirtualPrinter::ui_widgets() {
-  if (root) root->ui_widgets();
+  if (state().root) state().root->ui_widgets();
 }
@@ -8,6 +8,9 @@
 
 #include <glm/glm.hpp>
 
+class SnapshotWriter;
+class SnapshotReader;
+
 class VirtualPrinter {
 public:
   struct Component {
@@ -20,6 +23,10 @@ public:
     virtual void ui_widget() {};
     virtual void ui_widgets();
 
+    // checkpoint hooks, only state that can not be derived from pins needs saving
+    virtual void save_state(SnapshotWriter&) {};
+    virtual void restore_state(SnapshotReader&) {};
+
     template<typename T, class... Args>
     auto add_component(std::string name, Args&&... args) {
       auto component = VirtualPrinter::add_component<T>(name, args...);
@@ -36,10 +43,11 @@ public:
   };
 
   static void update() {
-    for(auto const& it : components) it->update();
+    for(auto const& it : state().components) it->update();
   }
 
   static void ui_widgets();
+  static void ui_init();
 
   static void build();
   static void update_kinematics();
@@ -48,20 +56,24 @@ public:
   static auto add_component(std::string name, Args&&... args) {
     auto component = std::make_shared<T>(args...);
     component->name = name;
-    components.push_back(component);
-    component_map[name] = component;
+    state().components.push_back(component);
+    state().component_map[name] = component;
     return component;
   }
 
   template<typename T>
   static auto get_component(std::string name) {
-    return std::static_pointer_cast<T>(component_map[name]);
+    return std::static_pointer_cast<T>(state().component_map[name]);
   }
 
-  static std::function<void(glm::vec4)> on_kinematic_update;
+  // Component tree of the simulated printer
+  struct State {
+    std::function<void(glm::vec4)> on_kinematic_update;
+    std::map<std::string, std::shared_ptr<Component>> component_map;
+    std::vector<std::shared_ptr<Component>> components;
+    std::shared_ptr<Component> root;
+  };
 
-private:
-  static std::map<std::string, std::shared_ptr<Component>> component_map;
-  static std::vector<std::shared_ptr<Component>> components;
-  static std::shared_ptr<Component> root;
+  inline static State& state() { return main_state; }
+  static State main_state;
 };
@@ -17,7 +17,7 @@
 #include "src/module/motion.h"
 
 Visualisation::Visualisation(VirtualPrinter& virtual_printer) : virtual_printer(virtual_printer) {
-  virtual_printer.on_kinematic_update = [this](glm::vec4 pos){this->set_head_position(pos);};
+  virtual_printer.state().on_kinematic_update = [this](glm::vec4 pos){this->set_head_position(pos);};
 }
 
 Visualisation::~Visualisation() {
@@ -404,6 +404,11 @@ void Visualisation::set_head_position(glm::vec4 sim_pos) {
   }
 }
 
+void Visualisation::clear_path() {
+  active_path_block = nullptr;
+  full_path.clear();
+}
+
 bool Visualisation::points_are_collinear(glm::vec3 a, glm::vec3 b, glm::vec3 c) {
   return glm::length(glm::dot(b - a, c - a) - (glm::length(b - a) * glm::length(c - a))) < 0.0002; // could be increased to further reduce rendered geometry
 }
@@ -461,8 +466,7 @@ void Visualisation::ui_viewport_callback(UiWindow* window) {
       render_path_line = !render_path_line;
     }
     if (ImGui::IsKeyPressed(SDL_SCANCODE_F4)) {
-      active_path_block = nullptr;
-      full_path.clear();
+      clear_path();
     }
     if (ImGui::GetIO().MouseWheel != 0 && viewport.hovered) {
       camera.position += camera.speed * camera.direction * delta * ImGui::GetIO().MouseWheel;
@@ -534,8 +538,7 @@ void Visualisation::ui_info_callback(UiWindow* w) {
   //             effector_pos.y,
   //             NATIVE_TO_LOGICAL(current_position[Z_AXIS], Z_AXIS) - effector_pos.y);
   if (ImGui::Button("Clear Print Area")) {
-    active_path_block = nullptr;
-    full_path.clear();
+    clear_path();
   }
   ImGui::PushItemWidth(150); ImGui::Text("Extrude Width    ");  ImGui::PopItemWidth(); ImGui::PushItemWidth(50); ImGui::SameLine(); ImGui::InputFloat("##Extrude_Width", &extrude_width); ImGui::PopItemWidth();
   ImGui::PushItemWidth(150); ImGui::Text("Extrude Thickness");  ImGui::PopItemWidth(); ImGui::PushItemWidth(50); ImGui::SameLine(); ImGui::InputFloat("##Extrude_Thickness", &extrude_thickness); ImGui::PopItemWidth();
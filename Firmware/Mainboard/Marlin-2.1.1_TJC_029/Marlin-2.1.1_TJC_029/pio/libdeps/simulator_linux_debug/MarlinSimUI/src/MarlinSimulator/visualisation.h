@@ -180,6 +180,7 @@ public:
   bool last_extruding  = false;
   const float filiment_diameter = 1.75;
   void set_head_position(glm::vec4 position);
+  void clear_path();
   bool points_are_collinear(glm::vec3 a, glm::vec3 b, glm::vec3 c);
 
   uint8_t follow_mode = 0;